@@ -0,0 +1,339 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <stdexcept>
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief When the packet in a buffer went through each stage of
+		 *        forwarding, in nanoseconds (see LatencyTracer).
+		 *
+		 * Only meaningful when read isn't 0: packets are only timed when
+		 * latency tracing is enabled.
+		 */
+		struct PacketTimes
+		{
+			std::int64_t read;
+			std::int64_t dispatched;
+			std::int64_t queued;
+		};
+
+		/*!
+		 * \brief Header preceding every pooled buffer's bytes.
+		 *
+		 * The bytes start at the next cache line after the header.
+		 */
+		struct BufferNode
+		{
+			static const std::size_t HEADER_SIZE = 64;
+
+			std::uint8_t *memory()
+			{
+				return reinterpret_cast<std::uint8_t*>(this) + HEADER_SIZE;
+			}
+
+			std::atomic<std::uint32_t> references;
+			std::uint32_t sizeClass;
+			std::size_t capacity;
+			BufferNode *next;
+			PacketTimes times;
+		};
+	}
+
+	/*!
+	 * \brief The BufferPool class hands out fixed-size packet buffers, recycling
+	 *        them once released.
+	 *
+	 * Buffers are carved out of large slabs, one set of slabs per size class.
+	 * Every thread keeps its own free list per size class, so acquiring and
+	 * releasing a buffer normally touches no shared state. Threads only go to
+	 * the shared free lists (under a lock) in bulk, when their own list runs
+	 * dry or grows too long. Slabs are never returned to the system.
+	 *
+	 * Use SharedBuffer rather than this class directly.
+	 */
+	class BufferPool
+	{
+		public:
+			/*!
+			 * \brief Usage counters for a single size class.
+			 */
+			struct Statistics
+			{
+				//! Size of the buffers in this class.
+				std::size_t bufferSize;
+
+				//! Acquisitions satisfied by a recycled buffer.
+				std::uint64_t hits;
+
+				//! Acquisitions that required allocating more memory.
+				std::uint64_t misses;
+
+				//! Buffers ever carved out of slabs for this class.
+				std::uint64_t buffers;
+
+				//! Buffers currently sitting in free lists.
+				std::uint64_t idleBuffers;
+			};
+
+			/*!
+			 * \brief Obtain the process-wide pool.
+			 */
+			static BufferPool &instance();
+
+			/*!
+			 * \brief Acquire a buffer able to hold at least the given number of
+			 *        bytes.
+			 *
+			 * \param[in] size
+			 * Number of bytes required. Requests larger than the largest size
+			 * class are served straight from the heap (and counted as misses).
+			 *
+			 * \return The buffer, with a reference count of one.
+			 */
+			internal::BufferNode *acquire(std::size_t size);
+
+			/*!
+			 * \brief Return a buffer whose reference count dropped to zero.
+			 *
+			 * \param[in] node
+			 * The buffer to recycle.
+			 */
+			void release(internal::BufferNode *node);
+
+			/*!
+			 * \brief Make sure the pool holds at least the given number of
+			 *        buffers of the given size, so they don't need to be
+			 *        allocated on the data path.
+			 *
+			 * \param[in] size
+			 * Buffer size (rounded up to a size class).
+			 *
+			 * \param[in] count
+			 * Number of buffers required.
+			 */
+			void reserve(std::size_t size, std::size_t count);
+
+			/*!
+			 * \brief Usage counters, one entry per size class.
+			 */
+			std::vector<Statistics> statistics() const;
+
+		private:
+			BufferPool();
+	};
+
+	/*!
+	 * \brief The SharedBuffer class is a reference-counted handle to a pooled
+	 *        packet buffer.
+	 *
+	 * Copies refer to the same bytes (much like a shared pointer), and the
+	 * buffer goes back to the pool when the last one is destroyed. Each handle
+	 * keeps its own size, which can be changed anywhere up to the buffer's
+	 * capacity without reallocating.
+	 */
+	class SharedBuffer
+	{
+		public:
+			/*!
+			 * \brief Create an empty handle that refers to no buffer.
+			 */
+			SharedBuffer() :
+			   m_node(nullptr),
+			   m_data(nullptr),
+			   m_size(0)
+			{
+			}
+
+			/*!
+			 * \brief Acquire a buffer from the pool.
+			 *
+			 * \param[in] size
+			 * Size of the buffer. Its contents are unspecified.
+			 */
+			explicit SharedBuffer(std::size_t size) :
+			   m_node(BufferPool::instance().acquire(size)),
+			   m_data(m_node->memory()),
+			   m_size(size)
+			{
+			}
+
+			/*!
+			 * \brief Acquire a buffer from the pool and copy data into it.
+			 *
+			 * \param[in] data
+			 * Data to copy.
+			 *
+			 * \param[in] size
+			 * Number of bytes to copy.
+			 */
+			SharedBuffer(const std::uint8_t *data, std::size_t size);
+
+			SharedBuffer(const SharedBuffer &other) :
+			   m_node(other.m_node),
+			   m_data(other.m_data),
+			   m_size(other.m_size)
+			{
+				if (m_node)
+				{
+					m_node->references.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+
+			SharedBuffer(SharedBuffer &&other) noexcept :
+			   m_node(other.m_node),
+			   m_data(other.m_data),
+			   m_size(other.m_size)
+			{
+				other.m_node = nullptr;
+				other.m_data = nullptr;
+				other.m_size = 0;
+			}
+
+			~SharedBuffer()
+			{
+				reset();
+			}
+
+			SharedBuffer &operator=(SharedBuffer other) noexcept
+			{
+				swap(other);
+				return *this;
+			}
+
+			void swap(SharedBuffer &other) noexcept
+			{
+				std::swap(m_node, other.m_node);
+				std::swap(m_data, other.m_data);
+				std::swap(m_size, other.m_size);
+			}
+
+			/*!
+			 * \brief Drop this handle's reference, leaving it empty.
+			 */
+			void reset()
+			{
+				if (m_node && m_node->references.fetch_sub(
+				                 1, std::memory_order_acq_rel) == 1)
+				{
+					BufferPool::instance().release(m_node);
+				}
+
+				m_node = nullptr;
+				m_data = nullptr;
+				m_size = 0;
+			}
+
+			explicit operator bool() const
+			{
+				return m_node != nullptr;
+			}
+
+			std::uint8_t *data() const
+			{
+				return m_data;
+			}
+
+			std::size_t size() const
+			{
+				return m_size;
+			}
+
+			/*!
+			 * \brief Obtain when the packet held went through each stage of
+			 *        forwarding (shared by every handle to the buffer). The
+			 *        handle must refer to a buffer.
+			 */
+			internal::PacketTimes &times() const
+			{
+				return m_node->times;
+			}
+
+			std::size_t capacity() const
+			{
+				return m_node ?
+				         m_node->capacity - (m_data - m_node->memory()) : 0;
+			}
+
+			/*!
+			 * \brief Change the size of this handle's view of the buffer.
+			 *
+			 * \param[in] size
+			 * New size.
+			 *
+			 * \exception std::length_error
+			 * If the size exceeds the buffer's capacity.
+			 */
+			void resize(std::size_t size)
+			{
+				if (size > capacity())
+				{
+					throw std::length_error(
+					         "SharedBuffer cannot grow beyond its capacity");
+				}
+
+				m_size = size;
+			}
+
+			/*!
+			 * \brief Move the start of this handle's view of the buffer
+			 *        forward (e.g. past a header), shrinking it.
+			 *
+			 * \param[in] count
+			 * Number of bytes to skip.
+			 *
+			 * \exception std::length_error
+			 * If the count exceeds the size.
+			 */
+			void trimFront(std::size_t count)
+			{
+				if (count > m_size)
+				{
+					throw std::length_error(
+					         "SharedBuffer cannot skip beyond its size");
+				}
+
+				m_data += count;
+				m_size -= count;
+			}
+
+			std::uint8_t &at(std::size_t index) const
+			{
+				if (index >= m_size)
+				{
+					throw std::out_of_range("SharedBuffer index out of range");
+				}
+
+				return m_data[index];
+			}
+
+			std::uint8_t &operator[](std::size_t index) const
+			{
+				return m_data[index];
+			}
+
+			std::uint8_t *begin() const
+			{
+				return m_data;
+			}
+
+			std::uint8_t *end() const
+			{
+				return m_data + m_size;
+			}
+
+		private:
+			internal::BufferNode *m_node;
+			std::uint8_t *m_data;
+			std::size_t m_size;
+	};
+}
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,27 @@
+#ifndef CIPHER_H
+#define CIPHER_H
+
+namespace Overpass
+{
+	/*!
+	 * \brief Authenticated encryption used between peers.
+	 */
+	enum class Cipher
+	{
+		//! Packets are sent in the clear, unauthenticated.
+		None,
+
+		//! ChaCha20-Poly1305 (RFC 8439).
+		ChaCha20Poly1305,
+
+		//! AES-256 in Galois/Counter Mode.
+		Aes256Gcm,
+	};
+
+	/*!
+	 * \brief Short human-readable name of a cipher.
+	 */
+	const char *toString(Cipher cipher);
+}
+
+#endif // CIPHER_H
@@ -0,0 +1,126 @@
+#ifndef DATAGRAM_H
+#define DATAGRAM_H
+
+#include <vector>
+
+#include "types.h"
+
+namespace Overpass
+{
+	/*!
+	 * \brief A single datagram along with its remote endpoint.
+	 *
+	 * For received datagrams the endpoint is the sender, for datagrams about to
+	 * be sent it's the destination.
+	 */
+	template <typename Endpoint>
+	struct Datagram
+	{
+		Endpoint endpoint;
+		SharedBuffer buffer;
+	};
+
+	template <typename Endpoint>
+	using DatagramBatch = std::vector<Datagram<Endpoint>>;
+
+	/*!
+	 * \brief What a DatagramServer drops when its send queue is full.
+	 */
+	enum class SendDropPolicy
+	{
+		//! Drop the datagram being sent (tail drop).
+		DropNewest,
+
+		//! Drop the datagram that has waited longest, to make room.
+		DropOldest,
+	};
+
+	/*!
+	 * \brief Counters describing what became of datagrams handed to a
+	 *        DatagramServer for sending.
+	 */
+	struct DatagramSendStatistics
+	{
+		//! Datagrams handed to the kernel.
+		std::uint64_t sent;
+
+		//! Bytes handed to the kernel.
+		std::uint64_t sentBytes;
+
+		//! Datagrams that had to wait for room in the socket's send buffer.
+		std::uint64_t queued;
+
+		//! Datagrams dropped because the send queue was full.
+		std::uint64_t dropped;
+
+		//! Datagrams the kernel refused (e.g. unreachable destinations).
+		std::uint64_t failed;
+	};
+
+	/*!
+	 * \brief Counters describing what a DatagramServer received.
+	 */
+	struct DatagramReceiveStatistics
+	{
+		//! Datagrams received (including empty ones).
+		std::uint64_t received;
+
+		//! Bytes received.
+		std::uint64_t receivedBytes;
+
+		//! Reads that failed.
+		std::uint64_t errors;
+	};
+
+	/*!
+	 * \brief Options controlling how a DatagramServer uses its socket.
+	 */
+	struct DatagramServerOptions
+	{
+		DatagramServerOptions() :
+		   bufferSize(1500),
+		   batchSize(1),
+		   readDepth(1),
+		   orderedReads(false),
+		   sendQueueDepth(256),
+		   sendDropPolicy(SendDropPolicy::DropNewest),
+		   dispatchMode(DispatchMode::Post),
+		   traceLatency(false)
+		{
+		}
+
+		//! How large of a buffer size to support (this is the packet size).
+		std::size_t bufferSize;
+
+		//! Maximum number of datagrams to read per wakeup. A value of 1 reads
+		//! one datagram at a time, anything larger drains the socket in
+		//! batches (using recvmmsg for real sockets).
+		std::size_t batchSize;
+
+		//! Number of reads (or, in batch mode, waits for datagrams) to keep
+		//! outstanding, so several threads can be receiving from the socket
+		//! at once.
+		std::size_t readDepth;
+
+		//! Whether or not datagrams must reach the callback in the order
+		//! they were received, whatever the read depth and however many
+		//! threads run the IO service. Callbacks then run one at a time.
+		bool orderedReads;
+
+		//! Maximum number of datagrams waiting for room in the socket's send
+		//! buffer. Sending never blocks: beyond this, datagrams are dropped.
+		std::size_t sendQueueDepth;
+
+		//! Which datagram to drop when the send queue is full.
+		SendDropPolicy sendDropPolicy;
+
+		//! How datagrams (or batches of them) are handed to the callback.
+		DispatchMode dispatchMode;
+
+		//! Whether or not to time datagrams received and sent (see
+		//! LatencyTracer). It costs a couple of clock reads per batch.
+		bool traceLatency;
+	};
+}
+
+#endif // DATAGRAM_H
@@ -4,6 +4,7 @@
 #include <boost/noncopyable.hpp>
 
 #include "types.h"
+#include "datagram.h"
 #include "internal/datagram_server_private.h"
 
 namespace Overpass
@@ -16,6 +17,8 @@ namespace Overpass
 	{
 		public:
 			typedef typename internal::DatagramServerPrivate<T>::ReadCallback ReadCallback;
+			typedef typename internal::DatagramServerPrivate<T>::BatchReadCallback BatchReadCallback;
+			typedef typename internal::DatagramServerPrivate<T>::Batch Batch;
 
 			/*!
 			 * \brief DatagramServer constructor.
@@ -36,7 +39,61 @@ namespace Overpass
 			               std::unique_ptr<typename T::socket> socket, ReadCallback callback,
 			               std::size_t bufferSize = 1500) :
 			   m_data(new internal::DatagramServerPrivate<T>(
-			             ioService, std::move(socket), callback, bufferSize))
+			             ioService, std::move(socket), callback,
+			             BatchReadCallback(), optionsWithBufferSize(bufferSize)))
+			{
+				m_data->beginReading();
+			}
+
+			/*!
+			 * \brief DatagramServer constructor.
+			 *
+			 * \param[in,out] ioService
+			 * IO service used for running the server.
+			 *
+			 * \param[in] socket
+			 * Datagram socket-like object.
+			 *
+			 * \param[in] callback
+			 * Function to be called for each datagram read from the socket.
+			 *
+			 * \param[in] options
+			 * Options controlling buffer and batch sizes.
+			 */
+			DatagramServer(const SharedIoService &ioService,
+			               std::unique_ptr<typename T::socket> socket, ReadCallback callback,
+			               const DatagramServerOptions &options) :
+			   m_data(new internal::DatagramServerPrivate<T>(
+			             ioService, std::move(socket), callback,
+			             BatchReadCallback(), options))
+			{
+				m_data->beginReading();
+			}
+
+			/*!
+			 * \brief DatagramServer constructor for batch mode.
+			 *
+			 * \param[in,out] ioService
+			 * IO service used for running the server.
+			 *
+			 * \param[in] socket
+			 * Datagram socket-like object.
+			 *
+			 * \param[in] callback
+			 * Function to be called with each batch of datagrams read from the
+			 * socket.
+			 *
+			 * \param[in] options
+			 * Options controlling buffer and batch sizes. If the batch size is 1,
+			 * each batch will contain a single datagram.
+			 */
+			DatagramServer(const SharedIoService &ioService,
+			               std::unique_ptr<typename T::socket> socket,
+			               BatchReadCallback callback,
+			               const DatagramServerOptions &options) :
+			   m_data(new internal::DatagramServerPrivate<T>(
+			             ioService, std::move(socket), ReadCallback(), callback,
+			             options))
 			{
 				m_data->beginReading();
 			}
@@ -49,6 +106,10 @@ namespace Overpass
 			 *
 			 * \param[in] buffer
 			 * The data to send.
+			 *
+			 * This never blocks: if the socket's send buffer is full, the data
+			 * waits in the send queue (or is dropped, depending on the
+			 * options). It may be called from any thread.
 			 */
 			void sendTo(const typename T::endpoint &destination,
 			            const SharedBuffer &buffer) const
@@ -56,7 +117,64 @@ namespace Overpass
 				m_data->sendTo(destination, buffer);
 			}
 
+			/*!
+			 * \brief Send a batch of datagrams over the socket, using as few
+			 *        system calls as possible.
+			 *
+			 * \param[in] batch
+			 * The datagrams to send, along with their destinations.
+			 *
+			 * Like sendTo(), this never blocks.
+			 */
+			void sendBatch(const Batch &batch) const
+			{
+				m_data->sendBatch(batch);
+			}
+
+			/*!
+			 * \brief Obtain counters describing what became of datagrams
+			 *        sent so far.
+			 */
+			DatagramSendStatistics sendStatistics() const
+			{
+				return m_data->sendStatistics();
+			}
+
+			/*!
+			 * \brief Obtain counters describing what was received so far.
+			 */
+			DatagramReceiveStatistics receiveStatistics() const
+			{
+				return m_data->receiveStatistics();
+			}
+
+			/*!
+			 * \brief Obtain the number of datagrams waiting for room in the
+			 *        socket's send buffer.
+			 */
+			std::size_t sendQueueDepth() const
+			{
+				return m_data->sendQueueDepth();
+			}
+
+			/*!
+			 * \brief Obtain the latencies of the datagrams going through the
+			 *        server (null unless tracing was enabled).
+			 */
+			const internal::LatencyTracer *tracer() const
+			{
+				return m_data->tracer();
+			}
+
 		private:
+			static DatagramServerOptions optionsWithBufferSize(
+			      std::size_t bufferSize)
+			{
+				DatagramServerOptions options;
+				options.bufferSize = bufferSize;
+				return options;
+			}
+
 			// Using a shared_ptr instead of unique_ptr because of
 			// enable_shared_from_this.
 			std::shared_ptr<internal::DatagramServerPrivate<T>> m_data;
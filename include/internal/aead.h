@@ -0,0 +1,183 @@
+#ifndef AEAD_H
+#define AEAD_H
+
+#include <array>
+#include <atomic>
+#include <memory>
+
+#include <boost/noncopyable.hpp>
+
+#include "types.h"
+#include "cipher.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		const std::size_t AEAD_KEY_SIZE = 32;
+
+		//! Type of messages holding packets (the first byte of each).
+		const std::uint8_t AEAD_MESSAGE_TYPE = 4;
+
+		//! Each message starts with its type, three reserved bytes, the
+		//! index of the key it's sealed with and its counter, which makes up
+		//! its nonce.
+		const std::size_t AEAD_HEADER_SIZE = 16;
+
+		//! Where the counter starts.
+		const std::size_t AEAD_COUNTER_OFFSET = 8;
+
+		const std::size_t AEAD_TAG_SIZE = 16;
+
+		//! How much larger a message is than the packet it holds.
+		const std::size_t AEAD_OVERHEAD = AEAD_HEADER_SIZE + AEAD_TAG_SIZE;
+
+		typedef std::array<std::uint8_t, AEAD_KEY_SIZE> AeadKey;
+
+		class AeadException : public Exception
+		{
+			public:
+				AeadException(const std::string &what);
+		};
+
+		/*!
+		 * \brief Obtain the index of the key a message claims to be sealed
+		 *        with.
+		 *
+		 * \param[in] message
+		 * The message (at least AEAD_HEADER_SIZE bytes).
+		 */
+		inline std::uint32_t aeadKeyIndex(const SharedBuffer &message)
+		{
+			const std::uint8_t *data = message.data();
+			return (std::uint32_t(data[4]) << 24) | (std::uint32_t(data[5]) << 16) |
+			       (std::uint32_t(data[6]) << 8) | data[7];
+		}
+
+		/*!
+		 * \brief The Aead class seals packets into messages and opens them
+		 *        again with a given cipher and key.
+		 *
+		 * A message is a header (see AEAD_HEADER_SIZE) holding the key's
+		 * index and the packet's 64-bit counter (big endian), followed by the
+		 * encrypted packet and the authentication tag. The header is
+		 * authenticated too. The nonce is the counter, preceded by four zero
+		 * bytes, so a key must never seal more than 2^64 messages (sealing
+		 * fails well before).
+		 *
+		 * It's used from any number of threads at once without sharing
+		 * anything but the counter: each thread has its own cipher contexts,
+		 * set up with the key the first time it seals or opens something.
+		 * The per-call setup that remains is amortized over batches, which
+		 * only touch the counter once. The CPU features used (AES-NI, AVX2,
+		 * AVX-512...) are picked at run time by libcrypto.
+		 */
+		class Aead : private boost::noncopyable
+		{
+			public:
+				//! Messages sealed before the key should be replaced. Sealing
+				//! fails once the counter reaches it.
+				static const std::uint64_t MAXIMUM_MESSAGES =
+				      std::uint64_t(1) << 60;
+
+				/*!
+				 * \brief Aead constructor.
+				 *
+				 * \param[in] cipher
+				 * Cipher to use (not Cipher::None).
+				 *
+				 * \param[in] key
+				 * Key to use.
+				 *
+				 * \param[in] keyIndex
+				 * Index written in the messages sealed, for the receiver to
+				 * find the key with.
+				 *
+				 * \exception AeadException
+				 * If the cipher isn't available.
+				 */
+				Aead(Cipher cipher, const AeadKey &key,
+				     std::uint32_t keyIndex = 0);
+
+				~Aead();
+
+				Cipher cipher() const
+				{
+					return m_cipher;
+				}
+
+				/*!
+				 * \brief Obtain the number of messages sealed so far (or
+				 *        rather, of counters used up).
+				 */
+				std::uint64_t sealedCount() const
+				{
+					return m_nextCounter.load(std::memory_order_relaxed);
+				}
+
+				/*!
+				 * \brief Seal a batch of packets into messages.
+				 *
+				 * \param[in] packets
+				 * Packets to seal.
+				 *
+				 * \param[in] count
+				 * Number of packets.
+				 *
+				 * \param[out] messages
+				 * One message per packet, in new buffers (or an empty buffer
+				 * if it couldn't be sealed). May be the packets themselves.
+				 *
+				 * \return The number of packets sealed.
+				 */
+				std::size_t seal(const SharedBuffer *packets, std::size_t count,
+				                 SharedBuffer *messages);
+
+				/*!
+				 * \brief Authenticate and decrypt a batch of messages.
+				 *
+				 * Messages are decrypted in place, so their buffers can't be
+				 * used for anything else afterwards.
+				 *
+				 * \param[in] messages
+				 * Messages to open.
+				 *
+				 * \param[in] count
+				 * Number of messages.
+				 *
+				 * \param[out] packets
+				 * One packet per message, viewing the message's buffer (or an
+				 * empty buffer if it's not authentic). May be the messages
+				 * themselves.
+				 *
+				 * \param[out] counters
+				 * The counter of each message, for detecting replays.
+				 *
+				 * \return The number of messages opened.
+				 */
+				std::size_t open(const SharedBuffer *messages, std::size_t count,
+				                 SharedBuffer *packets, std::uint64_t *counters);
+
+			private:
+				struct Context;
+
+				/*!
+				 * \brief Obtain the calling thread's context (or, if there are
+				 *        too many threads, one set up in the given storage).
+				 */
+				Context &context(std::unique_ptr<Context> &temporary);
+
+			private:
+				Cipher m_cipher;
+				AeadKey m_key;
+				std::uint32_t m_keyIndex;
+				std::atomic<std::uint64_t> m_nextCounter;
+
+				// Contexts, by thread index. Each is only touched by its
+				// thread (once set up, by it).
+				std::unique_ptr<std::unique_ptr<Context>[]> m_contexts;
+		};
+	}
+}
+
+#endif // AEAD_H
@@ -0,0 +1,117 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief Add data to a running Internet checksum (RFC 1071).
+		 *
+		 * \param[in] data
+		 * Data to add. Odd sizes are padded with a zero byte, so only the
+		 * last chunk of a checksum may be odd-sized.
+		 *
+		 * \param[in] size
+		 * Number of bytes.
+		 *
+		 * \param[in] total
+		 * Running total so far.
+		 *
+		 * \return The new total (unfolded).
+		 */
+		inline std::uint32_t checksumAdd(const std::uint8_t *data,
+		                                 std::size_t size,
+		                                 std::uint32_t total = 0)
+		{
+			for (std::size_t i = 0; i + 1 < size; i += 2)
+			{
+				total += (data[i] << 8) | data[i + 1];
+			}
+
+			if (size % 2)
+			{
+				total += data[size - 1] << 8;
+			}
+
+			return total;
+		}
+
+		/*!
+		 * \brief Fold a running total into 16 bits, without complementing
+		 *        it (e.g. for a partial checksum the kernel completes).
+		 */
+		inline std::uint16_t checksumFold(std::uint32_t total)
+		{
+			while (total >> 16)
+			{
+				total = (total & 0xffff) + (total >> 16);
+			}
+
+			return total;
+		}
+
+		/*!
+		 * \brief Turn a running total into the checksum to store.
+		 */
+		inline std::uint16_t checksumFinish(std::uint32_t total)
+		{
+			return ~checksumFold(total) & 0xffff;
+		}
+
+		/*!
+		 * \brief Running total for a TCP, UDP or ICMPv6 pseudo-header.
+		 *
+		 * \param[in] ipHeader
+		 * Start of the packet's IP header (version 4 or 6), for the
+		 * addresses.
+		 *
+		 * \param[in] protocol
+		 * Transport protocol.
+		 *
+		 * \param[in] length
+		 * Length of the transport header and payload.
+		 */
+		inline std::uint32_t pseudoHeaderSum(const std::uint8_t *ipHeader,
+		                                     std::uint8_t protocol,
+		                                     std::size_t length)
+		{
+			std::uint32_t total = (ipHeader[0] >> 4) == 4 ?
+			                      checksumAdd(ipHeader + 12, 8) :
+			                      checksumAdd(ipHeader + 8, 32);
+			total += length >> 16;
+			total += length & 0xffff;
+			return total + protocol;
+		}
+
+		inline std::uint16_t readShort(const std::uint8_t *data)
+		{
+			return (data[0] << 8) | data[1];
+		}
+
+		inline void writeShort(std::uint8_t *data, std::uint16_t value)
+		{
+			data[0] = value >> 8;
+			data[1] = value & 0xff;
+		}
+
+		inline std::uint32_t readLong(const std::uint8_t *data)
+		{
+			return static_cast<std::uint32_t>(data[0]) << 24 |
+			       data[1] << 16 | data[2] << 8 | data[3];
+		}
+
+		inline void writeLong(std::uint8_t *data, std::uint32_t value)
+		{
+			data[0] = value >> 24;
+			data[1] = (value >> 16) & 0xff;
+			data[2] = (value >> 8) & 0xff;
+			data[3] = value & 0xff;
+		}
+	}
+}
+
+#endif // CHECKSUM_H
@@ -0,0 +1,141 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+#include <boost/noncopyable.hpp>
+
+#include "types.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		//! Cells in a page (4 KiB of them).
+		const std::size_t COUNTER_PAGE_CELLS = 512;
+
+		//! Pages per thread, which bounds the number of counters.
+		const std::size_t COUNTER_PAGES = 1024;
+
+		/*!
+		 * \brief A page of one thread's counter cells (allocated on a cache
+		 *        line boundary).
+		 */
+		struct CounterPage
+		{
+			std::atomic<std::uint64_t> cells[COUNTER_PAGE_CELLS];
+		};
+
+		/*!
+		 * \brief One thread's counter cells, allocated a page at a time as
+		 *        the thread first counts in them.
+		 *
+		 * When a thread exits, its cells are handed down to the next thread
+		 * to start counting, so nothing counted is ever lost.
+		 */
+		struct CounterThread
+		{
+			std::atomic<CounterPage*> pages[COUNTER_PAGES];
+			CounterThread *next;
+		};
+
+		//! The calling thread's cells, once it has counted anything.
+		extern thread_local CounterThread *t_counterThread;
+
+		/*!
+		 * \brief Register the calling thread, setting t_counterThread.
+		 */
+		CounterThread &addCounterThread();
+
+		/*!
+		 * \brief Allocate a page of the calling thread's cells.
+		 */
+		CounterPage &addCounterPage(CounterThread &thread, std::size_t page);
+
+		/*!
+		 * \brief The Counters class is a set of counters for the data path,
+		 *        which any number of threads can count in without ever
+		 *        contending.
+		 *
+		 * Every thread counts in cells of its own, on pages no other thread
+		 * writes to, so counting is a plain load and store to a cache line
+		 * the thread already owns: no locked instructions, and no cache lines
+		 * bouncing between cores. Reading a counter sums its cells across
+		 * threads, so reads are comparatively slow (and take a lock), and
+		 * different counters read while counting goes on may be slightly
+		 * out of step with each other.
+		 *
+		 * Cells come from a process-wide registry. Those of a set are zeroed
+		 * and reused once it's destroyed.
+		 */
+		class Counters : private boost::noncopyable
+		{
+			public:
+				/*!
+				 * \brief Counters constructor.
+				 *
+				 * \param[in] count
+				 * Number of counters, all starting at 0.
+				 *
+				 * \exception Overpass::Exception
+				 * If the process has run out of counters.
+				 */
+				explicit Counters(std::size_t count);
+
+				~Counters();
+
+				std::size_t size() const
+				{
+					return m_count;
+				}
+
+				/*!
+				 * \brief Add to a counter (from any thread).
+				 *
+				 * \param[in] counter
+				 * Index of the counter.
+				 *
+				 * \param[in] value
+				 * Amount to add.
+				 */
+				void add(std::size_t counter, std::uint64_t value = 1)
+				{
+					std::size_t cell = m_first + counter;
+					CounterThread &thread = t_counterThread ? *t_counterThread :
+					                                          addCounterThread();
+					std::size_t index = cell / COUNTER_PAGE_CELLS;
+					CounterPage *page = thread.pages[index].load(
+					                       std::memory_order_relaxed);
+					if (!page)
+					{
+						page = &addCounterPage(thread, index);
+					}
+
+					// No other thread writes the cell.
+					std::atomic<std::uint64_t> &total =
+					      page->cells[cell % COUNTER_PAGE_CELLS];
+					total.store(total.load(std::memory_order_relaxed) + value,
+					            std::memory_order_relaxed);
+				}
+
+				/*!
+				 * \brief Obtain the total of a counter, across threads.
+				 */
+				std::uint64_t value(std::size_t counter) const;
+
+				/*!
+				 * \brief Obtain the totals of every counter at once (which is
+				 *        quicker than one at a time).
+				 */
+				std::vector<std::uint64_t> values() const;
+
+			private:
+				std::size_t m_first;
+				std::size_t m_count;
+		};
+	}
+}
+
+#endif // COUNTERS_H
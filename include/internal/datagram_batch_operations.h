@@ -0,0 +1,141 @@
+#ifndef DATAGRAM_BATCH_OPERATIONS_H
+#define DATAGRAM_BATCH_OPERATIONS_H
+
+#include <boost/asio/ip/udp.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "datagram.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief Receive as many datagrams as are ready (up to the size of the
+		 *        batch) with a single system call, without blocking.
+		 *
+		 * \param[in,out] socket
+		 * Socket from which to receive.
+		 *
+		 * \param[in,out] batch
+		 * Every entry must have a buffer large enough to hold a datagram. On
+		 * return the first N entries have their endpoint set to the sender and
+		 * their buffer trimmed to the size of the datagram received.
+		 *
+		 * \param[out] error
+		 * Error that occurred while receiving (if any). If nothing is ready
+		 * this is set to boost::asio::error::would_block.
+		 *
+		 * \return The number of datagrams (N) received.
+		 *
+		 * Other socket-like types can be used with a DatagramServer in batch
+		 * mode by providing an overload of this function.
+		 */
+		std::size_t receiveDatagrams(
+		      boost::asio::ip::udp::socket &socket,
+		      DatagramBatch<boost::asio::ip::udp::endpoint> &batch,
+		      boost::system::error_code &error);
+
+		/*!
+		 * \brief Send a datagram if the socket has room for it, without
+		 *        blocking.
+		 *
+		 * \param[in,out] socket
+		 * Socket over which to send.
+		 *
+		 * \param[in] destination
+		 * Where to send the datagram.
+		 *
+		 * \param[in] buffer
+		 * The datagram.
+		 *
+		 * \param[out] error
+		 * Error that occurred while sending (if any). If the socket's send
+		 * buffer is full this is set to boost::asio::error::would_block.
+		 *
+		 * \return Whether or not the datagram was sent.
+		 */
+		bool sendDatagram(boost::asio::ip::udp::socket &socket,
+		                  const boost::asio::ip::udp::endpoint &destination,
+		                  const SharedBuffer &buffer,
+		                  boost::system::error_code &error);
+
+		/*!
+		 * \brief Send as many datagrams as the socket has room for using as
+		 *        few system calls as possible, without blocking.
+		 *
+		 * \param[in,out] socket
+		 * Socket over which to send.
+		 *
+		 * \param[in] datagrams
+		 * Datagrams to send, along with their destinations.
+		 *
+		 * \param[in] count
+		 * Number of datagrams.
+		 *
+		 * \param[out] error
+		 * Error that occurred while sending (if any), as above.
+		 *
+		 * \return The number of datagrams (N) sent. This is only less than
+		 * the count if an error occurred, in which case it's datagram N that
+		 * couldn't be sent.
+		 */
+		std::size_t sendDatagrams(
+		      boost::asio::ip::udp::socket &socket,
+		      const Datagram<boost::asio::ip::udp::endpoint> *datagrams,
+		      std::size_t count,
+		      boost::system::error_code &error);
+
+		//! Largest datagram the kernel may coalesce received datagrams into
+		//! (see enableReceiveCoalescing()).
+		const std::size_t MAXIMUM_COALESCED_SIZE = 65535;
+
+		/*!
+		 * \brief Check whether or not the kernel can split datagrams sent
+		 *        over a socket (UDP_SEGMENT).
+		 */
+		bool supportsSegmentation(boost::asio::ip::udp::socket &socket);
+
+		/*!
+		 * \brief Ask the kernel to coalesce datagrams received over a socket
+		 *        (UDP_GRO), if it can.
+		 *
+		 * Coalesced datagrams are only split by receiveCoalescedDatagrams(),
+		 * so that must be used to receive from the socket from then on, into
+		 * buffers of MAXIMUM_COALESCED_SIZE.
+		 *
+		 * \return Whether or not the kernel supports it.
+		 */
+		bool enableReceiveCoalescing(boost::asio::ip::udp::socket &socket);
+
+		/*!
+		 * \brief Receive as many datagrams as are ready, like
+		 *        receiveDatagrams(), splitting those the kernel coalesced.
+		 *
+		 * Split datagrams are views into the buffer they were received in,
+		 * so nothing is copied. The batch may grow to hold them: on return
+		 * the first N entries are the datagrams received, the rest keep
+		 * their buffers.
+		 */
+		std::size_t receiveCoalescedDatagrams(
+		      boost::asio::ip::udp::socket &socket,
+		      DatagramBatch<boost::asio::ip::udp::endpoint> &batch,
+		      boost::system::error_code &error);
+
+		/*!
+		 * \brief Send datagrams like sendDatagrams(), handing consecutive
+		 *        datagrams of the same size to the same destination to the
+		 *        kernel as a single one to split (UDP_SEGMENT).
+		 *
+		 * The datagrams are gathered straight from their buffers. The socket
+		 * must support segmentation (see supportsSegmentation()).
+		 */
+		std::size_t sendSegmentedDatagrams(
+		      boost::asio::ip::udp::socket &socket,
+		      const Datagram<boost::asio::ip::udp::endpoint> *datagrams,
+		      std::size_t count,
+		      boost::system::error_code &error);
+	}
+}
+
+#endif // DATAGRAM_BATCH_OPERATIONS_H
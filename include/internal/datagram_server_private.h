@@ -1,12 +1,24 @@
 #ifndef DATAGRAM_SERVER_PRIVATE_H
 #define DATAGRAM_SERVER_PRIVATE_H
 
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
 #include <iostream>
 
+#include <boost/asio/error.hpp>
 #include <boost/asio/buffer.hpp>
+#include <boost/asio/strand.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/system/error_code.hpp>
 
+#include "datagram.h"
+#include "internal/counters.h"
+#include "internal/read_sequencer.h"
+#include "internal/latency_histogram.h"
+#include "internal/datagram_batch_operations.h"
+
 namespace Overpass
 {
 	namespace internal
@@ -14,6 +26,10 @@ namespace Overpass
 		/*!
 		 * \brief The DatagramServerPrivate class is a server for datagram
 		 *        sockets.
+		 *
+		 * Everything received and sent is counted, per thread (see
+		 * Counters), so counting doesn't contend however many threads send.
+		 * Datagrams may also be timed as they go through (see LatencyTracer).
 		 */
 		template <typename T>
 		class DatagramServerPrivate :
@@ -22,6 +38,8 @@ namespace Overpass
 			public:
 				typedef std::function<void (
 				      const typename T::endpoint&, const SharedBuffer&)> ReadCallback;
+				typedef DatagramBatch<typename T::endpoint> Batch;
+				typedef std::function<void (const Batch&)> BatchReadCallback;
 
 				/*!
 				 * \brief DatagramServerPrivate constructor.
@@ -33,21 +51,48 @@ namespace Overpass
 				 * Datagram socket-like object.
 				 *
 				 * \param[in] callback
-				 * Function to be called when new data has been received from the
+				 * Function to be called for each datagram received from the
 				 * socket.
 				 *
-				 * \param[in] bufferSize
-				 * How large of a buffer size to support (this is the packet size).
+				 * \param[in] batchCallback
+				 * Function to be called with each batch of datagrams received
+				 * from the socket (datagrams read one at a time coming in
+				 * batches of one). Takes precedence over callback if set.
+				 *
+				 * \param[in] options
+				 * Options controlling buffer and batch sizes.
 				 */
 				DatagramServerPrivate(const SharedIoService &ioService,
 				                      std::unique_ptr<typename T::socket> socket,
 				                      ReadCallback callback,
-				                      std::size_t bufferSize) :
+				                      BatchReadCallback batchCallback,
+				                      const DatagramServerOptions &options) :
 				   m_ioService(ioService),
 				   m_callback(callback),
+				   m_batchCallback(batchCallback),
 				   m_socket(std::move(socket)),
-				   m_bufferSize(bufferSize)
+				   m_bufferSize(options.bufferSize),
+				   m_batchSize(options.batchSize),
+				   m_dispatchMode(options.dispatchMode),
+				   m_readDepth(std::max<std::size_t>(1, options.readDepth)),
+				   m_senderEndpoints(m_readDepth),
+				   m_batches(m_readDepth),
+				   m_strand(*ioService),
+				   m_sendQueueDepth(options.sendQueueDepth),
+				   m_sendDropPolicy(options.sendDropPolicy),
+				   m_queuedSends(0),
+				   m_waitingToSend(false),
+				   m_counters(COUNTER_COUNT)
 				{
+					if (options.orderedReads)
+					{
+						m_sequencer.reset(new ReadSequencer<Completion>(m_readDepth));
+					}
+
+					if (options.traceLatency)
+					{
+						m_tracer.reset(new LatencyTracer);
+					}
 				}
 
 				/*!
@@ -59,39 +104,216 @@ namespace Overpass
 				 */
 				void beginReading()
 				{
-					SharedBuffer buffer(new Overpass::Buffer(m_bufferSize));
-
-					// Allocate a new endpoint to hold the sender's information.
-					std::shared_ptr<typename T::endpoint> endpoint(new typename T::endpoint);
-
-					m_socket->async_receive_from(
-					         boost::asio::buffer(*buffer), *endpoint,
-					         std::bind(&DatagramServerPrivate::handleRead,
-					                   this->shared_from_this(), endpoint, buffer,
-					                   std::placeholders::_1, std::placeholders::_2));
+					for (std::size_t slot = 0; slot < m_readDepth; ++slot)
+					{
+						if (m_batchSize > 1)
+						{
+							beginBatchReading(slot);
+						}
+						else
+						{
+							beginRead(slot);
+						}
+					}
 				}
 
 				/*!
-				 * \brief Send data to destination over socket.
+				 * \brief Send data to destination over socket, without
+				 *        blocking.
 				 *
 				 * \param[in] destination
 				 * Where to send the data.
 				 *
 				 * \param[in] buffer
-				 * The data to send.
+				 * The data to send. If the socket has no room for it, it's
+				 * queued until it does.
 				 */
 				void sendTo(const typename T::endpoint &destination,
 				            const SharedBuffer &buffer)
 				{
-					m_socket->send_to(boost::asio::buffer(*buffer), destination);
+					if (m_tracer)
+					{
+						m_tracer->queued(buffer, traceTime());
+					}
+
+					// Nothing may overtake datagrams already waiting, so only
+					// try sending right away if there are none.
+					if (m_queuedSends.load(std::memory_order_acquire) == 0)
+					{
+						boost::system::error_code error;
+						if (sendDatagram(*m_socket, destination, buffer, error))
+						{
+							m_counters.add(SENT);
+							m_counters.add(SENT_BYTES, buffer.size());
+							if (m_tracer)
+							{
+								m_tracer->written(buffer, traceTime());
+							}
+
+							return;
+						}
+
+						if (error != boost::asio::error::would_block)
+						{
+							m_counters.add(FAILED);
+							return;
+						}
+					}
+
+					std::lock_guard<std::mutex> lock(m_sendQueueMutex);
+					queueSend(Datagram<typename T::endpoint>{destination, buffer});
+				}
+
+				/*!
+				 * \brief Send a batch of datagrams over the socket, without
+				 *        blocking.
+				 *
+				 * \param[in] batch
+				 * The datagrams to send, along with their destinations. Those
+				 * the socket has no room for are queued, like with sendTo().
+				 */
+				void sendBatch(const Batch &batch)
+				{
+					if (m_tracer)
+					{
+						std::int64_t now = traceTime();
+						for (const auto &datagram : batch)
+						{
+							m_tracer->queued(datagram.buffer, now);
+						}
+					}
+
+					std::size_t done = 0;
+					if (m_queuedSends.load(std::memory_order_acquire) == 0)
+					{
+						done = sendSome(batch.data(), batch.size());
+					}
+
+					if (done < batch.size())
+					{
+						std::lock_guard<std::mutex> lock(m_sendQueueMutex);
+						for (std::size_t i = done; i < batch.size(); ++i)
+						{
+							queueSend(batch[i]);
+						}
+					}
+				}
+
+				/*!
+				 * \brief Obtain counters describing what became of datagrams
+				 *        sent so far.
+				 */
+				DatagramSendStatistics sendStatistics() const
+				{
+					return DatagramSendStatistics{
+					   m_counters.value(SENT), m_counters.value(SENT_BYTES),
+					   m_counters.value(QUEUED), m_counters.value(DROPPED),
+					   m_counters.value(FAILED)};
+				}
+
+				/*!
+				 * \brief Obtain counters describing what was received so far.
+				 */
+				DatagramReceiveStatistics receiveStatistics() const
+				{
+					return DatagramReceiveStatistics{
+					   m_counters.value(RECEIVED),
+					   m_counters.value(RECEIVED_BYTES),
+					   m_counters.value(READ_ERRORS)};
+				}
+
+				/*!
+				 * \brief Obtain the number of datagrams waiting for room in
+				 *        the socket's send buffer.
+				 */
+				std::size_t sendQueueDepth() const
+				{
+					return m_queuedSends.load(std::memory_order_relaxed);
+				}
+
+				/*!
+				 * \brief Obtain the latencies of the datagrams going through
+				 *        the server (null unless tracing was enabled).
+				 */
+				const LatencyTracer *tracer() const
+				{
+					return m_tracer.get();
 				}
 
 			private:
+				/*!
+				 * \brief What a read (or batch of reads) brought, on its way to
+				 *        the callback.
+				 */
+				struct Completion
+				{
+					Completion() :
+					   slot(0),
+					   more(false)
+					{
+					}
+
+					//! Read slot it came from.
+					std::size_t slot;
+
+					//! Whether or not to keep reading on the slot.
+					bool more;
+
+					//! The datagram read (one-at-a-time mode), if any.
+					typename T::endpoint sender;
+					SharedBuffer buffer;
+
+					//! The datagrams read (batch mode), if any.
+					Batch batch;
+				};
+
+				/*!
+				 * \brief Start a read on a slot (one-at-a-time mode).
+				 */
+				void beginRead(std::size_t slot)
+				{
+					if (m_sequencer)
+					{
+						m_sequencer->start([this, slot](std::uint64_t sequence)
+						{
+							receive(slot, sequence);
+						});
+
+						return;
+					}
+
+					receive(slot, 0);
+				}
+
+				/*!
+				 * \brief Receive a datagram into a new buffer.
+				 *
+				 * \param[in] slot
+				 * Read slot, whose sender endpoint the read fills in.
+				 *
+				 * \param[in] sequence
+				 * Number of the read (if reads are handed over in order).
+				 */
+				void receive(std::size_t slot, std::uint64_t sequence)
+				{
+					SharedBuffer buffer(m_bufferSize);
+					m_socket->async_receive_from(
+					         boost::asio::buffer(buffer.data(), buffer.size()),
+					         m_senderEndpoints[slot],
+					         std::bind(&DatagramServerPrivate::handleRead,
+					                   this->shared_from_this(), slot, sequence,
+					                   buffer, std::placeholders::_1,
+					                   std::placeholders::_2));
+				}
+
 				/*!
 				 * \brief Handle a completed read from the socket.
 				 *
-				 * \param[in] sender
-				 * Who sent the data we just received.
+				 * \param[in] slot
+				 * Read slot the read was started on.
+				 *
+				 * \param[in] sequence
+				 * Number of the read (if reads are handed over in order).
 				 *
 				 * \param[in] buffer
 				 * Buffer that was read (note that it's not necessarily full, check
@@ -104,35 +326,540 @@ namespace Overpass
 				 * The number of bytes read during the operation (if any).
 				 */
 				void handleRead(
-				      std::shared_ptr<typename T::endpoint> sender,
-				      SharedBuffer buffer,
+				      std::size_t slot, std::uint64_t sequence,
+				      const SharedBuffer &buffer,
 				      const boost::system::error_code &error,
 				      std::size_t bytesRead)
 				{
+					Completion read;
+					read.slot = slot;
 					if (error)
 					{
+						m_counters.add(READ_ERRORS);
 						std::cerr << "Error reading: " << error << std::endl;
+						complete(sequence, std::move(read));
 						return;
 					}
 
-					if (bytesRead == 0)
+					m_counters.add(RECEIVED);
+					m_counters.add(RECEIVED_BYTES, bytesRead);
+					read.more = true;
+
+					// Empty datagrams (e.g. keepalives) are only counted.
+					if (bytesRead > 0)
+					{
+						if (m_tracer)
+						{
+							LatencyTracer::read(buffer, traceTime());
+						}
+
+						// The slot's endpoint is reused by its next read, and
+						// the buffer is trimmed to the datagram, as in batches.
+						read.sender = m_senderEndpoints[slot];
+						read.buffer = buffer;
+						read.buffer.resize(bytesRead);
+					}
+
+					complete(sequence, std::move(read));
+				}
+
+				/*!
+				 * \brief Hand a completed read over, in order if need be.
+				 */
+				void complete(std::uint64_t sequence, Completion read)
+				{
+					if (m_sequencer)
 					{
-						std::cerr << "Received zero bytes?" << std::endl;
+						m_sequencer->complete(sequence, std::move(read),
+						                      [this](Completion &read)
+						{
+							deliver(read);
+						});
+
 						return;
 					}
 
-					// We got something: dispatch callback with buffer.
-					m_ioService->post(std::bind(m_callback, *sender, buffer));
+					deliver(read);
+				}
 
-					// Read some more.
-					beginReading();
+				/*!
+				 * \brief Keep reading on the slot a read came from, and hand
+				 *        what it brought to the callback.
+				 */
+				void deliver(Completion &read)
+				{
+					// Read some more first, so another thread can pick it up
+					// while this one handles the datagrams.
+					if (read.more)
+					{
+						if (m_batchSize > 1)
+						{
+							beginBatchReading(read.slot);
+						}
+						else
+						{
+							beginRead(read.slot);
+						}
+					}
+
+					if (read.buffer)
+					{
+						if (m_dispatchMode == DispatchMode::Inline)
+						{
+							dispatch(read.sender, read.buffer);
+						}
+						else
+						{
+							// Bind to a member function rather than copying the
+							// callback itself, which may need to allocate.
+							post(std::bind(&DatagramServerPrivate::dispatch,
+							               this->shared_from_this(), read.sender,
+							               std::move(read.buffer)));
+						}
+					}
+					else if (!read.batch.empty())
+					{
+						if (m_dispatchMode == DispatchMode::Inline)
+						{
+							dispatchBatch(read.batch);
+						}
+						else
+						{
+							post(std::bind(&DatagramServerPrivate::dispatchBatch,
+							               this->shared_from_this(),
+							               std::move(read.batch)));
+						}
+					}
+				}
+
+				/*!
+				 * \brief Post a handler to the IO service, keeping it in order
+				 *        with those posted before if reads are kept in order.
+				 */
+				template <typename Handler>
+				void post(Handler handler)
+				{
+					if (m_sequencer)
+					{
+						m_strand.post(std::move(handler));
+					}
+					else
+					{
+						m_ioService->post(std::move(handler));
+					}
+				}
+
+				/*!
+				 * \brief Hand a received datagram to the callback.
+				 *
+				 * \param[in] sender
+				 * Who sent the datagram.
+				 *
+				 * \param[in] buffer
+				 * The datagram.
+				 */
+				void dispatch(const typename T::endpoint &sender,
+				              const SharedBuffer &buffer)
+				{
+					if (m_tracer)
+					{
+						m_tracer->dispatched(buffer, traceTime());
+					}
+
+					if (!m_batchCallback)
+					{
+						m_callback(sender, buffer);
+						return;
+					}
+
+					// The batch's storage is kept for the thread's next
+					// datagram, but not the datagram itself.
+					static thread_local Batch t_single;
+					t_single.push_back(Datagram<typename T::endpoint>{sender,
+					                                                  buffer});
+					m_batchCallback(t_single);
+					t_single.clear();
+				}
+
+				/*!
+				 * \brief Wait for the socket to become readable so it can be
+				 *        drained in a batch.
+				 *
+				 * \param[in] slot
+				 * Read slot, whose receive slots the batch is received into.
+				 */
+				void beginBatchReading(std::size_t slot)
+				{
+					m_socket->async_receive(
+					         boost::asio::null_buffers(),
+					         std::bind(&DatagramServerPrivate::handleReadable,
+					                   this->shared_from_this(), slot,
+					                   std::placeholders::_1));
+				}
+
+				/*!
+				 * \brief Handle the socket becoming readable by receiving as many
+				 *        datagrams as are ready (up to the batch size).
+				 *
+				 * \param[in] slot
+				 * Read slot the wait was started on.
+				 *
+				 * \param[in] error
+				 * Error that occurred while waiting (if any).
+				 */
+				void handleReadable(std::size_t slot,
+				                    const boost::system::error_code &error)
+				{
+					if (error)
+					{
+						m_counters.add(READ_ERRORS);
+						std::cerr << "Error waiting to read: " << error << std::endl;
+						return;
+					}
+
+					// Make sure every slot has a full-sized buffer to receive into.
+					// Slots that weren't filled last time keep their buffer.
+					Batch &slots = m_batches[slot];
+					slots.resize(m_batchSize);
+					for (auto &datagram : slots)
+					{
+						if (datagram.buffer)
+						{
+							datagram.buffer.resize(m_bufferSize);
+						}
+						else
+						{
+							datagram.buffer = SharedBuffer(m_bufferSize);
+						}
+					}
+
+					// Other slots may be receiving at the same time, so when
+					// reads are kept in order, it's receiving that's numbered.
+					boost::system::error_code receiveError;
+					std::size_t received = 0;
+					std::uint64_t sequence = 0;
+					auto receive = [&](std::uint64_t number)
+					{
+						sequence = number;
+						received = receiveDatagrams(*m_socket, slots, receiveError);
+					};
+
+					if (m_sequencer)
+					{
+						m_sequencer->start(receive);
+					}
+					else
+					{
+						receive(0);
+					}
+
+					Completion read;
+					read.slot = slot;
+					if (receiveError &&
+					    receiveError != boost::asio::error::would_block)
+					{
+						m_counters.add(READ_ERRORS);
+						std::cerr << "Error reading: " << receiveError << std::endl;
+						complete(sequence, std::move(read));
+						return;
+					}
+
+					read.more = true;
+					if (received > 0)
+					{
+						// Hand the filled slots off. They now belong to the
+						// callback, so give them up here.
+						read.batch = takeSpareBatch();
+						std::size_t bytes = 0;
+						for (std::size_t i = 0; i < received; ++i)
+						{
+							bytes += slots[i].buffer.size();
+							read.batch.push_back(Datagram<typename T::endpoint>{
+							                        slots[i].endpoint,
+							                        std::move(slots[i].buffer)});
+						}
+
+						m_counters.add(RECEIVED, received);
+						m_counters.add(RECEIVED_BYTES, bytes);
+
+						// The whole batch was read at once.
+						if (m_tracer)
+						{
+							std::int64_t now = traceTime();
+							for (const auto &datagram : read.batch)
+							{
+								LatencyTracer::read(datagram.buffer, now);
+							}
+						}
+					}
+
+					complete(sequence, std::move(read));
+				}
+
+				/*!
+				 * \brief Hand a batch of received datagrams to the callback(s).
+				 *
+				 * \param[in] batch
+				 * The datagrams that were received.
+				 */
+				void dispatchBatch(Batch &batch)
+				{
+					if (m_tracer)
+					{
+						std::int64_t now = traceTime();
+						for (const auto &datagram : batch)
+						{
+							m_tracer->dispatched(datagram.buffer, now);
+						}
+					}
+
+					if (m_batchCallback)
+					{
+						m_batchCallback(batch);
+					}
+					else
+					{
+						for (const auto &datagram : batch)
+						{
+							m_callback(datagram.endpoint, datagram.buffer);
+						}
+					}
+
+					// Release the buffers but keep the batch's storage around for
+					// next time.
+					batch.clear();
+
+					std::lock_guard<std::mutex> lock(m_spareBatchesMutex);
+					if (m_spareBatches.size() < MAXIMUM_SPARE_BATCHES)
+					{
+						m_spareBatches.push_back(std::move(batch));
+					}
+				}
+
+				/*!
+				 * \brief Obtain an empty batch, reusing one from a previous read
+				 *        if possible.
+				 */
+				Batch takeSpareBatch()
+				{
+					std::lock_guard<std::mutex> lock(m_spareBatchesMutex);
+					if (m_spareBatches.empty())
+					{
+						Batch batch;
+						batch.reserve(m_batchSize);
+						return batch;
+					}
+
+					Batch batch(std::move(m_spareBatches.back()));
+					m_spareBatches.pop_back();
+					return batch;
+				}
+
+				/*!
+				 * \brief Send as many datagrams as the socket has room for,
+				 *        skipping (and counting) those the kernel refuses.
+				 *
+				 * \return The number of datagrams dealt with. Those after it
+				 * are waiting for room.
+				 */
+				std::size_t sendSome(const Datagram<typename T::endpoint> *datagrams,
+				                     std::size_t count)
+				{
+					std::size_t done = 0;
+					while (done < count)
+					{
+						boost::system::error_code error;
+						std::size_t sent = sendDatagrams(*m_socket, datagrams + done,
+						                                 count - done, error);
+						std::size_t bytes = 0;
+						for (std::size_t i = done; i < done + sent; ++i)
+						{
+							bytes += datagrams[i].buffer.size();
+						}
+
+						m_counters.add(SENT, sent);
+						m_counters.add(SENT_BYTES, bytes);
+						if (m_tracer && sent > 0)
+						{
+							std::int64_t now = traceTime();
+							for (std::size_t i = done; i < done + sent; ++i)
+							{
+								m_tracer->written(datagrams[i].buffer, now);
+							}
+						}
+
+						done += sent;
+
+						if (!error)
+						{
+							break;
+						}
+
+						if (error == boost::asio::error::would_block)
+						{
+							return done;
+						}
+
+						m_counters.add(FAILED);
+						++done;
+					}
+
+					return done;
+				}
+
+				/*!
+				 * \brief Queue a datagram until the socket has room for it,
+				 *        applying the drop policy if the queue is full.
+				 *
+				 * The send queue mutex must be held.
+				 */
+				void queueSend(const Datagram<typename T::endpoint> &datagram)
+				{
+					if (m_sendQueue.size() >= m_sendQueueDepth)
+					{
+						m_counters.add(DROPPED);
+						if (m_sendDropPolicy == SendDropPolicy::DropNewest ||
+						    m_sendQueue.empty())
+						{
+							return;
+						}
+
+						m_sendQueue.pop_front();
+					}
+
+					m_sendQueue.push_back(datagram);
+					m_counters.add(QUEUED);
+					m_queuedSends.store(m_sendQueue.size(),
+					                    std::memory_order_release);
+
+					beginWaitingToSend();
+				}
+
+				/*!
+				 * \brief Wait for the socket to have room for the queued
+				 *        datagrams, unless already waiting.
+				 *
+				 * The send queue mutex must be held.
+				 */
+				void beginWaitingToSend()
+				{
+					if (m_waitingToSend)
+					{
+						return;
+					}
+
+					m_waitingToSend = true;
+					m_socket->async_send(
+					         boost::asio::null_buffers(),
+					         std::bind(&DatagramServerPrivate::handleWritable,
+					                   this->shared_from_this(),
+					                   std::placeholders::_1));
+				}
+
+				/*!
+				 * \brief Handle the socket having room by sending as much of
+				 *        the queue as it will take.
+				 *
+				 * \param[in] error
+				 * Error that occurred while waiting (if any).
+				 */
+				void handleWritable(const boost::system::error_code &error)
+				{
+					std::lock_guard<std::mutex> lock(m_sendQueueMutex);
+					m_waitingToSend = false;
+
+					if (error)
+					{
+						std::cerr << "Error waiting to send: " << error << std::endl;
+						return;
+					}
+
+					while (!m_sendQueue.empty())
+					{
+						std::size_t count = m_sendQueue.size();
+						if (count > MAXIMUM_SEND_BATCH)
+						{
+							count = MAXIMUM_SEND_BATCH;
+						}
+
+						m_sendBatch.assign(m_sendQueue.begin(),
+						                   m_sendQueue.begin() + count);
+
+						std::size_t done = sendSome(m_sendBatch.data(), count);
+						m_sendQueue.erase(m_sendQueue.begin(),
+						                  m_sendQueue.begin() + done);
+						if (done < count)
+						{
+							break;
+						}
+					}
+
+					// Don't hold on to the buffers.
+					m_sendBatch.clear();
+
+					m_queuedSends.store(m_sendQueue.size(),
+					                    std::memory_order_release);
+					if (!m_sendQueue.empty())
+					{
+						beginWaitingToSend();
+					}
 				}
 
 			private:
 				SharedIoService m_ioService;
 				ReadCallback m_callback;
+				BatchReadCallback m_batchCallback;
 				std::unique_ptr<typename T::socket> m_socket;
 				std::size_t m_bufferSize;
+				std::size_t m_batchSize;
+				DispatchMode m_dispatchMode;
+
+				// Reads kept outstanding, each with a slot of its own: the
+				// sender of its datagram (one-at-a-time mode), or receive slots
+				// reused between batches (batch mode). A slot is only touched
+				// by its read.
+				std::size_t m_readDepth;
+				std::vector<typename T::endpoint> m_senderEndpoints;
+				std::vector<Batch> m_batches;
+
+				// Set if reads are handed to the callback in order, through
+				// the strand unless dispatched inline.
+				std::unique_ptr<ReadSequencer<Completion>> m_sequencer;
+				boost::asio::io_service::strand m_strand;
+
+				// Batches that have been dispatched, kept so their storage can be
+				// reused.
+				static const std::size_t MAXIMUM_SPARE_BATCHES = 16;
+				std::mutex m_spareBatchesMutex;
+				std::vector<Batch> m_spareBatches;
+
+				// Datagrams waiting for room in the socket's send buffer. The
+				// count is kept separately so senders can check it without
+				// taking the lock.
+				static const std::size_t MAXIMUM_SEND_BATCH = 64;
+				std::size_t m_sendQueueDepth;
+				SendDropPolicy m_sendDropPolicy;
+				std::mutex m_sendQueueMutex;
+				std::deque<Datagram<typename T::endpoint>> m_sendQueue;
+				std::atomic<std::size_t> m_queuedSends;
+				bool m_waitingToSend;
+				Batch m_sendBatch;
+
+				enum
+				{
+					RECEIVED,
+					RECEIVED_BYTES,
+					READ_ERRORS,
+					SENT,
+					SENT_BYTES,
+					QUEUED,
+					DROPPED,
+					FAILED,
+					COUNTER_COUNT
+				};
+
+				Counters m_counters;
+				std::unique_ptr<LatencyTracer> m_tracer;
 		};
 	}
 }
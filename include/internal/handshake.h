@@ -0,0 +1,280 @@
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H
+
+#include <array>
+#include <memory>
+
+#include <boost/noncopyable.hpp>
+#include <boost/asio/ip/udp.hpp>
+
+#include "types.h"
+#include "internal/aead.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		//! Message types, in the first byte of every message (data messages
+		//! being AEAD_MESSAGE_TYPE).
+		const std::uint8_t HANDSHAKE_INITIATION_TYPE = 1;
+		const std::uint8_t HANDSHAKE_RESPONSE_TYPE = 2;
+		const std::uint8_t COOKIE_REPLY_TYPE = 3;
+
+		const std::size_t HANDSHAKE_INITIATION_SIZE = 96;
+		const std::size_t HANDSHAKE_RESPONSE_SIZE = 92;
+		const std::size_t COOKIE_REPLY_SIZE = 52;
+
+		const std::size_t COOKIE_SIZE = 16;
+		const std::size_t MAC_SIZE = 16;
+
+		typedef std::array<std::uint8_t, COOKIE_SIZE> Cookie;
+		typedef std::array<std::uint8_t, MAC_SIZE> Mac;
+
+		class HandshakeException : public Exception
+		{
+			public:
+				HandshakeException(const std::string &what);
+		};
+
+		/*!
+		 * \brief Keys agreed on by a handshake, for one direction each.
+		 */
+		struct SessionKeys
+		{
+			AeadKey sending;
+			AeadKey receiving;
+
+			//! Index the peer puts in messages for us (ours), and the one we
+			//! put in messages for it.
+			std::uint32_t localIndex;
+			std::uint32_t remoteIndex;
+		};
+
+		/*!
+		 * \brief Where one side of a handshake is at.
+		 *
+		 * It's not thread-safe, and only meant to be used through a
+		 * HandshakeProtocol.
+		 */
+		class HandshakeState : private boost::noncopyable
+		{
+			public:
+				HandshakeState();
+				~HandshakeState();
+
+				std::uint32_t localIndex() const;
+				std::uint32_t remoteIndex() const;
+
+				//! mac1 of the last initiation sent, which cookie replies to it
+				//! are bound to.
+				const Mac &initiationMac() const;
+
+			private:
+				friend class HandshakeProtocol;
+
+				struct Private;
+				std::unique_ptr<Private> m_data;
+		};
+
+		/*!
+		 * \brief The HandshakeProtocol class creates and checks the messages
+		 *        of the handshakes that agree on session keys.
+		 *
+		 * The handshake is Noise_NNpsk0_25519_ChaChaPoly_SHA256: each side
+		 * contributes an ephemeral X25519 key, so every session has fresh
+		 * keys (with forward secrecy), and both are authenticated by the key
+		 * pre-shared by every peer. It takes one round trip:
+		 *
+		 * - The initiation holds the initiator's index and ephemeral key,
+		 *   and a timestamp (encrypted) so the responder can turn away
+		 *   replayed initiations.
+		 * - The response holds the responder's index and ephemeral key.
+		 *
+		 * Like WireGuard's, both end with two MACs: mac1, keyed with a hash
+		 * of the pre-shared key, lets junk be turned away without any
+		 * asymmetric crypto. mac2 is keyed with a cookie from the responder.
+		 * Under load, a responder only answers messages with a valid mac2,
+		 * and replies to the rest with a cookie (bound to the sender's
+		 * address and port), which has to be echoed back. Flooding with
+		 * spoofed addresses then gets nowhere.
+		 *
+		 * It's immutable once constructed, so it can be shared freely.
+		 */
+		class HandshakeProtocol : private boost::noncopyable
+		{
+			public:
+				/*!
+				 * \brief HandshakeProtocol constructor.
+				 *
+				 * \param[in] presharedKey
+				 * The key shared by every peer.
+				 */
+				explicit HandshakeProtocol(const AeadKey &presharedKey);
+
+				/*!
+				 * \brief Start a handshake.
+				 *
+				 * \param[out] state
+				 * State to keep for the response (reset).
+				 *
+				 * \param[in] localIndex
+				 * Index the responder should use for us.
+				 *
+				 * \param[in] timestamp
+				 * Must be higher than in any earlier initiation to the same
+				 * responder (e.g. the time).
+				 *
+				 * \param[in] cookie
+				 * The responder's latest cookie, if there's one.
+				 *
+				 * \return The initiation.
+				 *
+				 * \exception HandshakeException
+				 * If the crypto library fails.
+				 */
+				SharedBuffer createInitiation(HandshakeState &state,
+				                              std::uint32_t localIndex,
+				                              std::uint64_t timestamp,
+				                              const Cookie *cookie) const;
+
+				/*!
+				 * \brief Check an initiation.
+				 *
+				 * mac2 isn't checked (see hasValidMac2()).
+				 *
+				 * \param[in] message
+				 * The initiation.
+				 *
+				 * \param[out] state
+				 * State to respond with (reset).
+				 *
+				 * \param[out] timestamp
+				 * The initiation's timestamp.
+				 *
+				 * \return Whether or not it's a valid initiation.
+				 */
+				bool consumeInitiation(const SharedBuffer &message,
+				                       HandshakeState &state,
+				                       std::uint64_t &timestamp) const;
+
+				/*!
+				 * \brief Respond to an initiation, which completes the
+				 *        handshake on our side.
+				 *
+				 * \param[in,out] state
+				 * The state consumeInitiation() left.
+				 *
+				 * \param[in] localIndex
+				 * Index the initiator should use for us.
+				 *
+				 * \param[out] keys
+				 * The session's keys.
+				 *
+				 * \return The response.
+				 *
+				 * \exception HandshakeException
+				 * If the crypto library fails.
+				 */
+				SharedBuffer createResponse(HandshakeState &state,
+				                            std::uint32_t localIndex,
+				                            SessionKeys &keys) const;
+
+				/*!
+				 * \brief Check a response, which completes the handshake.
+				 *
+				 * \param[in] message
+				 * The response.
+				 *
+				 * \param[in,out] state
+				 * The state createInitiation() left.
+				 *
+				 * \param[out] keys
+				 * The session's keys.
+				 *
+				 * \return Whether or not it's a valid response to our
+				 * initiation.
+				 */
+				bool consumeResponse(const SharedBuffer &message,
+				                     HandshakeState &state,
+				                     SessionKeys &keys) const;
+
+				/*!
+				 * \brief Answer a handshake message with a cookie rather than
+				 *        going through with it.
+				 *
+				 * \param[in] message
+				 * An initiation or response (with a valid mac1).
+				 *
+				 * \param[in] cookie
+				 * Cookie for the message's sender.
+				 *
+				 * \return The cookie reply.
+				 */
+				SharedBuffer createCookieReply(const SharedBuffer &message,
+				                               const Cookie &cookie) const;
+
+				/*!
+				 * \brief Obtain the cookie from a reply to our initiation.
+				 *
+				 * \param[in] message
+				 * The cookie reply.
+				 *
+				 * \param[in] state
+				 * The state createInitiation() left.
+				 *
+				 * \param[out] cookie
+				 * The cookie.
+				 *
+				 * \return Whether or not it's a valid reply to our initiation.
+				 */
+				bool consumeCookieReply(const SharedBuffer &message,
+				                        const HandshakeState &state,
+				                        Cookie &cookie) const;
+
+				/*!
+				 * \brief Check the mac2 of an initiation or response.
+				 */
+				static bool hasValidMac2(const SharedBuffer &message,
+				                         const Cookie &cookie);
+
+				/*!
+				 * \brief Obtain the index a response or cookie reply is meant
+				 *        for (0 if it's neither).
+				 */
+				static std::uint32_t receiverIndex(const SharedBuffer &message);
+
+			private:
+				bool hasValidMac1(const SharedBuffer &message,
+				                  std::size_t offset) const;
+
+				void writeMacs(SharedBuffer &message, const Cookie *cookie) const;
+
+			private:
+				AeadKey m_presharedKey;
+				AeadKey m_macKey;
+		};
+
+		/*!
+		 * \brief The CookieSecret class hands out cookies bound to an
+		 *        address and port, with a secret that changes over time.
+		 */
+		class CookieSecret
+		{
+			public:
+				CookieSecret();
+
+				/*!
+				 * \brief Replace the secret, which invalidates every cookie
+				 *        handed out so far.
+				 */
+				void rotate();
+
+				Cookie cookie(const boost::asio::ip::udp::endpoint &endpoint) const;
+
+			private:
+				AeadKey m_secret;
+		};
+	}
+}
+
+#endif // HANDSHAKE_H
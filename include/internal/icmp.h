@@ -0,0 +1,37 @@
+#ifndef ICMP_H
+#define ICMP_H
+
+#include <boost/asio/ip/address.hpp>
+
+#include "types.h"
+
+namespace Overpass
+{
+	class PacketView;
+
+	namespace internal
+	{
+		/*!
+		 * \brief Build an ICMP (or ICMPv6) destination unreachable message in
+		 *        reply to a packet that couldn't be routed.
+		 *
+		 * Following RFC 1122 and RFC 4443, nothing is built in reply to ICMP
+		 * error messages, fragments other than the first, or packets from
+		 * unspecified or multicast addresses.
+		 *
+		 * \param[in] packet
+		 * The packet that couldn't be routed. It must be valid.
+		 *
+		 * \param[in] source
+		 * Address the message is sent from. Only packets of the same address
+		 * family are replied to.
+		 *
+		 * \return The message (an IP packet addressed to the packet's sender),
+		 * or an empty buffer if no reply should be sent.
+		 */
+		SharedBuffer makeHostUnreachable(const PacketView &packet,
+		                                 const boost::asio::ip::address &source);
+	}
+}
+
+#endif // ICMP_H
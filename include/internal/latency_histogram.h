@@ -0,0 +1,259 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <chrono>
+#include <vector>
+#include <cstdint>
+
+#include <boost/noncopyable.hpp>
+
+#include "types.h"
+#include "internal/counters.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief Obtain the current time as used for latency tracing, in
+		 *        nanoseconds (never 0).
+		 */
+		inline std::int64_t traceTime()
+		{
+			using namespace std::chrono;
+			return duration_cast<nanoseconds>(
+			         steady_clock::now().time_since_epoch()).count() | 1;
+		}
+
+		/*!
+		 * \brief A copy of a LatencyHistogram's counts, which can be merged
+		 *        with others and queried.
+		 */
+		struct LatencySnapshot
+		{
+			LatencySnapshot();
+
+			/*!
+			 * \brief Add another snapshot's counts to this one's.
+			 */
+			void merge(const LatencySnapshot &other);
+
+			/*!
+			 * \brief Obtain the latency below which a given fraction of the
+			 *        values recorded fall (0 if there are none).
+			 *
+			 * \param[in] fraction
+			 * The fraction (e.g. 0.99 for the 99th percentile).
+			 *
+			 * \return The highest latency of the bucket it falls in, in
+			 * nanoseconds, so it's never understated.
+			 */
+			std::uint64_t percentile(double fraction) const;
+
+			//! Values recorded, per bucket.
+			std::vector<std::uint64_t> buckets;
+
+			//! Number of values recorded.
+			std::uint64_t count;
+
+			//! Sum of the values recorded, in nanoseconds.
+			std::uint64_t sum;
+		};
+
+		/*!
+		 * \brief The LatencyHistogram class records latencies (in
+		 *        nanoseconds) from any number of threads without contending.
+		 *
+		 * Buckets are log-linear, like those of HDR histograms: every power
+		 * of two is split into 16 buckets, so any value is known to within
+		 * about 6% however large it is (up to about 18 minutes, beyond which
+		 * values are clamped). Bucket counts are Counters, so recording is a
+		 * couple of plain stores to the thread's own cells, and threads are
+		 * merged when a snapshot is taken.
+		 */
+		class LatencyHistogram : private boost::noncopyable
+		{
+			private:
+				// Values up to 2^MAXIMUM_BITS - 1 are told apart.
+				static const unsigned int SUB_BUCKET_BITS = 4;
+				static const unsigned int MAXIMUM_BITS = 40;
+				static const std::uint64_t SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+				static const std::uint64_t MAXIMUM_VALUE =
+				      (std::uint64_t(1) << MAXIMUM_BITS) - 1;
+
+			public:
+				//! Number of buckets.
+				static const std::size_t BUCKET_COUNT =
+				      (MAXIMUM_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+				LatencyHistogram();
+
+				/*!
+				 * \brief Record a latency (from any thread).
+				 *
+				 * \param[in] nanoseconds
+				 * The latency. Negative values count as 0.
+				 */
+				void record(std::int64_t nanoseconds)
+				{
+					std::uint64_t value = nanoseconds > 0 ? nanoseconds : 0;
+					m_counts.add(bucket(value));
+					m_counts.add(BUCKET_COUNT, value);
+				}
+
+				/*!
+				 * \brief Obtain a copy of the counts, across threads.
+				 */
+				LatencySnapshot snapshot() const;
+
+				/*!
+				 * \brief Obtain the bucket a value falls in.
+				 */
+				static std::size_t bucket(std::uint64_t value)
+				{
+					if (value < SUB_BUCKET_COUNT)
+					{
+						return value;
+					}
+
+					if (value > MAXIMUM_VALUE)
+					{
+						value = MAXIMUM_VALUE;
+					}
+
+					unsigned int exponent = 63 - __builtin_clzll(value);
+					unsigned int shift = exponent - SUB_BUCKET_BITS;
+					return (shift + 1) * SUB_BUCKET_COUNT +
+					       ((value >> shift) & (SUB_BUCKET_COUNT - 1));
+				}
+
+				/*!
+				 * \brief Obtain the highest value of a bucket.
+				 */
+				static std::uint64_t highestValue(std::size_t bucket);
+
+			private:
+				// One per bucket, followed by the sum.
+				Counters m_counts;
+		};
+
+		/*!
+		 * \brief Stages of forwarding, as seen by the server at either end.
+		 */
+		enum class LatencyStage
+		{
+			//! From a packet being read to its being handed to the callback
+			//! (the hop through the IO service), on the reading server.
+			Dispatch,
+
+			//! From a packet being handed to the callback on the reading
+			//! server to its being given to the writing server (routing,
+			//! sealing or opening, and any hop between shards).
+			Route,
+
+			//! From a packet being given to the writing server to its being
+			//! written (queueing included).
+			Send,
+
+			//! From a packet being read to its being written.
+			Total,
+		};
+
+		//! Number of LatencyStage values.
+		const std::size_t LATENCY_STAGE_COUNT = 4;
+
+		/*!
+		 * \brief Short name of a stage (for metrics).
+		 */
+		const char *toString(LatencyStage stage);
+
+		/*!
+		 * \brief The LatencyTracer class times the packets going through a
+		 *        server, stage by stage.
+		 *
+		 * Packets carry when they went through each stage in their buffers
+		 * (see PacketTimes), so they're timed across the IO service, queues
+		 * and threads they go through. The reading server stamps them as
+		 * they're read, and the server writing them records how long each
+		 * stage took, so a tracer's Dispatch histogram is about packets it
+		 * read while its other histograms are about packets it wrote. Packets
+		 * read by servers that don't trace aren't timed.
+		 */
+		class LatencyTracer : private boost::noncopyable
+		{
+			public:
+				/*!
+				 * \brief Stamp a packet as read.
+				 */
+				static void read(const SharedBuffer &buffer, std::int64_t now)
+				{
+					PacketTimes &times = buffer.times();
+					times.read = now;
+					times.dispatched = 0;
+					times.queued = 0;
+				}
+
+				/*!
+				 * \brief Stamp a packet (read by this server) as handed to the
+				 *        callback.
+				 */
+				void dispatched(const SharedBuffer &buffer, std::int64_t now)
+				{
+					PacketTimes &times = buffer.times();
+					if (times.read)
+					{
+						times.dispatched = now;
+						record(LatencyStage::Dispatch, now - times.read);
+					}
+				}
+
+				/*!
+				 * \brief Stamp a packet as given to this server to be written.
+				 */
+				void queued(const SharedBuffer &buffer, std::int64_t now)
+				{
+					PacketTimes &times = buffer.times();
+					if (times.read)
+					{
+						times.queued = now;
+						if (times.dispatched)
+						{
+							record(LatencyStage::Route, now - times.dispatched);
+						}
+					}
+				}
+
+				/*!
+				 * \brief Record a packet as written by this server.
+				 */
+				void written(const SharedBuffer &buffer, std::int64_t now)
+				{
+					const PacketTimes &times = buffer.times();
+					if (times.read && times.queued)
+					{
+						record(LatencyStage::Send, now - times.queued);
+						record(LatencyStage::Total, now - times.read);
+					}
+				}
+
+				/*!
+				 * \brief Obtain a copy of a stage's histogram.
+				 */
+				LatencySnapshot snapshot(LatencyStage stage) const
+				{
+					return m_stages[static_cast<std::size_t>(stage)].snapshot();
+				}
+
+			private:
+				void record(LatencyStage stage, std::int64_t nanoseconds)
+				{
+					m_stages[static_cast<std::size_t>(stage)].record(nanoseconds);
+				}
+
+			private:
+				LatencyHistogram m_stages[LATENCY_STAGE_COUNT];
+		};
+	}
+}
+
+#endif // LATENCY_HISTOGRAM_H
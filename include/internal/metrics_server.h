@@ -0,0 +1,83 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <memory>
+#include <ostream>
+#include <functional>
+
+#include <boost/noncopyable.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+
+#include "types.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief The MetricsServer class serves snapshots of metrics on a
+		 *        Unix domain socket.
+		 *
+		 * Every connection gets a fresh snapshot, written in the Prometheus
+		 * text format, and is then closed, so reading the socket (e.g. with
+		 * `socat - UNIX-CONNECT:<path>`) is all it takes to scrape it.
+		 * Snapshots are written from the IO service the server runs on.
+		 */
+		class MetricsServer :
+		      public std::enable_shared_from_this<MetricsServer>,
+		      private boost::noncopyable
+		{
+			public:
+				typedef std::function<void (std::ostream&)> Writer;
+
+				/*!
+				 * \brief MetricsServer constructor.
+				 *
+				 * \param[in,out] ioService
+				 * IO service used for running the server.
+				 *
+				 * \param[in] path
+				 * Path of the socket, which only its owner can connect to. A
+				 * socket there already is replaced (e.g. the one of a server
+				 * that didn't exit cleanly), but no other kind of file is.
+				 *
+				 * \param[in] writer
+				 * Function writing a snapshot.
+				 *
+				 * \exception boost::system::system_error
+				 * If the socket can't be bound, or something other than a
+				 * socket is in the way.
+				 */
+				MetricsServer(boost::asio::io_service &ioService,
+				              const std::string &path, Writer writer);
+
+				/*!
+				 * \brief MetricsServer destructor.
+				 *
+				 * The socket is removed.
+				 */
+				~MetricsServer();
+
+				/*!
+				 * \brief Start accepting connections.
+				 */
+				void start();
+
+			private:
+				typedef boost::asio::local::stream_protocol::socket Socket;
+
+				void beginAccepting();
+				void handleAccept(const std::shared_ptr<Socket> &socket,
+				                  const boost::system::error_code &error);
+
+			private:
+				boost::asio::io_service &m_ioService;
+				std::string m_path;
+				Writer m_writer;
+				boost::asio::local::stream_protocol::acceptor m_acceptor;
+		};
+	}
+}
+
+#endif // METRICS_SERVER_H
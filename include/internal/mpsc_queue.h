@@ -0,0 +1,173 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief Bounded lock-free queue for many producers and a single
+		 *        consumer.
+		 *
+		 * This is Dmitry Vyukov's bounded queue: every slot carries a sequence
+		 * number telling producers and the consumer whose turn it is, so
+		 * neither side ever waits on the other. Producers only contend with
+		 * each other, on the tail.
+		 */
+		template <typename T>
+		class MpscQueue
+		{
+			public:
+				/*!
+				 * \brief MpscQueue constructor.
+				 *
+				 * \param[in] capacity
+				 * Maximum number of entries (rounded up to a power of two).
+				 */
+				explicit MpscQueue(std::size_t capacity) :
+				   m_mask(roundUp(capacity) - 1),
+				   m_slots(new Slot[m_mask + 1]),
+				   m_tail(0),
+				   m_head(0)
+				{
+					for (std::size_t i = 0; i <= m_mask; ++i)
+					{
+						m_slots[i].sequence.store(i, std::memory_order_relaxed);
+					}
+				}
+
+				/*!
+				 * \brief Add an entry, unless the queue is full.
+				 *
+				 * This may be called from any thread.
+				 *
+				 * \return Whether or not the entry was added.
+				 */
+				bool tryPush(const T &value)
+				{
+					std::size_t position = m_tail.load(std::memory_order_relaxed);
+					Slot *slot;
+					for (;;)
+					{
+						slot = &m_slots[position & m_mask];
+						std::size_t sequence =
+						      slot->sequence.load(std::memory_order_acquire);
+						std::intptr_t difference =
+						      static_cast<std::intptr_t>(sequence) -
+						      static_cast<std::intptr_t>(position);
+
+						if (difference == 0)
+						{
+							if (m_tail.compare_exchange_weak(
+							       position, position + 1,
+							       std::memory_order_relaxed))
+							{
+								break;
+							}
+						}
+						else if (difference < 0)
+						{
+							// The consumer hasn't freed this slot yet.
+							return false;
+						}
+						else
+						{
+							position = m_tail.load(std::memory_order_relaxed);
+						}
+					}
+
+					slot->value = value;
+					slot->sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+
+				/*!
+				 * \brief Take the oldest entry, if any.
+				 *
+				 * Only one thread at a time may call this.
+				 *
+				 * \return Whether or not there was an entry to take.
+				 */
+				bool tryPop(T &value)
+				{
+					std::size_t position = m_head.load(std::memory_order_relaxed);
+					Slot &slot = m_slots[position & m_mask];
+					if (slot.sequence.load(std::memory_order_acquire) !=
+					    position + 1)
+					{
+						return false;
+					}
+
+					value = std::move(slot.value);
+					slot.value = T();
+					slot.sequence.store(position + m_mask + 1,
+					                    std::memory_order_release);
+					m_head.store(position + 1, std::memory_order_relaxed);
+					return true;
+				}
+
+				/*!
+				 * \brief Check whether or not there's an entry ready to be
+				 *        taken.
+				 *
+				 * Only meaningful on the consumer's thread.
+				 */
+				bool empty() const
+				{
+					std::size_t position = m_head.load(std::memory_order_relaxed);
+					return m_slots[position & m_mask].sequence.load(
+					         std::memory_order_acquire) != position + 1;
+				}
+
+				/*!
+				 * \brief Obtain the (approximate) number of entries.
+				 */
+				std::size_t size() const
+				{
+					std::size_t tail = m_tail.load(std::memory_order_relaxed);
+					std::size_t head = m_head.load(std::memory_order_relaxed);
+					return tail > head ? tail - head : 0;
+				}
+
+				std::size_t capacity() const
+				{
+					return m_mask + 1;
+				}
+
+			private:
+				static std::size_t roundUp(std::size_t capacity)
+				{
+					std::size_t rounded = 2;
+					while (rounded < capacity)
+					{
+						rounded <<= 1;
+					}
+
+					return rounded;
+				}
+
+				struct Slot
+				{
+					std::atomic<std::size_t> sequence;
+					T value;
+				};
+
+				const std::size_t m_mask;
+				std::unique_ptr<Slot[]> m_slots;
+
+				// Producers and the consumer each get their own cache line.
+				char m_padding1[64];
+				std::atomic<std::size_t> m_tail;
+				char m_padding2[64 - sizeof(std::atomic<std::size_t>)];
+				std::atomic<std::size_t> m_head;
+				char m_padding3[64 - sizeof(std::atomic<std::size_t>)];
+		};
+	}
+}
+
+#endif // MPSC_QUEUE_H
@@ -0,0 +1,153 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <vector>
+#include <functional>
+
+#include "types.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief The virtio_net_hdr prefixing every packet on a virtual
+		 *        interface with offloads enabled (in host byte order).
+		 *
+		 * linux/virtio_net.h can't be included from C++, hence this copy.
+		 */
+		struct VirtioNetHeader
+		{
+			std::uint8_t flags;
+			std::uint8_t gsoType;
+			std::uint16_t headerLength;
+			std::uint16_t gsoSize;
+			std::uint16_t checksumStart;
+			std::uint16_t checksumOffset;
+		};
+
+		const std::size_t VIRTIO_NET_HEADER_SIZE = sizeof(VirtioNetHeader);
+
+		//! The checksum from checksumStart on is left to be completed, into
+		//! the field at checksumOffset (which holds the pseudo-header's sum).
+		const std::uint8_t VIRTIO_NET_HEADER_NEEDS_CHECKSUM = 1;
+
+		const std::uint8_t VIRTIO_NET_GSO_NONE = 0;
+		const std::uint8_t VIRTIO_NET_GSO_TCPV4 = 1;
+		const std::uint8_t VIRTIO_NET_GSO_TCPV6 = 4;
+		const std::uint8_t VIRTIO_NET_GSO_ECN = 0x80;
+
+		//! Largest read from a virtual interface with offloads enabled: a
+		//! 64 KiB super-packet and its header.
+		const std::size_t MAXIMUM_OFFLOAD_READ_SIZE =
+		      65535 + VIRTIO_NET_HEADER_SIZE;
+
+		/*!
+		 * \brief Turn a packet read from a virtual interface with offloads
+		 *        enabled into packets that can go on the wire.
+		 *
+		 * TCP super-packets (TSO) are split into segments of the size the
+		 * kernel asked for, each with its own headers and checksum. Packets
+		 * left for us to checksum have it completed. Everything else is only
+		 * stripped of its header.
+		 *
+		 * Packets that don't match what their header claims are passed on
+		 * as they are (stripped), for the router to drop and account for.
+		 *
+		 * \param[in] buffer
+		 * What was read, starting with the virtio_net_hdr.
+		 *
+		 * \param[out] packets
+		 * The resulting packets are appended here.
+		 */
+		void segmentFromVirtual(const SharedBuffer &buffer,
+		                        std::vector<SharedBuffer> &packets);
+
+		/*!
+		 * \brief Prefix a packet with a virtio_net_hdr asking nothing of the
+		 *        kernel, so it can be written to a virtual interface with
+		 *        offloads enabled.
+		 *
+		 * \return A copy of the packet, after the header.
+		 */
+		SharedBuffer prependEmptyVirtioHeader(const SharedBuffer &packet);
+
+		/*!
+		 * \brief The GroCoalescer class merges consecutive TCP segments of the
+		 *        same flow into super-packets before they're written to a
+		 *        virtual interface with offloads enabled (GRO).
+		 *
+		 * Packets are added as they're routed, then flushed once the batch
+		 * they came in is done, so nothing is held back for longer than that.
+		 *
+		 * Segments are only merged when the kernel could have split the
+		 * result back into exactly them: contiguous sequence numbers, the
+		 * same acknowledgement and TCP options, no flags beyond ACK (PSH may
+		 * end a super-packet), and all but the last segment full-sized.
+		 * Anything else is written as it is, without overtaking segments of
+		 * its flow that are still held.
+		 *
+		 * It's not thread-safe: each thread should have its own.
+		 */
+		class GroCoalescer
+		{
+			public:
+				typedef std::function<void (const SharedBuffer&)> Writer;
+
+				/*!
+				 * \brief Add a packet.
+				 *
+				 * \param[in] packet
+				 * The IP packet (already validated by the router).
+				 *
+				 * \param[in] writer
+				 * Called with packets (prefixed with their virtio_net_hdr)
+				 * that are ready to be written.
+				 */
+				void add(const SharedBuffer &packet, const Writer &writer);
+
+				/*!
+				 * \brief Write every packet still held.
+				 */
+				void flush(const Writer &writer);
+
+				/*!
+				 * \brief Obtain the number of flows with packets held.
+				 */
+				std::size_t pendingFlows() const
+				{
+					return m_flows.size();
+				}
+
+			private:
+				struct Flow
+				{
+					//! The packet so far (the first segment, or the super-packet
+					//! within the merged buffer).
+					SharedBuffer packet;
+
+					//! Buffer segments are merged in, after room for the
+					//! virtio_net_hdr (only once there's more than one).
+					SharedBuffer merged;
+
+					std::size_t size;
+					std::size_t ipHeaderLength;
+					std::size_t headerLength;
+					std::size_t segmentSize;
+					std::size_t segments;
+					std::uint32_t nextSequence;
+					bool closed;
+				};
+
+				bool merge(Flow &flow, const SharedBuffer &packet,
+				           std::size_t headerLength);
+
+				void write(Flow &flow, const Writer &writer);
+
+			private:
+				std::vector<Flow> m_flows;
+		};
+	}
+}
+
+#endif // OFFLOAD_H
@@ -1,10 +1,17 @@
 #ifndef OVERPASS_SERVER_PRIVATE_H
 #define OVERPASS_SERVER_PRIVATE_H
 
-#include <boost/asio/ip/udp.hpp>
-#include <boost/asio/posix/stream_descriptor.hpp>
+#include <map>
+#include <mutex>
+#include <thread>
 
 #include "types.h"
+#include "datagram.h"
+#include "overpass_server.h"
+#include "internal/timer_wheel.h"
+#include "internal/metrics_server.h"
+#include "internal/session_manager.h"
+#include "internal/uring_sockets.h"
 
 namespace Overpass
 {
@@ -14,7 +21,8 @@ namespace Overpass
 	template <typename T>
 	class StreamServer;
 
-	class Router;
+	template <typename ExternalSenderPolicy, typename VirtualSenderPolicy>
+	class BasicRouter;
 
 	namespace internal
 	{
@@ -32,8 +40,11 @@ namespace Overpass
 				/*!
 				 * \brief OverpassServerPrivate constructor.
 				 *
-				 * \param[in,out] ioService
-				 * IO service used for running the server.
+				 * \param[in,out] ioServices
+				 * IO services used for running the server. With more than one,
+				 * each is treated as a shard (see ShardedRuntime) owning one
+				 * external socket and one virtual interface queue, overriding
+				 * the counts given in the options.
 				 *
 				 * \param[in] overpassInterfacePattern
 				 * Pattern determining virtual interface name (e.g. "ovp%d").
@@ -50,18 +61,26 @@ namespace Overpass
 				 *
 				 * \param[in] bindPort
 				 * UDP port on which to bind listening for Overpass traffic.
+				 *
+				 * \param[in] options
+				 * Tuning options.
+				 *
+				 * \exception Overpass::Exception
+				 * If a cipher is given without a key of the right size.
 				 */
-				OverpassServerPrivate(const SharedIoService &ioService,
+				OverpassServerPrivate(const std::vector<SharedIoService> &ioServices,
 				                      const std::string &overpassInterfacePattern,
 				                      const std::string &overpassIpAddress,
 				                      const std::string &overpassNetmask,
 				                      const std::string &bindIpAddress,
-				                      std::uint16_t bindPort);
+				                      std::uint16_t bindPort,
+				                      const OverpassServerOptions &options);
 
 				/*!
 				 * \brief OverpassServerPrivate destructor.
 				 *
-				 * Simply close the virtual interface file descriptor, if any.
+				 * Stop the handshake thread, and close the virtual interface
+				 * file descriptors not yet handed to a server, if any.
 				 */
 				~OverpassServerPrivate();
 
@@ -74,7 +93,7 @@ namespace Overpass
 
 				/*!
 				 * \brief Add a known client, mapping Overpass address to external
-				 *        address.
+				 *        address (and start sending it keepalives, if enabled).
 				 *
 				 * \param[in] overpassAddress
 				 * Client's IP address on the Overpass network.
@@ -92,7 +111,80 @@ namespace Overpass
 				      const boost::asio::ip::address &overpassAddress,
 				      const boost::asio::ip::address &externalAddress);
 
+				/*!
+				 * \brief Route a network to a known client.
+				 *
+				 * \param[in] network
+				 * Network on the Overpass side.
+				 *
+				 * \param[in] prefixLength
+				 * Number of significant bits of the network.
+				 *
+				 * \param[in] externalAddress
+				 * External address of the client handling the network.
+				 *
+				 * start() must be called before this function can be used.
+				 *
+				 * \exception Overpass::Exception
+				 * If called before start(), or the prefix length is invalid.
+				 */
+				void addRoute(const boost::asio::ip::address &network,
+				              unsigned int prefixLength,
+				              const boost::asio::ip::address &externalAddress);
+
+				/*!
+				 * \brief Obtain the number of packets dropped for a given
+				 *        reason (0 before start()).
+				 */
+				std::uint64_t dropCount(RoutingResult reason) const;
+
+				/*!
+				 * \brief Obtain the number of packets from peers that failed
+				 *        authentication (or came from unknown peers).
+				 */
+				std::uint64_t authenticationFailures() const;
+
+				/*!
+				 * \brief Obtain the number of authentic packets from peers
+				 *        dropped as replays (or too old to tell).
+				 */
+				std::uint64_t replayedPackets() const;
+
+				/*!
+				 * \brief Write a snapshot of the server's metrics (see
+				 *        OverpassServer::writeMetrics()).
+				 */
+				void writeMetrics(std::ostream &stream) const;
+
 			private:
+				/*!
+				 * \brief A known client's keepalive timer, on the wheel of the
+				 *        shard its socket belongs to.
+				 */
+				struct Keepalive
+				{
+					Keepalive(OverpassServerPrivate &server,
+					          const boost::asio::ip::address &externalAddress,
+					          TimerWheel &wheel);
+
+					boost::asio::ip::address externalAddress;
+					TimerWheel &wheel;
+					TimerWheel::Timer timer;
+				};
+
+				/*!
+				 * \brief Send a client an empty packet, wherever it was last
+				 *        heard from, and arm its timer again (or drop the
+				 *        keepalive, if the client is gone).
+				 */
+				void sendKeepalive(Keepalive *keepalive);
+
+				/*!
+				 * \brief Drop the keepalive of a client that's gone, unless
+				 *        it was added again.
+				 */
+				void dropKeepalive(Keepalive *keepalive);
+
 				/*!
 				 * \brief Handle incoming data from the virtual interface.
 				 *
@@ -102,35 +194,165 @@ namespace Overpass
 				void handleReadFromVirtual(const SharedBuffer &buffer);
 
 				/*!
-				 * \brief Handle incoming data from the external interface.
+				 * \brief Write a packet to the virtual interface.
+				 *
+				 * With offloads, it may be held to be merged with the segments
+				 * following it in the same batch.
+				 *
+				 * \param[in] buffer
+				 * The packet (already validated by the router).
+				 */
+				void writeToVirtual(const SharedBuffer &buffer);
+
+				/*!
+				 * \brief Write a packet prefixed with its virtio_net_hdr to the
+				 *        virtual interface (with offloads).
+				 */
+				void writeOffloadedToVirtual(const SharedBuffer &buffer);
+
+				/*!
+				 * \brief Write to one of the virtual interface's queues.
+				 *
+				 * With multiple queues, packets of the same flow always go to
+				 * the same queue so they stay in order.
+				 *
+				 * \param[in] buffer
+				 * What to write.
+				 *
+				 * \param[in] packet
+				 * The IP packet within it, to pick the queue by.
+				 */
+				void writeToVirtualQueue(const SharedBuffer &buffer,
+				                         const SharedBuffer &packet);
+
+				/*!
+				 * \brief Handle a batch of incoming data from the external
+				 *        interface.
+				 *
+				 * \param[in] batch
+				 * Datagrams read, along with their source endpoints.
+				 */
+				void handleBatchFromExternal(
+				      const DatagramBatch<boost::asio::ip::udp::endpoint> &batch);
+
+				/*!
+				 * \brief Authenticate and decrypt a batch of datagrams read
+				 *        from the external interface, and drop replays
+				 *        (handshake messages are handed to the handshake
+				 *        thread).
+				 *
+				 * \return The packets that are authentic, along with their
+				 *         source endpoints (only valid until the next call
+				 *         from the same thread). The external address of
+				 *         the peer each is authentic from is kept alongside.
+				 */
+				const DatagramBatch<boost::asio::ip::udp::endpoint> &openBatch(
+				      const DatagramBatch<boost::asio::ip::udp::endpoint> &batch);
+
+				/*!
+				 * \brief Send a packet over the external interface.
+				 *
+				 * With multiple sockets, each peer is always sent to from the
+				 * same socket.
 				 *
 				 * \param[in] endpoint
-				 * Source endpoint for the data.
+				 * Destination endpoint.
 				 *
 				 * \param[in] buffer
-				 * Data sent by the endpoint.
+				 * The packet.
 				 */
-				void handleReadFromExternal(
+				void sendToExternal(const boost::asio::ip::udp::endpoint &endpoint,
+				                    const SharedBuffer &buffer);
+
+				/*!
+				 * \brief Send a message that's ready to go (sealed already, if
+				 *        need be) over the external interface.
+				 */
+				void sendMessageToExternal(
+				      const boost::asio::ip::udp::endpoint &endpoint,
+				      const SharedBuffer &message);
+
+				/*!
+				 * \brief Send a handshake message over the external interface,
+				 *        from the handshake thread.
+				 */
+				void sendHandshakeMessage(
 				      const boost::asio::ip::udp::endpoint &endpoint,
-				      const SharedBuffer &buffer);
+				      const SharedBuffer &message);
+
+				/*!
+				 * \brief Send a batch of packets over the external interface,
+				 *        each run of them for the same socket at once.
+				 *
+				 * \param[in,out] batch
+				 * Packets, along with their destinations. With a cipher, they're
+				 * sealed in place (and those that can't be are removed).
+				 */
+				void sendBatchToExternal(
+				      DatagramBatch<boost::asio::ip::udp::endpoint> &batch);
+
+				/*!
+				 * \brief Obtain the IO service for a given shard (the only one
+				 *        when not sharded).
+				 */
+				const SharedIoService &shardIoService(std::size_t shard) const;
 
 			private:
-				SharedIoService m_ioService;
+				std::vector<SharedIoService> m_ioServices;
+				bool m_sharded;
 				std::string m_interfaceName;
-				int m_virtualInterfaceDescriptor;
+				std::vector<int> m_virtualInterfaceDescriptors;
 				std::string m_overpassIpAddress;
 				std::string m_overpassNetmask;
 				std::string m_bindIpAddress;
 				std::uint16_t m_bindPort;
+				OverpassServerOptions m_options;
+				bool m_segmentingExternal;
+
+				// With a cipher, handshakes are done on a thread of their own
+				// (at a lower priority), off the forwarding threads.
+				SharedIoService m_handshakeService;
+				std::unique_ptr<boost::asio::io_service::work> m_handshakeWork;
+				std::thread m_handshakeThread;
+				std::unique_ptr<SessionManager> m_sessions;
+
+				// The router calls straight into sendToExternal() and
+				// writeToVirtual(), so both can be inlined into it.
+				struct ExternalSender
+				{
+					void operator()(
+					      const boost::asio::ip::udp::endpoint &endpoint,
+					      const SharedBuffer &buffer) const;
 
+					OverpassServerPrivate *server;
+				};
+
+				struct VirtualSender
+				{
+					void operator()(const SharedBuffer &buffer) const;
+
+					OverpassServerPrivate *server;
+				};
+
+				typedef BasicRouter<ExternalSender, VirtualSender> Router;
 				std::unique_ptr<Router> m_router;
 
-				typedef DatagramServer<boost::asio::ip::udp> UdpServer;
-				std::shared_ptr<UdpServer> m_externalServer;
+				// One timer wheel per shard (a single one when not sharded),
+				// and a keepalive per client if enabled.
+				std::vector<std::unique_ptr<TimerWheel>> m_timerWheels;
+				std::mutex m_keepalivesMutex;
+				std::map<boost::asio::ip::address,
+				         std::unique_ptr<Keepalive>> m_keepalives;
+
+				// Plain Asio sockets and descriptors, unless io_uring is used.
+				typedef DatagramServer<UringUdp> UdpServer;
+				std::vector<std::shared_ptr<UdpServer>> m_externalServers;
+
+				typedef StreamServer<UringStreamDescriptor> PosixStreamServer;
+				std::vector<std::shared_ptr<PosixStreamServer>> m_virtualServers;
 
-				typedef StreamServer<boost::asio::posix::stream_descriptor>
-				PosixStreamServer;
-				std::shared_ptr<PosixStreamServer> m_virtualServer;
+				// Serves writeMetrics() snapshots, if enabled.
+				std::shared_ptr<MetricsServer> m_metricsServer;
 		};
 	}
 }
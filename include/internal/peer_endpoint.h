@@ -0,0 +1,65 @@
+#ifndef PEER_ENDPOINT_H
+#define PEER_ENDPOINT_H
+
+#include <atomic>
+
+#include <boost/noncopyable.hpp>
+#include <boost/asio/ip/udp.hpp>
+
+#include "types.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief The PeerEndpoint class holds where a peer was last heard
+		 *        from, as a ready-made socket address.
+		 *
+		 * It's read for every packet sent to the peer and checked for every
+		 * packet received from it, so neither takes a lock: the address is
+		 * kept as raw sockaddr bytes behind a sequence counter (a seqlock).
+		 * Readers copy the bytes and retry in the rare event they raced with
+		 * a change. Writers never wait either: one that finds another change
+		 * under way leaves it be, as both come from the latest packets.
+		 */
+		class PeerEndpoint : private boost::noncopyable
+		{
+			public:
+				explicit PeerEndpoint(
+				      const boost::asio::ip::udp::endpoint &endpoint);
+
+				/*!
+				 * \brief Obtain the endpoint.
+				 *
+				 * \param[out] endpoint
+				 * Set to the endpoint (a copy of the socket address, nothing
+				 * is converted).
+				 */
+				void load(boost::asio::ip::udp::endpoint &endpoint) const;
+
+				/*!
+				 * \brief Change the endpoint, unless it's the same already.
+				 *
+				 * \return Whether or not it was changed.
+				 */
+				bool update(const boost::asio::ip::udp::endpoint &endpoint);
+
+			private:
+				// Enough for any socket address an endpoint can hold.
+				static const std::size_t WORD_COUNT = 4;
+
+				static_assert(sizeof(std::uint64_t) * WORD_COUNT >=
+				              sizeof(boost::asio::ip::udp::endpoint),
+				              "Socket addresses don't fit");
+
+				// Odd while a change is under way.
+				std::atomic<std::uint32_t> m_sequence;
+
+				// The socket address (its family tells its size).
+				std::atomic<std::uint64_t> m_words[WORD_COUNT];
+		};
+	}
+}
+
+#endif // PEER_ENDPOINT_H
@@ -0,0 +1,432 @@
+#ifndef PREFIX_TRIE_H
+#define PREFIX_TRIE_H
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief Key traits for IPv4 addresses (in host byte order).
+		 */
+		struct Ipv4Key
+		{
+			typedef std::uint32_t Type;
+			static const unsigned int BITS = 32;
+
+			/*!
+			 * \brief Extract count bits (at most 16) starting at offset,
+			 *        counting from the most significant bit.
+			 */
+			static std::uint32_t extract(Type key, unsigned int offset,
+			                             unsigned int count)
+			{
+				return (key >> (BITS - offset - count)) & ((1u << count) - 1);
+			}
+
+			/*!
+			 * \brief Clear every bit past the first length bits.
+			 */
+			static Type mask(Type key, unsigned int length)
+			{
+				return length == 0 ? 0 : key & ~((1ull << (BITS - length)) - 1);
+			}
+		};
+
+		/*!
+		 * \brief Key traits for IPv6 addresses, split into two halves.
+		 */
+		struct Ipv6Key
+		{
+			struct Type
+			{
+				std::uint64_t high;
+				std::uint64_t low;
+
+				bool operator<(const Type &other) const
+				{
+					return high < other.high ||
+					      (high == other.high && low < other.low);
+				}
+			};
+
+			static const unsigned int BITS = 128;
+
+			static std::uint32_t extract(const Type &key, unsigned int offset,
+			                             unsigned int count)
+			{
+				std::uint64_t mask = (1ull << count) - 1;
+				if (offset + count <= 64)
+				{
+					return (key.high >> (64 - offset - count)) & mask;
+				}
+
+				if (offset >= 64)
+				{
+					return (key.low >> (128 - offset - count)) & mask;
+				}
+
+				// Straddles the halves.
+				unsigned int lowBits = offset + count - 64;
+				return ((key.high << lowBits) | (key.low >> (64 - lowBits))) & mask;
+			}
+
+			static Type mask(const Type &key, unsigned int length)
+			{
+				Type masked = key;
+				if (length < 64)
+				{
+					masked.high = length == 0 ?
+					                 0 : key.high & ~((1ull << (64 - length)) - 1);
+					masked.low = 0;
+				}
+				else if (length < 128)
+				{
+					masked.low = length == 64 ?
+					                0 : key.low & ~((1ull << (128 - length)) - 1);
+				}
+
+				return masked;
+			}
+		};
+
+		/*!
+		 * \brief The PrefixTrie class performs longest-prefix matches.
+		 *
+		 * It's a multibit trie in the style of Poptrie: the first 16 bits of a
+		 * key index a flat table directly, after which each node covers 6 more
+		 * bits. A node stores a bitmap of which of its 64 slots lead to further
+		 * nodes and a bitmap marking where runs of identical results start, so
+		 * its children and results are packed into contiguous arrays and found
+		 * with a popcount. A lookup is a handful of dependent loads from three
+		 * flat arrays.
+		 *
+		 * The trie is built all at once and is read-only afterwards (so any
+		 * number of threads may look things up concurrently). Changing it means
+		 * building a new one.
+		 */
+		template <typename Key>
+		class PrefixTrie
+		{
+			public:
+				typedef typename Key::Type KeyType;
+
+				/*!
+				 * \brief A prefix along with the value it maps to.
+				 */
+				struct Prefix
+				{
+					KeyType key;
+					unsigned int length;
+
+					//! Anything but zero, which means "no match".
+					std::uint32_t value;
+				};
+
+				PrefixTrie()
+				{
+					build(std::vector<Prefix>());
+				}
+
+				/*!
+				 * \brief Replace the contents of the trie.
+				 *
+				 * \param[in] prefixes
+				 * Prefixes to match. Bits past each prefix's length are ignored.
+				 * If the same prefix appears more than once, the last one wins.
+				 */
+				void build(std::vector<Prefix> prefixes)
+				{
+					for (auto &prefix : prefixes)
+					{
+						prefix.key = Key::mask(prefix.key, prefix.length);
+					}
+
+					// Sorting by key then length puts every prefix after the
+					// shorter ones covering it, and groups prefixes sharing
+					// leading bits together.
+					std::stable_sort(prefixes.begin(), prefixes.end(),
+					                 [](const Prefix &left, const Prefix &right)
+					{
+						return left.key < right.key ||
+						      (!(right.key < left.key) &&
+						       left.length < right.length);
+					});
+
+					m_nodes.clear();
+					m_leaves.clear();
+					if (prefixes.empty())
+					{
+						// Nothing can match, so don't bother with a table.
+						m_direct.clear();
+						return;
+					}
+
+					Level level;
+					describeLevel(prefixes, 0, prefixes.size(), 0, DIRECT_BITS, 0,
+					              level);
+
+					m_direct.swap(level.results);
+					for (auto &entry : m_direct)
+					{
+						entry |= LEAF;
+					}
+
+					for (const auto &child : level.children)
+					{
+						std::uint32_t index = m_nodes.size();
+						m_nodes.push_back(Node());
+						std::uint32_t inherited = m_direct[child.slot] & ~LEAF;
+						m_direct[child.slot] = index;
+						buildNode(prefixes, index, child, DIRECT_BITS, inherited);
+					}
+				}
+
+				/*!
+				 * \brief Find the value of the longest prefix matching a key.
+				 *
+				 * \param[in] key
+				 * Key to look up.
+				 *
+				 * \return The value, or zero if nothing matched.
+				 */
+				std::uint32_t lookup(const KeyType &key) const
+				{
+					if (m_direct.empty())
+					{
+						return 0;
+					}
+
+					std::uint32_t entry = m_direct[Key::extract(key, 0,
+					                                            DIRECT_BITS)];
+					if (entry & LEAF)
+					{
+						return entry & ~LEAF;
+					}
+
+					unsigned int offset = DIRECT_BITS;
+					while (true)
+					{
+						const Node &node = m_nodes[entry];
+						unsigned int stride = std::min(STRIDE, Key::BITS - offset);
+						std::uint64_t bit = 1ull << Key::extract(key, offset,
+						                                         stride);
+						std::uint64_t upToBit = bit | (bit - 1);
+
+						if (!(node.vector & bit))
+						{
+							return m_leaves[node.leafBase +
+							                __builtin_popcountll(
+							                   node.leafVector & upToBit) - 1];
+						}
+
+						entry = node.childBase +
+						        __builtin_popcountll(node.vector & upToBit) - 1;
+						offset += stride;
+					}
+				}
+
+				/*!
+				 * \brief Start fetching the first entry a lookup of a key
+				 *        would read, so looking up a batch of keys can overlap
+				 *        their cache misses.
+				 *
+				 * \param[in] key
+				 * Key about to be looked up.
+				 */
+				void prefetch(const KeyType &key) const
+				{
+					if (!m_direct.empty())
+					{
+						__builtin_prefetch(&m_direct[Key::extract(key, 0,
+						                                          DIRECT_BITS)]);
+					}
+				}
+
+			private:
+				static const unsigned int DIRECT_BITS = 16;
+				static const unsigned int STRIDE = 6;
+				static const std::uint32_t LEAF = 0x80000000u;
+
+				struct Node
+				{
+					//! Bit i set if slot i leads to another node.
+					std::uint64_t vector;
+
+					//! Bit i set if slot i starts a run of identical results.
+					std::uint64_t leafVector;
+
+					//! Index of the first child in m_nodes.
+					std::uint32_t childBase;
+
+					//! Index of the first result in m_leaves.
+					std::uint32_t leafBase;
+				};
+
+				/*!
+				 * \brief A slot whose prefixes continue past the current level,
+				 *        and the range of prefixes that do.
+				 */
+				struct Child
+				{
+					std::size_t slot;
+					std::size_t begin;
+					std::size_t end;
+				};
+
+				struct Level
+				{
+					std::vector<std::uint32_t> results;
+					std::vector<Child> children;
+				};
+
+				/*!
+				 * \brief Work out the contents of one level of the trie.
+				 *
+				 * \param[in] prefixes
+				 * Every prefix, sorted.
+				 *
+				 * \param[in] begin, end
+				 * Range of prefixes that fall under this level, all longer than
+				 * offset.
+				 *
+				 * \param[in] offset
+				 * Number of key bits consumed above this level.
+				 *
+				 * \param[in] stride
+				 * Number of key bits this level consumes.
+				 *
+				 * \param[in] inherited
+				 * Result of the longest prefix ending above this level.
+				 *
+				 * \param[out] level
+				 * Each slot's result (for a child, the result it inherits), and
+				 * the slots that need children.
+				 */
+				static void describeLevel(const std::vector<Prefix> &prefixes,
+				                          std::size_t begin, std::size_t end,
+				                          unsigned int offset, unsigned int stride,
+				                          std::uint32_t inherited, Level &level)
+				{
+					level.results.assign(std::size_t(1) << stride, inherited);
+					level.children.clear();
+
+					for (std::size_t i = begin; i < end; ++i)
+					{
+						const Prefix &prefix = prefixes[i];
+						if (prefix.length <= offset + stride)
+						{
+							// Ends within this level: covers a run of slots.
+							// Anything longer comes later and paints over it.
+							unsigned int bits = prefix.length - offset;
+							std::size_t first = bits == 0 ?
+							         0 : Key::extract(prefix.key, offset, bits)
+							             << (stride - bits);
+							std::size_t count = std::size_t(1) << (stride - bits);
+							std::fill(level.results.begin() + first,
+							          level.results.begin() + first + count,
+							          prefix.value);
+							continue;
+						}
+
+						std::size_t slot = Key::extract(prefix.key, offset, stride);
+						if (level.children.empty() ||
+						    level.children.back().slot != slot)
+						{
+							level.children.push_back(Child{slot, i, i});
+						}
+
+						level.children.back().end = i + 1;
+					}
+				}
+
+				/*!
+				 * \brief Build a node (and everything below it).
+				 *
+				 * \param[in] prefixes
+				 * Every prefix, sorted.
+				 *
+				 * \param[in] index
+				 * Index of the node, already reserved in m_nodes.
+				 *
+				 * \param[in] child
+				 * Prefixes falling under the node.
+				 *
+				 * \param[in] offset
+				 * Number of key bits consumed above the node.
+				 *
+				 * \param[in] inherited
+				 * Result of the longest prefix ending above the node.
+				 */
+				void buildNode(const std::vector<Prefix> &prefixes,
+				               std::uint32_t index, const Child &child,
+				               unsigned int offset, std::uint32_t inherited)
+				{
+					unsigned int stride = std::min(STRIDE, Key::BITS - offset);
+
+					Level level;
+					describeLevel(prefixes, child.begin, child.end, offset, stride,
+					              inherited, level);
+
+					Node node = Node();
+					for (const auto &grandchild : level.children)
+					{
+						node.vector |= 1ull << grandchild.slot;
+					}
+
+					// Pack runs of results, skipping slots with children.
+					node.leafBase = m_leaves.size();
+					bool previousIsLeaf = false;
+					for (std::size_t slot = 0; slot < level.results.size(); ++slot)
+					{
+						if (node.vector & (1ull << slot))
+						{
+							previousIsLeaf = false;
+							continue;
+						}
+
+						if (!previousIsLeaf ||
+						    level.results[slot] != level.results[slot - 1])
+						{
+							node.leafVector |= 1ull << slot;
+							m_leaves.push_back(level.results[slot]);
+						}
+
+						previousIsLeaf = true;
+					}
+
+					// Children are contiguous, so reserve them all before
+					// building any.
+					node.childBase = m_nodes.size();
+					m_nodes.resize(m_nodes.size() + level.children.size());
+					m_nodes[index] = node;
+
+					for (std::size_t i = 0; i < level.children.size(); ++i)
+					{
+						const Child &grandchild = level.children[i];
+						buildNode(prefixes, node.childBase + i, grandchild,
+						          offset + stride, level.results[grandchild.slot]);
+					}
+				}
+
+			private:
+				std::vector<std::uint32_t> m_direct;
+				std::vector<Node> m_nodes;
+				std::vector<std::uint32_t> m_leaves;
+		};
+
+		template <typename Key>
+		const unsigned int PrefixTrie<Key>::DIRECT_BITS;
+
+		template <typename Key>
+		const unsigned int PrefixTrie<Key>::STRIDE;
+
+		template <typename Key>
+		const std::uint32_t PrefixTrie<Key>::LEAF;
+	}
+}
+
+#endif // PREFIX_TRIE_H
@@ -0,0 +1,99 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <atomic>
+#include <cstdint>
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief Per-thread state of an RCU reader.
+		 *
+		 * epoch is zero while the thread isn't reading, otherwise it's the
+		 * global epoch observed when the outermost read began.
+		 */
+		struct RcuReader
+		{
+			// Padded so readers on different cores don't share cache lines.
+			alignas(64) std::atomic<std::uint64_t> epoch;
+			unsigned int depth;
+			RcuReader *next;
+		};
+
+		/*!
+		 * \brief Obtain the calling thread's reader, registering it the first
+		 *        time.
+		 */
+		RcuReader &rcuReader();
+
+		/*!
+		 * \brief The global epoch, advanced by every retirement.
+		 */
+		extern std::atomic<std::uint64_t> g_rcuEpoch;
+
+		/*!
+		 * \brief Start a new epoch, after having unpublished something.
+		 *
+		 * \return The new epoch. Whatever was unpublished before the call
+		 * can be freed once rcuQuiescent() says so for this epoch.
+		 */
+		std::uint64_t advanceRcuEpoch();
+
+		/*!
+		 * \brief Determine whether every read that could have seen something
+		 *        retired before the given epoch has finished.
+		 *
+		 * This never waits, so neither readers nor writers are ever blocked.
+		 *
+		 * \param[in] epoch
+		 * Epoch returned by advanceRcuEpoch().
+		 */
+		bool rcuQuiescent(std::uint64_t epoch);
+
+		/*!
+		 * \brief The RcuReadGuard class marks the calling thread as reading
+		 *        for its lifetime.
+		 *
+		 * Anything loaded from an RCU-protected pointer is guaranteed to stay
+		 * alive until the guard is destroyed. Guards may be nested. Entering
+		 * and leaving a read is wait-free (after the thread's first read,
+		 * which registers it).
+		 */
+		class RcuReadGuard
+		{
+			public:
+				RcuReadGuard() :
+				   m_reader(rcuReader())
+				{
+					if (m_reader.depth++ == 0)
+					{
+						// Seeing an epoch means also seeing whatever was
+						// published before it began (hence acquire), and the
+						// store must be visible before any protected pointer
+						// is loaded (hence sequential consistency).
+						m_reader.epoch.store(
+						         g_rcuEpoch.load(std::memory_order_acquire),
+						         std::memory_order_seq_cst);
+					}
+				}
+
+				~RcuReadGuard()
+				{
+					if (--m_reader.depth == 0)
+					{
+						m_reader.epoch.store(0, std::memory_order_release);
+					}
+				}
+
+				RcuReadGuard(const RcuReadGuard&) = delete;
+				RcuReadGuard &operator=(const RcuReadGuard&) = delete;
+
+			private:
+				RcuReader &m_reader;
+		};
+	}
+}
+
+#endif // RCU_H
@@ -0,0 +1,149 @@
+#ifndef RCU_MAP_H
+#define RCU_MAP_H
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+
+#include <boost/noncopyable.hpp>
+
+#include "internal/rcu.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief The RcuMap class is a map for many concurrent readers and
+		 *        the occasional writer.
+		 *
+		 * Like RoutingTable, lookups are wait-free and read an immutable
+		 * snapshot of the map, while changes copy it and publish the copy.
+		 * Retired snapshots are freed by later changes once no lookup can
+		 * still be using them.
+		 *
+		 * Values are meant to be small handles (e.g. pointers). Whatever they
+		 * point to isn't managed: the owner must keep it alive for as long as
+		 * lookups could return it (e.g. by retiring it through RCU as well).
+		 *
+		 * \tparam Key
+		 * Key type (ordered).
+		 *
+		 * \tparam Value
+		 * Value type. A value-initialized one is returned for missing keys.
+		 */
+		template <typename Key, typename Value>
+		class RcuMap : private boost::noncopyable
+		{
+			public:
+				RcuMap() :
+				   m_map(new Map)
+				{
+				}
+
+				~RcuMap()
+				{
+					// Nothing may be looking anything up by now.
+					for (const auto &retired : m_retired)
+					{
+						delete retired.second;
+					}
+
+					delete m_map.load(std::memory_order_relaxed);
+				}
+
+				/*!
+				 * \brief Look up a key.
+				 *
+				 * \return Its value, or a value-initialized one if missing.
+				 */
+				Value find(const Key &key) const
+				{
+					RcuReadGuard guard;
+
+					const Map *map = m_map.load(std::memory_order_seq_cst);
+					auto entry = map->find(key);
+					return entry != map->end() ? entry->second : Value();
+				}
+
+				/*!
+				 * \brief Add a key, unless it's there already.
+				 *
+				 * \return Whether or not it was added.
+				 */
+				bool insert(const Key &key, const Value &value)
+				{
+					std::lock_guard<std::mutex> lock(m_writeMutex);
+
+					const Map *current = m_map.load(std::memory_order_relaxed);
+					if (current->count(key))
+					{
+						return false;
+					}
+
+					Map *updated = new Map(*current);
+					(*updated)[key] = value;
+					publish(updated);
+					return true;
+				}
+
+				/*!
+				 * \brief Remove a key.
+				 *
+				 * \return Whether or not it was there.
+				 */
+				bool erase(const Key &key)
+				{
+					std::lock_guard<std::mutex> lock(m_writeMutex);
+
+					const Map *current = m_map.load(std::memory_order_relaxed);
+					if (!current->count(key))
+					{
+						return false;
+					}
+
+					Map *updated = new Map(*current);
+					updated->erase(key);
+					publish(updated);
+					return true;
+				}
+
+				std::size_t size() const
+				{
+					RcuReadGuard guard;
+					return m_map.load(std::memory_order_seq_cst)->size();
+				}
+
+			private:
+				typedef std::map<Key, Value> Map;
+
+				/*!
+				 * \brief Make a map current and retire the old one, then free
+				 *        what nothing can be reading anymore. Must be called
+				 *        with the write mutex held.
+				 */
+				void publish(const Map *map)
+				{
+					const Map *old = m_map.exchange(map, std::memory_order_seq_cst);
+					m_retired.push_back(std::make_pair(advanceRcuEpoch(), old));
+					while (!m_retired.empty() &&
+					       rcuQuiescent(m_retired.front().first))
+					{
+						delete m_retired.front().second;
+						m_retired.pop_front();
+					}
+				}
+
+			private:
+				std::atomic<const Map*> m_map;
+				std::mutex m_writeMutex;
+
+				// Maps no longer published, oldest first, along with the epoch
+				// in which they were retired.
+				std::deque<std::pair<std::uint64_t, const Map*>> m_retired;
+		};
+	}
+}
+
+#endif // RCU_MAP_H
@@ -0,0 +1,144 @@
+#ifndef READ_SEQUENCER_H
+#define READ_SEQUENCER_H
+
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+#include <boost/noncopyable.hpp>
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief The ReadSequencer class hands over reads in the order they
+		 *        were started, however they complete.
+		 *
+		 * Reads are numbered as they're started, one at a time, so the
+		 * numbers follow the order in which the descriptor fills them. Reads
+		 * that complete early wait in their slot until those before them have
+		 * been handed over, and whichever thread fills a gap hands over
+		 * everything up to the next one, so reads are also handed over one
+		 * at a time.
+		 *
+		 * There's a slot per read in flight, so a read must not be started
+		 * again until the previous one using it has been handed over (which
+		 * the deliver function is a good place for).
+		 */
+		template <typename Read>
+		class ReadSequencer : private boost::noncopyable
+		{
+			public:
+				/*!
+				 * \brief ReadSequencer constructor.
+				 *
+				 * \param[in] depth
+				 * Maximum number of reads started but not yet handed over.
+				 */
+				explicit ReadSequencer(std::size_t depth) :
+				   m_slots(depth),
+				   m_next(0),
+				   m_delivering(false),
+				   m_started(0)
+				{
+				}
+
+				/*!
+				 * \brief Number and start a read.
+				 *
+				 * \param[in] start
+				 * Function starting the read, given its number. Reads are
+				 * started one at a time.
+				 */
+				template <typename Start>
+				void start(Start start)
+				{
+					std::lock_guard<std::mutex> lock(m_startMutex);
+					start(m_started++);
+				}
+
+				/*!
+				 * \brief Record a read as completed, and hand over every read
+				 *        now in sequence.
+				 *
+				 * \param[in] sequence
+				 * Number the read was given when started.
+				 *
+				 * \param[in] read
+				 * What was read.
+				 *
+				 * \param[in] deliver
+				 * Function given each read in turn, unless another thread is
+				 * already handing reads over (in which case it'll hand this
+				 * one over too).
+				 */
+				template <typename Deliver>
+				void complete(std::uint64_t sequence, Read read, Deliver deliver)
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					Slot &slot = m_slots[sequence % m_slots.size()];
+					slot.read = std::move(read);
+					slot.done = true;
+					if (m_delivering)
+					{
+						return;
+					}
+
+					m_delivering = true;
+					for (;;)
+					{
+						Slot &next = m_slots[m_next % m_slots.size()];
+						if (!next.done)
+						{
+							break;
+						}
+
+						Read ready(std::move(next.read));
+						next.read = Read();
+						next.done = false;
+						++m_next;
+
+						lock.unlock();
+						try
+						{
+							deliver(ready);
+						}
+						catch (...)
+						{
+							// Let the next read to complete take over.
+							lock.lock();
+							m_delivering = false;
+							throw;
+						}
+
+						lock.lock();
+					}
+
+					m_delivering = false;
+				}
+
+			private:
+				struct Slot
+				{
+					Slot() :
+					   done(false)
+					{
+					}
+
+					Read read;
+					bool done;
+				};
+
+				std::mutex m_mutex;
+				std::vector<Slot> m_slots;
+				std::uint64_t m_next;
+				bool m_delivering;
+
+				std::mutex m_startMutex;
+				std::uint64_t m_started;
+		};
+	}
+}
+
+#endif // READ_SEQUENCER_H
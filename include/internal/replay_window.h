@@ -0,0 +1,67 @@
+#ifndef REPLAY_WINDOW_H
+#define REPLAY_WINDOW_H
+
+#include <atomic>
+
+#include <boost/noncopyable.hpp>
+
+#include "types.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief The ReplayWindow class turns away messages whose counter was
+		 *        already seen, or is too old to tell (RFC 6479).
+		 *
+		 * Counters up to WINDOW_SIZE behind the highest one accepted so far
+		 * are accepted once each, in any order. Anything older is rejected.
+		 *
+		 * The window is a ring of words, each holding a block of 32 counters
+		 * along with which block it is. Words are recycled as the window
+		 * slides, by the first counter of a newer block landing on them, so
+		 * sliding never touches more than one word. Every word is updated
+		 * with a single compare-and-swap: the window is lock-free and can be
+		 * used by any number of threads at once, though it's fastest when
+		 * each peer is only received from by one (as when sharded).
+		 *
+		 * Only authentic messages should be checked, so that forged counters
+		 * can't slide the window.
+		 */
+		class ReplayWindow : private boost::noncopyable
+		{
+			public:
+				static const std::size_t WORD_COUNT = 128;
+				static const std::size_t BITS_PER_WORD = 32;
+
+				//! How far behind the highest counter others are still
+				//! accepted (the last word is the one being recycled).
+				static const std::uint64_t WINDOW_SIZE =
+				      (WORD_COUNT - 1) * BITS_PER_WORD;
+
+				ReplayWindow();
+
+				/*!
+				 * \brief Check a counter, and remember it if it's accepted.
+				 *
+				 * \param[in] counter
+				 * The message's counter (the highest possible value is never
+				 * accepted).
+				 *
+				 * \return Whether or not the message should be accepted.
+				 */
+				bool accept(std::uint64_t counter);
+
+			private:
+				// One past the highest counter accepted (0 before any).
+				std::atomic<std::uint64_t> m_end;
+
+				// Block number (low 32 bits) in the upper half, one bit per
+				// counter of the block in the lower half.
+				std::atomic<std::uint64_t> m_words[WORD_COUNT];
+		};
+	}
+}
+
+#endif // REPLAY_WINDOW_H
@@ -0,0 +1,327 @@
+#ifndef SESSION_MANAGER_H
+#define SESSION_MANAGER_H
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <functional>
+
+#include <boost/noncopyable.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/io_service.hpp>
+
+#include "types.h"
+#include "datagram.h"
+#include "internal/aead.h"
+#include "internal/rcu_map.h"
+#include "internal/counters.h"
+#include "internal/handshake.h"
+#include "internal/timer_wheel.h"
+#include "internal/replay_window.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief Timing of sessions and handshakes.
+		 */
+		struct SessionOptions
+		{
+			SessionOptions();
+
+			//! Age at which the side that initiated a session starts a new
+			//! handshake (the other side waits a little longer).
+			std::chrono::milliseconds rekeyAfter;
+
+			//! Age after which a session's keys aren't used anymore.
+			std::chrono::milliseconds rejectAfter;
+
+			//! How long to wait for a response before initiating again.
+			std::chrono::milliseconds handshakeTimeout;
+
+			//! Initiations sent before giving up (until there's something
+			//! to send again).
+			std::size_t handshakeAttempts;
+
+			//! How often the cookie secret changes.
+			std::chrono::milliseconds cookieLifetime;
+
+			//! Handshake messages waiting to be handled past which the
+			//! responder only goes through with those with a valid cookie.
+			std::size_t loadThreshold;
+
+			//! Handshake messages waiting to be handled past which more are
+			//! dropped.
+			std::size_t maximumPending;
+		};
+
+		/*!
+		 * \brief The SessionManager class seals packets for peers and opens
+		 *        packets from them, with keys agreed on by handshakes.
+		 *
+		 * The data path (seal() and open(), called from the forwarding
+		 * threads) never waits on anything: it only reads keys, published
+		 * wait-free through RCU, and hands whatever needs more than that
+		 * over to the executor, a separate (lower priority) IO service.
+		 * That's where handshakes happen, along with every key change.
+		 *
+		 * Each peer has up to three sessions (each with its own keys, replay
+		 * window and index):
+		 *
+		 * - The current one, which packets are sealed with.
+		 * - The previous one, kept so packets sealed with it on the way
+		 *   still open during a rekey.
+		 * - The next one, which the responder to a handshake has keys for
+		 *   but doesn't seal with until it gets a packet sealed with it
+		 *   (confirming the initiator has the keys too).
+		 *
+		 * A new session is installed by publishing its index and swapping
+		 * pointers, so sessions change atomically as far as the data path
+		 * is concerned. Sessions replaced are retired through RCU.
+		 *
+		 * Handshakes are started the first time a packet is sealed for a
+		 * peer without a session (which is dropped meanwhile), and again as
+		 * sessions get old.
+		 *
+		 * Peers that move to another address keep their sessions: once a
+		 * packet from the new address opens, the peer is known by it as
+		 * well (only by the last one it moved to, besides its own, which a
+		 * peer added with it takes over).
+		 *
+		 * The executor's timers (handshake retries, and expiring each peer's
+		 * keys) run off a timer wheel, so they cost next to nothing however
+		 * many peers there are.
+		 */
+		class SessionManager : private boost::noncopyable
+		{
+			public:
+				typedef std::function<void (
+				      const boost::asio::ip::udp::endpoint &,
+				      const SharedBuffer &)> Sender;
+
+				/*!
+				 * \brief SessionManager constructor.
+				 *
+				 * \param[in] cipher
+				 * Cipher sealing packets (not Cipher::None).
+				 *
+				 * \param[in] presharedKey
+				 * Key shared by every peer, authenticating handshakes.
+				 *
+				 * \param[in] executor
+				 * IO service on which handshakes are done, by a single
+				 * thread. It must outlive the manager, and not be running
+				 * anymore when it's destroyed.
+				 *
+				 * \param[in] sender
+				 * Called (from the executor) to send handshake messages.
+				 *
+				 * \param[in] options
+				 * Timing of sessions and handshakes.
+				 */
+				SessionManager(Cipher cipher, const AeadKey &presharedKey,
+				               boost::asio::io_service &executor, Sender sender,
+				               const SessionOptions &options = SessionOptions());
+
+				~SessionManager();
+
+				/*!
+				 * \brief Add a peer, by external address (nothing changes if
+				 *        a peer is known by it already).
+				 *
+				 * Only known peers can have sessions.
+				 */
+				void addPeer(const boost::asio::ip::address &address);
+
+				/*!
+				 * \brief Seal a batch of packets for peers, in place.
+				 *
+				 * \param[in,out] batch
+				 * Packets, along with their destinations. Those that can't
+				 * be sealed yet are removed.
+				 */
+				void seal(DatagramBatch<boost::asio::ip::udp::endpoint> &batch);
+
+				/*!
+				 * \brief Open a batch of messages from peers, in place.
+				 *
+				 * \param[in,out] batch
+				 * Messages, along with their sources. Only the packets opened
+				 * are left. Handshake messages are handed to the executor.
+				 *
+				 * \param[out] peers
+				 * If given, set to the address each packet left's peer was
+				 * added with (whatever address the packet came from): the
+				 * peer whose session opened it, so the one it's authentic
+				 * from.
+				 */
+				void open(DatagramBatch<boost::asio::ip::udp::endpoint> &batch,
+				          std::vector<boost::asio::ip::address> *peers = nullptr);
+
+				//! Messages dropped for not being authentic (or being from
+				//! unknown peers or sessions).
+				std::uint64_t authenticationFailures() const
+				{
+					return m_counters.value(AUTHENTICATION_FAILURES);
+				}
+
+				//! Authentic messages dropped as replays.
+				std::uint64_t replayedPackets() const
+				{
+					return m_counters.value(REPLAYED_PACKETS);
+				}
+
+				//! Packets dropped waiting for a session.
+				std::uint64_t packetsWithoutSession() const
+				{
+					return m_counters.value(PACKETS_WITHOUT_SESSION);
+				}
+
+				//! Handshakes completed (on either side).
+				std::uint64_t handshakesCompleted() const
+				{
+					return m_counters.value(HANDSHAKES_COMPLETED);
+				}
+
+				//! Handshake messages answered with a cookie.
+				std::uint64_t cookieReplies() const
+				{
+					return m_counters.value(COOKIE_REPLIES);
+				}
+
+			private:
+				struct Peer;
+
+				struct Session
+				{
+					Session(Cipher cipher, const SessionKeys &keys, Peer *peer,
+					        bool initiator);
+
+					Peer *peer;
+					std::uint32_t localIndex;
+					bool initiator;
+					std::int64_t created;
+					Aead sending;
+					Aead receiving;
+					ReplayWindow window;
+
+					// Set once the next session's confirmation is handed to
+					// the executor.
+					std::atomic<bool> confirming;
+				};
+
+				struct Peer
+				{
+					Peer(const boost::asio::ip::address &address,
+					     SessionManager &manager);
+
+					boost::asio::ip::address address;
+					std::atomic<Session*> current;
+					std::atomic<Session*> previous;
+					std::atomic<Session*> next;
+
+					// Set while a handshake is requested or under way.
+					std::atomic<bool> handshaking;
+
+					// Set while a new address is being added for the peer.
+					std::atomic<bool> roaming;
+
+					// Address the peer last moved to, if any (it's known by
+					// that one besides its own). Guarded by the peers
+					// mutex.
+					boost::asio::ip::address alias;
+
+					// Only touched by the executor from here on.
+					boost::asio::ip::udp::endpoint endpoint;
+					std::unique_ptr<HandshakeState> handshake;
+					std::size_t attempts;
+					TimerWheel::Timer retryTimer;
+					TimerWheel::Timer expiryTimer;
+					Cookie cookie;
+					std::int64_t cookieReceived;
+					std::uint64_t lastTimestamp;
+				};
+
+				// Data path.
+				std::int64_t now() const;
+				bool expired(const Session &session, std::int64_t now) const;
+				bool needsRekey(const Session &session, std::int64_t now) const;
+				void requestHandshake(Peer &peer,
+				                      const boost::asio::ip::udp::endpoint &endpoint);
+				void openRun(DatagramBatch<boost::asio::ip::udp::endpoint> &batch,
+				             std::size_t first, std::size_t last,
+				             Session *session, std::int64_t now);
+				void dispatchHandshakeMessage(
+				      const boost::asio::ip::udp::endpoint &endpoint,
+				      const SharedBuffer &message);
+				void learnAddress(Peer &peer,
+				                  const boost::asio::ip::address &address);
+
+				// Executor.
+				void startHandshake(Peer *peer,
+				                    const boost::asio::ip::udp::endpoint &endpoint);
+				void sendInitiation(Peer *peer);
+				void retryInitiation(Peer *peer);
+				void endHandshake(Peer *peer);
+				void handleMessage(const boost::asio::ip::udp::endpoint &endpoint,
+				                   const SharedBuffer &message);
+				void handleInitiation(const boost::asio::ip::udp::endpoint &endpoint,
+				                      const SharedBuffer &message, bool underLoad);
+				void handleResponse(const boost::asio::ip::udp::endpoint &endpoint,
+				                    const SharedBuffer &message);
+				void handleCookieReply(const SharedBuffer &message);
+				void confirmSession(Peer *peer, std::uint32_t localIndex);
+				void addAddress(Peer *peer, const boost::asio::ip::address &address);
+				std::uint32_t allocateIndex();
+				void install(Peer *peer, const SessionKeys &keys, bool initiator);
+				void retire(Session *session);
+				void reclaim();
+				void expireSessions(Peer *peer);
+				void rotateCookieSecret();
+
+			private:
+				Cipher m_cipher;
+				HandshakeProtocol m_protocol;
+				boost::asio::io_service &m_executor;
+				Sender m_sender;
+				SessionOptions m_options;
+				TimerWheel m_wheel;
+
+				RcuMap<boost::asio::ip::address, Peer*> m_peers;
+				RcuMap<std::uint32_t, Session*> m_sessions;
+
+				std::mutex m_peersMutex;
+				std::vector<std::unique_ptr<Peer>> m_peerStorage;
+
+				// Handshake messages handed to the executor and not yet
+				// handled.
+				std::atomic<std::size_t> m_pending;
+
+				// Only touched by the executor.
+				std::map<std::uint32_t, Peer*> m_handshakes;
+				std::deque<std::pair<std::uint64_t, Session*>> m_retired;
+				CookieSecret m_cookieSecret;
+				TimerWheel::Timer m_cookieTimer;
+				std::uint64_t m_lastTimestamp;
+
+				enum
+				{
+					AUTHENTICATION_FAILURES,
+					REPLAYED_PACKETS,
+					PACKETS_WITHOUT_SESSION,
+					HANDSHAKES_COMPLETED,
+					COOKIE_REPLIES,
+					COUNTER_COUNT
+				};
+
+				Counters m_counters;
+		};
+	}
+}
+
+#endif // SESSION_MANAGER_H
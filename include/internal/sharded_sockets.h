@@ -0,0 +1,68 @@
+#ifndef SHARDED_SOCKETS_H
+#define SHARDED_SOCKETS_H
+
+#include <boost/asio/ip/udp.hpp>
+
+#include "types.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		typedef std::vector<std::unique_ptr<boost::asio::ip::udp::socket>>
+		ShardedSockets;
+
+		/*!
+		 * \brief Open a group of UDP sockets bound to the same endpoint with
+		 *        SO_REUSEPORT, so the kernel spreads incoming datagrams
+		 *        across them.
+		 *
+		 * By default the kernel picks a socket by hashing the sender's address
+		 * and port. With steering, a socket filter picks it by the sender's
+		 * address alone (see peerShard()), so a peer sticks to the same
+		 * socket even if its port changes.
+		 *
+		 * \param[in,out] ioServices
+		 * IO services the sockets belong to: socket i belongs to IO service
+		 * i, wrapping around if there are fewer IO services than sockets.
+		 *
+		 * \param[in] endpoint
+		 * Endpoint on which to bind. If the port is 0 the first socket picks
+		 * one and the rest share it.
+		 *
+		 * \param[in] count
+		 * Number of sockets. A single socket is opened normally.
+		 *
+		 * \param[in] steerByPeer
+		 * Whether or not to install the steering filter.
+		 *
+		 * \return The sockets, in the order the kernel indexes them.
+		 *
+		 * \exception boost::system::system_error
+		 * If the sockets can't be opened, bound, or the filter installed.
+		 */
+		ShardedSockets openShardedSockets(
+		      const std::vector<SharedIoService> &ioServices,
+		      const boost::asio::ip::udp::endpoint &endpoint,
+		      std::size_t count, bool steerByPeer);
+
+		/*!
+		 * \brief Determine which of a group of steered sockets handles a peer.
+		 *
+		 * This computes the same thing as the steering filter, so outgoing
+		 * traffic can use the socket incoming traffic arrives on.
+		 *
+		 * \param[in] peer
+		 * The peer's address.
+		 *
+		 * \param[in] count
+		 * Number of sockets in the group.
+		 *
+		 * \return Index of the socket.
+		 */
+		std::size_t peerShard(const boost::asio::ip::address &peer,
+		                      std::size_t count);
+	}
+}
+
+#endif // SHARDED_SOCKETS_H
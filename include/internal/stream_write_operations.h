@@ -0,0 +1,86 @@
+#ifndef STREAM_WRITE_OPERATIONS_H
+#define STREAM_WRITE_OPERATIONS_H
+
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "types.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief Write packets one at a time, each with its own system call,
+		 *        without blocking.
+		 *
+		 * This is for descriptors where every write is a packet (like TUN
+		 * devices), so packets can't be combined.
+		 *
+		 * \param[in,out] descriptor
+		 * Descriptor to write to.
+		 *
+		 * \param[in] packets
+		 * Packets to write.
+		 *
+		 * \param[in] count
+		 * Number of packets.
+		 *
+		 * \param[out] error
+		 * Error that occurred while writing (if any). If the descriptor can't
+		 * take more this is set to boost::asio::error::would_block.
+		 *
+		 * \return The number of packets written.
+		 *
+		 * Other descriptor-like types can be written to by a StreamServer by
+		 * providing an overload of this function.
+		 */
+		std::size_t writePackets(boost::asio::posix::stream_descriptor &descriptor,
+		                         const SharedBuffer *packets, std::size_t count,
+		                         boost::system::error_code &error);
+
+		/*!
+		 * \brief Write as much of a run of buffers as possible with a single
+		 *        gathering system call (writev), without blocking.
+		 *
+		 * This is for byte streams, where buffers can be combined.
+		 *
+		 * \param[in,out] descriptor
+		 * Descriptor to write to.
+		 *
+		 * \param[in] buffers
+		 * Buffers to write.
+		 *
+		 * \param[in] count
+		 * Number of buffers.
+		 *
+		 * \param[in] offset
+		 * Number of bytes of the first buffer already written.
+		 *
+		 * \param[out] error
+		 * As above.
+		 *
+		 * \return The number of bytes written (from offset on).
+		 */
+		std::size_t writeGathered(boost::asio::posix::stream_descriptor &descriptor,
+		                          const SharedBuffer *buffers, std::size_t count,
+		                          std::size_t offset,
+		                          boost::system::error_code &error);
+
+		/*!
+		 * \brief Take the number of packets accepted by writePackets() that
+		 *        then couldn't be written.
+		 *
+		 * Descriptors that only accept packets once they're written never
+		 * have any. Ones that queue packets (see UringStreamDescriptor)
+		 * provide an overload of this as well.
+		 */
+		inline std::size_t takeFailedWrites(
+		      boost::asio::posix::stream_descriptor&)
+		{
+			return 0;
+		}
+	}
+}
+
+#endif // STREAM_WRITE_OPERATIONS_H
@@ -0,0 +1,187 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+#include <boost/noncopyable.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief The TimerWheel class runs large numbers of timers (e.g. one
+		 *        or more per peer) off a single Asio timer.
+		 *
+		 * Time is counted in ticks of a fixed resolution, and timers are
+		 * kept in a hierarchy of wheels: the first has a slot per tick, and
+		 * each of the others a slot per full turn of the one before it.
+		 * Arming a timer links it into the slot its expiry falls in, and
+		 * cancelling it unlinks it, so both take constant time and never
+		 * allocate. As time passes, the slots of the coarser wheels are
+		 * spread over the finer ones, and the timers of each tick's slot
+		 * fire.
+		 *
+		 * The wheel only wakes up when something is due (or has to be spread
+		 * out): timers expiring in the same tick fire together, and a wheel
+		 * with nothing armed doesn't wake up at all. Timers never fire
+		 * early, and late by less than a tick when the IO service keeps up.
+		 *
+		 * A wheel isn't thread-safe. Timers are armed and cancelled from its
+		 * timers' callbacks, functions given to post(), or anything else that
+		 * can't run concurrently with them (e.g. handlers of an IO service
+		 * only one thread runs). When sharded, each shard has its own wheel.
+		 */
+		class TimerWheel : private boost::noncopyable
+		{
+			private:
+				// Timers of a slot are in a circular list, headed by the
+				// slot itself.
+				struct Link
+				{
+					Link *previous;
+					Link *next;
+				};
+
+			public:
+				typedef std::chrono::steady_clock Clock;
+
+				/*!
+				 * \brief The Timer class is a timer for a wheel, intrusively
+				 *        linked into it while armed.
+				 *
+				 * A timer can be armed again from its own callback. It's
+				 * cancelled when destroyed.
+				 */
+				class Timer : private Link, private boost::noncopyable
+				{
+					public:
+						/*!
+						 * \brief Timer constructor.
+						 *
+						 * \param[in] callback
+						 * Called (from the wheel's IO service) whenever the
+						 * timer fires.
+						 */
+						explicit Timer(std::function<void ()> callback);
+
+						~Timer();
+
+						//! Whether or not the timer is waiting to fire.
+						bool armed() const
+						{
+							return m_wheel != nullptr;
+						}
+
+					private:
+						friend class TimerWheel;
+
+						std::uint64_t m_expiry;
+						TimerWheel *m_wheel;
+						std::uint8_t m_level;
+						std::uint8_t m_slot;
+						std::function<void ()> m_callback;
+				};
+
+				/*!
+				 * \brief TimerWheel constructor.
+				 *
+				 * \param[in] ioService
+				 * IO service on which timers fire. It must not run anything
+				 * of the wheel's once the wheel is destroyed.
+				 *
+				 * \param[in] resolution
+				 * Duration of a tick.
+				 */
+				explicit TimerWheel(boost::asio::io_service &ioService,
+				                    Clock::duration resolution =
+				                       std::chrono::milliseconds(10));
+
+				/*!
+				 * \brief TimerWheel destructor.
+				 *
+				 * Timers still armed are cancelled.
+				 */
+				~TimerWheel();
+
+				/*!
+				 * \brief Arm a timer, or arm it again if it's armed already.
+				 *
+				 * \param[in,out] timer
+				 * The timer. It may belong to another wheel until now.
+				 *
+				 * \param[in] delay
+				 * How long from now it fires (rounded up to whole ticks).
+				 */
+				void arm(Timer &timer, Clock::duration delay);
+
+				/*!
+				 * \brief Cancel a timer (nothing happens unless it's armed).
+				 */
+				void cancel(Timer &timer);
+
+				/*!
+				 * \brief Run a function on the IO service, where it's safe to
+				 *        arm and cancel timers (from any thread).
+				 */
+				void post(std::function<void ()> function);
+
+				//! Number of timers armed.
+				std::size_t armedCount() const
+				{
+					return m_armedCount;
+				}
+
+			private:
+				// Each wheel has 2^LEVEL_BITS slots, so which ones are in use
+				// fits in a word, and there are enough of them for any tick.
+				static const unsigned int LEVEL_BITS = 6;
+				static const unsigned int SLOT_COUNT = 1 << LEVEL_BITS;
+				static const unsigned int LEVEL_COUNT =
+				      (64 + LEVEL_BITS - 1) / LEVEL_BITS;
+
+				// Level of the timers being fired, whose slot is gone.
+				static const std::uint8_t FIRING = 0xff;
+
+				struct Level
+				{
+					std::uint64_t occupied;
+					std::array<Link, SLOT_COUNT> slots;
+				};
+
+				static void unlink(Link &link);
+				static bool empty(const Link &slot);
+
+				std::uint64_t currentTick() const;
+				void link(Timer &timer);
+				std::uint64_t nextEvent() const;
+				void advance(std::uint64_t tick);
+				void cascade(unsigned int level);
+				void fire();
+				void schedule();
+				void handleTimeout(const boost::system::error_code &error);
+
+			private:
+				boost::asio::io_service::strand m_strand;
+				boost::asio::steady_timer m_timer;
+				Clock::duration m_resolution;
+				Clock::time_point m_start;
+
+				// Ticks the wheels have turned to, and the tick the Asio
+				// timer is set for (0 when it isn't).
+				std::uint64_t m_now;
+				std::uint64_t m_scheduled;
+
+				std::size_t m_armedCount;
+				std::array<Level, LEVEL_COUNT> m_levels;
+		};
+	}
+}
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,201 @@
+#ifndef URING_H
+#define URING_H
+
+#include <cstdint>
+#include <cstddef>
+
+#include <boost/noncopyable.hpp>
+
+struct io_uring_sqe;
+struct io_uring_buf_ring;
+
+namespace Overpass
+{
+	namespace internal
+	{
+		/*!
+		 * \brief A completed io_uring request.
+		 */
+		struct UringCompletion
+		{
+			//! Whatever was attached to the request.
+			std::uint64_t userData;
+
+			//! The request's result: a byte count, or a negative errno.
+			std::int32_t result;
+
+			//! IORING_CQE_F_* flags (including the buffer ID, if any).
+			std::uint32_t flags;
+		};
+
+		/*!
+		 * \brief The Uring class is a minimal io_uring instance, driven with
+		 *        the raw system calls.
+		 *
+		 * It isn't thread-safe: users serialize access themselves.
+		 */
+		class Uring : private boost::noncopyable
+		{
+			public:
+				/*!
+				 * \brief Uring constructor.
+				 *
+				 * \param[in] entries
+				 * Size of the submission queue (the completion queue is twice
+				 * as large).
+				 *
+				 * \exception boost::system::system_error
+				 * If the ring can't be set up.
+				 */
+				explicit Uring(unsigned int entries);
+
+				/*!
+				 * \brief Uring destructor.
+				 *
+				 * Requests still in flight are cancelled, and waited for, so
+				 * the kernel is done with their memory on return.
+				 */
+				~Uring();
+
+				/*!
+				 * \brief Check whether or not the kernel supports everything
+				 *        the io_uring backend relies on.
+				 *
+				 * The answer is worked out once, then remembered.
+				 */
+				static bool isSupported();
+
+				/*!
+				 * \brief Obtain the next free submission queue entry.
+				 *
+				 * \param[in] userData
+				 * Value reported with the request's completion(s).
+				 *
+				 * \return The entry (zeroed but for the user data), or nullptr if
+				 * the queue is full. It's handed to the kernel by submit().
+				 */
+				io_uring_sqe *prepare(std::uint64_t userData);
+
+				/*!
+				 * \brief Hand every prepared entry to the kernel, with a single
+				 *        system call.
+				 *
+				 * \exception boost::system::system_error
+				 * If the kernel refuses them.
+				 */
+				void submit();
+
+				/*!
+				 * \brief Collect completed requests.
+				 *
+				 * \param[out] completions
+				 * Where to put them.
+				 *
+				 * \param[in] maximum
+				 * Maximum number of completions to collect.
+				 *
+				 * \return The number collected.
+				 */
+				std::size_t complete(UringCompletion *completions,
+				                     std::size_t maximum);
+
+				/*!
+				 * \brief Have an eventfd signalled whenever a request completes.
+				 *
+				 * \exception boost::system::system_error
+				 * If the kernel refuses.
+				 */
+				void registerEventFd(int eventFd);
+
+				/*!
+				 * \brief Register a file descriptor as fixed file 0, saving the
+				 *        kernel a lookup per request.
+				 *
+				 * \exception boost::system::system_error
+				 * If the kernel refuses.
+				 */
+				void registerFile(int descriptor);
+
+				/*!
+				 * \brief Set up a ring of provided buffers (group 0), from which
+				 *        the kernel picks a buffer for each received packet.
+				 *
+				 * \param[in] entries
+				 * Number of buffers the ring can hold (a power of two).
+				 *
+				 * \exception boost::system::system_error
+				 * If the kernel refuses.
+				 */
+				void registerBufferRing(std::uint16_t entries);
+
+				/*!
+				 * \brief Hand a buffer to the kernel through the buffer ring.
+				 *
+				 * Buffers aren't visible to the kernel until commitBuffers().
+				 *
+				 * \param[in] data
+				 * The buffer's memory.
+				 *
+				 * \param[in] size
+				 * The buffer's size.
+				 *
+				 * \param[in] id
+				 * ID reported with completions that used the buffer.
+				 */
+				void provideBuffer(void *data, std::uint32_t size,
+				                   std::uint16_t id);
+
+				/*!
+				 * \brief Make provided buffers visible to the kernel.
+				 */
+				void commitBuffers();
+
+				/*!
+				 * \brief Obtain the number of requests prepared that haven't
+				 *        completed for good yet.
+				 */
+				std::size_t inFlight() const
+				{
+					return m_inFlight;
+				}
+
+			private:
+				void enter(unsigned int submit, unsigned int wait,
+				           unsigned int flags);
+
+			private:
+				int m_descriptor;
+				unsigned int m_submissionEntries;
+
+				// Submission queue.
+				void *m_submissionRing;
+				std::size_t m_submissionRingSize;
+				unsigned int *m_submissionHead;
+				unsigned int *m_submissionTail;
+				unsigned int *m_submissionFlags;
+				unsigned int m_submissionMask;
+				io_uring_sqe *m_entries;
+				unsigned int m_preparedTail;
+				unsigned int m_submittedTail;
+
+				// Completion queue (possibly sharing the submission queue's
+				// mapping).
+				void *m_completionRing;
+				std::size_t m_completionRingSize;
+				unsigned int *m_completionHead;
+				unsigned int *m_completionTail;
+				unsigned int m_completionMask;
+				void *m_completions;
+
+				// Provided buffer ring.
+				io_uring_buf_ring *m_bufferRing;
+				std::size_t m_bufferRingSize;
+				std::uint16_t m_bufferMask;
+				std::uint16_t m_bufferTail;
+
+				std::size_t m_inFlight;
+		};
+	}
+}
+
+#endif // URING_H
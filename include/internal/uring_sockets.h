@@ -0,0 +1,303 @@
+#ifndef URING_SOCKETS_H
+#define URING_SOCKETS_H
+
+#include <memory>
+#include <functional>
+
+#include <boost/noncopyable.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "types.h"
+#include "datagram.h"
+
+namespace Overpass
+{
+	namespace internal
+	{
+		typedef std::function<void (const boost::system::error_code&,
+		                            std::size_t)> UringHandler;
+
+		/*!
+		 * \brief The UringDatagramSocket class is a UDP socket for
+		 *        DatagramServer (see UringUdp) that receives through io_uring.
+		 *
+		 * A single multishot receive keeps the kernel filling pooled buffers
+		 * from a provided buffer ring, and every completion that piles up
+		 * between two wakeups is handed out in one batch, without copying.
+		 * Sending is left to sendmmsg, which already batches.
+		 *
+		 * If io_uring isn't wanted, or the kernel can't do it, this is just a
+		 * plain Asio socket.
+		 *
+		 * Either way, UDP segmentation and receive coalescing offloads can be
+		 * enabled on top.
+		 */
+		class UringDatagramSocket : private boost::noncopyable
+		{
+			public:
+				/*!
+				 * \brief UringDatagramSocket constructor.
+				 *
+				 * \param[in,out] ioService
+				 * IO service on which completions are handled (the socket's).
+				 *
+				 * \param[in] socket
+				 * An open (and bound) socket.
+				 *
+				 * \param[in] useUring
+				 * Whether or not to use io_uring, if supported.
+				 *
+				 * \param[in] bufferSize
+				 * Largest datagram to receive.
+				 */
+				UringDatagramSocket(boost::asio::io_service &ioService,
+				                    std::unique_ptr<boost::asio::ip::udp::socket> socket,
+				                    bool useUring, std::size_t bufferSize = 1500);
+
+				~UringDatagramSocket();
+
+				/*!
+				 * \brief Check whether or not io_uring is in use.
+				 */
+				bool usingUring() const;
+
+				/*!
+				 * \brief Hand batches of datagrams to the kernel to split
+				 *        (UDP_SEGMENT), if it can.
+				 *
+				 * \return Whether or not it's enabled.
+				 */
+				bool enableSegmentation();
+
+				/*!
+				 * \brief Have the kernel coalesce received datagrams (UDP_GRO),
+				 *        if it can. They're split again when received in a
+				 *        batch.
+				 *
+				 * It can't be used along with io_uring, nor when receiving one
+				 * datagram at a time, and needs receive buffers of
+				 * MAXIMUM_COALESCED_SIZE.
+				 *
+				 * \return Whether or not it's enabled.
+				 */
+				bool enableCoalescing();
+
+				boost::asio::ip::udp::socket &socket()
+				{
+					return *m_socket;
+				}
+
+				template <typename Handler>
+				void async_receive_from(const boost::asio::mutable_buffers_1 &buffers,
+				                        boost::asio::ip::udp::endpoint &sender,
+				                        Handler handler)
+				{
+					if (usingUring())
+					{
+						receiveFrom(buffers, sender, handler);
+					}
+					else
+					{
+						m_socket->async_receive_from(buffers, sender, handler);
+					}
+				}
+
+				template <typename Handler>
+				void async_receive(boost::asio::null_buffers, Handler handler)
+				{
+					if (usingUring())
+					{
+						waitForDatagrams(handler);
+					}
+					else
+					{
+						m_socket->async_receive(boost::asio::null_buffers(),
+						                        handler);
+					}
+				}
+
+				template <typename Handler>
+				void async_send(boost::asio::null_buffers, Handler handler)
+				{
+					m_socket->async_send(boost::asio::null_buffers(), handler);
+				}
+
+				friend std::size_t receiveDatagrams(
+				      UringDatagramSocket &socket,
+				      DatagramBatch<boost::asio::ip::udp::endpoint> &batch,
+				      boost::system::error_code &error);
+
+				friend std::size_t sendDatagrams(
+				      UringDatagramSocket &socket,
+				      const Datagram<boost::asio::ip::udp::endpoint> *datagrams,
+				      std::size_t count, boost::system::error_code &error);
+
+			private:
+				void receiveFrom(const boost::asio::mutable_buffers_1 &buffers,
+				                 boost::asio::ip::udp::endpoint &sender,
+				                 UringHandler handler);
+
+				void waitForDatagrams(UringHandler handler);
+
+			private:
+				struct Private;
+
+				std::unique_ptr<boost::asio::ip::udp::socket> m_socket;
+				std::shared_ptr<Private> m_data;
+				bool m_segmenting;
+				bool m_coalescing;
+		};
+
+		/*!
+		 * \brief Receive datagrams that arrived through io_uring (or straight
+		 *        from the socket, without it).
+		 *
+		 * See the udp::socket overload.
+		 */
+		std::size_t receiveDatagrams(
+		      UringDatagramSocket &socket,
+		      DatagramBatch<boost::asio::ip::udp::endpoint> &batch,
+		      boost::system::error_code &error);
+
+		bool sendDatagram(UringDatagramSocket &socket,
+		                  const boost::asio::ip::udp::endpoint &destination,
+		                  const SharedBuffer &buffer,
+		                  boost::system::error_code &error);
+
+		std::size_t sendDatagrams(
+		      UringDatagramSocket &socket,
+		      const Datagram<boost::asio::ip::udp::endpoint> *datagrams,
+		      std::size_t count, boost::system::error_code &error);
+
+		/*!
+		 * \brief Traits for a DatagramServer over UringDatagramSocket.
+		 */
+		struct UringUdp
+		{
+			typedef boost::asio::ip::udp::endpoint endpoint;
+			typedef UringDatagramSocket socket;
+		};
+
+		/*!
+		 * \brief The UringStreamDescriptor class is a stream descriptor for
+		 *        StreamServer that reads and writes through io_uring.
+		 *
+		 * The descriptor is registered as a fixed file. Reads go straight
+		 * into the caller's buffer, and each batch of writes handed over by
+		 * the StreamServer's writer is submitted with a single system call.
+		 * The writes in a batch are linked, and a batch is only submitted
+		 * once the previous one is done, so packets stay in order. A write
+		 * that fails doesn't stop the ones after it.
+		 *
+		 * If io_uring isn't wanted, or the kernel can't do it, this is just a
+		 * plain Asio stream descriptor.
+		 */
+		class UringStreamDescriptor : private boost::noncopyable
+		{
+			public:
+				/*!
+				 * \brief UringStreamDescriptor constructor.
+				 *
+				 * \param[in,out] ioService
+				 * IO service on which completions are handled.
+				 *
+				 * \param[in] descriptor
+				 * File descriptor to take ownership of.
+				 *
+				 * \param[in] useUring
+				 * Whether or not to use io_uring, if supported.
+				 */
+				UringStreamDescriptor(boost::asio::io_service &ioService,
+				                      int descriptor, bool useUring);
+
+				~UringStreamDescriptor();
+
+				/*!
+				 * \brief Check whether or not io_uring is in use.
+				 */
+				bool usingUring() const;
+
+				boost::asio::posix::stream_descriptor &descriptor()
+				{
+					return m_descriptor;
+				}
+
+				template <typename Handler>
+				void async_read_some(const boost::asio::mutable_buffers_1 &buffers,
+				                     Handler handler)
+				{
+					if (usingUring())
+					{
+						read(buffers, handler);
+					}
+					else
+					{
+						m_descriptor.async_read_some(buffers, handler);
+					}
+				}
+
+				template <typename Handler>
+				void async_write_some(boost::asio::null_buffers, Handler handler)
+				{
+					if (usingUring())
+					{
+						waitForRoom(handler);
+					}
+					else
+					{
+						m_descriptor.async_write_some(boost::asio::null_buffers(),
+						                              handler);
+					}
+				}
+
+				friend std::size_t writePackets(UringStreamDescriptor &descriptor,
+				                                const SharedBuffer *packets,
+				                                std::size_t count,
+				                                boost::system::error_code &error);
+
+				friend std::size_t takeFailedWrites(
+				      UringStreamDescriptor &descriptor);
+
+			private:
+				void read(const boost::asio::mutable_buffers_1 &buffers,
+				          UringHandler handler);
+
+				void waitForRoom(UringHandler handler);
+
+			private:
+				struct Private;
+
+				boost::asio::posix::stream_descriptor m_descriptor;
+				std::shared_ptr<Private> m_data;
+		};
+
+		/*!
+		 * \brief Queue packets to be written through io_uring, submitting
+		 *        them all at once (or write them directly, without it).
+		 *
+		 * See the stream_descriptor overload. Errors writing queued packets
+		 * are known after the fact, so they're counted for
+		 * takeFailedWrites() instead.
+		 */
+		std::size_t writePackets(UringStreamDescriptor &descriptor,
+		                         const SharedBuffer *packets, std::size_t count,
+		                         boost::system::error_code &error);
+
+		std::size_t writeGathered(UringStreamDescriptor &descriptor,
+		                          const SharedBuffer *buffers, std::size_t count,
+		                          std::size_t offset,
+		                          boost::system::error_code &error);
+
+		/*!
+		 * \brief Take the number of packets queued by writePackets() that
+		 *        then couldn't be written (since last taken).
+		 */
+		std::size_t takeFailedWrites(UringStreamDescriptor &descriptor);
+	}
+}
+
+#endif // URING_SOCKETS_H
@@ -1,7 +1,13 @@
 #ifndef OVERPASS_SERVER_H
 #define OVERPASS_SERVER_H
 
+#include <chrono>
+#include <ostream>
+
 #include "types.h"
+#include "cipher.h"
+#include "datagram.h"
+#include "routing_result.h"
 
 namespace boost
 {
@@ -16,11 +22,104 @@ namespace boost
 
 namespace Overpass
 {
+	class ShardedRuntime;
+
 	namespace internal
 	{
 		class OverpassServerPrivate;
 	}
 
+	/*!
+	 * \brief Tuning options for an OverpassServer.
+	 *
+	 * The defaults favor simplicity over throughput.
+	 */
+	struct OverpassServerOptions
+	{
+		OverpassServerOptions();
+
+		//! Maximum number of datagrams to read from the external socket per
+		//! wakeup (1 reads one datagram at a time).
+		std::size_t externalBatchSize;
+
+		//! Number of queues to open on the virtual interface, each with its
+		//! own reader (1 disables multi-queue support).
+		std::size_t virtualQueueCount;
+
+		//! Number of SO_REUSEPORT sockets to open for external traffic, each
+		//! with its own reader (1 opens a single, ordinary socket).
+		std::size_t externalSocketCount;
+
+		//! Whether or not to steer external traffic to sockets by peer
+		//! address (rather than the kernel's default address and port hash).
+		bool steerExternalByPeer;
+
+		//! Maximum number of packets per external socket waiting for room
+		//! in its send buffer (sending never blocks).
+		std::size_t externalSendQueueDepth;
+
+		//! Which packet to drop when an external send queue is full.
+		SendDropPolicy externalSendDropPolicy;
+
+		//! How packets read from the external sockets and the virtual
+		//! interface are handed to the router.
+		DispatchMode dispatchMode;
+
+		//! Number of reads to keep outstanding on each external socket and
+		//! virtual interface queue.
+		std::size_t readDepth;
+
+		//! Whether or not packets read from each socket and queue must be
+		//! routed in the order they were read. Otherwise, with more than one
+		//! read outstanding (or in post mode) and several threads running
+		//! an IO service, packets of a flow may overtake each other.
+		bool orderedReads;
+
+		//! Whether or not to log dropped packets (at most once a second).
+		bool logDrops;
+
+		//! How often to send each known client an empty packet, keeping
+		//! mappings of NATs on the way (and, with a cipher, sessions) alive.
+		//! Zero disables keepalives. Empty packets received are dropped.
+		std::chrono::milliseconds keepaliveInterval;
+
+		//! Path of a Unix socket serving metrics (see writeMetrics()) to
+		//! whoever connects. Empty disables it.
+		std::string metricsSocket;
+
+		//! Whether or not to time packets through each stage of forwarding,
+		//! exporting latency percentiles with the metrics. It costs a few
+		//! clock reads per packet (or batch).
+		bool traceLatency;
+
+		//! Whether or not to answer packets bound for unknown destinations
+		//! with an ICMP destination unreachable message.
+		bool sendUnreachable;
+
+		//! Whether or not to do socket and virtual interface I/O through
+		//! io_uring (falling back to Asio if the kernel can't).
+		bool useIoUring;
+
+		//! Whether or not to enable offloads on the virtual interface: TCP
+		//! super-packets are read from it (and split before being sent), and
+		//! segments received are merged before being written to it.
+		bool virtualOffload;
+
+		//! Whether or not to use UDP segmentation and receive coalescing
+		//! offloads on the external sockets, if the kernel supports them.
+		//! Coalescing needs batched reads and isn't used with io_uring.
+		bool externalUdpOffload;
+
+		//! Cipher sealing packets sent to peers (and opening those they
+		//! send). Every peer must use the same cipher and key.
+		Cipher cipher;
+
+		//! Key shared with peers (AEAD_KEY_SIZE bytes), unless the cipher is
+		//! Cipher::None. It authenticates the handshakes agreeing on the
+		//! session keys packets are actually sealed with.
+		std::vector<std::uint8_t> key;
+	};
+
 	/*!
 	 * \brief The OverpassServer is for orchestrating the Overpass client
 	 *        components.
@@ -52,13 +151,42 @@ namespace Overpass
 			 *
 			 * \param[in] bindPort
 			 * UDP port on which to bind listening for Overpass traffic.
+			 *
+			 * \param[in] options
+			 * Tuning options.
 			 */
 			OverpassServer(const SharedIoService &ioService,
 			               const std::string &overpassInterfacePattern,
 			               const std::string &overpassIpAddress,
 			               const std::string &overpassNetmask,
 			               const std::string &bindIpAddress,
-			               std::uint16_t bindPort);
+			               std::uint16_t bindPort,
+			               const OverpassServerOptions &options =
+			                  OverpassServerOptions());
+
+			/*!
+			 * \brief OverpassServer constructor for thread-per-core operation.
+			 *
+			 * Every shard of the runtime gets its own external socket and
+			 * virtual interface queue (the corresponding counts in the
+			 * options are ignored). Peers are steered to shards by address,
+			 * and packets are only handed between shards when they're bound
+			 * for a peer owned by another one.
+			 *
+			 * \param[in,out] runtime
+			 * Runtime whose shards will run the server. It must outlive the
+			 * server.
+			 *
+			 * The remaining parameters are the same as above.
+			 */
+			OverpassServer(const ShardedRuntime &runtime,
+			               const std::string &overpassInterfacePattern,
+			               const std::string &overpassIpAddress,
+			               const std::string &overpassNetmask,
+			               const std::string &bindIpAddress,
+			               std::uint16_t bindPort,
+			               const OverpassServerOptions &options =
+			                  OverpassServerOptions());
 
 			/*!
 			 * \brief Add a known client, mapping Overpass address to external
@@ -75,6 +203,64 @@ namespace Overpass
 			      const boost::asio::ip::address &overpassAddress,
 			      const boost::asio::ip::address &externalAddress);
 
+			/*!
+			 * \brief Route a network (e.g. a LAN behind a client) to a known
+			 *        client.
+			 *
+			 * \param[in] network
+			 * Network on the Overpass side.
+			 *
+			 * \param[in] prefixLength
+			 * Number of significant bits of the network (0 for a default
+			 * route).
+			 *
+			 * \param[in] externalAddress
+			 * External address of the client handling the network.
+			 *
+			 * \exception RoutingTableException
+			 * If the prefix length is too long for the network address.
+			 */
+			void addRoute(const boost::asio::ip::address &network,
+			              unsigned int prefixLength,
+			              const boost::asio::ip::address &externalAddress);
+
+			/*!
+			 * \brief Obtain the number of packets dropped for a given reason.
+			 *
+			 * \param[in] reason
+			 * Reason for the drops.
+			 */
+			std::uint64_t dropCount(RoutingResult reason) const;
+
+			/*!
+			 * \brief Obtain the number of packets from peers dropped for not
+			 *        being authentic (or not being sealed at all, or coming
+			 *        from an unknown peer).
+			 */
+			std::uint64_t authenticationFailures() const;
+
+			/*!
+			 * \brief Obtain the number of authentic packets from peers dropped
+			 *        as replays.
+			 */
+			std::uint64_t replayedPackets() const;
+
+			/*!
+			 * \brief Write a snapshot of the server's metrics, in the
+			 *        Prometheus text format.
+			 *
+			 * This covers traffic to and from each client (and removed
+			 * clients, all together), each external socket and each virtual
+			 * interface queue, drops by reason, session and handshake
+			 * counters, and buffer pool usage.
+			 * Counters are summed across threads, so this is meant to be
+			 * called now and then rather than per packet.
+			 *
+			 * \param[out] stream
+			 * Stream to write to.
+			 */
+			void writeMetrics(std::ostream &stream) const;
+
 		private:
 			// Using a shared_ptr instead of unique_ptr because of
 			// enable_shared_from_this.
@@ -0,0 +1,223 @@
+#ifndef PACKET_VIEW_H
+#define PACKET_VIEW_H
+
+#include <cstring>
+
+#include <boost/asio/ip/address.hpp>
+
+#include "types.h"
+
+namespace Overpass
+{
+	/*!
+	 * \brief The PacketView class reads IPv4 and IPv6 header fields in place.
+	 *
+	 * It doesn't copy or own the packet: the buffer must outlive the view.
+	 * The header is validated on construction (check isValid()), after which
+	 * the accessors can be used without further checks. Only the fixed part of
+	 * the header is inspected; options and extension headers are left alone.
+	 */
+	class PacketView
+	{
+		public:
+			static const std::size_t IPV4_HEADER_SIZE = 20;
+			static const std::size_t IPV6_HEADER_SIZE = 40;
+
+			/*!
+			 * \brief PacketView constructor.
+			 *
+			 * \param[in] buffer
+			 * Buffer beginning with an IP header. It may be larger than the
+			 * packet, in which case the remainder is ignored.
+			 */
+			explicit PacketView(const SharedBuffer &buffer) :
+			   m_buffer(&buffer),
+			   m_version(0),
+			   m_headerLength(0),
+			   m_totalLength(0)
+			{
+				const std::uint8_t *data = buffer.data();
+				std::size_t size = buffer.size();
+				if (size < 1)
+				{
+					return;
+				}
+
+				unsigned int version = data[0] >> 4;
+				if (version == 4 && size >= IPV4_HEADER_SIZE)
+				{
+					std::size_t headerLength = (data[0] & 0x0f) * 4;
+					std::size_t totalLength = readShort(data + 2);
+					if (headerLength >= IPV4_HEADER_SIZE &&
+					    totalLength >= headerLength && totalLength <= size)
+					{
+						m_version = 4;
+						m_headerLength = headerLength;
+						m_totalLength = totalLength;
+					}
+				}
+				else if (version == 6 && size >= IPV6_HEADER_SIZE)
+				{
+					std::size_t totalLength =
+					      IPV6_HEADER_SIZE + readShort(data + 4);
+					if (totalLength <= size)
+					{
+						m_version = 6;
+						m_headerLength = IPV6_HEADER_SIZE;
+						m_totalLength = totalLength;
+					}
+				}
+			}
+
+			/*!
+			 * \brief Whether or not the buffer holds a well-formed IPv4 or IPv6
+			 *        header. Nothing else may be used if it doesn't.
+			 */
+			bool isValid() const
+			{
+				return m_version != 0;
+			}
+
+			/*!
+			 * \brief IP version (4 or 6).
+			 */
+			unsigned int version() const
+			{
+				return m_version;
+			}
+
+			/*!
+			 * \brief Length of the header (for IPv6, the fixed header only).
+			 */
+			std::size_t headerLength() const
+			{
+				return m_headerLength;
+			}
+
+			/*!
+			 * \brief Length of the entire packet, header included.
+			 */
+			std::size_t totalLength() const
+			{
+				return m_totalLength;
+			}
+
+			/*!
+			 * \brief IPv4 protocol, or IPv6 next header.
+			 */
+			std::uint8_t protocol() const
+			{
+				return m_version == 4 ? data()[9] : data()[6];
+			}
+
+			/*!
+			 * \brief IPv4 time to live, or IPv6 hop limit.
+			 */
+			std::uint8_t timeToLive() const
+			{
+				return m_version == 4 ? data()[8] : data()[7];
+			}
+
+			/*!
+			 * \brief Source address, in network byte order (4 or 16 bytes).
+			 */
+			const std::uint8_t *sourceBytes() const
+			{
+				return data() + (m_version == 4 ? 12 : 8);
+			}
+
+			/*!
+			 * \brief Destination address, in network byte order (4 or 16 bytes).
+			 */
+			const std::uint8_t *destinationBytes() const
+			{
+				return data() + (m_version == 4 ? 16 : 24);
+			}
+
+			boost::asio::ip::address sourceAddress() const
+			{
+				return toAddress(sourceBytes());
+			}
+
+			boost::asio::ip::address destinationAddress() const
+			{
+				return toAddress(destinationBytes());
+			}
+
+			/*!
+			 * \brief Hash of the packet's addresses and protocol.
+			 *
+			 * Packets belonging to the same flow always hash the same, so this
+			 * can be used to spread flows across queues without reordering any
+			 * of them.
+			 */
+			std::uint32_t flowHash() const
+			{
+				// FNV-1a over the protocol and both addresses.
+				std::uint32_t hash = 2166136261u;
+				const std::uint8_t *bytes = sourceBytes();
+				std::size_t length = m_version == 4 ? 8 : 32;
+				for (std::size_t i = 0; i < length; ++i)
+				{
+					hash = (hash ^ bytes[i]) * 16777619u;
+				}
+
+				return (hash ^ protocol()) * 16777619u;
+			}
+
+			/*!
+			 * \brief Start of the packet.
+			 */
+			const std::uint8_t *data() const
+			{
+				return m_buffer->data();
+			}
+
+			/*!
+			 * \brief The underlying buffer, which may extend past the packet.
+			 */
+			const SharedBuffer &buffer() const
+			{
+				return *m_buffer;
+			}
+
+			/*!
+			 * \brief The packet itself: a handle to the same bytes, trimmed to
+			 *        the packet's length. Nothing is copied.
+			 */
+			SharedBuffer packet() const
+			{
+				SharedBuffer packet(*m_buffer);
+				packet.resize(m_totalLength);
+				return packet;
+			}
+
+		private:
+			static std::size_t readShort(const std::uint8_t *data)
+			{
+				return (static_cast<std::size_t>(data[0]) << 8) | data[1];
+			}
+
+			boost::asio::ip::address toAddress(const std::uint8_t *bytes) const
+			{
+				if (m_version == 4)
+				{
+					boost::asio::ip::address_v4::bytes_type address;
+					std::memcpy(address.data(), bytes, address.size());
+					return boost::asio::ip::address_v4(address);
+				}
+
+				boost::asio::ip::address_v6::bytes_type address;
+				std::memcpy(address.data(), bytes, address.size());
+				return boost::asio::ip::address_v6(address);
+			}
+
+		private:
+			const SharedBuffer *m_buffer;
+			unsigned int m_version;
+			std::size_t m_headerLength;
+			std::size_t m_totalLength;
+	};
+}
+
+#endif // PACKET_VIEW_H
@@ -1,11 +1,17 @@
 #ifndef ROUTER_H
 #define ROUTER_H
 
-#include <map>
+#include <atomic>
+#include <algorithm>
+#include <functional>
 
 #include <boost/asio/ip/udp.hpp>
 
 #include "types.h"
+#include "packet_view.h"
+#include "routing_table.h"
+#include "routing_result.h"
+#include "internal/rcu.h"
 
 namespace Tins
 {
@@ -27,35 +33,36 @@ namespace Overpass
 	};
 
 	/*!
-	 * \brief The Router class shuffles packets between the external and virtual
-	 *        interfaces.
+	 * \brief How a Router deals with packets it drops.
+	 *
+	 * Drops are always counted; everything else is opt-in.
 	 */
-	class Router
+	struct RouterOptions
 	{
-		public:
-			typedef std::function<void (
-			      const boost::asio::ip::udp::endpoint &,
-			      const Overpass::SharedBuffer &)> ExternalSender;
-			typedef std::function<void (
-			      const Overpass::SharedBuffer &)> VirtualSender;
+		RouterOptions();
 
-			/*!
-			 * \brief Router constructor.
-			 *
-			 * \param[in] externalSender
-			 * Function to call in order to send a packet over the external
-			 * interface.
-			 *
-			 * \param[in] virtualSender
-			 * Function to call in order to send a packet over the virtual
-			 * interface.
-			 *
-			 * \param[in] overpassPort
-			 * Port on which Overpass clients should be listening.
-			 */
-			Router(ExternalSender externalSender, VirtualSender virtualSender,
-			       std::uint16_t overpassPort);
+		//! Whether or not to log drops (at most one summary line a second).
+		bool logDrops;
+
+		//! Whether or not to answer packets without a route with an ICMP
+		//! destination unreachable message written to the virtual interface.
+		bool sendUnreachable;
 
+		//! Address unreachable messages are sent from (this host's Overpass
+		//! address). Only packets of the same address family are answered.
+		boost::asio::ip::address localAddress;
+	};
+
+	/*!
+	 * \brief The RouterBase class holds everything about routing that doesn't
+	 *        depend on how packets are sent: the routing table, and drop
+	 *        accounting.
+	 *
+	 * It's only meant to be used through BasicRouter.
+	 */
+	class RouterBase
+	{
+		public:
 			/*!
 			 * \brief Add a known client, mapping Overpass address to external
 			 *        address.
@@ -66,39 +73,777 @@ namespace Overpass
 			 * \param[in] externalAddress
 			 * Client's external IP address, on which the Overpass client is
 			 * (hopefully) listening.
+			 *
+			 * This may be called at any time, including while packets are
+			 * being routed on other threads.
 			 */
 			void addKnownClient(
 			      const boost::asio::ip::address &overpassAddress,
 			      const boost::asio::ip::address &externalAddress);
 
+			/*!
+			 * \brief Forget a known client.
+			 *
+			 * \param[in] overpassAddress
+			 * Client's IP address on the Overpass network.
+			 *
+			 * \return Whether or not the client was known.
+			 *
+			 * Like addKnownClient(), this may be called at any time.
+			 */
+			bool removeKnownClient(
+			      const boost::asio::ip::address &overpassAddress);
+
+			/*!
+			 * \brief Route a whole network (e.g. a LAN behind a client, or
+			 *        everything, for a default route) to a known client.
+			 *
+			 * \param[in] network
+			 * Network on the Overpass side.
+			 *
+			 * \param[in] prefixLength
+			 * Number of significant bits of the network.
+			 *
+			 * \param[in] externalAddress
+			 * External address of the client handling the network.
+			 *
+			 * Packets go to the client with the longest matching route. Like
+			 * addKnownClient(), this may be called at any time.
+			 *
+			 * \exception RoutingTableException
+			 * If the prefix length is too long for the network address.
+			 */
+			void addRoute(const boost::asio::ip::address &network,
+			              unsigned int prefixLength,
+			              const boost::asio::ip::address &externalAddress);
+
+			/*!
+			 * \brief Remove a route added by addRoute().
+			 *
+			 * \param[in] network
+			 * Network on the Overpass side.
+			 *
+			 * \param[in] prefixLength
+			 * Number of significant bits of the network.
+			 *
+			 * \return Whether or not the route existed.
+			 */
+			bool removeRoute(const boost::asio::ip::address &network,
+			                 unsigned int prefixLength);
+
+			/*!
+			 * \brief Obtain where a known client was last heard from.
+			 *
+			 * \param[in] externalAddress
+			 * External address the client was added with.
+			 *
+			 * \param[out] endpoint
+			 * Set to the client's endpoint, if it's known.
+			 *
+			 * \return Whether or not the client is known.
+			 */
+			bool clientEndpoint(const boost::asio::ip::address &externalAddress,
+			                    boost::asio::ip::udp::endpoint &endpoint) const;
+
+			/*!
+			 * \brief Obtain the traffic routed to and from every client, by
+			 *        external address.
+			 *
+			 * Packets to clients are counted as they're handed to the
+			 * external sender, and packets from them as they arrive with a
+			 * source endpoint. This is meant for reporting: it sums every
+			 * thread's counts.
+			 */
+			std::map<boost::asio::ip::address, RoutingTable::Traffic>
+			clientTraffic() const;
+
+			/*!
+			 * \brief Obtain the traffic routed to and from clients that have
+			 *        since been removed, all together.
+			 */
+			RoutingTable::Traffic removedClientTraffic() const;
+
+			/*!
+			 * \brief Obtain the number of packets dropped for a given reason.
+			 *
+			 * \param[in] reason
+			 * Reason for the drops (forwarded packets aren't counted, so
+			 * RoutingResult::Forwarded always gives 0).
+			 */
+			std::uint64_t dropCount(RoutingResult reason) const;
+
+		protected:
+			//! Most packets a batch is routed at once (larger ones are routed
+			//! this many at a time), which bounds the scratch space needed.
+			static const std::size_t BATCH_CHUNK_SIZE = 64;
+
+			RouterBase(std::uint16_t overpassPort, const RouterOptions &options);
+
+			/*!
+			 * \brief Check whether a (valid) packet is bound for a multicast
+			 *        or broadcast address, without building an address
+			 *        object.
+			 */
+			static bool isMulticast(const PacketView &packet)
+			{
+				const std::uint8_t *destination = packet.destinationBytes();
+				if (packet.version() == 6)
+				{
+					return destination[0] == 0xff;
+				}
+
+				return (destination[0] & 0xf0) == 0xe0 ||
+				       (destination[0] == 0xff && destination[1] == 0xff &&
+				        destination[2] == 0xff && destination[3] == 0xff);
+			}
+
+			/*!
+			 * \brief Account for a dropped packet, and log it if so
+			 *        configured.
+			 *
+			 * \return An ICMP destination unreachable message to write to
+			 *         the virtual interface in answer, if so configured
+			 *         (otherwise a null buffer).
+			 */
+			SharedBuffer countDrop(RoutingResult reason, const PacketView &packet);
+
+			/*!
+			 * \brief Serialize a libtins packet into a new buffer (for the slow
+			 *        paths).
+			 */
+			static SharedBuffer serialize(Tins::IP &packet);
+
+			/*!
+			 * \brief Throw the exception matching how a packet routed through
+			 *        a slow path was dropped, if it was.
+			 */
+			static void check(RoutingResult result, const PacketView &packet);
+
+		private:
+			/*!
+			 * \brief Log a summary of recent drops, unless one was logged less
+			 *        than a second ago.
+			 */
+			void logDrop(RoutingResult reason, const PacketView &packet);
+
+		protected:
+			RoutingTable m_knownClients;
+
+		private:
+			RouterOptions m_options;
+
+			// Drops by reason (indexed by RoutingResult), counted per
+			// thread.
+			internal::Counters m_counts;
+
+			// Steady clock time (in nanoseconds) before which nothing is
+			// logged, and the number of drops accounted for by the last log.
+			std::atomic<std::int64_t> m_nextLogTime;
+			std::atomic<std::uint64_t> m_loggedDrops;
+	};
+
+	/*!
+	 * \brief The BasicRouter class template shuffles packets between the
+	 *        external and virtual interfaces.
+	 *
+	 * Clients are identified by the external address they were added with,
+	 * but packets go to wherever each was last heard from (address and
+	 * port), so clients behind NAT or changing networks keep getting them.
+	 * That's only learned from packets authenticated as coming from the
+	 * client (by the cipher's session with it), never from addresses within
+	 * packets, which anyone can forge: without a cipher, clients stay where
+	 * they were added. Authenticated packets are also only let in from
+	 * source addresses routed to their client, so no client can pass its
+	 * packets off as another's.
+	 *
+	 * Packets are sent through the ExternalSenderPolicy and
+	 * VirtualSenderPolicy function objects, called as
+	 * `externalSender(endpoint, buffer)` and `virtualSender(buffer)`. With
+	 * concrete policy types the whole route and send path can be inlined;
+	 * Router erases them behind std::function (e.g. for mocks).
+	 */
+	template <typename ExternalSenderPolicy, typename VirtualSenderPolicy>
+	class BasicRouter : public RouterBase
+	{
+		public:
+			typedef ExternalSenderPolicy ExternalSender;
+			typedef VirtualSenderPolicy VirtualSender;
+
+			/*!
+			 * \brief BasicRouter constructor.
+			 *
+			 * \param[in] externalSender
+			 * Function to call in order to send a packet over the external
+			 * interface.
+			 *
+			 * \param[in] virtualSender
+			 * Function to call in order to send a packet over the virtual
+			 * interface.
+			 *
+			 * \param[in] overpassPort
+			 * Port on which Overpass clients should be listening (until
+			 * they're heard from).
+			 *
+			 * \param[in] options
+			 * How to deal with dropped packets.
+			 */
+			BasicRouter(ExternalSender externalSender,
+			            VirtualSender virtualSender, std::uint16_t overpassPort,
+			            const RouterOptions &options = RouterOptions()) :
+			   RouterBase(overpassPort, options),
+			   m_externalSender(std::move(externalSender)),
+			   m_virtualSender(std::move(virtualSender))
+			{
+			}
+
 			/*!
 			 * \brief Route a packet from the virtual interface to a known client
 			 *        over the external interface.
 			 *
 			 * \param[in] packet
-			 * The packet to be routed.
+			 * The packet to be routed. Its buffer is forwarded as-is.
+			 *
+			 * \return What became of the packet. Dropping never throws, so a
+			 * flood of unroutable traffic is cheap to turn away.
 			 */
-			void handlePacketFromVirtual(Tins::IP &packet);
+			RoutingResult handlePacketFromVirtual(const PacketView &packet)
+			{
+				if (!packet.isValid())
+				{
+					return drop(RoutingResult::Malformed, packet);
+				}
+
+				// Overpass only carries unicast traffic, so don't bother
+				// looking these up.
+				if (isMulticast(packet))
+				{
+					return drop(RoutingResult::Multicast, packet);
+				}
+
+				// Coming from the virtual interface, the destination will be
+				// an IP address on the Overpass network (or a network behind
+				// one of its clients). We need to look it up in our routing
+				// table to determine where this packet actually needs to go.
+				// The client's endpoint comes as a ready-made socket address.
+				boost::asio::ip::udp::endpoint endpoint;
+				{
+					// Its counters only last while we're reading.
+					internal::RcuReadGuard guard;
+					internal::Counters *traffic;
+					if (!m_knownClients.lookup(packet.destinationAddress(),
+					                           endpoint, &traffic))
+					{
+						return drop(RoutingResult::NoRoute, packet);
+					}
+
+					traffic->add(RoutingTable::PACKETS_SENT);
+					traffic->add(RoutingTable::BYTES_SENT,
+					             packet.totalLength());
+				}
+
+				m_externalSender(endpoint, packet.packet());
+				return RoutingResult::Forwarded;
+			}
 
 			/*!
 			 * \brief Route a packet from the external interface to the virtual
 			 *        interface.
 			 *
 			 * \param[in] packet
+			 * The packet to be routed. Its buffer is forwarded as-is.
+			 *
+			 * \return What became of the packet.
+			 */
+			RoutingResult handlePacketFromExternal(const PacketView &packet)
+			{
+				if (!packet.isValid())
+				{
+					return drop(RoutingResult::Malformed, packet);
+				}
+
+				// This packet is destined for something listening on our
+				// virtual interface. Send it there.
+				m_virtualSender(packet.packet());
+				return RoutingResult::Forwarded;
+			}
+
+			/*!
+			 * \brief Route a packet from the external interface to the virtual
+			 *        interface, counting it for its client.
+			 *
+			 * \param[in] packet
+			 * The packet to be routed. Its buffer is forwarded as-is.
+			 *
+			 * \param[in] source
+			 * Endpoint it came from.
+			 *
+			 * \return What became of the packet.
+			 *
+			 * Nothing vouches for where the packet is from, so it's counted
+			 * for the client its source address routes to, but the client's
+			 * endpoint is left alone.
+			 */
+			RoutingResult handlePacketFromExternal(
+			      const PacketView &packet,
+			      const boost::asio::ip::udp::endpoint &source)
+			{
+				return routeFromExternal(packet, source, nullptr);
+			}
+
+			/*!
+			 * \brief Route a packet authenticated as coming from a client
+			 *        from the external interface to the virtual interface,
+			 *        learning where the client is.
+			 *
+			 * \param[in] packet
+			 * The packet to be routed. Its buffer is forwarded as-is.
+			 *
+			 * \param[in] source
+			 * Endpoint it came from. Packets to the client go there from now
+			 * on.
+			 *
+			 * \param[in] peer
+			 * External address of the client the packet was authenticated
+			 * as coming from. Its source address must route to that client.
+			 *
+			 * \return What became of the packet.
+			 */
+			RoutingResult handlePacketFromExternal(
+			      const PacketView &packet,
+			      const boost::asio::ip::udp::endpoint &source,
+			      const boost::asio::ip::address &peer)
+			{
+				return routeFromExternal(packet, source, &peer);
+			}
+
+			/*!
+			 * \brief Route a batch of packets from the virtual interface to
+			 *        known clients over the external interface.
+			 *
+			 * Every destination is looked up before anything is sent, with
+			 * the lookups prefetched, and the packets forwarded are handed to
+			 * the external sender grouped by client endpoint (clients in the
+			 * order they first appear, each one's packets in their original
+			 * order), so consecutive sends can go out together.
+			 *
+			 * \param[in] packets
+			 * The packets to be routed. Their buffers are forwarded as-is.
+			 *
+			 * \param[in] count
+			 * Number of packets.
+			 *
+			 * \param[out] results
+			 * If given, set to what became of each packet.
+			 */
+			void handlePacketsFromVirtual(const PacketView *packets,
+			                              std::size_t count,
+			                              RoutingResult *results = nullptr)
+			{
+				for (std::size_t first = 0; first < count;
+				     first += BATCH_CHUNK_SIZE)
+				{
+					routeChunkFromVirtual(packets + first,
+					                      std::min(count - first,
+					                               BATCH_CHUNK_SIZE),
+					                      results ? results + first : nullptr);
+				}
+			}
+
+			/*!
+			 * \brief Route a batch of packets from the external interface to
+			 *        the virtual interface.
+			 *
+			 * The same as calling handlePacketFromExternal() for each packet
+			 * (with or without its peer), with the clients' lookups batched.
+			 *
+			 * \param[in] packets
+			 * The packets to be routed. Their buffers are forwarded as-is.
+			 *
+			 * \param[in] sources
+			 * Endpoint each packet came from.
+			 *
+			 * \param[in] peers
+			 * External address of the client each packet was authenticated
+			 * as coming from, or nullptr if they weren't (in which case no
+			 * endpoint is learned).
+			 *
+			 * \param[in] count
+			 * Number of packets.
+			 *
+			 * \param[out] results
+			 * If given, set to what became of each packet.
+			 */
+			void handlePacketsFromExternal(
+			      const PacketView *packets,
+			      const boost::asio::ip::udp::endpoint *sources,
+			      const boost::asio::ip::address *peers, std::size_t count,
+			      RoutingResult *results = nullptr)
+			{
+				for (std::size_t first = 0; first < count;
+				     first += BATCH_CHUNK_SIZE)
+				{
+					routeChunkFromExternal(packets + first, sources + first,
+					                       peers ? peers + first : nullptr,
+					                       std::min(count - first,
+					                                BATCH_CHUNK_SIZE),
+					                       results ? results + first : nullptr);
+				}
+			}
+
+			/*!
+			 * \brief Route a libtins packet from the virtual interface.
+			 *
+			 * This is a slow path (the packet is serialized into a new buffer)
+			 * meant for debugging and tests.
+			 *
+			 * \param[in] packet
 			 * The packet to be routed.
+			 *
+			 * \exception UnknownClientException
+			 * If there is no route to the packet's destination address.
+			 *
+			 * \exception RoutingException
+			 * If the packet is dropped for any other reason.
 			 */
-			void handlePacketFromExternal(Tins::IP &packet);
+			void handlePacketFromVirtual(Tins::IP &packet)
+			{
+				SharedBuffer buffer = serialize(packet);
+				PacketView view(buffer);
+				check(handlePacketFromVirtual(view), view);
+			}
+
+			/*!
+			 * \brief Route a libtins packet from the external interface.
+			 *
+			 * This is a slow path (the packet is serialized into a new buffer)
+			 * meant for debugging and tests.
+			 *
+			 * \param[in] packet
+			 * The packet to be routed.
+			 *
+			 * \exception RoutingException
+			 * If the packet is dropped.
+			 */
+			void handlePacketFromExternal(Tins::IP &packet)
+			{
+				SharedBuffer buffer = serialize(packet);
+				PacketView view(buffer);
+				check(handlePacketFromExternal(view), view);
+			}
+
+		private:
+			/*!
+			 * \brief Route up to BATCH_CHUNK_SIZE packets from the virtual
+			 *        interface (see handlePacketsFromVirtual()).
+			 */
+			void routeChunkFromVirtual(const PacketView *packets,
+			                           std::size_t count,
+			                           RoutingResult *results)
+			{
+				// Packets worth looking up, and their destinations.
+				std::size_t routable[BATCH_CHUNK_SIZE];
+				boost::asio::ip::address destinations[BATCH_CHUNK_SIZE];
+				std::size_t routableCount = 0;
+				for (std::size_t i = 0; i < count; ++i)
+				{
+					RoutingResult result = RoutingResult::Forwarded;
+					if (!packets[i].isValid())
+					{
+						result = drop(RoutingResult::Malformed, packets[i]);
+					}
+					else if (isMulticast(packets[i]))
+					{
+						result = drop(RoutingResult::Multicast, packets[i]);
+					}
+					else
+					{
+						routable[routableCount] = i;
+						destinations[routableCount++] =
+						      packets[i].destinationAddress();
+					}
+
+					if (results)
+					{
+						results[i] = result;
+					}
+				}
+
+				// The clients' counters only last while we're reading (and
+				// tell them apart until then).
+				internal::RcuReadGuard guard;
+				boost::asio::ip::udp::endpoint endpoints[BATCH_CHUNK_SIZE];
+				internal::Counters *traffic[BATCH_CHUNK_SIZE];
+				m_knownClients.lookup(destinations, routableCount, endpoints,
+				                      traffic);
+
+				// Group what's forwarded by client, in the order each was
+				// first seen (and each client's packets in their own order),
+				// with a counting sort. Clients are told apart by their
+				// counters, and batches usually go to one or a few of them,
+				// so finding each packet's is cheap.
+				std::size_t peers[BATCH_CHUNK_SIZE];
+				std::size_t peerCounts[BATCH_CHUNK_SIZE];
+				std::size_t peerOf[BATCH_CHUNK_SIZE];
+				std::size_t peerCount = 0;
+				for (std::size_t i = 0; i < routableCount; ++i)
+				{
+					const PacketView &packet = packets[routable[i]];
+					if (!traffic[i])
+					{
+						RoutingResult result = drop(RoutingResult::NoRoute,
+						                            packet);
+						if (results)
+						{
+							results[routable[i]] = result;
+						}
+
+						continue;
+					}
+
+					traffic[i]->add(RoutingTable::PACKETS_SENT);
+					traffic[i]->add(RoutingTable::BYTES_SENT,
+					                packet.totalLength());
+
+					std::size_t peer = 0;
+					while (peer < peerCount && traffic[peers[peer]] != traffic[i])
+					{
+						++peer;
+					}
+
+					if (peer == peerCount)
+					{
+						peers[peerCount] = i;
+						peerCounts[peerCount++] = 0;
+					}
+
+					peerOf[i] = peer;
+					++peerCounts[peer];
+				}
+
+				// Turn counts into where each client's packets start.
+				std::size_t start = 0;
+				for (std::size_t peer = 0; peer < peerCount; ++peer)
+				{
+					std::size_t peerSize = peerCounts[peer];
+					peerCounts[peer] = start;
+					start += peerSize;
+				}
+
+				std::size_t forwarded[BATCH_CHUNK_SIZE];
+				for (std::size_t i = 0; i < routableCount; ++i)
+				{
+					if (traffic[i])
+					{
+						forwarded[peerCounts[peerOf[i]]++] = i;
+					}
+				}
+
+				for (std::size_t i = 0; i < start; ++i)
+				{
+					m_externalSender(endpoints[forwarded[i]],
+					                 packets[routable[forwarded[i]]].packet());
+				}
+			}
+
+			/*!
+			 * \brief Route a packet from the external interface, learning
+			 *        where its client is if it's authenticated (see
+			 *        handlePacketFromExternal()).
+			 */
+			RoutingResult routeFromExternal(
+			      const PacketView &packet,
+			      const boost::asio::ip::udp::endpoint &source,
+			      const boost::asio::ip::address *peer)
+			{
+				if (!packet.isValid())
+				{
+					return drop(RoutingResult::Malformed, packet);
+				}
+
+				// Only authenticated packets can move their client (nothing
+				// is written unless the endpoint actually changed), and only
+				// from addresses the client has. Its counters only last
+				// while we're reading.
+				internal::RcuReadGuard guard;
+				internal::Counters *traffic = nullptr;
+				if (peer)
+				{
+					if (!m_knownClients.routesTo(packet.sourceAddress(), *peer))
+					{
+						return drop(RoutingResult::SpoofedSource, packet);
+					}
+
+					m_knownClients.learnEndpoint(*peer, source, &traffic);
+				}
+				else
+				{
+					boost::asio::ip::udp::endpoint endpoint;
+					m_knownClients.lookup(packet.sourceAddress(), endpoint,
+					                      &traffic);
+				}
+
+				if (traffic)
+				{
+					traffic->add(RoutingTable::PACKETS_RECEIVED);
+					traffic->add(RoutingTable::BYTES_RECEIVED,
+					             packet.totalLength());
+				}
+
+				m_virtualSender(packet.packet());
+				return RoutingResult::Forwarded;
+			}
+
+			/*!
+			 * \brief Route up to BATCH_CHUNK_SIZE packets from the external
+			 *        interface (see handlePacketsFromExternal()).
+			 */
+			void routeChunkFromExternal(
+			      const PacketView *packets,
+			      const boost::asio::ip::udp::endpoint *sources,
+			      const boost::asio::ip::address *peers, std::size_t count,
+			      RoutingResult *results)
+			{
+				// Valid packets, and the clients they're from: the peer
+				// they were authenticated as coming from, or whoever their
+				// source address routes to.
+				std::size_t valid[BATCH_CHUNK_SIZE];
+				boost::asio::ip::address clients[BATCH_CHUNK_SIZE];
+				boost::asio::ip::udp::endpoint endpoints[BATCH_CHUNK_SIZE];
+				std::size_t validCount = 0;
+				for (std::size_t i = 0; i < count; ++i)
+				{
+					RoutingResult result = RoutingResult::Forwarded;
+					if (!packets[i].isValid())
+					{
+						result = drop(RoutingResult::Malformed, packets[i]);
+					}
+					else if (peers)
+					{
+						valid[validCount] = i;
+						clients[validCount] = peers[i];
+						endpoints[validCount++] = sources[i];
+					}
+					else
+					{
+						valid[validCount] = i;
+						clients[validCount++] = packets[i].sourceAddress();
+					}
+
+					if (results)
+					{
+						results[i] = result;
+					}
+				}
+
+				// The clients' counters only last while we're reading.
+				internal::RcuReadGuard guard;
+				internal::Counters *traffic[BATCH_CHUNK_SIZE];
+				if (peers)
+				{
+					validCount = dropSpoofed(packets, valid, clients, endpoints,
+					                         validCount, results);
+					m_knownClients.learnEndpoints(clients, endpoints,
+					                              validCount, traffic);
+				}
+				else
+				{
+					// The endpoints looked up aren't needed.
+					m_knownClients.lookup(clients, validCount, endpoints,
+					                      traffic);
+				}
+
+				for (std::size_t i = 0; i < validCount; ++i)
+				{
+					const PacketView &packet = packets[valid[i]];
+					if (traffic[i])
+					{
+						traffic[i]->add(RoutingTable::PACKETS_RECEIVED);
+						traffic[i]->add(RoutingTable::BYTES_RECEIVED,
+						                packet.totalLength());
+					}
+
+					m_virtualSender(packet.packet());
+				}
+			}
+
+			/*!
+			 * \brief Drop authenticated packets whose source address doesn't
+			 *        route to their client, keeping the rest in order.
+			 *
+			 * \return The number of packets kept.
+			 */
+			std::size_t dropSpoofed(const PacketView *packets,
+			                        std::size_t *valid,
+			                        boost::asio::ip::address *clients,
+			                        boost::asio::ip::udp::endpoint *endpoints,
+			                        std::size_t count, RoutingResult *results)
+			{
+				boost::asio::ip::address sourceAddresses[BATCH_CHUNK_SIZE];
+				for (std::size_t i = 0; i < count; ++i)
+				{
+					sourceAddresses[i] = packets[valid[i]].sourceAddress();
+				}
+
+				bool allowed[BATCH_CHUNK_SIZE];
+				m_knownClients.routesTo(sourceAddresses, clients, count,
+				                        allowed);
+
+				std::size_t kept = 0;
+				for (std::size_t i = 0; i < count; ++i)
+				{
+					if (!allowed[i])
+					{
+						RoutingResult result = drop(RoutingResult::SpoofedSource,
+						                            packets[valid[i]]);
+						if (results)
+						{
+							results[valid[i]] = result;
+						}
+
+						continue;
+					}
+
+					valid[kept] = valid[i];
+					clients[kept] = clients[i];
+					endpoints[kept++] = endpoints[i];
+				}
+
+				return kept;
+			}
+
+			/*!
+			 * \brief Account for a dropped packet, and log or answer it if so
+			 *        configured.
+			 *
+			 * \return The reason, for convenience.
+			 */
+			RoutingResult drop(RoutingResult reason, const PacketView &packet)
+			{
+				SharedBuffer reply = countDrop(reason, packet);
+				if (reply)
+				{
+					m_virtualSender(reply);
+				}
+
+				return reason;
+			}
 
 		private:
 			ExternalSender m_externalSender;
 			VirtualSender m_virtualSender;
+	};
 
-			typedef std::map<boost::asio::ip::address, boost::asio::ip::address>
-			ClientMap;
-			ClientMap m_knownClients;
+	/*!
+	 * \brief A router sending packets through any functions (e.g. mocks), at
+	 *        the cost of an indirect call per packet.
+	 */
+	typedef BasicRouter<
+	   std::function<void (const boost::asio::ip::udp::endpoint &,
+	                       const SharedBuffer &)>,
+	   std::function<void (const SharedBuffer &)>> Router;
 
-			std::uint16_t m_overpassPort;
-	};
+	extern template class BasicRouter<Router::ExternalSender,
+	                                  Router::VirtualSender>;
 }
 
 #endif // ROUTER_H
@@ -0,0 +1,42 @@
+#ifndef ROUTING_RESULT_H
+#define ROUTING_RESULT_H
+
+#include <cstddef>
+
+namespace Overpass
+{
+	/*!
+	 * \brief What the router did with a packet.
+	 *
+	 * Everything but Forwarded means the packet was dropped, for that reason.
+	 */
+	enum class RoutingResult
+	{
+		//! Handed to the external or virtual interface.
+		Forwarded,
+
+		//! Not a well-formed IPv4 or IPv6 packet.
+		Malformed,
+
+		//! Destined for a multicast or broadcast address, which Overpass
+		//! doesn't carry.
+		Multicast,
+
+		//! No route to the destination address.
+		NoRoute,
+
+		//! Authenticated as coming from a client its source address doesn't
+		//! route to (so passing itself off as someone else).
+		SpoofedSource,
+	};
+
+	//! Number of RoutingResult values.
+	const std::size_t ROUTING_RESULT_COUNT = 5;
+
+	/*!
+	 * \brief Short human-readable description of a result.
+	 */
+	const char *toString(RoutingResult result);
+}
+
+#endif // ROUTING_RESULT_H
@@ -0,0 +1,456 @@
+#ifndef ROUTING_TABLE_H
+#define ROUTING_TABLE_H
+
+#include <map>
+#include <vector>
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <memory>
+
+#include <boost/noncopyable.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/ip/address.hpp>
+
+#include "types.h"
+#include "internal/counters.h"
+#include "internal/peer_endpoint.h"
+
+namespace Overpass
+{
+	class RoutingTableException : public Exception
+	{
+		public:
+			RoutingTableException(const std::string &what);
+	};
+
+	/*!
+	 * \brief The RoutingTable class maps Overpass addresses to the external
+	 *        addresses of the clients they belong to.
+	 *
+	 * Routes are prefixes (anything from a single host to a default route),
+	 * and lookups find the longest one matching an address, for both IPv4 and
+	 * IPv6.
+	 *
+	 * It's built for many concurrent readers and the occasional writer.
+	 * Lookups are wait-free: they read an immutable snapshot of the table,
+	 * which holds a compressed trie per address family. Changes build a new
+	 * snapshot and publish it atomically (read-copy-update). The old snapshot
+	 * is retired rather than freed, and retired snapshots are freed by later
+	 * changes once no lookup can still be using them. Only writers wait, and
+	 * only on one another, so changing the table never stalls the data path.
+	 * (The flip side is that the last retired snapshots linger until the table
+	 * next changes, or is destroyed.)
+	 *
+	 * Every change rebuilds the tries, so add many routes at once with the
+	 * batch overload of insert().
+	 *
+	 * Each client also has an endpoint: where it was last heard from (see
+	 * learnEndpoint(), which goes by the client's external address rather
+	 * than its routes), or its external address and the table's port until
+	 * then. Lookups can give it directly, as a ready-made socket address.
+	 * Endpoints are updated in place, without taking a lock or changing
+	 * the snapshot. They're kept for as long as the client has a route: once
+	 * no snapshot refers to it, it's freed along with the last one that did
+	 * (so a client removed and added again starts over from its external
+	 * address).
+	 *
+	 * Clients have traffic counters as well, kept alongside their endpoints
+	 * (and for as long). Lookups can give them too, for the caller to count
+	 * in (see TrafficCounter), as long as the caller holds an
+	 * internal::RcuReadGuard from the lookup until it's done counting. The
+	 * counts of freed clients are added to a total (see removedTraffic()).
+	 */
+	class RoutingTable: private boost::noncopyable
+	{
+		public:
+			/*!
+			 * \brief A route to a client.
+			 */
+			struct Route
+			{
+				//! Network (on the Overpass side) being routed.
+				boost::asio::ip::address network;
+
+				//! Number of leading bits of the network that are significant.
+				unsigned int prefixLength;
+
+				//! External address of the client handling the network.
+				boost::asio::ip::address externalAddress;
+			};
+
+			/*!
+			 * \brief Indices of a client's traffic counters.
+			 */
+			enum TrafficCounter
+			{
+				PACKETS_RECEIVED,
+				BYTES_RECEIVED,
+				PACKETS_SENT,
+				BYTES_SENT,
+				TRAFFIC_COUNTER_COUNT
+			};
+
+			/*!
+			 * \brief Traffic to and from a client.
+			 */
+			struct Traffic
+			{
+				//! Packets received from the client.
+				std::uint64_t packetsReceived;
+
+				//! Bytes received from the client.
+				std::uint64_t bytesReceived;
+
+				//! Packets sent to the client.
+				std::uint64_t packetsSent;
+
+				//! Bytes sent to the client.
+				std::uint64_t bytesSent;
+			};
+
+			/*!
+			 * \brief RoutingTable constructor.
+			 *
+			 * \param[in] port
+			 * Port clients are reached on until they're heard from.
+			 */
+			explicit RoutingTable(std::uint16_t port = 0);
+			~RoutingTable();
+
+			/*!
+			 * \brief Look up the client handling an Overpass address.
+			 *
+			 * \param[in] overpassAddress
+			 * IP address on the Overpass network.
+			 *
+			 * \param[out] externalAddress
+			 * Set to the external address of the client with the longest
+			 * matching route, if any.
+			 *
+			 * \return Whether or not a route was found.
+			 */
+			bool lookup(const boost::asio::ip::address &overpassAddress,
+			            boost::asio::ip::address &externalAddress) const;
+
+			/*!
+			 * \brief Look up the endpoint of the client handling an Overpass
+			 *        address.
+			 *
+			 * \param[in] overpassAddress
+			 * IP address on the Overpass network.
+			 *
+			 * \param[out] endpoint
+			 * Set to the endpoint of the client with the longest matching
+			 * route, if any.
+			 *
+			 * \param[out] traffic
+			 * If given, set to the client's traffic counters, if any (indexed
+			 * by TrafficCounter). They're valid for as long as the caller
+			 * holds an internal::RcuReadGuard it entered before the lookup.
+			 *
+			 * \return Whether or not a route was found.
+			 */
+			bool lookup(const boost::asio::ip::address &overpassAddress,
+			            boost::asio::ip::udp::endpoint &endpoint,
+			            internal::Counters **traffic = nullptr) const;
+
+			/*!
+			 * \brief Look up the endpoints of the clients handling a batch of
+			 *        Overpass addresses.
+			 *
+			 * This is the same as calling lookup() for each address, but the
+			 * table is only entered once and every lookup is prefetched
+			 * before any is made, so their cache misses overlap.
+			 *
+			 * \param[in] overpassAddresses
+			 * IP addresses on the Overpass network.
+			 *
+			 * \param[in] count
+			 * Number of addresses.
+			 *
+			 * \param[out] endpoints
+			 * Set to the endpoint of the client with the longest matching
+			 * route for each address, if any.
+			 *
+			 * \param[out] traffic
+			 * Set to the traffic counters of the client for each address, or
+			 * nullptr if there's no route to it (valid as for lookup()).
+			 */
+			void lookup(const boost::asio::ip::address *overpassAddresses,
+			            std::size_t count,
+			            boost::asio::ip::udp::endpoint *endpoints,
+			            internal::Counters **traffic) const;
+
+			/*!
+			 * \brief Record where a client was heard from.
+			 *
+			 * The client is found by external address, never by the
+			 * addresses routed to it: only the peer that sent a packet
+			 * (as authenticated by a cipher) says which client it's from,
+			 * so it's up to the caller to only call this for authentic
+			 * packets.
+			 *
+			 * \param[in] externalAddress
+			 * External address the client was added with.
+			 *
+			 * \param[in] endpoint
+			 * Endpoint the packet came from.
+			 *
+			 * \param[out] traffic
+			 * If given, set to the client's traffic counters (nullptr if
+			 * there's no route to it), valid as for lookup().
+			 *
+			 * \return Whether or not the client's endpoint changed.
+			 */
+			bool learnEndpoint(const boost::asio::ip::address &externalAddress,
+			                   const boost::asio::ip::udp::endpoint &endpoint,
+			                   internal::Counters **traffic = nullptr);
+
+			/*!
+			 * \brief Record where a batch of clients were heard from.
+			 *
+			 * This is the same as calling learnEndpoint() for each client,
+			 * but the table is only entered once (and looked up once per
+			 * run of packets from the same client).
+			 *
+			 * \param[in] externalAddresses
+			 * External addresses the clients were added with.
+			 *
+			 * \param[in] endpoints
+			 * Endpoints each packet came from.
+			 *
+			 * \param[in] count
+			 * Number of packets.
+			 *
+			 * \param[out] traffic
+			 * Set to the traffic counters of the client for each packet
+			 * (nullptr if there's no route to it), valid as for lookup().
+			 */
+			void learnEndpoints(
+			      const boost::asio::ip::address *externalAddresses,
+			      const boost::asio::ip::udp::endpoint *endpoints,
+			      std::size_t count, internal::Counters **traffic);
+
+			/*!
+			 * \brief Check whether an Overpass address routes to a client,
+			 *        i.e. whether the client's is the longest route matching
+			 *        it.
+			 *
+			 * A packet authenticated as coming from a client is only its own
+			 * if its source address passes this check (much like
+			 * WireGuard's allowed IPs).
+			 *
+			 * \param[in] overpassAddress
+			 * IP address on the Overpass network.
+			 *
+			 * \param[in] externalAddress
+			 * External address the client was added with.
+			 */
+			bool routesTo(const boost::asio::ip::address &overpassAddress,
+			              const boost::asio::ip::address &externalAddress) const;
+
+			/*!
+			 * \brief Check a batch of addresses as routesTo() does, with the
+			 *        lookups prefetched.
+			 *
+			 * \param[in] overpassAddresses
+			 * IP addresses on the Overpass network.
+			 *
+			 * \param[in] externalAddresses
+			 * External address of the client each should route to.
+			 *
+			 * \param[in] count
+			 * Number of addresses.
+			 *
+			 * \param[out] results
+			 * Set to whether or not each address routes to its client.
+			 */
+			void routesTo(const boost::asio::ip::address *overpassAddresses,
+			              const boost::asio::ip::address *externalAddresses,
+			              std::size_t count, bool *results) const;
+
+			/*!
+			 * \brief Obtain the endpoint of a client.
+			 *
+			 * Like lookups, this never waits for the table to be updated.
+			 *
+			 * \param[in] externalAddress
+			 * External address the client was added with.
+			 *
+			 * \param[out] endpoint
+			 * Set to the client's endpoint, if there's a route to it.
+			 *
+			 * \return Whether or not there's a route to the client.
+			 */
+			bool clientEndpoint(const boost::asio::ip::address &externalAddress,
+			                    boost::asio::ip::udp::endpoint &endpoint) const;
+
+			/*!
+			 * \brief Obtain the traffic counted for every client routed to,
+			 *        by external address.
+			 *
+			 * This sums every thread's counts, so it's meant for reporting
+			 * rather than the data path.
+			 */
+			std::map<boost::asio::ip::address, Traffic> traffic() const;
+
+			/*!
+			 * \brief Obtain the traffic counted for every client no longer
+			 *        routed to, all together.
+			 *
+			 * Adding this to the totals of traffic() gives everything ever
+			 * counted.
+			 */
+			Traffic removedTraffic() const;
+
+			/*!
+			 * \brief Add a route to a single host, or update it if it exists.
+			 *
+			 * \param[in] overpassAddress
+			 * Client's IP address on the Overpass network.
+			 *
+			 * \param[in] externalAddress
+			 * Client's external IP address.
+			 */
+			void insert(const boost::asio::ip::address &overpassAddress,
+			            const boost::asio::ip::address &externalAddress);
+
+			/*!
+			 * \brief Add a route to a network, or update it if it exists.
+			 *
+			 * \param[in] network
+			 * Network being routed. Bits past the prefix length are ignored.
+			 *
+			 * \param[in] prefixLength
+			 * Number of significant bits (0 for a default route).
+			 *
+			 * \param[in] externalAddress
+			 * External address of the client handling the network.
+			 *
+			 * \exception RoutingTableException
+			 * If the prefix length is too long for the address.
+			 */
+			void insert(const boost::asio::ip::address &network,
+			            unsigned int prefixLength,
+			            const boost::asio::ip::address &externalAddress);
+
+			/*!
+			 * \brief Add (or update) many routes at once.
+			 *
+			 * \param[in] routes
+			 * The routes.
+			 *
+			 * \exception RoutingTableException
+			 * If any prefix length is too long for its address (in which case
+			 * nothing is changed).
+			 */
+			void insert(const std::vector<Route> &routes);
+
+			/*!
+			 * \brief Remove the route to a single host.
+			 *
+			 * \param[in] overpassAddress
+			 * Client's IP address on the Overpass network.
+			 *
+			 * \return Whether or not the route existed.
+			 */
+			bool remove(const boost::asio::ip::address &overpassAddress);
+
+			/*!
+			 * \brief Remove the route to a network.
+			 *
+			 * \param[in] network
+			 * Network being routed.
+			 *
+			 * \param[in] prefixLength
+			 * Number of significant bits.
+			 *
+			 * \return Whether or not the route existed.
+			 */
+			bool remove(const boost::asio::ip::address &network,
+			            unsigned int prefixLength);
+
+			/*!
+			 * \brief Number of routes.
+			 */
+			std::size_t size() const;
+
+		private:
+			struct Client;
+			struct Snapshot;
+
+			typedef std::pair<boost::asio::ip::address, unsigned int> Prefix;
+			typedef std::map<Prefix, boost::asio::ip::address> RouteMap;
+
+			/*!
+			 * \brief Something no longer published.
+			 */
+			struct Retired
+			{
+				//! Epoch in which it was retired.
+				std::uint64_t epoch;
+
+				//! The snapshot that was replaced.
+				const Snapshot *snapshot;
+
+				//! Clients it was the last snapshot to refer to.
+				std::vector<std::unique_ptr<Client>> clients;
+			};
+
+			/*!
+			 * \brief Build a snapshot from a set of routes, make it current
+			 *        and retire the old one (along with the clients it no
+			 *        longer has routes to), then free anything retired that
+			 *        nothing can be reading anymore. Must be called with the
+			 *        write mutex held.
+			 *
+			 * \param[in] routes
+			 * Every route the new snapshot should hold.
+			 */
+			void publish(RouteMap routes);
+
+			/*!
+			 * \brief Find the client with the longest route matching an
+			 *        address in a snapshot.
+			 *
+			 * \return Its index in the snapshot (0 if there's none).
+			 */
+			static std::uint32_t find(const Snapshot &snapshot,
+			                          const boost::asio::ip::address &address);
+
+			/*!
+			 * \brief Find a client by external address in a snapshot.
+			 *
+			 * \return The client, or nullptr if there's no route to it.
+			 */
+			static Client *findClient(
+			      const Snapshot &snapshot,
+			      const boost::asio::ip::address &externalAddress);
+
+			/*!
+			 * \brief Start fetching what find() will read first for an
+			 *        address.
+			 */
+			static void prefetch(const Snapshot &snapshot,
+			                     const boost::asio::ip::address &address);
+
+		private:
+			std::uint16_t m_port;
+			std::atomic<const Snapshot*> m_snapshot;
+			mutable std::mutex m_writeMutex;
+
+			// Endpoint and counters of every client with a route, by external
+			// address. Only changed with the write mutex held.
+			std::map<boost::asio::ip::address,
+			         std::unique_ptr<Client>> m_clients;
+
+			// What was retired, oldest first.
+			std::deque<Retired> m_retired;
+
+			// Counts of the clients freed so far (with the write mutex held).
+			Traffic m_removedTraffic;
+	};
+}
+
+#endif // ROUTING_TABLE_H
@@ -0,0 +1,100 @@
+#ifndef SHARDED_RUNTIME_H
+#define SHARDED_RUNTIME_H
+
+#include <thread>
+#include <limits>
+
+#include <boost/noncopyable.hpp>
+
+#include "types.h"
+
+namespace Overpass
+{
+	/*!
+	 * \brief The ShardedRuntime class runs one IO service per core, each on its
+	 *        own thread pinned to that core.
+	 *
+	 * Anything bound to a shard's IO service only ever runs on that shard's
+	 * thread, so it needs no locking and its data stays in that core's caches.
+	 * Work meant for another shard has to be posted to its IO service
+	 * explicitly.
+	 */
+	class ShardedRuntime: private boost::noncopyable
+	{
+		public:
+			//! Returned by currentShard() outside of a shard's thread.
+			static const std::size_t NO_SHARD =
+			      std::numeric_limits<std::size_t>::max();
+
+			/*!
+			 * \brief ShardedRuntime constructor.
+			 *
+			 * \param[in] shardCount
+			 * Number of shards (and threads). At least one is created. See
+			 * availableShards() for a sensible default.
+			 *
+			 * \param[in] pinThreads
+			 * Whether or not to pin each thread to its own CPU (wrapping around
+			 * if there are more shards than CPUs available to the process).
+			 */
+			explicit ShardedRuntime(std::size_t shardCount,
+			                        bool pinThreads = true);
+
+			~ShardedRuntime();
+
+			std::size_t shardCount() const;
+
+			/*!
+			 * \brief Obtain the IO service belonging to a shard.
+			 *
+			 * \param[in] shard
+			 * Index of the shard.
+			 */
+			const SharedIoService &ioService(std::size_t shard) const;
+
+			/*!
+			 * \brief Obtain every shard's IO service, in shard order.
+			 */
+			const std::vector<SharedIoService> &ioServices() const;
+
+			/*!
+			 * \brief Run every shard until stop() is called.
+			 *
+			 * This blocks until all threads have finished.
+			 */
+			void run();
+
+			/*!
+			 * \brief Ask every shard to stop. Safe to call from any thread,
+			 *        including a shard's own.
+			 */
+			void stop();
+
+			/*!
+			 * \brief Index of the shard running on the calling thread, or
+			 *        NO_SHARD.
+			 */
+			static std::size_t currentShard();
+
+			/*!
+			 * \brief Number of CPUs the process may run on (which can be
+			 *        fewer than the machine has, e.g. under taskset or in a
+			 *        container), so one shard per CPU.
+			 */
+			static std::size_t availableShards();
+
+		private:
+			void runShard(std::size_t shard);
+
+		private:
+			std::vector<SharedIoService> m_ioServices;
+			// Keeps each IO service from running out of work (these are
+			// io_service::work objects, held type-erased to keep Asio out of
+			// this header).
+			std::vector<std::shared_ptr<void>> m_work;
+			std::vector<int> m_cpus;
+			bool m_pinThreads;
+	};
+}
+
+#endif // SHARDED_RUNTIME_H
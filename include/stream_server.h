@@ -1,19 +1,105 @@
 #ifndef STREAM_SERVER_H
 #define STREAM_SERVER_H
 
+#include <atomic>
 #include <memory>
 #include <iostream>
+#include <algorithm>
 
 #include <boost/system/error_code.hpp>
-#include <boost/asio/write.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/strand.hpp>
 #include <boost/asio/io_service.hpp>
 
 #include "types.h"
+#include "internal/counters.h"
+#include "internal/mpsc_queue.h"
+#include "internal/read_sequencer.h"
+#include "internal/latency_histogram.h"
+#include "internal/stream_write_operations.h"
 
 namespace Overpass
 {
 	typedef std::function<void (const SharedBuffer&)> ReadCallback;
 
+	/*!
+	 * \brief Options controlling how a StreamServer uses its descriptor.
+	 */
+	struct StreamServerOptions
+	{
+		StreamServerOptions() :
+		   bufferSize(1500),
+		   writeQueueDepth(1024),
+		   writeBatchSize(64),
+		   coalesceWrites(false),
+		   dispatchMode(DispatchMode::Post),
+		   readDepth(1),
+		   orderedReads(false),
+		   traceLatency(false)
+		{
+		}
+
+		//! How large of a buffer size to support (this is the packet size).
+		std::size_t bufferSize;
+
+		//! Maximum number of packets waiting to be written (rounded up to a
+		//! power of two). Writes beyond this are refused.
+		std::size_t writeQueueDepth;
+
+		//! Maximum number of packets the writer takes from the queue at once.
+		std::size_t writeBatchSize;
+
+		//! Whether or not packets may be combined into a single (gathering)
+		//! write. Only byte streams allow it: on a TUN device every write is
+		//! a packet.
+		bool coalesceWrites;
+
+		//! How packets read are handed to the callback.
+		DispatchMode dispatchMode;
+
+		//! Number of reads to keep outstanding, so several threads can be
+		//! reading from the descriptor at once.
+		std::size_t readDepth;
+
+		//! Whether or not packets must reach the callback in the order they
+		//! were read, whatever the read depth and however many threads run
+		//! the IO service. Callbacks then run one at a time.
+		bool orderedReads;
+
+		//! Whether or not to time packets read and written (see
+		//! LatencyTracer). It costs a couple of clock reads per packet.
+		bool traceLatency;
+	};
+
+	/*!
+	 * \brief Counters describing what a StreamServer read and wrote.
+	 */
+	struct StreamStatistics
+	{
+		//! Reads completed (packets, on a TUN device).
+		std::uint64_t packetsRead;
+
+		//! Bytes read.
+		std::uint64_t bytesRead;
+
+		//! Reads that failed.
+		std::uint64_t readErrors;
+
+		//! Packets written in full (or queued, by descriptors that write
+		//! them later; those that then fail are write errors as well).
+		std::uint64_t packetsWritten;
+
+		//! Bytes written.
+		std::uint64_t bytesWritten;
+
+		//! Writes refused because the queue was full.
+		std::uint64_t droppedWrites;
+
+		//! Packets given up on because writing them failed.
+		std::uint64_t writeErrors;
+	};
+
 	template <typename T>
 	class StreamServer;
 
@@ -24,11 +110,26 @@ namespace Overpass
 	      std::unique_ptr<T> socket,
 	      std::size_t bufferSize = 1500);
 
+	template <typename T>
+	std::shared_ptr<StreamServer<T>> makeStreamServer(
+	      const SharedIoService &ioService,
+	      ReadCallback callback,
+	      std::unique_ptr<T> socket,
+	      const StreamServerOptions &options);
+
 	template <typename T>
 	using SharedStreamServer = std::shared_ptr<StreamServer<T>>;
 
 	/*!
 	 * \brief The StreamServer class acts like a server for stream descriptors.
+	 *
+	 * Packets to be written may come from any thread. They're queued, and a
+	 * single writer (running on the IO service) drains the queue in batches,
+	 * so writes never interleave and an idle descriptor costs no more than a
+	 * busy one.
+	 *
+	 * Everything read and written is counted, per thread (see Counters), and
+	 * packets may be timed as they go through (see LatencyTracer).
 	 */
 	template <typename T>
 	class StreamServer :
@@ -55,11 +156,58 @@ namespace Overpass
 			             ReadCallback callback,
 			             std::unique_ptr<T> socket,
 			             std::size_t bufferSize = 1500):
+			   StreamServer(ioService, callback, std::move(socket),
+			                optionsWithBufferSize(bufferSize))
+			{
+			}
+
+			/*!
+			 * \brief StreamServer constructor
+			 *
+			 * \param[in,out] ioService
+			 * IO service used for running the server.
+			 *
+			 * \param[in] callback
+			 * Function to be called when new data has been read from the
+			 * descriptor.
+			 *
+			 * \param[in] socket
+			 * Stream descriptor-like object.
+			 *
+			 * \param[in] options
+			 * Options controlling buffer sizes and writing.
+			 */
+			StreamServer(const SharedIoService &ioService,
+			             ReadCallback callback,
+			             std::unique_ptr<T> socket,
+			             const StreamServerOptions &options):
 			   m_ioService(ioService),
 			   m_callback(callback),
-			   m_bufferSize(bufferSize),
-			   m_socket(std::move(socket))
+			   m_bufferSize(options.bufferSize),
+			   m_socket(std::move(socket)),
+			   m_writeQueue(options.writeQueueDepth),
+			   m_writeBatchSize(std::max(static_cast<std::size_t>(1),
+			                             options.writeBatchSize)),
+			   m_coalesceWrites(options.coalesceWrites),
+			   m_dispatchMode(options.dispatchMode),
+			   m_readDepth(std::max<std::size_t>(1, options.readDepth)),
+			   m_strand(*ioService),
+			   m_writing(false),
+			   m_counters(COUNTER_COUNT),
+			   m_pendingFirst(0),
+			   m_pendingOffset(0)
 			{
+				m_pendingWrites.reserve(m_writeBatchSize);
+				if (options.orderedReads)
+				{
+					m_sequencer.reset(new internal::ReadSequencer<Completion>(
+					                     m_readDepth));
+				}
+
+				if (options.traceLatency)
+				{
+					m_tracer.reset(new internal::LatencyTracer);
+				}
 			}
 
 			/*!
@@ -68,19 +216,80 @@ namespace Overpass
 			 * \param[in] buffer
 			 * Buffer containing data to be written.
 			 *
-			 * This function will return immediately. It will do nothing until the
-			 * IO service is up and running (i.e. it queues up work to be done).
+			 * This function will return immediately, and may be called from
+			 * any thread. It will do nothing until the IO service is up and
+			 * running (i.e. it queues up work to be done).
+			 *
+			 * \return Whether or not the data was queued. If the writer has
+			 * fallen too far behind, the data is dropped (and counted)
+			 * instead: callers may want to ease off.
+			 */
+			bool write(const Overpass::SharedBuffer &buffer)
+			{
+				if (m_tracer)
+				{
+					m_tracer->queued(buffer, internal::traceTime());
+				}
+
+				if (!m_writeQueue.tryPush(buffer))
+				{
+					m_counters.add(DROPPED_WRITES);
+					return false;
+				}
+
+				// Pairs with the fence in drainWrites(): either the writer
+				// sees this buffer, or we see that it has let go and start it
+				// again.
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (!m_writing.exchange(true, std::memory_order_relaxed))
+				{
+					m_ioService->post(std::bind(&StreamServer::drainWrites,
+					                            this->shared_from_this()));
+				}
+
+				return true;
+			}
+
+			/*!
+			 * \brief Obtain the number of writes refused because the queue
+			 *        was full.
+			 */
+			std::uint64_t droppedWrites() const
+			{
+				return m_counters.value(DROPPED_WRITES);
+			}
+
+			/*!
+			 * \brief Obtain counters describing what was read and written so
+			 *        far.
+			 */
+			StreamStatistics statistics() const
+			{
+				return StreamStatistics{
+				   m_counters.value(PACKETS_READ), m_counters.value(BYTES_READ),
+				   m_counters.value(READ_ERRORS),
+				   m_counters.value(PACKETS_WRITTEN),
+				   m_counters.value(BYTES_WRITTEN),
+				   m_counters.value(DROPPED_WRITES),
+				   m_counters.value(WRITE_ERRORS)};
+			}
+
+			/*!
+			 * \brief Obtain the (approximate) number of packets waiting to be
+			 *        written.
+			 */
+			std::size_t pendingWrites() const
+			{
+				return m_writeQueue.size();
+			}
+
+			/*!
+			 * \brief Obtain the latencies of the packets going through the
+			 *        server (null unless tracing was enabled).
 			 */
-			void write(const Overpass::SharedBuffer &buffer) const
+			const internal::LatencyTracer *tracer() const
 			{
-				// Using a raw pointer to the socket, but since `this` is
-				// shared_from_this it's guaranteed to stay valid.
-				boost::asio::async_write(*m_socket,
-				                         boost::asio::buffer(*buffer),
-				                         std::bind(&StreamServer::handleWrite,
-				                                   this->shared_from_this(),
-				                                   std::placeholders::_1,
-				                                   std::placeholders::_2));
+				return m_tracer.get();
 			}
 
 			friend std::shared_ptr<StreamServer> makeStreamServer<T>(
@@ -89,6 +298,12 @@ namespace Overpass
 			      std::unique_ptr<T> socket,
 			      std::size_t bufferSize);
 
+			friend std::shared_ptr<StreamServer> makeStreamServer<T>(
+			      const SharedIoService &ioService,
+			      ReadCallback callback,
+			      std::unique_ptr<T> socket,
+			      const StreamServerOptions &options);
+
 		private:
 
 			/*!
@@ -97,14 +312,64 @@ namespace Overpass
 			 * This function will return immediately. It will do nothing until the
 			 * IO service is up and running (i.e. it queues up work to be done).
 			 */
-			void beginReading() const
+			void beginReading()
 			{
-				Overpass::SharedBuffer buffer(new Overpass::Buffer(m_bufferSize));
+				for (std::size_t i = 0; i < m_readDepth; ++i)
+				{
+					beginRead();
+				}
+			}
 
-				m_socket->async_read_some(boost::asio::buffer(*buffer),
+			/*!
+			 * \brief What a read brought, on its way to the callback.
+			 */
+			struct Completion
+			{
+				Completion() :
+				   more(false)
+				{
+				}
+
+				//! Whether or not to keep reading.
+				bool more;
+
+				//! The packet read, if any.
+				Overpass::SharedBuffer buffer;
+			};
+
+			/*!
+			 * \brief Start a read (numbered, if reads are kept in order).
+			 */
+			void beginRead()
+			{
+				if (m_sequencer)
+				{
+					m_sequencer->start([this](std::uint64_t sequence)
+					{
+						read(sequence);
+					});
+
+					return;
+				}
+
+				read(0);
+			}
+
+			/*!
+			 * \brief Read into a new buffer.
+			 *
+			 * \param[in] sequence
+			 * Number of the read (if reads are handed over in order).
+			 */
+			void read(std::uint64_t sequence)
+			{
+				Overpass::SharedBuffer buffer(m_bufferSize);
+
+				m_socket->async_read_some(boost::asio::buffer(buffer.data(),
+				                                              buffer.size()),
 				                          std::bind(&StreamServer::handleRead,
 				                                    this->shared_from_this(),
-				                                    buffer,
+				                                    sequence, buffer,
 				                                    std::placeholders::_1,
 				                                    std::placeholders::_2));
 			}
@@ -112,6 +377,9 @@ namespace Overpass
 			/*!
 			 * \brief Handle a completed read from the descriptor.
 			 *
+			 * \param[in] sequence
+			 * Number of the read (if reads are handed over in order).
+			 *
 			 * \param[in] buffer
 			 * Buffer that was read (note that it's not necessarily full, check
 			 * bytesRead).
@@ -122,57 +390,329 @@ namespace Overpass
 			 * \param[in] bytesRead
 			 * The number of bytes read during the operation (if any).
 			 */
-			void handleRead(Overpass::SharedBuffer buffer,
+			void handleRead(std::uint64_t sequence,
+			                const Overpass::SharedBuffer &buffer,
 			                const boost::system::error_code &error,
-			                std::size_t bytesRead) const
+			                std::size_t bytesRead)
 			{
+				Completion read;
 				if (error)
 				{
+					m_counters.add(READ_ERRORS);
 					std::cerr << "Error reading: " << error << std::endl;
+				}
+				else if (bytesRead == 0)
+				{
+					std::cerr << "Received zero bytes?" << std::endl;
+				}
+				else
+				{
+					m_counters.add(PACKETS_READ);
+					m_counters.add(BYTES_READ, bytesRead);
+					if (m_tracer)
+					{
+						internal::LatencyTracer::read(buffer,
+						                              internal::traceTime());
+					}
+
+					read.more = true;
+					read.buffer = buffer;
+				}
+
+				if (m_sequencer)
+				{
+					m_sequencer->complete(sequence, std::move(read),
+					                      [this](Completion &read)
+					{
+						deliver(read);
+					});
+
 					return;
 				}
 
-				if (bytesRead == 0)
+				deliver(read);
+			}
+
+			/*!
+			 * \brief Keep reading, and hand what a read brought to the
+			 *        callback.
+			 */
+			void deliver(Completion &read)
+			{
+				if (!read.more)
 				{
-					std::cerr << "Received zero bytes?" << std::endl;
 					return;
 				}
 
-				// We got something: dispatch callback with buffer.
-				m_ioService->post(std::bind(m_callback, buffer));
+				// Read some more first, so another thread can pick it up while
+				// this one handles the packet.
+				beginRead();
 
-				// Read some more.
-				beginReading();
+				if (m_dispatchMode == DispatchMode::Inline)
+				{
+					dispatch(read.buffer);
+				}
+				else if (m_sequencer)
+				{
+					// In order with the packets posted before.
+					m_strand.post(std::bind(&StreamServer::dispatch,
+					                        this->shared_from_this(),
+					                        std::move(read.buffer)));
+				}
+				else
+				{
+					// Bind to a member function rather than copying the
+					// callback itself, which may need to allocate.
+					m_ioService->post(std::bind(&StreamServer::dispatch,
+					                            this->shared_from_this(),
+					                            std::move(read.buffer)));
+				}
 			}
 
 			/*!
-			 * \brief Handle a completed write to the descriptor.
+			 * \brief Hand data read from the descriptor to the callback.
 			 *
-			 * \param[in] error
-			 * Error that occurred during writing (if any).
+			 * \param[in] buffer
+			 * Buffer that was read.
+			 */
+			void dispatch(const Overpass::SharedBuffer &buffer) const
+			{
+				if (m_tracer)
+				{
+					m_tracer->dispatched(buffer, internal::traceTime());
+				}
+
+				m_callback(buffer);
+			}
+
+			/*!
+			 * \brief Write queued packets until the queue is empty or the
+			 *        descriptor is full.
 			 *
-			 * \param[in] bytesWritten
-			 * The number of bytes written during the operation (if any).
+			 * Only one of these runs at a time (see m_writing).
 			 */
-			void handleWrite(const boost::system::error_code &error,
-			                 std::size_t bytesWritten) const
+			void drainWrites()
 			{
-				if (error)
+				// Yield to other handlers now and then under sustained load.
+				for (int batches = 0; batches < MAXIMUM_BATCHES_PER_DRAIN;)
 				{
-					std::cerr << "Error writing: " << error << std::endl;
+					if (m_pendingFirst == m_pendingWrites.size())
+					{
+						if (!takeWrites())
+						{
+							return;
+						}
+
+						++batches;
+					}
+
+					boost::system::error_code error;
+					flushWrites(error);
+
+					if (error == boost::asio::error::would_block)
+					{
+						// Keep the writer role until there's room again.
+						m_socket->async_write_some(
+						         boost::asio::null_buffers(),
+						         std::bind(&StreamServer::handleWritable,
+						                   this->shared_from_this(),
+						                   std::placeholders::_1));
+						return;
+					}
+
+					if (error)
+					{
+						m_counters.add(WRITE_ERRORS);
+						std::cerr << "Error writing: " << error << std::endl;
+
+						// Give up on the packet that failed.
+						++m_pendingFirst;
+						m_pendingOffset = 0;
+					}
 				}
 
-				if (bytesWritten == 0)
+				m_ioService->post(std::bind(&StreamServer::drainWrites,
+				                            this->shared_from_this()));
+			}
+
+			/*!
+			 * \brief Take the next batch of packets off the queue, or give up
+			 *        the writer role if there are none.
+			 *
+			 * \return Whether or not there's anything to write.
+			 */
+			bool takeWrites()
+			{
+				m_pendingWrites.clear();
+				m_pendingFirst = 0;
+				m_pendingOffset = 0;
+
+				for (;;)
 				{
-					std::cerr << "Wrote zero bytes?" << std::endl;
+					Overpass::SharedBuffer buffer;
+					while (m_pendingWrites.size() < m_writeBatchSize &&
+					       m_writeQueue.tryPop(buffer))
+					{
+						m_pendingWrites.push_back(std::move(buffer));
+					}
+
+					if (!m_pendingWrites.empty())
+					{
+						return true;
+					}
+
+					m_writing.store(false, std::memory_order_relaxed);
+					std::atomic_thread_fence(std::memory_order_seq_cst);
+
+					// A producer may have queued something after we looked
+					// but before we let go (seeing us still writing). If so,
+					// take the role back unless it already has.
+					if (m_writeQueue.empty() ||
+					    m_writing.exchange(true, std::memory_order_relaxed))
+					{
+						return false;
+					}
 				}
 			}
 
+			/*!
+			 * \brief Write as much of the current batch as the descriptor
+			 *        will take.
+			 *
+			 * \param[out] error
+			 * Error that occurred while writing (if any).
+			 */
+			void flushWrites(boost::system::error_code &error)
+			{
+				using namespace internal;
+
+				const SharedBuffer *first = m_pendingWrites.data() + m_pendingFirst;
+				std::size_t count = m_pendingWrites.size() - m_pendingFirst;
+
+				if (!m_coalesceWrites)
+				{
+					std::size_t packets = writePackets(*m_socket, first, count,
+					                                   error);
+					std::size_t bytes = 0;
+					for (std::size_t i = 0; i < packets; ++i)
+					{
+						bytes += first[i].size();
+					}
+
+					if (m_tracer)
+					{
+						std::int64_t now = traceTime();
+						for (std::size_t i = 0; i < packets; ++i)
+						{
+							m_tracer->written(first[i], now);
+						}
+					}
+
+					m_counters.add(PACKETS_WRITTEN, packets);
+					m_counters.add(BYTES_WRITTEN, bytes);
+					m_counters.add(WRITE_ERRORS, takeFailedWrites(*m_socket));
+					m_pendingFirst += packets;
+					return;
+				}
+
+				std::size_t written = writeGathered(*m_socket, first, count,
+				                                    m_pendingOffset, error);
+				m_counters.add(BYTES_WRITTEN, written);
+				while (written > 0)
+				{
+					std::size_t remaining =
+					      m_pendingWrites[m_pendingFirst].size() - m_pendingOffset;
+					if (written < remaining)
+					{
+						m_pendingOffset += written;
+						break;
+					}
+
+					written -= remaining;
+					m_counters.add(PACKETS_WRITTEN);
+					if (m_tracer)
+					{
+						m_tracer->written(m_pendingWrites[m_pendingFirst],
+						                  traceTime());
+					}
+
+					++m_pendingFirst;
+					m_pendingOffset = 0;
+				}
+			}
+
+			/*!
+			 * \brief Handle the descriptor having room for more writes.
+			 *
+			 * \param[in] error
+			 * Error that occurred while waiting (if any).
+			 */
+			void handleWritable(const boost::system::error_code &error)
+			{
+				if (error)
+				{
+					m_counters.add(WRITE_ERRORS);
+					std::cerr << "Error waiting to write: " << error << std::endl;
+
+					// Give up on the packet that was waiting, but carry on
+					// with the rest (or let go of the writer role), so later
+					// writes aren't stuck behind it.
+					++m_pendingFirst;
+					m_pendingOffset = 0;
+				}
+
+				drainWrites();
+			}
+
+			static StreamServerOptions optionsWithBufferSize(
+			      std::size_t bufferSize)
+			{
+				StreamServerOptions options;
+				options.bufferSize = bufferSize;
+				return options;
+			}
+
 		private:
+			static const int MAXIMUM_BATCHES_PER_DRAIN = 16;
+
+			enum
+			{
+				PACKETS_READ,
+				BYTES_READ,
+				READ_ERRORS,
+				PACKETS_WRITTEN,
+				BYTES_WRITTEN,
+				DROPPED_WRITES,
+				WRITE_ERRORS,
+				COUNTER_COUNT
+			};
+
 			SharedIoService m_ioService;
 			ReadCallback m_callback;
 			std::size_t m_bufferSize;
 			std::unique_ptr<T> m_socket;
+
+			internal::MpscQueue<Overpass::SharedBuffer> m_writeQueue;
+			std::size_t m_writeBatchSize;
+			bool m_coalesceWrites;
+			DispatchMode m_dispatchMode;
+
+			// Reads kept outstanding. The sequencer is set if they're handed
+			// to the callback in order, through the strand unless dispatched
+			// inline.
+			std::size_t m_readDepth;
+			std::unique_ptr<internal::ReadSequencer<Completion>> m_sequencer;
+			boost::asio::io_service::strand m_strand;
+
+			// Whether or not a writer is running (or about to be).
+			std::atomic<bool> m_writing;
+			internal::Counters m_counters;
+			std::unique_ptr<internal::LatencyTracer> m_tracer;
+
+			// The batch being written (only touched by the writer).
+			std::vector<Overpass::SharedBuffer> m_pendingWrites;
+			std::size_t m_pendingFirst;
+			std::size_t m_pendingOffset;
 	};
 
 	/*!
@@ -197,10 +737,38 @@ namespace Overpass
 	      ReadCallback callback,
 	      std::unique_ptr<T> socket,
 	      std::size_t bufferSize)
+	{
+		StreamServerOptions options;
+		options.bufferSize = bufferSize;
+		return makeStreamServer(ioService, callback, std::move(socket), options);
+	}
+
+	/*!
+	 * \brief Create a new StreamServer and start it.
+	 *
+	 * \param[in,out] ioService
+	 * IO service used for running the server.
+	 *
+	 * \param[in] callback
+	 * Function to be called when new data has been read from the
+	 * descriptor.
+	 *
+	 * \param[in] socket
+	 * Stream descriptor-like object.
+	 *
+	 * \param[in] options
+	 * Options controlling buffer sizes and writing.
+	 */
+	template <typename T>
+	std::shared_ptr<StreamServer<T>> makeStreamServer(
+	      const SharedIoService &ioService,
+	      ReadCallback callback,
+	      std::unique_ptr<T> socket,
+	      const StreamServerOptions &options)
 	{
 		auto communicator = std::make_shared<StreamServer<T> >(
 		                       ioService, callback, std::move(socket),
-		                       bufferSize);
+		                       options);
 
 		// Ideally the constructor would do this, but it can't as shared_from_this
 		// can only be used once at least one shared pointer is pointing to the
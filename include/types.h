@@ -3,9 +3,13 @@
 
 #include <vector>
 #include <memory>
+#include <string>
 #include <cstdint>
+#include <stdexcept>
 #include <functional>
 
+#include "buffer_pool.h"
+
 namespace boost
 {
 	namespace asio
@@ -17,10 +21,25 @@ namespace boost
 namespace Overpass
 {
 	typedef std::vector<uint8_t> Buffer;
-	typedef std::shared_ptr<Buffer> SharedBuffer;
 
 	typedef std::shared_ptr<boost::asio::io_service> SharedIoService;
 
+	/*!
+	 * \brief How a server hands what it reads to its callback.
+	 */
+	enum class DispatchMode
+	{
+		//! Post the callback to the IO service, to run on whichever thread
+		//! picks it up. Callbacks never run while a read is completing, at
+		//! the cost of a queue hop per packet (or batch).
+		Post,
+
+		//! Run the callback on the thread that completed the read, right
+		//! after starting the next one. Callbacks must be quick, and must
+		//! not wait on anything the IO service runs.
+		Inline,
+	};
+
 	class Exception : public std::runtime_error
 	{
 		public:
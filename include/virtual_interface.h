@@ -2,6 +2,7 @@
 #define VIRTUAL_INTERFACE_H
 
 #include <string>
+#include <vector>
 
 #include "types.h"
 
@@ -30,6 +31,40 @@ namespace Overpass
 	void createVirtualInterface(std::string &interfaceName,
 	                            int &interfaceFileDescriptor);
 
+	/*!
+	 * \brief Create multi-queue virtual network interface.
+	 *
+	 * Each queue has its own file descriptor. Packets written to any of them
+	 * end up on the same interface, while packets sent out of the interface
+	 * are spread across the queues by flow, so every queue can be served
+	 * independently.
+	 *
+	 * \param[in,out] interfaceName
+	 * Set to desired interface name (or template, e.g. "eth%d"), and it will be
+	 * set to the actual interface name when it's created.
+	 *
+	 * \param[out] queueFileDescriptors
+	 * One file descriptor per queue.
+	 *
+	 * \param[in] queueCount
+	 * Number of queues to create. With a single queue this is the same as
+	 * the function above.
+	 *
+	 * \param[in] offload
+	 * Whether or not to enable offloads (IFF_VNET_HDR). Every packet read or
+	 * written is then prefixed with a virtio_net_hdr, and the kernel may hand
+	 * over TCP super-packets (up to 64 KiB) with their checksum left to be
+	 * completed, and accepts them in return (see internal/offload.h).
+	 *
+	 * \exception VirtualInterfaceException
+	 * If interface can't be created (e.g. the kernel doesn't support
+	 * multi-queue interfaces or offloads). No descriptors are left open in
+	 * that case.
+	 */
+	void createVirtualInterface(std::string &interfaceName,
+	                            std::vector<int> &queueFileDescriptors,
+	                            std::size_t queueCount, bool offload = false);
+
 	/*!
 	 * \brief Assign an IPv4 address and netmask to a given network interface.
 	 *
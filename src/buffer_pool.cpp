@@ -0,0 +1,494 @@
+#include <mutex>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "buffer_pool.h"
+
+using namespace Overpass;
+using Overpass::internal::BufferNode;
+
+namespace
+{
+	// Standard packets (with room to spare for encapsulation), jumbo frames,
+	// and full 64 KiB offload super-packets.
+	const std::size_t SIZE_CLASSES[] = {2048, 16384, 66560};
+	const std::uint32_t NUMBER_OF_SIZE_CLASSES =
+	      sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]);
+
+	// Size class used for buffers too large to pool.
+	const std::uint32_t OVERSIZED = NUMBER_OF_SIZE_CLASSES;
+
+	const std::size_t CACHE_LINE_SIZE = 64;
+	static_assert(sizeof(BufferNode) <= BufferNode::HEADER_SIZE,
+	              "Buffer headers don't fit before their bytes");
+
+	const std::size_t SLAB_SIZE = 256 * 1024;
+	const std::size_t MINIMUM_NODES_PER_SLAB = 4;
+
+	// How many bytes worth of buffers each thread may hoard per size class
+	// before handing some back.
+	const std::size_t THREAD_CACHE_SIZE = 512 * 1024;
+
+	std::size_t nodeStride(std::uint32_t sizeClass)
+	{
+		std::size_t size = SIZE_CLASSES[sizeClass];
+		size = (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+		return BufferNode::HEADER_SIZE + size;
+	}
+
+	std::size_t threadCacheLimit(std::uint32_t sizeClass)
+	{
+		return std::max(static_cast<std::size_t>(8),
+		                THREAD_CACHE_SIZE / nodeStride(sizeClass));
+	}
+
+	std::uint32_t sizeClassFor(std::size_t size)
+	{
+		std::uint32_t sizeClass = 0;
+		while (sizeClass < NUMBER_OF_SIZE_CLASSES &&
+		       SIZE_CLASSES[sizeClass] < size)
+		{
+			++sizeClass;
+		}
+
+		return sizeClass;
+	}
+
+	void *allocateAligned(std::size_t size)
+	{
+		void *memory;
+		if (posix_memalign(&memory, CACHE_LINE_SIZE, size) != 0)
+		{
+			throw std::bad_alloc();
+		}
+
+		return memory;
+	}
+
+	BufferNode *initializeNode(void *memory, std::uint32_t sizeClass,
+	                           std::size_t capacity)
+	{
+		BufferNode *node = new (memory) BufferNode;
+		node->references.store(0, std::memory_order_relaxed);
+		node->sizeClass = sizeClass;
+		node->capacity = capacity;
+		node->next = nullptr;
+		return node;
+	}
+
+	// Counters only ever written by a single thread: avoid the cost of an
+	// atomic read-modify-write while still allowing them to be read from
+	// elsewhere.
+	void increment(std::atomic<std::uint64_t> &counter, std::uint64_t amount = 1)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + amount,
+		              std::memory_order_relaxed);
+	}
+
+	struct SizeClass
+	{
+		SizeClass() :
+		   freeList(nullptr),
+		   freeCount(0),
+		   buffers(0),
+		   retiredHits(0),
+		   retiredMisses(0)
+		{
+		}
+
+		// Carve out a new slab, returning its nodes linked together. The
+		// last node's next pointer is null.
+		BufferNode *allocateSlab(std::uint32_t sizeClass, std::size_t &count)
+		{
+			std::size_t stride = nodeStride(sizeClass);
+			count = std::max(MINIMUM_NODES_PER_SLAB, SLAB_SIZE / stride);
+
+			std::uint8_t *slab = static_cast<std::uint8_t*>(
+			                        allocateAligned(stride * count));
+
+			BufferNode *head = nullptr;
+			for (std::size_t i = count; i > 0; --i)
+			{
+				BufferNode *node = initializeNode(slab + (i - 1) * stride,
+				                                  sizeClass,
+				                                  SIZE_CLASSES[sizeClass]);
+				node->next = head;
+				head = node;
+			}
+
+			buffers.fetch_add(count, std::memory_order_relaxed);
+			return head;
+		}
+
+		// Put a chain of nodes (first through last, inclusive) on the free
+		// list.
+		void give(BufferNode *first, BufferNode *last, std::size_t count)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			last->next = freeList;
+			freeList = first;
+			freeCount += count;
+		}
+
+		// Take a single node off the free list, allocating a slab if needed.
+		// Only used by threads without a cache.
+		BufferNode *take(std::uint32_t sizeClass)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (freeList)
+				{
+					BufferNode *node = freeList;
+					freeList = node->next;
+					--freeCount;
+					return node;
+				}
+			}
+
+			std::size_t count;
+			BufferNode *node = allocateSlab(sizeClass, count);
+			if (node->next)
+			{
+				BufferNode *last = node->next;
+				while (last->next)
+				{
+					last = last->next;
+				}
+
+				give(node->next, last, count - 1);
+			}
+
+			return node;
+		}
+
+		std::mutex mutex;
+		BufferNode *freeList;
+		std::size_t freeCount;
+
+		std::atomic<std::uint64_t> buffers;
+
+		// Counters inherited from threads that have exited (protected by the
+		// registry mutex).
+		std::uint64_t retiredHits;
+		std::uint64_t retiredMisses;
+	};
+
+	class ThreadCache;
+
+	struct PoolState
+	{
+		PoolState() :
+		   oversizedMisses(0)
+		{
+		}
+
+		SizeClass sizeClasses[NUMBER_OF_SIZE_CLASSES];
+
+		std::atomic<std::uint64_t> oversizedMisses;
+
+		std::mutex registryMutex;
+		std::vector<ThreadCache*> threadCaches;
+	};
+
+	PoolState &state()
+	{
+		// Intentionally leaked: buffers may be released from static
+		// destructors, after anything with a destructor of its own is gone.
+		static PoolState *state = new PoolState();
+		return *state;
+	}
+
+	thread_local bool t_cacheDestroyed = false;
+
+	/*!
+	 * \brief A single thread's free lists.
+	 */
+	class ThreadCache
+	{
+		public:
+			struct List
+			{
+				List() :
+				   head(nullptr),
+				   count(0),
+				   hits(0),
+				   misses(0)
+				{
+				}
+
+				BufferNode *head;
+				std::atomic<std::size_t> count;
+				std::atomic<std::uint64_t> hits;
+				std::atomic<std::uint64_t> misses;
+			};
+
+			ThreadCache()
+			{
+				std::lock_guard<std::mutex> lock(state().registryMutex);
+				state().threadCaches.push_back(this);
+			}
+
+			~ThreadCache()
+			{
+				t_cacheDestroyed = true;
+
+				std::lock_guard<std::mutex> lock(state().registryMutex);
+				auto &caches = state().threadCaches;
+				caches.erase(std::remove(caches.begin(), caches.end(), this),
+				             caches.end());
+
+				for (std::uint32_t sizeClass = 0;
+				     sizeClass < NUMBER_OF_SIZE_CLASSES; ++sizeClass)
+				{
+					List &list = m_lists[sizeClass];
+					SizeClass &shared = state().sizeClasses[sizeClass];
+					shared.retiredHits += list.hits.load();
+					shared.retiredMisses += list.misses.load();
+					flush(sizeClass, list.count.load());
+				}
+			}
+
+			BufferNode *pop(std::uint32_t sizeClass)
+			{
+				List &list = m_lists[sizeClass];
+				if (!list.head && !refill(sizeClass))
+				{
+					increment(list.misses);
+				}
+				else
+				{
+					increment(list.hits);
+				}
+
+				BufferNode *node = list.head;
+				list.head = node->next;
+				list.count.store(list.count.load(std::memory_order_relaxed) - 1,
+				                 std::memory_order_relaxed);
+				return node;
+			}
+
+			void push(BufferNode *node)
+			{
+				List &list = m_lists[node->sizeClass];
+				node->next = list.head;
+				list.head = node;
+
+				std::size_t count = list.count.load(std::memory_order_relaxed) + 1;
+				list.count.store(count, std::memory_order_relaxed);
+
+				std::size_t limit = threadCacheLimit(node->sizeClass);
+				if (count > limit)
+				{
+					flush(node->sizeClass, limit / 2);
+				}
+			}
+
+			const List &list(std::uint32_t sizeClass) const
+			{
+				return m_lists[sizeClass];
+			}
+
+		private:
+			// Grab a bunch of buffers from the shared free list, allocating a
+			// new slab if there are none. Returns false if a slab was needed.
+			bool refill(std::uint32_t sizeClass)
+			{
+				List &list = m_lists[sizeClass];
+				SizeClass &shared = state().sizeClasses[sizeClass];
+				std::size_t wanted = threadCacheLimit(sizeClass) / 2;
+
+				{
+					std::lock_guard<std::mutex> lock(shared.mutex);
+					std::size_t taken = 0;
+					while (shared.freeList && taken < wanted)
+					{
+						BufferNode *node = shared.freeList;
+						shared.freeList = node->next;
+						node->next = list.head;
+						list.head = node;
+						++taken;
+					}
+
+					shared.freeCount -= taken;
+					if (taken > 0)
+					{
+						list.count.store(taken, std::memory_order_relaxed);
+						return true;
+					}
+				}
+
+				std::size_t count;
+				list.head = shared.allocateSlab(sizeClass, count);
+				list.count.store(count, std::memory_order_relaxed);
+				return false;
+			}
+
+			// Hand buffers back to the shared free list.
+			void flush(std::uint32_t sizeClass, std::size_t count)
+			{
+				List &list = m_lists[sizeClass];
+				if (count == 0 || !list.head)
+				{
+					return;
+				}
+
+				BufferNode *first = list.head;
+				BufferNode *last = first;
+				std::size_t moved = 1;
+				while (moved < count && last->next)
+				{
+					last = last->next;
+					++moved;
+				}
+
+				list.head = last->next;
+				list.count.store(list.count.load(std::memory_order_relaxed) - moved,
+				                 std::memory_order_relaxed);
+
+				state().sizeClasses[sizeClass].give(first, last, moved);
+			}
+
+			List m_lists[NUMBER_OF_SIZE_CLASSES];
+	};
+
+	ThreadCache *threadCache()
+	{
+		if (t_cacheDestroyed)
+		{
+			return nullptr;
+		}
+
+		thread_local ThreadCache cache;
+		return &cache;
+	}
+}
+
+BufferPool &BufferPool::instance()
+{
+	static BufferPool *pool = new BufferPool();
+	return *pool;
+}
+
+BufferPool::BufferPool()
+{
+}
+
+BufferNode *BufferPool::acquire(std::size_t size)
+{
+	std::uint32_t sizeClass = sizeClassFor(size);
+	BufferNode *node;
+	if (sizeClass == OVERSIZED)
+	{
+		state().oversizedMisses.fetch_add(1, std::memory_order_relaxed);
+		node = initializeNode(allocateAligned(BufferNode::HEADER_SIZE + size),
+		                      OVERSIZED, size);
+	}
+	else if (ThreadCache *cache = threadCache())
+	{
+		node = cache->pop(sizeClass);
+	}
+	else
+	{
+		// This thread is exiting: bypass its cache.
+		node = state().sizeClasses[sizeClass].take(sizeClass);
+	}
+
+	node->references.store(1, std::memory_order_relaxed);
+	node->times.read = 0;
+	return node;
+}
+
+void BufferPool::release(BufferNode *node)
+{
+	if (node->sizeClass == OVERSIZED)
+	{
+		node->~BufferNode();
+		free(node);
+	}
+	else if (ThreadCache *cache = threadCache())
+	{
+		cache->push(node);
+	}
+	else
+	{
+		state().sizeClasses[node->sizeClass].give(node, node, 1);
+	}
+}
+
+void BufferPool::reserve(std::size_t size, std::size_t count)
+{
+	std::uint32_t sizeClass = sizeClassFor(size);
+	if (sizeClass == OVERSIZED)
+	{
+		return;
+	}
+
+	SizeClass &shared = state().sizeClasses[sizeClass];
+	while (shared.buffers.load() < count)
+	{
+		std::size_t carved;
+		BufferNode *head = shared.allocateSlab(sizeClass, carved);
+		BufferNode *last = head;
+		while (last->next)
+		{
+			last = last->next;
+		}
+
+		shared.give(head, last, carved);
+	}
+}
+
+std::vector<BufferPool::Statistics> BufferPool::statistics() const
+{
+	std::vector<Statistics> statistics;
+
+	std::lock_guard<std::mutex> registryLock(state().registryMutex);
+	for (std::uint32_t sizeClass = 0; sizeClass < NUMBER_OF_SIZE_CLASSES;
+	     ++sizeClass)
+	{
+		SizeClass &shared = state().sizeClasses[sizeClass];
+
+		Statistics entry;
+		entry.bufferSize = SIZE_CLASSES[sizeClass];
+		entry.hits = shared.retiredHits;
+		entry.misses = shared.retiredMisses;
+		entry.buffers = shared.buffers.load(std::memory_order_relaxed);
+
+		{
+			std::lock_guard<std::mutex> lock(shared.mutex);
+			entry.idleBuffers = shared.freeCount;
+		}
+
+		for (const ThreadCache *cache : state().threadCaches)
+		{
+			const ThreadCache::List &list = cache->list(sizeClass);
+			entry.hits += list.hits.load(std::memory_order_relaxed);
+			entry.misses += list.misses.load(std::memory_order_relaxed);
+			entry.idleBuffers += list.count.load(std::memory_order_relaxed);
+		}
+
+		statistics.push_back(entry);
+	}
+
+	// Buffers too large for any size class are never pooled, so they're all
+	// misses.
+	Statistics oversized;
+	oversized.bufferSize = 0;
+	oversized.hits = 0;
+	oversized.misses = state().oversizedMisses.load(std::memory_order_relaxed);
+	oversized.buffers = 0;
+	oversized.idleBuffers = 0;
+	statistics.push_back(oversized);
+
+	return statistics;
+}
+
+SharedBuffer::SharedBuffer(const std::uint8_t *data, std::size_t size) :
+   m_node(BufferPool::instance().acquire(size)),
+   m_data(m_node->memory()),
+   m_size(size)
+{
+	std::memcpy(m_data, data, size);
+}
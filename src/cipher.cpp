@@ -0,0 +1,18 @@
+#include "cipher.h"
+
+using namespace Overpass;
+
+const char *Overpass::toString(Cipher cipher)
+{
+	switch (cipher)
+	{
+		case Cipher::None:
+			return "none";
+		case Cipher::ChaCha20Poly1305:
+			return "chacha20-poly1305";
+		case Cipher::Aes256Gcm:
+			return "aes-256-gcm";
+	}
+
+	return "unknown";
+}
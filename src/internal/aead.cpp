@@ -0,0 +1,281 @@
+#include <mutex>
+#include <algorithm>
+
+#include <openssl/evp.h>
+
+#include "internal/aead.h"
+
+using namespace Overpass;
+using namespace Overpass::internal;
+
+namespace
+{
+	//! Threads with their own contexts. Any more share temporary ones,
+	//! set up on every call.
+	const std::size_t MAXIMUM_THREADS = 256;
+
+	const std::size_t NONCE_SIZE = 12;
+	const std::size_t COUNTER_SIZE = AEAD_HEADER_SIZE - AEAD_COUNTER_OFFSET;
+
+	/*!
+	 * \brief Index of the calling thread among those running, reused once
+	 *        it's done.
+	 */
+	class ThreadIndex
+	{
+		public:
+			ThreadIndex()
+			{
+				std::lock_guard<std::mutex> lock(s_mutex);
+				if (!s_free.empty())
+				{
+					m_index = s_free.back();
+					s_free.pop_back();
+				}
+				else
+				{
+					m_index = s_next < MAXIMUM_THREADS ?
+					          s_next++ : MAXIMUM_THREADS;
+				}
+			}
+
+			~ThreadIndex()
+			{
+				if (m_index < MAXIMUM_THREADS)
+				{
+					std::lock_guard<std::mutex> lock(s_mutex);
+					s_free.push_back(m_index);
+				}
+			}
+
+			std::size_t index() const
+			{
+				return m_index;
+			}
+
+		private:
+			std::size_t m_index;
+
+			static std::mutex s_mutex;
+			static std::vector<std::size_t> s_free;
+			static std::size_t s_next;
+	};
+
+	std::mutex ThreadIndex::s_mutex;
+	std::vector<std::size_t> ThreadIndex::s_free;
+	std::size_t ThreadIndex::s_next = 0;
+
+	thread_local ThreadIndex t_threadIndex;
+
+	const EVP_CIPHER *evpCipher(Cipher cipher)
+	{
+		switch (cipher)
+		{
+			case Cipher::ChaCha20Poly1305:
+				return EVP_chacha20_poly1305();
+			case Cipher::Aes256Gcm:
+				return EVP_aes_256_gcm();
+			case Cipher::None:
+				break;
+		}
+
+		return nullptr;
+	}
+
+	void makeNonce(std::uint64_t counter, std::uint8_t *nonce)
+	{
+		std::fill(nonce, nonce + NONCE_SIZE - COUNTER_SIZE, 0);
+		for (std::size_t i = 0; i < COUNTER_SIZE; ++i)
+		{
+			nonce[NONCE_SIZE - 1 - i] = std::uint8_t(counter >> (8 * i));
+		}
+	}
+}
+
+/*!
+ * \brief Cipher contexts of a thread, keyed once so that each packet only
+ *        needs its nonce set.
+ */
+struct Aead::Context
+{
+	Context(const EVP_CIPHER *cipher, const AeadKey &key) :
+	   encryption(EVP_CIPHER_CTX_new()),
+	   decryption(EVP_CIPHER_CTX_new())
+	{
+		if (!encryption || !decryption ||
+		    EVP_EncryptInit_ex(encryption, cipher, nullptr, key.data(),
+		                       nullptr) != 1 ||
+		    EVP_DecryptInit_ex(decryption, cipher, nullptr, key.data(),
+		                       nullptr) != 1)
+		{
+			EVP_CIPHER_CTX_free(encryption);
+			EVP_CIPHER_CTX_free(decryption);
+			throw AeadException("failed to set up cipher context");
+		}
+	}
+
+	~Context()
+	{
+		EVP_CIPHER_CTX_free(encryption);
+		EVP_CIPHER_CTX_free(decryption);
+	}
+
+	EVP_CIPHER_CTX *encryption;
+	EVP_CIPHER_CTX *decryption;
+};
+
+AeadException::AeadException(const std::string &what) :
+   Exception(what)
+{
+}
+
+Aead::Aead(Cipher cipher, const AeadKey &key, std::uint32_t keyIndex) :
+   m_cipher(cipher),
+   m_key(key),
+   m_keyIndex(keyIndex),
+   m_nextCounter(0),
+   m_contexts(new std::unique_ptr<Context>[MAXIMUM_THREADS])
+{
+	if (!evpCipher(cipher))
+	{
+		throw AeadException(std::string("cipher not available: ") +
+		                    toString(cipher));
+	}
+}
+
+Aead::~Aead()
+{
+}
+
+std::size_t Aead::seal(const SharedBuffer *packets, std::size_t count,
+                       SharedBuffer *messages)
+{
+	std::unique_ptr<Context> temporary;
+	EVP_CIPHER_CTX *encryption = context(temporary).encryption;
+
+	// Reserve the whole batch's counters at once
+	std::uint64_t counter = m_nextCounter.fetch_add(count,
+	                                                std::memory_order_relaxed);
+
+	std::size_t sealed = 0;
+	for (std::size_t i = 0; i < count; ++i, ++counter)
+	{
+		// The packet may be replaced by its message
+		SharedBuffer packet = packets[i];
+		messages[i] = SharedBuffer();
+		if (counter >= MAXIMUM_MESSAGES)
+		{
+			continue;
+		}
+
+		SharedBuffer message(packet.size() + AEAD_OVERHEAD);
+		message.times() = packet.times();
+		std::uint8_t *header = message.data();
+		header[0] = AEAD_MESSAGE_TYPE;
+		header[1] = header[2] = header[3] = 0;
+		for (std::size_t j = 0; j < 4; ++j)
+		{
+			header[4 + j] = std::uint8_t(m_keyIndex >> (24 - 8 * j));
+		}
+
+		std::uint8_t nonce[NONCE_SIZE];
+		makeNonce(counter, nonce);
+		std::copy(nonce + NONCE_SIZE - COUNTER_SIZE, nonce + NONCE_SIZE,
+		          header + AEAD_COUNTER_OFFSET);
+
+		std::uint8_t *ciphertext = message.data() + AEAD_HEADER_SIZE;
+		int length = 0;
+		int finalLength = 0;
+		if (EVP_EncryptInit_ex(encryption, nullptr, nullptr, nullptr,
+		                       nonce) != 1 ||
+		    EVP_EncryptUpdate(encryption, nullptr, &length, header,
+		                      AEAD_COUNTER_OFFSET) != 1 ||
+		    EVP_EncryptUpdate(encryption, ciphertext, &length, packet.data(),
+		                      int(packet.size())) != 1 ||
+		    EVP_EncryptFinal_ex(encryption, ciphertext + length,
+		                        &finalLength) != 1 ||
+		    EVP_CIPHER_CTX_ctrl(encryption, EVP_CTRL_AEAD_GET_TAG,
+		                        int(AEAD_TAG_SIZE),
+		                        ciphertext + packet.size()) != 1)
+		{
+			continue;
+		}
+
+		messages[i] = message;
+		++sealed;
+	}
+
+	return sealed;
+}
+
+std::size_t Aead::open(const SharedBuffer *messages, std::size_t count,
+                       SharedBuffer *packets, std::uint64_t *counters)
+{
+	std::unique_ptr<Context> temporary;
+	EVP_CIPHER_CTX *decryption = context(temporary).decryption;
+
+	std::size_t opened = 0;
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		// The message may be replaced by its packet
+		SharedBuffer message = messages[i];
+		packets[i] = SharedBuffer();
+		counters[i] = 0;
+		if (message.size() < AEAD_OVERHEAD)
+		{
+			continue;
+		}
+
+		std::uint64_t counter = 0;
+		for (std::size_t j = AEAD_COUNTER_OFFSET; j < AEAD_HEADER_SIZE; ++j)
+		{
+			counter = (counter << 8) | message[j];
+		}
+
+		std::uint8_t nonce[NONCE_SIZE];
+		makeNonce(counter, nonce);
+
+		std::size_t size = message.size() - AEAD_OVERHEAD;
+		std::uint8_t *text = message.data() + AEAD_HEADER_SIZE;
+		std::uint8_t tag[AEAD_TAG_SIZE];
+		std::copy(text + size, text + size + AEAD_TAG_SIZE, tag);
+
+		// Decrypt in place
+		int length = 0;
+		int finalLength = 0;
+		if (EVP_DecryptInit_ex(decryption, nullptr, nullptr, nullptr,
+		                       nonce) != 1 ||
+		    EVP_CIPHER_CTX_ctrl(decryption, EVP_CTRL_AEAD_SET_TAG,
+		                        int(AEAD_TAG_SIZE), tag) != 1 ||
+		    EVP_DecryptUpdate(decryption, nullptr, &length, message.data(),
+		                      AEAD_COUNTER_OFFSET) != 1 ||
+		    EVP_DecryptUpdate(decryption, text, &length, text,
+		                      int(size)) != 1 ||
+		    EVP_DecryptFinal_ex(decryption, text + length,
+		                        &finalLength) != 1)
+		{
+			continue;
+		}
+
+		message.trimFront(AEAD_HEADER_SIZE);
+		message.resize(size);
+		packets[i] = message;
+		counters[i] = counter;
+		++opened;
+	}
+
+	return opened;
+}
+
+Aead::Context &Aead::context(std::unique_ptr<Context> &temporary)
+{
+	std::size_t index = t_threadIndex.index();
+	std::unique_ptr<Context> &slot = index < MAXIMUM_THREADS ?
+	                                 m_contexts[index] : temporary;
+	if (!slot)
+	{
+		slot.reset(new Context(evpCipher(m_cipher), m_key));
+	}
+
+	return *slot;
+}
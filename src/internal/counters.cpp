@@ -0,0 +1,205 @@
+#include <map>
+#include <new>
+#include <mutex>
+#include <vector>
+#include <cstdlib>
+
+#include "internal/counters.h"
+
+using namespace Overpass;
+using namespace Overpass::internal;
+
+namespace
+{
+	const std::size_t CACHE_LINE_SIZE = 64;
+
+	/*!
+	 * \brief Every thread's cells, and which cells belong to which set.
+	 *
+	 * Leaked on purpose: threads may still be exiting during static
+	 * destruction.
+	 */
+	struct CounterRegistry
+	{
+		std::mutex mutex;
+
+		// Cells of every thread that ever counted, and those of the threads
+		// that have exited since (waiting to be handed down).
+		CounterThread *threads = nullptr;
+		std::vector<CounterThread*> orphans;
+
+		// First cell never used yet, and ranges of cells released, by
+		// length.
+		std::size_t nextCell = 0;
+		std::map<std::size_t, std::vector<std::size_t>> released;
+	};
+
+	CounterRegistry &registry()
+	{
+		static CounterRegistry *registry = new CounterRegistry;
+		return *registry;
+	}
+
+	/*!
+	 * \brief Takes cells for the thread on construction, and hands them
+	 *        down when the thread exits.
+	 */
+	struct ThreadCells
+	{
+		ThreadCells()
+		{
+			CounterRegistry &counters = registry();
+			std::lock_guard<std::mutex> lock(counters.mutex);
+			if (!counters.orphans.empty())
+			{
+				thread = counters.orphans.back();
+				counters.orphans.pop_back();
+				return;
+			}
+
+			thread = new CounterThread;
+			for (auto &page : thread->pages)
+			{
+				page.store(nullptr, std::memory_order_relaxed);
+			}
+
+			thread->next = counters.threads;
+			counters.threads = thread;
+		}
+
+		~ThreadCells()
+		{
+			CounterRegistry &counters = registry();
+			std::lock_guard<std::mutex> lock(counters.mutex);
+			counters.orphans.push_back(thread);
+		}
+
+		CounterThread *thread;
+	};
+}
+
+thread_local CounterThread *internal::t_counterThread = nullptr;
+
+CounterThread &internal::addCounterThread()
+{
+	// Hands the cells down when the thread exits (t_counterThread itself
+	// needs no destruction, so counting never checks whether it's been
+	// constructed).
+	thread_local ThreadCells t_cells;
+	t_counterThread = t_cells.thread;
+	return *t_cells.thread;
+}
+
+CounterPage &internal::addCounterPage(CounterThread &thread, std::size_t page)
+{
+	// Aligned so that no other thread's data shares its cache lines.
+	void *memory;
+	if (posix_memalign(&memory, CACHE_LINE_SIZE, sizeof(CounterPage)) != 0)
+	{
+		throw std::bad_alloc();
+	}
+
+	CounterPage *cells = new (memory) CounterPage;
+	for (auto &cell : cells->cells)
+	{
+		cell.store(0, std::memory_order_relaxed);
+	}
+
+	// Readers may find it as soon as it's there.
+	thread.pages[page].store(cells, std::memory_order_release);
+	return *cells;
+}
+
+Counters::Counters(std::size_t count) :
+   m_first(0),
+   m_count(count)
+{
+	CounterRegistry &counters = registry();
+	std::lock_guard<std::mutex> lock(counters.mutex);
+	std::vector<std::size_t> &released = counters.released[count];
+	if (!released.empty())
+	{
+		m_first = released.back();
+		released.pop_back();
+		return;
+	}
+
+	if (counters.nextCell + count > COUNTER_PAGES * COUNTER_PAGE_CELLS)
+	{
+		throw Exception("out of counters.");
+	}
+
+	m_first = counters.nextCell;
+	counters.nextCell += count;
+}
+
+Counters::~Counters()
+{
+	// Nothing counts in the cells anymore, so they can be zeroed for the
+	// next set.
+	CounterRegistry &counters = registry();
+	std::lock_guard<std::mutex> lock(counters.mutex);
+	for (CounterThread *thread = counters.threads; thread;
+	     thread = thread->next)
+	{
+		for (std::size_t cell = m_first; cell < m_first + m_count; ++cell)
+		{
+			CounterPage *page = thread->pages[cell / COUNTER_PAGE_CELLS].load(
+			                       std::memory_order_acquire);
+			if (page)
+			{
+				page->cells[cell % COUNTER_PAGE_CELLS].store(
+				      0, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	counters.released[m_count].push_back(m_first);
+}
+
+std::uint64_t Counters::value(std::size_t counter) const
+{
+	std::size_t cell = m_first + counter;
+	std::uint64_t total = 0;
+
+	CounterRegistry &counters = registry();
+	std::lock_guard<std::mutex> lock(counters.mutex);
+	for (CounterThread *thread = counters.threads; thread;
+	     thread = thread->next)
+	{
+		CounterPage *page = thread->pages[cell / COUNTER_PAGE_CELLS].load(
+		                       std::memory_order_acquire);
+		if (page)
+		{
+			total += page->cells[cell % COUNTER_PAGE_CELLS].load(
+			            std::memory_order_relaxed);
+		}
+	}
+
+	return total;
+}
+
+std::vector<std::uint64_t> Counters::values() const
+{
+	std::vector<std::uint64_t> totals(m_count, 0);
+
+	CounterRegistry &counters = registry();
+	std::lock_guard<std::mutex> lock(counters.mutex);
+	for (CounterThread *thread = counters.threads; thread;
+	     thread = thread->next)
+	{
+		for (std::size_t counter = 0; counter < m_count; ++counter)
+		{
+			std::size_t cell = m_first + counter;
+			CounterPage *page = thread->pages[cell / COUNTER_PAGE_CELLS].load(
+			                       std::memory_order_acquire);
+			if (page)
+			{
+				totals[counter] += page->cells[cell % COUNTER_PAGE_CELLS].load(
+				                      std::memory_order_relaxed);
+			}
+		}
+	}
+
+	return totals;
+}
@@ -0,0 +1,392 @@
+#include <sys/socket.h>
+#include <netinet/udp.h>
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include <boost/asio/error.hpp>
+
+#include "internal/datagram_batch_operations.h"
+
+using namespace Overpass;
+
+namespace
+{
+	// Scratch space for the message headers handed to the kernel. These are
+	// only ever grown, so once warmed up batching doesn't allocate.
+	thread_local std::vector<mmsghdr> t_messages;
+	thread_local std::vector<iovec> t_vectors;
+
+	void prepareScratch(std::size_t size)
+	{
+		if (t_messages.size() < size)
+		{
+			t_messages.resize(size);
+			t_vectors.resize(size);
+		}
+	}
+
+	boost::system::error_code lastError()
+	{
+		return boost::system::error_code(errno,
+		                                 boost::system::system_category());
+	}
+
+	// Segmented sends and coalesced receives need their own scratch space,
+	// as they may fall back to the plain versions above midway. Control
+	// messages are kept in words so they're suitably aligned.
+	thread_local std::vector<mmsghdr> t_segmentMessages;
+	thread_local std::vector<iovec> t_segmentVectors;
+	thread_local std::vector<std::size_t> t_segmentCounts;
+	thread_local std::vector<std::uint64_t> t_control;
+	thread_local DatagramBatch<boost::asio::ip::udp::endpoint> t_split;
+
+	const std::size_t CONTROL_WORDS = (CMSG_SPACE(sizeof(int)) + 7) / 8;
+
+	// The kernel's limits on a segmented send: at most 64 segments, and no
+	// more than fits a UDP datagram (over IPv4).
+	const std::size_t MAXIMUM_SEGMENTS = 64;
+	const std::size_t MAXIMUM_SEGMENTED_SIZE = 65507;
+
+	void prepareSegmentScratch(std::size_t size)
+	{
+		if (t_segmentMessages.size() < size)
+		{
+			t_segmentMessages.resize(size);
+			t_segmentVectors.resize(size);
+			t_segmentCounts.resize(size);
+			t_control.resize(size * CONTROL_WORDS);
+		}
+	}
+
+	/*!
+	 * \brief Obtain the size of the datagrams the kernel coalesced into a
+	 *        received one (0 if it didn't).
+	 */
+	std::size_t coalescedSize(msghdr &header)
+	{
+		for (cmsghdr *message = CMSG_FIRSTHDR(&header); message;
+		     message = CMSG_NXTHDR(&header, message))
+		{
+			if (message->cmsg_level == SOL_UDP && message->cmsg_type == UDP_GRO)
+			{
+				int size;
+				std::memcpy(&size, CMSG_DATA(message), sizeof(size));
+				return size > 0 ? size : 0;
+			}
+		}
+
+		return 0;
+	}
+}
+
+std::size_t internal::receiveDatagrams(
+      boost::asio::ip::udp::socket &socket,
+      DatagramBatch<boost::asio::ip::udp::endpoint> &batch,
+      boost::system::error_code &error)
+{
+	prepareScratch(batch.size());
+
+	for (std::size_t i = 0; i < batch.size(); ++i)
+	{
+		Datagram<boost::asio::ip::udp::endpoint> &datagram = batch[i];
+		t_vectors[i].iov_base = datagram.buffer.data();
+		t_vectors[i].iov_len = datagram.buffer.size();
+
+		msghdr &header = t_messages[i].msg_hdr;
+		header = msghdr();
+		header.msg_name = datagram.endpoint.data();
+		header.msg_namelen = datagram.endpoint.capacity();
+		header.msg_iov = &t_vectors[i];
+		header.msg_iovlen = 1;
+	}
+
+	int received;
+	do
+	{
+		received = recvmmsg(socket.native_handle(), t_messages.data(),
+		                    batch.size(), MSG_DONTWAIT, nullptr);
+	} while (received < 0 && errno == EINTR);
+
+	if (received < 0)
+	{
+		error = lastError();
+		return 0;
+	}
+
+	for (int i = 0; i < received; ++i)
+	{
+		batch[i].buffer.resize(t_messages[i].msg_len);
+		batch[i].endpoint.resize(t_messages[i].msg_hdr.msg_namelen);
+	}
+
+	error = boost::system::error_code();
+	return received;
+}
+
+bool internal::sendDatagram(boost::asio::ip::udp::socket &socket,
+                            const boost::asio::ip::udp::endpoint &destination,
+                            const SharedBuffer &buffer,
+                            boost::system::error_code &error)
+{
+	ssize_t result;
+	do
+	{
+		result = sendto(socket.native_handle(), buffer.data(), buffer.size(),
+		                MSG_DONTWAIT, destination.data(), destination.size());
+	} while (result < 0 && errno == EINTR);
+
+	if (result < 0)
+	{
+		error = lastError();
+		return false;
+	}
+
+	error = boost::system::error_code();
+	return true;
+}
+
+std::size_t internal::sendDatagrams(
+      boost::asio::ip::udp::socket &socket,
+      const Datagram<boost::asio::ip::udp::endpoint> *datagrams,
+      std::size_t count, boost::system::error_code &error)
+{
+	prepareScratch(count);
+
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		const Datagram<boost::asio::ip::udp::endpoint> &datagram = datagrams[i];
+		t_vectors[i].iov_base = datagram.buffer.data();
+		t_vectors[i].iov_len = datagram.buffer.size();
+
+		msghdr &header = t_messages[i].msg_hdr;
+		header = msghdr();
+		header.msg_name = const_cast<sockaddr*>(datagram.endpoint.data());
+		header.msg_namelen = datagram.endpoint.size();
+		header.msg_iov = &t_vectors[i];
+		header.msg_iovlen = 1;
+	}
+
+	std::size_t sent = 0;
+	while (sent < count)
+	{
+		int result = sendmmsg(socket.native_handle(), t_messages.data() + sent,
+		                      count - sent, MSG_DONTWAIT);
+		if (result >= 0)
+		{
+			sent += result;
+			continue;
+		}
+
+		if (errno == EINTR)
+		{
+			continue;
+		}
+
+		error = lastError();
+		return sent;
+	}
+
+	error = boost::system::error_code();
+	return sent;
+}
+
+bool internal::supportsSegmentation(boost::asio::ip::udp::socket &socket)
+{
+	int size = 0;
+	socklen_t length = sizeof(size);
+	return getsockopt(socket.native_handle(), SOL_UDP, UDP_SEGMENT, &size,
+	                  &length) == 0;
+}
+
+bool internal::enableReceiveCoalescing(boost::asio::ip::udp::socket &socket)
+{
+	int enable = 1;
+	return setsockopt(socket.native_handle(), SOL_UDP, UDP_GRO, &enable,
+	                  sizeof(enable)) == 0;
+}
+
+std::size_t internal::receiveCoalescedDatagrams(
+      boost::asio::ip::udp::socket &socket,
+      DatagramBatch<boost::asio::ip::udp::endpoint> &batch,
+      boost::system::error_code &error)
+{
+	prepareSegmentScratch(batch.size());
+
+	for (std::size_t i = 0; i < batch.size(); ++i)
+	{
+		Datagram<boost::asio::ip::udp::endpoint> &datagram = batch[i];
+		t_segmentVectors[i].iov_base = datagram.buffer.data();
+		t_segmentVectors[i].iov_len = datagram.buffer.size();
+
+		msghdr &header = t_segmentMessages[i].msg_hdr;
+		header = msghdr();
+		header.msg_name = datagram.endpoint.data();
+		header.msg_namelen = datagram.endpoint.capacity();
+		header.msg_iov = &t_segmentVectors[i];
+		header.msg_iovlen = 1;
+		header.msg_control = &t_control[i * CONTROL_WORDS];
+		header.msg_controllen = CONTROL_WORDS * 8;
+	}
+
+	int received;
+	do
+	{
+		received = recvmmsg(socket.native_handle(), t_segmentMessages.data(),
+		                    batch.size(), MSG_DONTWAIT, nullptr);
+	} while (received < 0 && errno == EINTR);
+
+	if (received < 0)
+	{
+		error = lastError();
+		return 0;
+	}
+
+	// Split coalesced datagrams into views of their buffer.
+	t_split.clear();
+	for (int i = 0; i < received; ++i)
+	{
+		Datagram<boost::asio::ip::udp::endpoint> &datagram = batch[i];
+		datagram.endpoint.resize(t_segmentMessages[i].msg_hdr.msg_namelen);
+
+		std::size_t size = t_segmentMessages[i].msg_len;
+		std::size_t segmentSize = coalescedSize(t_segmentMessages[i].msg_hdr);
+		if (segmentSize == 0 || segmentSize >= size)
+		{
+			datagram.buffer.resize(size);
+			t_split.push_back(std::move(datagram));
+			continue;
+		}
+
+		for (std::size_t offset = 0; offset < size; offset += segmentSize)
+		{
+			SharedBuffer segment(datagram.buffer);
+			segment.trimFront(offset);
+			segment.resize(std::min(segmentSize, size - offset));
+			t_split.push_back(Datagram<boost::asio::ip::udp::endpoint>{
+			                     datagram.endpoint, std::move(segment)});
+		}
+	}
+
+	std::size_t count = t_split.size();
+
+	// Slots that weren't filled keep their buffers.
+	for (std::size_t i = received; i < batch.size(); ++i)
+	{
+		t_split.push_back(std::move(batch[i]));
+	}
+
+	batch.swap(t_split);
+	t_split.clear();
+
+	error = boost::system::error_code();
+	return count;
+}
+
+std::size_t internal::sendSegmentedDatagrams(
+      boost::asio::ip::udp::socket &socket,
+      const Datagram<boost::asio::ip::udp::endpoint> *datagrams,
+      std::size_t count, boost::system::error_code &error)
+{
+	prepareSegmentScratch(count);
+
+	// Group consecutive datagrams the kernel can split back apart: same
+	// destination, and the same size, except for a shorter last one.
+	std::size_t messages = 0;
+	for (std::size_t first = 0; first < count; ++messages)
+	{
+		const Datagram<boost::asio::ip::udp::endpoint> &datagram =
+		      datagrams[first];
+		std::size_t segmentSize = datagram.buffer.size();
+		std::size_t total = segmentSize;
+		std::size_t last = first + 1;
+		while (segmentSize > 0 && last < count &&
+		       last - first < MAXIMUM_SEGMENTS &&
+		       datagrams[last].buffer.size() <= segmentSize &&
+		       total + datagrams[last].buffer.size() <= MAXIMUM_SEGMENTED_SIZE &&
+		       datagrams[last].endpoint == datagram.endpoint)
+		{
+			total += datagrams[last].buffer.size();
+			if (datagrams[last++].buffer.size() < segmentSize)
+			{
+				break;
+			}
+		}
+
+		for (std::size_t i = first; i < last; ++i)
+		{
+			t_segmentVectors[i].iov_base = datagrams[i].buffer.data();
+			t_segmentVectors[i].iov_len = datagrams[i].buffer.size();
+		}
+
+		msghdr &header = t_segmentMessages[messages].msg_hdr;
+		header = msghdr();
+		header.msg_name = const_cast<sockaddr*>(datagram.endpoint.data());
+		header.msg_namelen = datagram.endpoint.size();
+		header.msg_iov = &t_segmentVectors[first];
+		header.msg_iovlen = last - first;
+
+		if (last - first > 1)
+		{
+			header.msg_control = &t_control[messages * CONTROL_WORDS];
+			header.msg_controllen = CMSG_SPACE(sizeof(std::uint16_t));
+
+			cmsghdr *message = CMSG_FIRSTHDR(&header);
+			message->cmsg_level = SOL_UDP;
+			message->cmsg_type = UDP_SEGMENT;
+			message->cmsg_len = CMSG_LEN(sizeof(std::uint16_t));
+
+			std::uint16_t size = segmentSize;
+			std::memcpy(CMSG_DATA(message), &size, sizeof(size));
+		}
+
+		t_segmentCounts[messages] = last - first;
+		first = last;
+	}
+
+	std::size_t sentMessages = 0;
+	std::size_t sent = 0;
+	while (sentMessages < messages)
+	{
+		int result = sendmmsg(socket.native_handle(),
+		                      t_segmentMessages.data() + sentMessages,
+		                      messages - sentMessages, MSG_DONTWAIT);
+		if (result >= 0)
+		{
+			for (int i = 0; i < result; ++i)
+			{
+				sent += t_segmentCounts[sentMessages++];
+			}
+
+			continue;
+		}
+
+		if (errno == EINTR)
+		{
+			continue;
+		}
+
+		std::size_t segments = t_segmentCounts[sentMessages];
+		if (segments == 1 || errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			error = lastError();
+			return sent;
+		}
+
+		// The kernel refused to split these (e.g. the route's device can't
+		// checksum them): send them one by one instead.
+		std::size_t done = sendDatagrams(socket, datagrams + sent, segments,
+		                                 error);
+		sent += done;
+		if (error)
+		{
+			return sent;
+		}
+
+		++sentMessages;
+	}
+
+	error = boost::system::error_code();
+	return sent;
+}
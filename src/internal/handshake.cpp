@@ -0,0 +1,701 @@
+#include <cstring>
+#include <algorithm>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "internal/handshake.h"
+
+using namespace Overpass;
+using namespace Overpass::internal;
+
+namespace
+{
+	const char PROTOCOL_NAME[] = "Noise_NNpsk0_25519_ChaChaPoly_SHA256";
+	const char PROLOGUE[] = "overpass handshake v1";
+	const char MAC_LABEL[] = "mac1----";
+	const char COOKIE_LABEL[] = "cookie--";
+
+	const std::size_t HASH_SIZE = 32;
+	const std::size_t PUBLIC_KEY_SIZE = 32;
+	const std::size_t TAG_SIZE = 16;
+	const std::size_t NONCE_SIZE = 12;
+	const std::size_t TIMESTAMP_SIZE = 8;
+
+	// Initiation layout.
+	const std::size_t INITIATION_SENDER = 4;
+	const std::size_t INITIATION_EPHEMERAL = 8;
+	const std::size_t INITIATION_TIMESTAMP = 40;
+	const std::size_t INITIATION_MAC1 = 64;
+
+	// Response layout.
+	const std::size_t RESPONSE_SENDER = 4;
+	const std::size_t RESPONSE_RECEIVER = 8;
+	const std::size_t RESPONSE_EPHEMERAL = 12;
+	const std::size_t RESPONSE_EMPTY = 44;
+	const std::size_t RESPONSE_MAC1 = 60;
+
+	// Cookie reply layout.
+	const std::size_t COOKIE_RECEIVER = 4;
+	const std::size_t COOKIE_NONCE = 8;
+	const std::size_t COOKIE_ENCRYPTED = 20;
+
+	typedef std::array<std::uint8_t, HASH_SIZE> Hash;
+
+	struct PkeyDeleter
+	{
+		void operator()(EVP_PKEY *key) const
+		{
+			EVP_PKEY_free(key);
+		}
+	};
+
+	struct PkeyContextDeleter
+	{
+		void operator()(EVP_PKEY_CTX *context) const
+		{
+			EVP_PKEY_CTX_free(context);
+		}
+	};
+
+	struct CipherContextDeleter
+	{
+		void operator()(EVP_CIPHER_CTX *context) const
+		{
+			EVP_CIPHER_CTX_free(context);
+		}
+	};
+
+	typedef std::unique_ptr<EVP_PKEY, PkeyDeleter> Pkey;
+	typedef std::unique_ptr<EVP_PKEY_CTX, PkeyContextDeleter> PkeyContext;
+	typedef std::unique_ptr<EVP_CIPHER_CTX, CipherContextDeleter> CipherContext;
+
+	void writeIndex(std::uint8_t *data, std::uint32_t index)
+	{
+		for (std::size_t i = 0; i < 4; ++i)
+		{
+			data[i] = std::uint8_t(index >> (24 - 8 * i));
+		}
+	}
+
+	std::uint32_t readIndex(const std::uint8_t *data)
+	{
+		return (std::uint32_t(data[0]) << 24) | (std::uint32_t(data[1]) << 16) |
+		       (std::uint32_t(data[2]) << 8) | data[3];
+	}
+
+	Hash hash(const std::uint8_t *first, std::size_t firstSize,
+	          const std::uint8_t *second = nullptr, std::size_t secondSize = 0)
+	{
+		Hash result;
+		EVP_MD_CTX *context = EVP_MD_CTX_new();
+		if (!context ||
+		    EVP_DigestInit_ex(context, EVP_sha256(), nullptr) != 1 ||
+		    EVP_DigestUpdate(context, first, firstSize) != 1 ||
+		    (secondSize > 0 &&
+		     EVP_DigestUpdate(context, second, secondSize) != 1) ||
+		    EVP_DigestFinal_ex(context, result.data(), nullptr) != 1)
+		{
+			EVP_MD_CTX_free(context);
+			throw HandshakeException("failed to hash");
+		}
+
+		EVP_MD_CTX_free(context);
+		return result;
+	}
+
+	Hash hmac(const std::uint8_t *key, std::size_t keySize,
+	          const std::uint8_t *data, std::size_t size)
+	{
+		Hash result;
+		unsigned int resultSize = 0;
+		if (!HMAC(EVP_sha256(), key, int(keySize), data, size, result.data(),
+		          &resultSize))
+		{
+			throw HandshakeException("failed to compute HMAC");
+		}
+
+		return result;
+	}
+
+	Mac truncatedHmac(const std::uint8_t *key, std::size_t keySize,
+	                  const std::uint8_t *data, std::size_t size)
+	{
+		Hash full = hmac(key, keySize, data, size);
+		Mac mac;
+		std::copy(full.begin(), full.begin() + MAC_SIZE, mac.begin());
+		return mac;
+	}
+
+	bool equal(const std::uint8_t *first, const std::uint8_t *second,
+	           std::size_t size)
+	{
+		return CRYPTO_memcmp(first, second, size) == 0;
+	}
+
+	/*!
+	 * \brief ChaCha20-Poly1305 encryption (or decryption, checking the tag
+	 *        after the input) with associated data.
+	 *
+	 * \return Whether or not it worked (i.e. the input is authentic).
+	 */
+	bool chachaPoly(bool encrypt, const std::uint8_t *key,
+	                const std::uint8_t *nonce, const std::uint8_t *ad,
+	                std::size_t adSize, const std::uint8_t *input,
+	                std::size_t size, std::uint8_t *output)
+	{
+		CipherContext context(EVP_CIPHER_CTX_new());
+		int length = 0;
+		if (!context ||
+		    EVP_CipherInit_ex(context.get(), EVP_chacha20_poly1305(), nullptr,
+		                      key, nonce, encrypt ? 1 : 0) != 1)
+		{
+			return false;
+		}
+
+		if (!encrypt)
+		{
+			std::uint8_t tag[TAG_SIZE];
+			std::copy(input + size, input + size + TAG_SIZE, tag);
+			if (EVP_CIPHER_CTX_ctrl(context.get(), EVP_CTRL_AEAD_SET_TAG,
+			                        int(TAG_SIZE), tag) != 1)
+			{
+				return false;
+			}
+		}
+
+		if ((adSize > 0 &&
+		     EVP_CipherUpdate(context.get(), nullptr, &length, ad,
+		                      int(adSize)) != 1) ||
+		    (size > 0 &&
+		     EVP_CipherUpdate(context.get(), output, &length, input,
+		                      int(size)) != 1) ||
+		    EVP_CipherFinal_ex(context.get(), output + size, &length) != 1)
+		{
+			return false;
+		}
+
+		return !encrypt ||
+		       EVP_CIPHER_CTX_ctrl(context.get(), EVP_CTRL_AEAD_GET_TAG,
+		                           int(TAG_SIZE), output + size) == 1;
+	}
+
+	Pkey generateKey()
+	{
+		PkeyContext context(EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr));
+		EVP_PKEY *key = nullptr;
+		if (!context || EVP_PKEY_keygen_init(context.get()) != 1 ||
+		    EVP_PKEY_keygen(context.get(), &key) != 1)
+		{
+			throw HandshakeException("failed to generate an ephemeral key");
+		}
+
+		return Pkey(key);
+	}
+
+	void publicKey(EVP_PKEY *key, std::uint8_t *output)
+	{
+		std::size_t size = PUBLIC_KEY_SIZE;
+		if (EVP_PKEY_get_raw_public_key(key, output, &size) != 1 ||
+		    size != PUBLIC_KEY_SIZE)
+		{
+			throw HandshakeException("failed to obtain a public key");
+		}
+	}
+
+	/*!
+	 * \brief X25519. Fails on low-order points (an all-zero result).
+	 */
+	bool diffieHellman(EVP_PKEY *key, const std::uint8_t *peerPublicKey,
+	                   AeadKey &shared)
+	{
+		Pkey peer(EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr,
+		                                      peerPublicKey, PUBLIC_KEY_SIZE));
+		PkeyContext context(EVP_PKEY_CTX_new(key, nullptr));
+		std::size_t size = shared.size();
+		return peer && context && EVP_PKEY_derive_init(context.get()) == 1 &&
+		       EVP_PKEY_derive_set_peer(context.get(), peer.get()) == 1 &&
+		       EVP_PKEY_derive(context.get(), shared.data(), &size) == 1 &&
+		       size == shared.size();
+	}
+
+	/*!
+	 * \brief Noise's SymmetricState, with SHA-256 and ChaChaPoly.
+	 */
+	class SymmetricState
+	{
+		public:
+			void initialize()
+			{
+				std::size_t size = sizeof(PROTOCOL_NAME) - 1;
+				m_hash = hash(reinterpret_cast<const std::uint8_t*>(PROTOCOL_NAME),
+				              size);
+				m_chainingKey = m_hash;
+				m_hasKey = false;
+				m_nonce = 0;
+				mixHash(reinterpret_cast<const std::uint8_t*>(PROLOGUE),
+				        sizeof(PROLOGUE) - 1);
+			}
+
+			void mixHash(const std::uint8_t *data, std::size_t size)
+			{
+				m_hash = hash(m_hash.data(), m_hash.size(), data, size);
+			}
+
+			void mixKey(const std::uint8_t *input, std::size_t size)
+			{
+				Hash outputs[2];
+				hkdf(input, size, outputs, 2);
+				m_chainingKey = outputs[0];
+				setKey(outputs[1]);
+			}
+
+			void mixKeyAndHash(const std::uint8_t *input, std::size_t size)
+			{
+				Hash outputs[3];
+				hkdf(input, size, outputs, 3);
+				m_chainingKey = outputs[0];
+				mixHash(outputs[1].data(), outputs[1].size());
+				setKey(outputs[2]);
+			}
+
+			bool encryptAndHash(const std::uint8_t *plaintext, std::size_t size,
+			                    std::uint8_t *output)
+			{
+				std::uint8_t nonce[NONCE_SIZE];
+				makeNonce(nonce);
+				if (!m_hasKey ||
+				    !chachaPoly(true, m_key.data(), nonce, m_hash.data(),
+				                m_hash.size(), plaintext, size, output))
+				{
+					return false;
+				}
+
+				++m_nonce;
+				mixHash(output, size + TAG_SIZE);
+				return true;
+			}
+
+			bool decryptAndHash(const std::uint8_t *ciphertext, std::size_t size,
+			                    std::uint8_t *output)
+			{
+				std::uint8_t nonce[NONCE_SIZE];
+				makeNonce(nonce);
+				if (!m_hasKey ||
+				    !chachaPoly(false, m_key.data(), nonce, m_hash.data(),
+				                m_hash.size(), ciphertext, size, output))
+				{
+					return false;
+				}
+
+				++m_nonce;
+				mixHash(ciphertext, size + TAG_SIZE);
+				return true;
+			}
+
+			void split(AeadKey &first, AeadKey &second) const
+			{
+				Hash outputs[2];
+				hkdf(nullptr, 0, outputs, 2);
+				std::copy(outputs[0].begin(), outputs[0].end(), first.begin());
+				std::copy(outputs[1].begin(), outputs[1].end(), second.begin());
+			}
+
+		private:
+			void hkdf(const std::uint8_t *input, std::size_t size,
+			          Hash *outputs, std::size_t count) const
+			{
+				Hash key = hmac(m_chainingKey.data(), m_chainingKey.size(),
+				                input, size);
+
+				std::uint8_t block[HASH_SIZE + 1];
+				std::size_t blockSize = 0;
+				for (std::size_t i = 0; i < count; ++i)
+				{
+					block[blockSize++] = std::uint8_t(i + 1);
+					outputs[i] = hmac(key.data(), key.size(), block, blockSize);
+					std::copy(outputs[i].begin(), outputs[i].end(), block);
+					blockSize = HASH_SIZE;
+				}
+			}
+
+			void setKey(const Hash &key)
+			{
+				std::copy(key.begin(), key.end(), m_key.begin());
+				m_hasKey = true;
+				m_nonce = 0;
+			}
+
+			void makeNonce(std::uint8_t *nonce) const
+			{
+				// 32 zero bits, then the counter in little endian.
+				std::fill(nonce, nonce + 4, 0);
+				for (std::size_t i = 0; i < 8; ++i)
+				{
+					nonce[4 + i] = std::uint8_t(m_nonce >> (8 * i));
+				}
+			}
+
+		private:
+			Hash m_chainingKey;
+			Hash m_hash;
+			AeadKey m_key;
+			bool m_hasKey;
+			std::uint64_t m_nonce;
+	};
+}
+
+struct HandshakeState::Private
+{
+	SymmetricState symmetric;
+	Pkey ephemeral;
+	std::uint32_t localIndex = 0;
+	std::uint32_t remoteIndex = 0;
+	Mac initiationMac{};
+	std::uint8_t remoteEphemeral[PUBLIC_KEY_SIZE];
+};
+
+HandshakeException::HandshakeException(const std::string &what) :
+   Exception(what)
+{
+}
+
+HandshakeState::HandshakeState() :
+   m_data(new Private)
+{
+}
+
+HandshakeState::~HandshakeState()
+{
+}
+
+std::uint32_t HandshakeState::localIndex() const
+{
+	return m_data->localIndex;
+}
+
+std::uint32_t HandshakeState::remoteIndex() const
+{
+	return m_data->remoteIndex;
+}
+
+const Mac &HandshakeState::initiationMac() const
+{
+	return m_data->initiationMac;
+}
+
+HandshakeProtocol::HandshakeProtocol(const AeadKey &presharedKey) :
+   m_presharedKey(presharedKey)
+{
+	Hash macKey = hash(reinterpret_cast<const std::uint8_t*>(MAC_LABEL),
+	                   sizeof(MAC_LABEL) - 1, presharedKey.data(),
+	                   presharedKey.size());
+	std::copy(macKey.begin(), macKey.end(), m_macKey.begin());
+}
+
+SharedBuffer HandshakeProtocol::createInitiation(HandshakeState &state,
+                                                 std::uint32_t localIndex,
+                                                 std::uint64_t timestamp,
+                                                 const Cookie *cookie) const
+{
+	HandshakeState::Private &data = *state.m_data;
+	data = HandshakeState::Private();
+	data.localIndex = localIndex;
+
+	SharedBuffer message(HANDSHAKE_INITIATION_SIZE);
+	std::fill(message.begin(), message.end(), 0);
+	message[0] = HANDSHAKE_INITIATION_TYPE;
+	writeIndex(message.data() + INITIATION_SENDER, localIndex);
+
+	// -> psk, e
+	data.symmetric.initialize();
+	data.symmetric.mixKeyAndHash(m_presharedKey.data(), m_presharedKey.size());
+
+	data.ephemeral = generateKey();
+	std::uint8_t *ephemeral = message.data() + INITIATION_EPHEMERAL;
+	publicKey(data.ephemeral.get(), ephemeral);
+	data.symmetric.mixHash(ephemeral, PUBLIC_KEY_SIZE);
+	data.symmetric.mixKey(ephemeral, PUBLIC_KEY_SIZE);
+
+	std::uint8_t payload[TIMESTAMP_SIZE];
+	for (std::size_t i = 0; i < TIMESTAMP_SIZE; ++i)
+	{
+		payload[i] = std::uint8_t(timestamp >> (56 - 8 * i));
+	}
+
+	if (!data.symmetric.encryptAndHash(payload, sizeof(payload),
+	                                   message.data() + INITIATION_TIMESTAMP))
+	{
+		throw HandshakeException("failed to encrypt initiation");
+	}
+
+	writeMacs(message, cookie);
+	std::copy(message.data() + INITIATION_MAC1,
+	          message.data() + INITIATION_MAC1 + MAC_SIZE,
+	          data.initiationMac.begin());
+	return message;
+}
+
+bool HandshakeProtocol::consumeInitiation(const SharedBuffer &message,
+                                          HandshakeState &state,
+                                          std::uint64_t &timestamp) const
+{
+	if (message.size() != HANDSHAKE_INITIATION_SIZE ||
+	    message[0] != HANDSHAKE_INITIATION_TYPE ||
+	    !hasValidMac1(message, INITIATION_MAC1))
+	{
+		return false;
+	}
+
+	HandshakeState::Private &data = *state.m_data;
+	data = HandshakeState::Private();
+	data.remoteIndex = readIndex(message.data() + INITIATION_SENDER);
+
+	// -> psk, e
+	data.symmetric.initialize();
+	data.symmetric.mixKeyAndHash(m_presharedKey.data(), m_presharedKey.size());
+
+	const std::uint8_t *ephemeral = message.data() + INITIATION_EPHEMERAL;
+	std::copy(ephemeral, ephemeral + PUBLIC_KEY_SIZE, data.remoteEphemeral);
+	data.symmetric.mixHash(ephemeral, PUBLIC_KEY_SIZE);
+	data.symmetric.mixKey(ephemeral, PUBLIC_KEY_SIZE);
+
+	std::uint8_t payload[TIMESTAMP_SIZE];
+	if (!data.symmetric.decryptAndHash(message.data() + INITIATION_TIMESTAMP,
+	                                   sizeof(payload), payload))
+	{
+		return false;
+	}
+
+	timestamp = 0;
+	for (std::size_t i = 0; i < TIMESTAMP_SIZE; ++i)
+	{
+		timestamp = (timestamp << 8) | payload[i];
+	}
+
+	return true;
+}
+
+SharedBuffer HandshakeProtocol::createResponse(HandshakeState &state,
+                                               std::uint32_t localIndex,
+                                               SessionKeys &keys) const
+{
+	HandshakeState::Private &data = *state.m_data;
+	data.localIndex = localIndex;
+
+	SharedBuffer message(HANDSHAKE_RESPONSE_SIZE);
+	std::fill(message.begin(), message.end(), 0);
+	message[0] = HANDSHAKE_RESPONSE_TYPE;
+	writeIndex(message.data() + RESPONSE_SENDER, localIndex);
+	writeIndex(message.data() + RESPONSE_RECEIVER, data.remoteIndex);
+
+	// <- e, ee
+	data.ephemeral = generateKey();
+	std::uint8_t *ephemeral = message.data() + RESPONSE_EPHEMERAL;
+	publicKey(data.ephemeral.get(), ephemeral);
+	data.symmetric.mixHash(ephemeral, PUBLIC_KEY_SIZE);
+	data.symmetric.mixKey(ephemeral, PUBLIC_KEY_SIZE);
+
+	AeadKey shared;
+	if (!diffieHellman(data.ephemeral.get(), data.remoteEphemeral, shared))
+	{
+		throw HandshakeException("failed to agree on a key");
+	}
+
+	data.symmetric.mixKey(shared.data(), shared.size());
+
+	if (!data.symmetric.encryptAndHash(nullptr, 0,
+	                                   message.data() + RESPONSE_EMPTY))
+	{
+		throw HandshakeException("failed to encrypt response");
+	}
+
+	writeMacs(message, nullptr);
+
+	// The initiator sends with the first key.
+	data.symmetric.split(keys.receiving, keys.sending);
+	keys.localIndex = data.localIndex;
+	keys.remoteIndex = data.remoteIndex;
+	return message;
+}
+
+bool HandshakeProtocol::consumeResponse(const SharedBuffer &message,
+                                        HandshakeState &state,
+                                        SessionKeys &keys) const
+{
+	HandshakeState::Private &data = *state.m_data;
+	if (message.size() != HANDSHAKE_RESPONSE_SIZE ||
+	    message[0] != HANDSHAKE_RESPONSE_TYPE || !data.ephemeral ||
+	    readIndex(message.data() + RESPONSE_RECEIVER) != data.localIndex ||
+	    !hasValidMac1(message, RESPONSE_MAC1))
+	{
+		return false;
+	}
+
+	// Work on a copy, so a forged response doesn't spoil the handshake for
+	// the genuine one.
+	SymmetricState symmetric(data.symmetric);
+
+	// <- e, ee
+	const std::uint8_t *ephemeral = message.data() + RESPONSE_EPHEMERAL;
+	symmetric.mixHash(ephemeral, PUBLIC_KEY_SIZE);
+	symmetric.mixKey(ephemeral, PUBLIC_KEY_SIZE);
+
+	AeadKey shared;
+	if (!diffieHellman(data.ephemeral.get(), ephemeral, shared))
+	{
+		return false;
+	}
+
+	symmetric.mixKey(shared.data(), shared.size());
+
+	if (!symmetric.decryptAndHash(message.data() + RESPONSE_EMPTY, 0, nullptr))
+	{
+		return false;
+	}
+
+	data.symmetric = symmetric;
+	data.remoteIndex = readIndex(message.data() + RESPONSE_SENDER);
+	data.symmetric.split(keys.sending, keys.receiving);
+	keys.localIndex = data.localIndex;
+	keys.remoteIndex = data.remoteIndex;
+	return true;
+}
+
+SharedBuffer HandshakeProtocol::createCookieReply(const SharedBuffer &message,
+                                                  const Cookie &cookie) const
+{
+	// The cookie is encrypted, and bound to the message's mac1 so that only
+	// whoever sent it (and knows the pre-shared key) can use the reply.
+	std::size_t macOffset = message[0] == HANDSHAKE_INITIATION_TYPE ?
+	                        INITIATION_MAC1 : RESPONSE_MAC1;
+	std::size_t senderOffset = message[0] == HANDSHAKE_INITIATION_TYPE ?
+	                           INITIATION_SENDER : RESPONSE_SENDER;
+
+	SharedBuffer reply(COOKIE_REPLY_SIZE);
+	std::fill(reply.begin(), reply.end(), 0);
+	reply[0] = COOKIE_REPLY_TYPE;
+	std::copy(message.data() + senderOffset, message.data() + senderOffset + 4,
+	          reply.data() + COOKIE_RECEIVER);
+
+	Hash key = hash(reinterpret_cast<const std::uint8_t*>(COOKIE_LABEL),
+	                sizeof(COOKIE_LABEL) - 1, m_presharedKey.data(),
+	                m_presharedKey.size());
+	std::uint8_t *nonce = reply.data() + COOKIE_NONCE;
+	if (RAND_bytes(nonce, int(NONCE_SIZE)) != 1 ||
+	    !chachaPoly(true, key.data(), nonce, message.data() + macOffset,
+	                MAC_SIZE, cookie.data(), cookie.size(),
+	                reply.data() + COOKIE_ENCRYPTED))
+	{
+		throw HandshakeException("failed to encrypt cookie");
+	}
+
+	return reply;
+}
+
+bool HandshakeProtocol::consumeCookieReply(const SharedBuffer &message,
+                                           const HandshakeState &state,
+                                           Cookie &cookie) const
+{
+	if (message.size() != COOKIE_REPLY_SIZE || message[0] != COOKIE_REPLY_TYPE ||
+	    readIndex(message.data() + COOKIE_RECEIVER) != state.localIndex())
+	{
+		return false;
+	}
+
+	Hash key = hash(reinterpret_cast<const std::uint8_t*>(COOKIE_LABEL),
+	                sizeof(COOKIE_LABEL) - 1, m_presharedKey.data(),
+	                m_presharedKey.size());
+	return chachaPoly(false, key.data(), message.data() + COOKIE_NONCE,
+	                  state.initiationMac().data(), MAC_SIZE,
+	                  message.data() + COOKIE_ENCRYPTED, cookie.size(),
+	                  cookie.data());
+}
+
+bool HandshakeProtocol::hasValidMac2(const SharedBuffer &message,
+                                     const Cookie &cookie)
+{
+	std::size_t mac2;
+	if (message.size() == HANDSHAKE_INITIATION_SIZE)
+	{
+		mac2 = INITIATION_MAC1 + MAC_SIZE;
+	}
+	else if (message.size() == HANDSHAKE_RESPONSE_SIZE)
+	{
+		mac2 = RESPONSE_MAC1 + MAC_SIZE;
+	}
+	else
+	{
+		return false;
+	}
+
+	Mac expected = truncatedHmac(cookie.data(), cookie.size(), message.data(),
+	                             mac2);
+	return equal(expected.data(), message.data() + mac2, MAC_SIZE);
+}
+
+std::uint32_t HandshakeProtocol::receiverIndex(const SharedBuffer &message)
+{
+	if (message.size() == HANDSHAKE_RESPONSE_SIZE &&
+	    message[0] == HANDSHAKE_RESPONSE_TYPE)
+	{
+		return readIndex(message.data() + RESPONSE_RECEIVER);
+	}
+
+	if (message.size() == COOKIE_REPLY_SIZE && message[0] == COOKIE_REPLY_TYPE)
+	{
+		return readIndex(message.data() + COOKIE_RECEIVER);
+	}
+
+	return 0;
+}
+
+bool HandshakeProtocol::hasValidMac1(const SharedBuffer &message,
+                                     std::size_t offset) const
+{
+	Mac expected = truncatedHmac(m_macKey.data(), m_macKey.size(),
+	                             message.data(), offset);
+	return equal(expected.data(), message.data() + offset, MAC_SIZE);
+}
+
+void HandshakeProtocol::writeMacs(SharedBuffer &message,
+                                  const Cookie *cookie) const
+{
+	std::size_t mac1 = message.size() - 2 * MAC_SIZE;
+	Mac mac = truncatedHmac(m_macKey.data(), m_macKey.size(), message.data(),
+	                        mac1);
+	std::copy(mac.begin(), mac.end(), message.data() + mac1);
+
+	std::size_t mac2 = mac1 + MAC_SIZE;
+	if (cookie)
+	{
+		mac = truncatedHmac(cookie->data(), cookie->size(), message.data(),
+		                    mac2);
+		std::copy(mac.begin(), mac.end(), message.data() + mac2);
+	}
+}
+
+CookieSecret::CookieSecret()
+{
+	rotate();
+}
+
+void CookieSecret::rotate()
+{
+	if (RAND_bytes(m_secret.data(), int(m_secret.size())) != 1)
+	{
+		throw HandshakeException("failed to generate cookie secret");
+	}
+}
+
+Cookie CookieSecret::cookie(const boost::asio::ip::udp::endpoint &endpoint) const
+{
+	// The address (as text, to cover both families) and port.
+	std::string source = endpoint.address().to_string() + "/" +
+	                     std::to_string(endpoint.port());
+	return truncatedHmac(m_secret.data(), m_secret.size(),
+	                     reinterpret_cast<const std::uint8_t*>(source.data()),
+	                     source.size());
+}
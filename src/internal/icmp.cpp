@@ -0,0 +1,158 @@
+#include <cstring>
+#include <algorithm>
+
+#include "packet_view.h"
+#include "internal/icmp.h"
+#include "internal/checksum.h"
+
+using namespace Overpass;
+using namespace Overpass::internal;
+
+namespace
+{
+	const std::uint8_t PROTOCOL_ICMP = 1;
+	const std::uint8_t PROTOCOL_ICMPV6 = 58;
+
+	const std::uint8_t ICMP_DESTINATION_UNREACHABLE = 3;
+	const std::uint8_t ICMP_HOST_UNREACHABLE = 1;
+	const std::uint8_t ICMPV6_DESTINATION_UNREACHABLE = 1;
+	const std::uint8_t ICMPV6_ADDRESS_UNREACHABLE = 3;
+
+	const std::size_t ICMP_HEADER_SIZE = 8;
+
+	// Replies are kept within the minimum MTU every host must accept.
+	const std::size_t IPV4_MAXIMUM_REPLY = 576;
+	const std::size_t IPV6_MAXIMUM_REPLY = 1280;
+
+	const std::uint8_t DEFAULT_TTL = 64;
+
+	bool isIcmpError(const PacketView &packet)
+	{
+		if (packet.totalLength() < packet.headerLength() + 1)
+		{
+			// Too short to tell, so err on the side of silence.
+			return packet.protocol() == PROTOCOL_ICMP ||
+			       packet.protocol() == PROTOCOL_ICMPV6;
+		}
+
+		std::uint8_t type = packet.data()[packet.headerLength()];
+		if (packet.version() == 4)
+		{
+			return packet.protocol() == PROTOCOL_ICMP &&
+			       (type == 3 || type == 4 || type == 5 || type == 11 ||
+			        type == 12);
+		}
+
+		return packet.protocol() == PROTOCOL_ICMPV6 && type < 128;
+	}
+
+	SharedBuffer makeIpv4Reply(const PacketView &packet,
+	                           const boost::asio::ip::address_v4 &source)
+	{
+		// Only the first fragment gets a reply.
+		if (((packet.data()[6] & 0x1f) << 8 | packet.data()[7]) != 0)
+		{
+			return SharedBuffer();
+		}
+
+		boost::asio::ip::address_v4 destination = packet.sourceAddress().to_v4();
+		if (destination.is_unspecified() || destination.is_multicast() ||
+		    destination == boost::asio::ip::address_v4::broadcast())
+		{
+			return SharedBuffer();
+		}
+
+		std::size_t quoted = std::min(packet.totalLength(),
+		                              IPV4_MAXIMUM_REPLY -
+		                              PacketView::IPV4_HEADER_SIZE -
+		                              ICMP_HEADER_SIZE);
+		std::size_t size = PacketView::IPV4_HEADER_SIZE + ICMP_HEADER_SIZE +
+		                   quoted;
+
+		SharedBuffer reply(size);
+		std::uint8_t *data = reply.data();
+		std::memset(data, 0, PacketView::IPV4_HEADER_SIZE + ICMP_HEADER_SIZE);
+
+		data[0] = 0x45;
+		writeShort(data + 2, size);
+		data[8] = DEFAULT_TTL;
+		data[9] = PROTOCOL_ICMP;
+		boost::asio::ip::address_v4::bytes_type sourceBytes = source.to_bytes();
+		std::copy(sourceBytes.begin(), sourceBytes.end(), data + 12);
+		std::copy(packet.sourceBytes(), packet.sourceBytes() + 4, data + 16);
+		writeShort(data + 10, checksumFinish(
+	                         checksumAdd(data, PacketView::IPV4_HEADER_SIZE)));
+
+		std::uint8_t *icmp = data + PacketView::IPV4_HEADER_SIZE;
+		icmp[0] = ICMP_DESTINATION_UNREACHABLE;
+		icmp[1] = ICMP_HOST_UNREACHABLE;
+		std::memcpy(icmp + ICMP_HEADER_SIZE, packet.data(), quoted);
+		writeShort(icmp + 2, checksumFinish(
+	                         checksumAdd(icmp, ICMP_HEADER_SIZE + quoted)));
+
+		return reply;
+	}
+
+	SharedBuffer makeIpv6Reply(const PacketView &packet,
+	                           const boost::asio::ip::address_v6 &source)
+	{
+		boost::asio::ip::address_v6 destination = packet.sourceAddress().to_v6();
+		if (destination.is_unspecified() || destination.is_multicast())
+		{
+			return SharedBuffer();
+		}
+
+		std::size_t quoted = std::min(packet.totalLength(),
+		                              IPV6_MAXIMUM_REPLY -
+		                              PacketView::IPV6_HEADER_SIZE -
+		                              ICMP_HEADER_SIZE);
+		std::size_t payloadSize = ICMP_HEADER_SIZE + quoted;
+
+		SharedBuffer reply(PacketView::IPV6_HEADER_SIZE + payloadSize);
+		std::uint8_t *data = reply.data();
+		std::memset(data, 0, PacketView::IPV6_HEADER_SIZE + ICMP_HEADER_SIZE);
+
+		data[0] = 0x60;
+		writeShort(data + 4, payloadSize);
+		data[6] = PROTOCOL_ICMPV6;
+		data[7] = DEFAULT_TTL;
+		boost::asio::ip::address_v6::bytes_type sourceBytes = source.to_bytes();
+		std::copy(sourceBytes.begin(), sourceBytes.end(), data + 8);
+		std::copy(packet.sourceBytes(), packet.sourceBytes() + 16, data + 24);
+
+		std::uint8_t *icmp = data + PacketView::IPV6_HEADER_SIZE;
+		icmp[0] = ICMPV6_DESTINATION_UNREACHABLE;
+		icmp[1] = ICMPV6_ADDRESS_UNREACHABLE;
+		std::memcpy(icmp + ICMP_HEADER_SIZE, packet.data(), quoted);
+
+		// The checksum covers a pseudo-header: both addresses, the length and
+		// the next header.
+		std::uint32_t total = pseudoHeaderSum(data, PROTOCOL_ICMPV6,
+		                                      payloadSize);
+		writeShort(icmp + 2, checksumFinish(
+		                        checksumAdd(icmp, payloadSize, total)));
+
+		return reply;
+	}
+}
+
+SharedBuffer internal::makeHostUnreachable(
+      const PacketView &packet, const boost::asio::ip::address &source)
+{
+	if (isIcmpError(packet))
+	{
+		return SharedBuffer();
+	}
+
+	if (packet.version() == 4 && source.is_v4())
+	{
+		return makeIpv4Reply(packet, source.to_v4());
+	}
+
+	if (packet.version() == 6 && source.is_v6())
+	{
+		return makeIpv6Reply(packet, source.to_v6());
+	}
+
+	return SharedBuffer();
+}
@@ -0,0 +1,101 @@
+#include <cmath>
+#include <algorithm>
+
+#include "internal/latency_histogram.h"
+
+using namespace Overpass::internal;
+
+const std::size_t LatencyHistogram::BUCKET_COUNT;
+
+LatencySnapshot::LatencySnapshot() :
+   buckets(LatencyHistogram::BUCKET_COUNT, 0),
+   count(0),
+   sum(0)
+{
+}
+
+void LatencySnapshot::merge(const LatencySnapshot &other)
+{
+	for (std::size_t i = 0; i < buckets.size(); ++i)
+	{
+		buckets[i] += other.buckets[i];
+	}
+
+	count += other.count;
+	sum += other.sum;
+}
+
+std::uint64_t LatencySnapshot::percentile(double fraction) const
+{
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	// The rank of the value, counting from 1.
+	std::uint64_t rank = std::max<std::uint64_t>(
+	                        1, std::uint64_t(std::ceil(fraction * count)));
+	std::uint64_t seen = 0;
+	for (std::size_t i = 0; i < buckets.size(); ++i)
+	{
+		seen += buckets[i];
+		if (seen >= rank)
+		{
+			return LatencyHistogram::highestValue(i);
+		}
+	}
+
+	return LatencyHistogram::highestValue(buckets.size() - 1);
+}
+
+LatencyHistogram::LatencyHistogram() :
+   m_counts(BUCKET_COUNT + 1)
+{
+}
+
+LatencySnapshot LatencyHistogram::snapshot() const
+{
+	std::vector<std::uint64_t> counts = m_counts.values();
+
+	LatencySnapshot snapshot;
+	snapshot.sum = counts[BUCKET_COUNT];
+	for (std::size_t i = 0; i < BUCKET_COUNT; ++i)
+	{
+		snapshot.buckets[i] = counts[i];
+		snapshot.count += counts[i];
+	}
+
+	return snapshot;
+}
+
+std::uint64_t LatencyHistogram::highestValue(std::size_t bucket)
+{
+	if (bucket < SUB_BUCKET_COUNT)
+	{
+		return bucket;
+	}
+
+	// The bucket's values share their highest bits, and range over the
+	// rest.
+	unsigned int shift = bucket / SUB_BUCKET_COUNT - 1;
+	std::uint64_t lowest = (SUB_BUCKET_COUNT + bucket % SUB_BUCKET_COUNT) <<
+	                       shift;
+	return lowest + (std::uint64_t(1) << shift) - 1;
+}
+
+const char *Overpass::internal::toString(LatencyStage stage)
+{
+	switch (stage)
+	{
+		case LatencyStage::Dispatch:
+			return "dispatch";
+		case LatencyStage::Route:
+			return "route";
+		case LatencyStage::Send:
+			return "send";
+		case LatencyStage::Total:
+			return "total";
+	}
+
+	return "unknown";
+}
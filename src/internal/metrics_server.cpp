@@ -0,0 +1,100 @@
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <iostream>
+
+#include <boost/asio/write.hpp>
+#include <boost/asio/streambuf.hpp>
+
+#include "internal/metrics_server.h"
+
+using namespace Overpass::internal;
+
+MetricsServer::MetricsServer(boost::asio::io_service &ioService,
+                             const std::string &path, Writer writer) :
+   m_ioService(ioService),
+   m_path(path),
+   m_writer(writer),
+   m_acceptor(ioService)
+{
+	// Only a socket left behind is replaced, never some other file.
+	struct stat status;
+	if (lstat(m_path.c_str(), &status) == 0)
+	{
+		if (!S_ISSOCK(status.st_mode))
+		{
+			throw boost::system::system_error(
+			         EEXIST, boost::system::system_category(), m_path);
+		}
+
+		unlink(m_path.c_str());
+	}
+	else if (errno != ENOENT)
+	{
+		throw boost::system::system_error(
+		         errno, boost::system::system_category(), m_path);
+	}
+
+	boost::asio::local::stream_protocol::endpoint endpoint(m_path);
+	m_acceptor.open(endpoint.protocol());
+
+	// Only the owner gets to connect, from the moment the socket exists.
+	mode_t mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+	boost::system::error_code error;
+	m_acceptor.bind(endpoint, error);
+	umask(mask);
+	if (error)
+	{
+		throw boost::system::system_error(error, m_path);
+	}
+
+	m_acceptor.listen();
+}
+
+MetricsServer::~MetricsServer()
+{
+	unlink(m_path.c_str());
+}
+
+void MetricsServer::start()
+{
+	beginAccepting();
+}
+
+void MetricsServer::beginAccepting()
+{
+	std::shared_ptr<Socket> socket = std::make_shared<Socket>(m_ioService);
+	m_acceptor.async_accept(*socket, std::bind(&MetricsServer::handleAccept,
+	                                           shared_from_this(), socket,
+	                                           std::placeholders::_1));
+}
+
+void MetricsServer::handleAccept(const std::shared_ptr<Socket> &socket,
+                                 const boost::system::error_code &error)
+{
+	if (error)
+	{
+		if (error != boost::asio::error::operation_aborted)
+		{
+			std::cerr << "Error accepting metrics connection: " << error
+			          << std::endl;
+		}
+
+		return;
+	}
+
+	std::shared_ptr<boost::asio::streambuf> snapshot =
+	      std::make_shared<boost::asio::streambuf>();
+	std::ostream stream(snapshot.get());
+	m_writer(stream);
+
+	// The socket goes away (closing the connection) once it's written.
+	boost::asio::async_write(*socket, *snapshot,
+	                         [socket, snapshot](
+	                            const boost::system::error_code&, std::size_t)
+	{
+	});
+
+	beginAccepting();
+}
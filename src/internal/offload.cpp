@@ -0,0 +1,434 @@
+#include <cstring>
+#include <algorithm>
+
+#include "packet_view.h"
+#include "internal/offload.h"
+#include "internal/checksum.h"
+
+using namespace Overpass;
+using namespace Overpass::internal;
+
+namespace
+{
+	const std::uint8_t PROTOCOL_TCP = 6;
+
+	const std::size_t TCP_HEADER_SIZE = 20;
+	const std::size_t TCP_CHECKSUM_OFFSET = 16;
+
+	const std::uint8_t TCP_FIN = 0x01;
+	const std::uint8_t TCP_PSH = 0x08;
+	const std::uint8_t TCP_ACK = 0x10;
+	const std::uint8_t TCP_CWR = 0x80;
+
+	// Largest IP packet a super-packet may grow to.
+	const std::size_t MAXIMUM_PACKET_SIZE = 65535;
+
+	// Flows followed at once per coalescer, like a GRO hash bucket. The
+	// oldest is written out to make room.
+	const std::size_t MAXIMUM_FLOWS = 8;
+
+	/*!
+	 * \brief Find the end of the TCP header of a packet, if it's a TCP
+	 *        segment with a complete header.
+	 *
+	 * \return The length of the IP and TCP headers, or 0 if it's not.
+	 */
+	std::size_t tcpHeadersLength(const PacketView &view)
+	{
+		if (!view.isValid() || view.protocol() != PROTOCOL_TCP)
+		{
+			return 0;
+		}
+
+		std::size_t ipHeaderLength = view.headerLength();
+		if (view.totalLength() < ipHeaderLength + TCP_HEADER_SIZE)
+		{
+			return 0;
+		}
+
+		std::size_t tcpHeaderLength = (view.data()[ipHeaderLength + 12] >> 4) * 4;
+		if (tcpHeaderLength < TCP_HEADER_SIZE ||
+		    ipHeaderLength + tcpHeaderLength > view.totalLength())
+		{
+			return 0;
+		}
+
+		return ipHeaderLength + tcpHeaderLength;
+	}
+
+	/*!
+	 * \brief Set the length fields of an IP header (and the IPv4 header
+	 *        checksum).
+	 */
+	void setPacketLength(std::uint8_t *data, std::size_t ipHeaderLength,
+	                     std::size_t length)
+	{
+		if ((data[0] >> 4) == 4)
+		{
+			writeShort(data + 2, length);
+			writeShort(data + 10, 0);
+			writeShort(data + 10, checksumFinish(
+			                         checksumAdd(data, ipHeaderLength)));
+		}
+		else
+		{
+			writeShort(data + 4, length - PacketView::IPV6_HEADER_SIZE);
+		}
+	}
+
+	/*!
+	 * \brief Compute the full TCP checksum of a packet.
+	 */
+	void setTcpChecksum(std::uint8_t *data, std::size_t ipHeaderLength,
+	                    std::size_t length)
+	{
+		std::uint8_t *tcp = data + ipHeaderLength;
+		std::size_t tcpLength = length - ipHeaderLength;
+		writeShort(tcp + TCP_CHECKSUM_OFFSET, 0);
+		writeShort(tcp + TCP_CHECKSUM_OFFSET, checksumFinish(
+		              checksumAdd(tcp, tcpLength,
+		                          pseudoHeaderSum(data, PROTOCOL_TCP,
+		                                          tcpLength))));
+	}
+
+	/*!
+	 * \brief Split a TCP super-packet into segments.
+	 *
+	 * \return Whether or not it could be split.
+	 */
+	bool segment(const SharedBuffer &packet, std::size_t segmentSize,
+	             std::vector<SharedBuffer> &packets)
+	{
+		PacketView view(packet);
+		std::size_t headerLength = tcpHeadersLength(view);
+		if (headerLength == 0 || segmentSize == 0)
+		{
+			return false;
+		}
+
+		const std::uint8_t *data = packet.data();
+		std::size_t ipHeaderLength = view.headerLength();
+		std::size_t payload = view.totalLength() - headerLength;
+		std::uint32_t sequence = readLong(data + ipHeaderLength + 4);
+		std::uint16_t identification = readShort(data + 4);
+
+		std::size_t offset = 0;
+		for (std::size_t index = 0; offset < payload || index == 0; ++index)
+		{
+			std::size_t size = std::min(segmentSize, payload - offset);
+			std::size_t length = headerLength + size;
+
+			SharedBuffer segment(length);
+			segment.times() = packet.times();
+			std::uint8_t *segmentData = segment.data();
+			std::memcpy(segmentData, data, headerLength);
+			std::memcpy(segmentData + headerLength,
+			            data + headerLength + offset, size);
+
+			if (view.version() == 4)
+			{
+				writeShort(segmentData + 4, identification + index);
+			}
+
+			setPacketLength(segmentData, ipHeaderLength, length);
+
+			// Only the first segment reports congestion window reduction, and
+			// only the last one pushes or finishes.
+			std::uint8_t *tcp = segmentData + ipHeaderLength;
+			writeLong(tcp + 4, sequence + offset);
+			if (index > 0)
+			{
+				tcp[13] &= ~TCP_CWR;
+			}
+
+			offset += size;
+			if (offset < payload)
+			{
+				tcp[13] &= ~(TCP_FIN | TCP_PSH);
+			}
+
+			setTcpChecksum(segmentData, ipHeaderLength, length);
+			packets.push_back(std::move(segment));
+		}
+
+		return true;
+	}
+
+	/*!
+	 * \brief Complete a checksum left for us (e.g. of a UDP datagram or a
+	 *        TCP segment that didn't need splitting).
+	 */
+	void completeChecksum(const SharedBuffer &packet, std::size_t start,
+	                      std::size_t offset)
+	{
+		PacketView view(packet);
+		std::size_t length = view.isValid() ? view.totalLength() : packet.size();
+		if (start + offset + 2 > length)
+		{
+			return;
+		}
+
+		// The field already holds the pseudo-header's sum.
+		std::uint8_t *data = packet.data();
+		writeShort(data + start + offset,
+		           checksumFinish(checksumAdd(data + start, length - start)));
+	}
+
+	/*!
+	 * \brief Check whether or not two TCP segments belong to the same flow
+	 *        (addresses and ports).
+	 */
+	bool sameFlow(const std::uint8_t *first, std::size_t firstHeaderLength,
+	              const PacketView &second)
+	{
+		const std::uint8_t *data = second.data();
+		if (first[0] >> 4 != second.version())
+		{
+			return false;
+		}
+
+		bool sameAddresses = second.version() == 4 ?
+		                     std::memcmp(first + 12, data + 12, 8) == 0 :
+		                     std::memcmp(first + 8, data + 8, 32) == 0;
+		return sameAddresses &&
+		       std::memcmp(first + firstHeaderLength,
+		                   data + second.headerLength(), 4) == 0;
+	}
+
+	/*!
+	 * \brief Check whether or not a TCP segment may be merged with others
+	 *        at all.
+	 */
+	bool isMergeable(const PacketView &view, std::size_t headerLength)
+	{
+		const std::uint8_t *data = view.data();
+		if (view.version() == 4 &&
+		    (view.headerLength() != PacketView::IPV4_HEADER_SIZE ||
+		     (data[6] & 0xbf) != 0 || data[7] != 0))
+		{
+			// Options or fragments.
+			return false;
+		}
+
+		std::uint8_t flags = data[view.headerLength() + 13];
+		return (flags & ~TCP_PSH) == TCP_ACK &&
+		       view.totalLength() > headerLength;
+	}
+}
+
+void Overpass::internal::segmentFromVirtual(const SharedBuffer &buffer,
+                                            std::vector<SharedBuffer> &packets)
+{
+	SharedBuffer packet(buffer);
+	if (packet.size() < VIRTIO_NET_HEADER_SIZE)
+	{
+		packet.trimFront(packet.size());
+		packets.push_back(std::move(packet));
+		return;
+	}
+
+	VirtioNetHeader header;
+	std::memcpy(&header, buffer.data(), sizeof(header));
+	packet.trimFront(VIRTIO_NET_HEADER_SIZE);
+
+	switch (header.gsoType & ~VIRTIO_NET_GSO_ECN)
+	{
+		case VIRTIO_NET_GSO_TCPV4:
+		case VIRTIO_NET_GSO_TCPV6:
+			if (segment(packet, header.gsoSize, packets))
+			{
+				return;
+			}
+
+			break;
+
+		case VIRTIO_NET_GSO_NONE:
+			if (header.flags & VIRTIO_NET_HEADER_NEEDS_CHECKSUM)
+			{
+				completeChecksum(packet, header.checksumStart, header.checksumOffset);
+			}
+
+			break;
+	}
+
+	packets.push_back(std::move(packet));
+}
+
+SharedBuffer Overpass::internal::prependEmptyVirtioHeader(
+      const SharedBuffer &packet)
+{
+	SharedBuffer buffer(VIRTIO_NET_HEADER_SIZE + packet.size());
+	buffer.times() = packet.times();
+	std::memset(buffer.data(), 0, VIRTIO_NET_HEADER_SIZE);
+	std::memcpy(buffer.data() + VIRTIO_NET_HEADER_SIZE, packet.data(),
+	            packet.size());
+	return buffer;
+}
+
+void GroCoalescer::add(const SharedBuffer &packet, const Writer &writer)
+{
+	PacketView view(packet);
+	std::size_t headerLength = tcpHeadersLength(view);
+	if (headerLength == 0)
+	{
+		writer(prependEmptyVirtioHeader(packet));
+		return;
+	}
+
+	SharedBuffer trimmed = view.packet();
+	auto flow = std::find_if(m_flows.begin(), m_flows.end(),
+	                         [&view](const Flow &flow)
+	{
+		return sameFlow(flow.packet.data(), flow.ipHeaderLength, view);
+	});
+
+	if (flow != m_flows.end())
+	{
+		if (merge(*flow, trimmed, headerLength))
+		{
+			return;
+		}
+
+		// Whatever is held for the flow goes first.
+		write(*flow, writer);
+		m_flows.erase(flow);
+	}
+
+	if (!isMergeable(view, headerLength) ||
+	    (packet.data()[view.headerLength() + 13] & TCP_PSH))
+	{
+		writer(prependEmptyVirtioHeader(trimmed));
+		return;
+	}
+
+	if (m_flows.size() >= MAXIMUM_FLOWS)
+	{
+		write(m_flows.front(), writer);
+		m_flows.erase(m_flows.begin());
+	}
+
+	Flow newFlow;
+	newFlow.packet = trimmed;
+	newFlow.size = trimmed.size();
+	newFlow.ipHeaderLength = view.headerLength();
+	newFlow.headerLength = headerLength;
+	newFlow.segmentSize = trimmed.size() - headerLength;
+	newFlow.segments = 1;
+	newFlow.nextSequence = readLong(trimmed.data() + view.headerLength() + 4) +
+	                       newFlow.segmentSize;
+	newFlow.closed = false;
+	m_flows.push_back(std::move(newFlow));
+}
+
+void GroCoalescer::flush(const Writer &writer)
+{
+	for (Flow &flow : m_flows)
+	{
+		write(flow, writer);
+	}
+
+	m_flows.clear();
+}
+
+bool GroCoalescer::merge(Flow &flow, const SharedBuffer &packet,
+                         std::size_t headerLength)
+{
+	if (flow.closed || headerLength != flow.headerLength)
+	{
+		return false;
+	}
+
+	const std::uint8_t *first = flow.packet.data();
+	const std::uint8_t *data = packet.data();
+	std::size_t payload = packet.size() - headerLength;
+
+	// The IP headers must only differ by length (and IPv4 identification
+	// and checksum), so the kernel can restore them when splitting.
+	if ((data[0] >> 4) == 4)
+	{
+		if (data[0] != first[0] || data[1] != first[1] ||
+		    data[6] != first[6] || data[7] != first[7] || data[8] != first[8])
+		{
+			return false;
+		}
+	}
+	else if (std::memcmp(data, first, 4) != 0 || data[7] != first[7])
+	{
+		return false;
+	}
+
+	const std::uint8_t *firstTcp = first + flow.ipHeaderLength;
+	const std::uint8_t *tcp = data + flow.ipHeaderLength;
+	std::uint8_t flags = tcp[13];
+	if ((flags & ~TCP_PSH) != TCP_ACK || payload == 0 ||
+	    payload > flow.segmentSize ||
+	    flow.size + payload > MAXIMUM_PACKET_SIZE ||
+	    readLong(tcp + 4) != flow.nextSequence ||
+	    std::memcmp(tcp + 8, firstTcp + 8, 4) != 0 ||
+	    std::memcmp(tcp + TCP_HEADER_SIZE, firstTcp + TCP_HEADER_SIZE,
+	                headerLength - flow.ipHeaderLength - TCP_HEADER_SIZE) != 0)
+	{
+		return false;
+	}
+
+	if (flow.segments == 1)
+	{
+		// Only now is the first segment copied, after room for the header,
+		// so single segments aren't held in large buffers.
+		// The super-packet is timed as its first segment.
+		flow.merged = SharedBuffer(MAXIMUM_OFFLOAD_READ_SIZE);
+		flow.merged.times() = flow.packet.times();
+		std::memcpy(flow.merged.data() + VIRTIO_NET_HEADER_SIZE, first,
+		            flow.size);
+		flow.packet = flow.merged;
+		flow.packet.trimFront(VIRTIO_NET_HEADER_SIZE);
+	}
+
+	std::uint8_t *merged = flow.packet.data();
+	std::memcpy(merged + flow.size, data + headerLength, payload);
+	flow.size += payload;
+	flow.nextSequence += payload;
+	++flow.segments;
+
+	// The super-packet carries the latest window, and PSH if it's the end.
+	std::uint8_t *mergedTcp = merged + flow.ipHeaderLength;
+	mergedTcp[13] = flags;
+	std::memcpy(mergedTcp + 14, tcp + 14, 2);
+
+	// Only full-sized segments may be followed by more.
+	flow.closed = payload < flow.segmentSize || (flags & TCP_PSH);
+	return true;
+}
+
+void GroCoalescer::write(Flow &flow, const Writer &writer)
+{
+	if (flow.segments == 1)
+	{
+		writer(prependEmptyVirtioHeader(flow.packet));
+		return;
+	}
+
+	std::uint8_t *data = flow.packet.data();
+	setPacketLength(data, flow.ipHeaderLength, flow.size);
+
+	// Leave the checksum to the kernel: the field holds the pseudo-header's
+	// sum, as it would coming from a NIC.
+	std::size_t tcpLength = flow.size - flow.ipHeaderLength;
+	writeShort(data + flow.ipHeaderLength + TCP_CHECKSUM_OFFSET,
+	           checksumFold(pseudoHeaderSum(data, PROTOCOL_TCP, tcpLength)));
+
+	VirtioNetHeader header;
+	std::memset(&header, 0, sizeof(header));
+	header.flags = VIRTIO_NET_HEADER_NEEDS_CHECKSUM;
+	header.gsoType = (data[0] >> 4) == 4 ? VIRTIO_NET_GSO_TCPV4 :
+	                                        VIRTIO_NET_GSO_TCPV6;
+	header.headerLength = flow.headerLength;
+	header.gsoSize = flow.segmentSize;
+	header.checksumStart = flow.ipHeaderLength;
+	header.checksumOffset = TCP_CHECKSUM_OFFSET;
+
+	// The header goes in the room left for it in front of the packet.
+	flow.merged.resize(VIRTIO_NET_HEADER_SIZE + flow.size);
+	std::memcpy(flow.merged.data(), &header, sizeof(header));
+	writer(flow.merged);
+}
@@ -1,72 +1,337 @@
 #include <unistd.h>
+#include <sys/resource.h>
 
-#include <tins/ip.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
 
 #include "virtual_interface.h"
 #include "datagram_server.h"
 #include "stream_server.h"
 #include "router.h"
+#include "packet_view.h"
+#include "sharded_runtime.h"
+#include "internal/uring.h"
+#include "internal/offload.h"
+#include "internal/sharded_sockets.h"
+#include "internal/datagram_batch_operations.h"
 #include "internal/overpass_server_private.h"
 
 using namespace Overpass::internal;
 
+namespace
+{
+	// Scratch space for splitting super-packets.
+	thread_local std::vector<Overpass::SharedBuffer> t_segments;
+
+	// Scratch space for handing batches to the router.
+	thread_local std::vector<Overpass::PacketView> t_packets;
+	thread_local std::vector<boost::asio::ip::udp::endpoint> t_sources;
+	thread_local std::vector<boost::asio::ip::address> t_peers;
+
+	// Segments of the batch being routed are merged here. The pointer is
+	// only set while routing one, so writes from anywhere else go straight
+	// to the virtual interface.
+	thread_local GroCoalescer t_batchCoalescer;
+	thread_local GroCoalescer *t_coalescer = nullptr;
+
+	// Datagrams to send together, collected the same way.
+	thread_local Overpass::DatagramBatch<boost::asio::ip::udp::endpoint> t_outgoingBatch;
+	thread_local Overpass::DatagramBatch<boost::asio::ip::udp::endpoint> *t_outgoing =
+	      nullptr;
+
+	// Scratch space for sealing single packets and opening batches (along
+	// with the peer each packet opened is from).
+	thread_local Overpass::DatagramBatch<boost::asio::ip::udp::endpoint> t_sealedBatch;
+	thread_local Overpass::DatagramBatch<boost::asio::ip::udp::endpoint> t_openedBatch;
+	thread_local std::vector<boost::asio::ip::address> t_openedPeers;
+
+	//! Niceness of the handshake thread, so that forwarding comes first.
+	const int HANDSHAKE_THREAD_NICENESS = 10;
+
+	/*!
+	 * \brief Write the type of a metric, which comes before its samples.
+	 */
+	void writeType(std::ostream &stream, const char *name, const char *type)
+	{
+		stream << "# TYPE overpass_" << name << " " << type << "\n";
+	}
+
+	/*!
+	 * \brief Write a sample of a metric, with a single label (or none, if
+	 *        its name is empty).
+	 */
+	template <typename Value>
+	void writeSample(std::ostream &stream, const char *name,
+	                 const char *label, const std::string &labelValue,
+	                 Value value)
+	{
+		stream << "overpass_" << name;
+		if (*label)
+		{
+			stream << "{" << label << "=\"" << labelValue << "\"}";
+		}
+
+		stream << " " << value << "\n";
+	}
+
+	/*!
+	 * \brief Write the latencies of a stage of a forwarding path, as a
+	 *        summary in seconds.
+	 */
+	void writeLatency(std::ostream &stream, const char *path,
+	                  LatencyStage stage, const LatencySnapshot &snapshot)
+	{
+		const double quantiles[] = {0.5, 0.99, 0.999};
+		for (double quantile : quantiles)
+		{
+			stream << "overpass_latency_seconds{path=\"" << path
+			       << "\",stage=\"" << toString(stage) << "\",quantile=\""
+			       << quantile << "\"} "
+			       << snapshot.percentile(quantile) * 1e-9 << "\n";
+		}
+
+		stream << "overpass_latency_seconds_sum{path=\"" << path
+		       << "\",stage=\"" << toString(stage) << "\"} "
+		       << snapshot.sum * 1e-9 << "\n";
+		stream << "overpass_latency_seconds_count{path=\"" << path
+		       << "\",stage=\"" << toString(stage) << "\"} "
+		       << snapshot.count << "\n";
+	}
+
+	/*!
+	 * \brief Merge a stage's latencies across servers (those tracing).
+	 */
+	template <typename Servers>
+	LatencySnapshot mergeLatency(const Servers &servers, LatencyStage stage)
+	{
+		LatencySnapshot merged;
+		for (const auto &server : servers)
+		{
+			if (server->tracer())
+			{
+				merged.merge(server->tracer()->snapshot(stage));
+			}
+		}
+
+		return merged;
+	}
+}
+
+OverpassServerPrivate::Keepalive::Keepalive(
+      OverpassServerPrivate &server,
+      const boost::asio::ip::address &externalAddress, TimerWheel &wheel) :
+   externalAddress(externalAddress),
+   wheel(wheel),
+   timer(std::bind(&OverpassServerPrivate::sendKeepalive, &server, this))
+{
+}
+
 OverpassServerPrivate::OverpassServerPrivate(
-      const SharedIoService &ioService,
+      const std::vector<SharedIoService> &ioServices,
       const std::string &overpassInterfacePattern,
       const std::string &overpassIpAddress, const std::string &overpassNetmask,
-      const std::string &bindIpAddress, std::uint16_t bindPort) :
-   m_ioService(ioService),
+      const std::string &bindIpAddress, std::uint16_t bindPort,
+      const OverpassServerOptions &options) :
+   m_ioServices(ioServices),
+   m_sharded(ioServices.size() > 1),
    m_interfaceName(overpassInterfacePattern),
    m_overpassIpAddress(overpassIpAddress),
    m_overpassNetmask(overpassNetmask),
    m_bindIpAddress(bindIpAddress),
-   m_bindPort(bindPort)
+   m_bindPort(bindPort),
+   m_options(options),
+   m_segmentingExternal(false)
 {
+	if (m_options.cipher != Cipher::None)
+	{
+		if (m_options.key.size() != AEAD_KEY_SIZE)
+		{
+			throw Exception("key must be " + std::to_string(AEAD_KEY_SIZE) +
+			                " bytes long.");
+		}
+
+		AeadKey key;
+		std::copy(m_options.key.begin(), m_options.key.end(), key.begin());
+		m_handshakeService = std::make_shared<boost::asio::io_service>();
+		m_sessions.reset(new SessionManager(
+		                    m_options.cipher, key, *m_handshakeService,
+		                    std::bind(&OverpassServerPrivate::sendHandshakeMessage,
+		                              this, std::placeholders::_1,
+		                              std::placeholders::_2)));
+	}
+
+	if (m_sharded)
+	{
+		m_options.externalSocketCount = m_ioServices.size();
+		m_options.steerExternalByPeer = true;
+		m_options.virtualQueueCount = m_ioServices.size();
+	}
+
 	Overpass::createVirtualInterface(m_interfaceName,
-	                                 m_virtualInterfaceDescriptor);
+	                                 m_virtualInterfaceDescriptors,
+	                                 m_options.virtualQueueCount,
+	                                 m_options.virtualOffload);
 	Overpass::assignDeviceAddress(m_interfaceName, overpassIpAddress,
 	                              overpassNetmask);
 }
 
 OverpassServerPrivate::~OverpassServerPrivate()
 {
-	if (m_virtualInterfaceDescriptor)
+	// The session manager's callbacks use `this`.
+	if (m_handshakeThread.joinable())
+	{
+		m_handshakeWork.reset();
+		m_handshakeService->stop();
+		m_handshakeThread.join();
+	}
+
+	for (int descriptor : m_virtualInterfaceDescriptors)
 	{
-		close(m_virtualInterfaceDescriptor);
+		close(descriptor);
 	}
 }
 
 void OverpassServerPrivate::start()
 {
-	std::unique_ptr<boost::asio::ip::udp::socket> socket(
-	         new boost::asio::ip::udp::socket(
-	            *m_ioService, boost::asio::ip::udp::endpoint(
-	               boost::asio::ip::address::from_string(
-	                  m_bindIpAddress), m_bindPort)));
-	m_externalServer.reset(new UdpServer(
-	                          m_ioService, std::move(socket),
-	                          std::bind(
-	                             &OverpassServerPrivate::handleReadFromExternal,
-	                             shared_from_this(),
-	                             std::placeholders::_1, std::placeholders::_2)));
-
-	std::unique_ptr<boost::asio::posix::stream_descriptor> descriptor(
-	         new boost::asio::posix::stream_descriptor(*m_ioService));
-	descriptor->assign(m_virtualInterfaceDescriptor);
-
-	m_virtualServer = makeStreamServer(
-	                         m_ioService, std::bind(
-	                            &OverpassServerPrivate::handleReadFromVirtual,
-	                            shared_from_this(),
-	                            std::placeholders::_1),
-	                         std::move(descriptor));
-
-	m_router.reset(new Overpass::Router(
-	                  std::bind(&UdpServer::sendTo, m_externalServer,
-	                            std::placeholders::_1, std::placeholders::_2),
-	                  std::bind(&PosixStreamServer::write, m_virtualServer,
-	                            std::placeholders::_1),
-	                  m_bindPort));
+	bool useUring = m_options.useIoUring && Uring::isSupported();
+	if (m_options.useIoUring && !useUring)
+	{
+		std::cerr << "io_uring isn't supported by this kernel, falling back "
+		          << "to asio" << std::endl;
+	}
+
+	// One reader per socket. With SO_REUSEPORT the kernel spreads peers
+	// across them. When sharded, each socket (and each queue below) belongs
+	// to the shard with the same index.
+	ShardedSockets sockets = openShardedSockets(
+	                            m_ioServices, boost::asio::ip::udp::endpoint(
+	                               boost::asio::ip::address::from_string(
+	                                  m_bindIpAddress), m_bindPort),
+	                            m_options.externalSocketCount,
+	                            m_options.steerExternalByPeer);
+
+	DatagramServerOptions externalOptions;
+	externalOptions.batchSize = m_options.externalBatchSize;
+	externalOptions.sendQueueDepth = m_options.externalSendQueueDepth;
+	externalOptions.sendDropPolicy = m_options.externalSendDropPolicy;
+	externalOptions.dispatchMode = m_options.dispatchMode;
+	externalOptions.readDepth = m_options.readDepth;
+	externalOptions.orderedReads = m_options.orderedReads;
+	externalOptions.traceLatency = m_options.traceLatency;
+	if (m_sessions)
+	{
+		// Sealed packets are larger than the ones they hold.
+		externalOptions.bufferSize += AEAD_OVERHEAD;
+
+		m_handshakeWork.reset(new boost::asio::io_service::work(
+		                         *m_handshakeService));
+		SharedIoService handshakeService = m_handshakeService;
+		m_handshakeThread = std::thread([handshakeService]()
+		{
+			// Not being able to lower its priority isn't fatal either.
+			if (setpriority(PRIO_PROCESS, 0, HANDSHAKE_THREAD_NICENESS) != 0)
+			{
+				std::cerr << "Unable to lower the handshake thread's priority: "
+				          << strerror(errno) << std::endl;
+			}
+
+			handshakeService->run();
+		});
+	}
+
+	bool offloadUnsupported = false;
+	for (std::size_t i = 0; i < sockets.size(); ++i)
+	{
+		const SharedIoService &ioService = shardIoService(i);
+		std::unique_ptr<UringDatagramSocket> socket(new UringDatagramSocket(
+		         *ioService, std::move(sockets[i]), useUring,
+		         externalOptions.bufferSize));
+
+		// Coalesced datagrams are only split when received in batches, and
+		// need room to be received whole.
+		DatagramServerOptions socketOptions = externalOptions;
+		if (m_options.externalUdpOffload)
+		{
+			m_segmentingExternal = socket->enableSegmentation();
+			offloadUnsupported |= !m_segmentingExternal;
+			if (socketOptions.batchSize > 1 && socket->enableCoalescing())
+			{
+				socketOptions.bufferSize = MAXIMUM_COALESCED_SIZE;
+			}
+		}
+
+		m_externalServers.emplace_back(new UdpServer(
+		                                  ioService, std::move(socket),
+		                                  UdpServer::BatchReadCallback(std::bind(
+		                                     &OverpassServerPrivate::handleBatchFromExternal,
+		                                     shared_from_this(),
+		                                     std::placeholders::_1)),
+		                                  socketOptions));
+	}
+
+	if (offloadUnsupported)
+	{
+		std::cerr << "UDP segmentation offload isn't supported by this "
+		          << "kernel, sending datagrams one by one" << std::endl;
+		m_segmentingExternal = false;
+	}
+
+	// With offloads, super-packets are read whole.
+	StreamServerOptions virtualOptions;
+	virtualOptions.dispatchMode = m_options.dispatchMode;
+	virtualOptions.readDepth = m_options.readDepth;
+	virtualOptions.orderedReads = m_options.orderedReads;
+	virtualOptions.traceLatency = m_options.traceLatency;
+	if (m_options.virtualOffload)
+	{
+		virtualOptions.bufferSize = MAXIMUM_OFFLOAD_READ_SIZE;
+	}
+
+	// One reader (and writer) per queue. The stream descriptors take
+	// ownership of the queues, so they're no longer ours to close.
+	for (std::size_t i = 0; i < m_virtualInterfaceDescriptors.size(); ++i)
+	{
+		const SharedIoService &ioService = shardIoService(i);
+		std::unique_ptr<UringStreamDescriptor> descriptor(
+		         new UringStreamDescriptor(*ioService,
+		                                   m_virtualInterfaceDescriptors[i],
+		                                   useUring));
+
+		m_virtualServers.push_back(makeStreamServer(
+		                              ioService, std::bind(
+		                                 &OverpassServerPrivate::handleReadFromVirtual,
+		                                 shared_from_this(),
+		                                 std::placeholders::_1),
+		                              std::move(descriptor), virtualOptions));
+	}
+
+	m_virtualInterfaceDescriptors.clear();
+
+	RouterOptions routerOptions;
+	routerOptions.logDrops = m_options.logDrops;
+	routerOptions.sendUnreachable = m_options.sendUnreachable;
+	routerOptions.localAddress = boost::asio::ip::address::from_string(
+	                                m_overpassIpAddress);
+
+	m_router.reset(new Router(ExternalSender{this}, VirtualSender{this},
+	                          m_bindPort, routerOptions));
+
+	// Each shard's timers only ever run on its own thread.
+	for (std::size_t i = 0; i < (m_sharded ? m_ioServices.size() : 1); ++i)
+	{
+		m_timerWheels.emplace_back(new TimerWheel(*shardIoService(i)));
+	}
+
+	if (!m_options.metricsSocket.empty())
+	{
+		m_metricsServer = std::make_shared<MetricsServer>(
+		                     *m_ioServices.front(), m_options.metricsSocket,
+		                     std::bind(&OverpassServerPrivate::writeMetrics,
+		                               shared_from_this(),
+		                               std::placeholders::_1));
+		m_metricsServer->start();
+	}
 }
 
 void OverpassServerPrivate::addKnownClient(
@@ -78,31 +343,578 @@ void OverpassServerPrivate::addKnownClient(
 		throw Exception("server isn't started, cannot add client.");
 	}
 
+	if (m_sessions)
+	{
+		m_sessions->addPeer(externalAddress);
+	}
+
 	m_router->addKnownClient(overpassAddress, externalAddress);
+
+	if (m_options.keepaliveInterval.count() <= 0)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_keepalivesMutex);
+	std::unique_ptr<Keepalive> &keepalive = m_keepalives[externalAddress];
+	if (keepalive)
+	{
+		return;
+	}
+
+	// The client's timer goes with its socket.
+	std::size_t shard = peerShard(externalAddress, m_externalServers.size());
+	TimerWheel &wheel = *m_timerWheels[m_sharded ? shard : 0];
+	keepalive.reset(new Keepalive(*this, externalAddress, wheel));
+
+	// Clients added together don't all get keepalives at once either: the
+	// first one comes anywhere within the interval.
+	std::chrono::milliseconds delay(
+	      std::hash<std::string>()(externalAddress.to_string()) %
+	      m_options.keepaliveInterval.count());
+	Keepalive *added = keepalive.get();
+	wheel.post([added, delay]()
+	{
+		added->wheel.arm(added->timer, delay);
+	});
+}
+
+void OverpassServerPrivate::addRoute(
+      const boost::asio::ip::address &network, unsigned int prefixLength,
+      const boost::asio::ip::address &externalAddress)
+{
+	if (!m_router)
+	{
+		throw Exception("server isn't started, cannot add route.");
+	}
+
+	if (m_sessions)
+	{
+		m_sessions->addPeer(externalAddress);
+	}
+
+	m_router->addRoute(network, prefixLength, externalAddress);
+}
+
+std::uint64_t OverpassServerPrivate::dropCount(RoutingResult reason) const
+{
+	return m_router ? m_router->dropCount(reason) : 0;
+}
+
+std::uint64_t OverpassServerPrivate::authenticationFailures() const
+{
+	return m_sessions ? m_sessions->authenticationFailures() : 0;
+}
+
+std::uint64_t OverpassServerPrivate::replayedPackets() const
+{
+	return m_sessions ? m_sessions->replayedPackets() : 0;
+}
+
+void OverpassServerPrivate::writeMetrics(std::ostream &stream) const
+{
+	if (!m_router)
+	{
+		return;
+	}
+
+	// Per client, and for every client removed since.
+	std::map<boost::asio::ip::address, RoutingTable::Traffic> clients =
+	      m_router->clientTraffic();
+	RoutingTable::Traffic removed = m_router->removedClientTraffic();
+	const struct
+	{
+		const char *name;
+		const char *removedName;
+		std::uint64_t RoutingTable::Traffic::*value;
+	} clientMetrics[] = {
+		{"client_received_packets_total",
+		 "removed_client_received_packets_total",
+		 &RoutingTable::Traffic::packetsReceived},
+		{"client_received_bytes_total", "removed_client_received_bytes_total",
+		 &RoutingTable::Traffic::bytesReceived},
+		{"client_sent_packets_total", "removed_client_sent_packets_total",
+		 &RoutingTable::Traffic::packetsSent},
+		{"client_sent_bytes_total", "removed_client_sent_bytes_total",
+		 &RoutingTable::Traffic::bytesSent}};
+	for (const auto &metric : clientMetrics)
+	{
+		writeType(stream, metric.name, "counter");
+		for (const auto &client : clients)
+		{
+			writeSample(stream, metric.name, "client",
+			            client.first.to_string(), client.second.*metric.value);
+		}
+
+		writeType(stream, metric.removedName, "counter");
+		writeSample(stream, metric.removedName, "", "",
+		            removed.*metric.value);
+	}
+
+	// Per external socket.
+	std::vector<DatagramReceiveStatistics> received;
+	std::vector<DatagramSendStatistics> sent;
+	for (const auto &server : m_externalServers)
+	{
+		received.push_back(server->receiveStatistics());
+		sent.push_back(server->sendStatistics());
+	}
+
+	const struct
+	{
+		const char *name;
+		std::uint64_t DatagramReceiveStatistics::*value;
+	} receiveMetrics[] = {
+		{"socket_received_datagrams_total", &DatagramReceiveStatistics::received},
+		{"socket_received_bytes_total", &DatagramReceiveStatistics::receivedBytes},
+		{"socket_read_errors_total", &DatagramReceiveStatistics::errors}};
+	for (const auto &metric : receiveMetrics)
+	{
+		writeType(stream, metric.name, "counter");
+		for (std::size_t i = 0; i < received.size(); ++i)
+		{
+			writeSample(stream, metric.name, "socket", std::to_string(i),
+			            received[i].*metric.value);
+		}
+	}
+
+	const struct
+	{
+		const char *name;
+		std::uint64_t DatagramSendStatistics::*value;
+	} sendMetrics[] = {
+		{"socket_sent_datagrams_total", &DatagramSendStatistics::sent},
+		{"socket_sent_bytes_total", &DatagramSendStatistics::sentBytes},
+		{"socket_queued_datagrams_total", &DatagramSendStatistics::queued},
+		{"socket_dropped_datagrams_total", &DatagramSendStatistics::dropped},
+		{"socket_send_errors_total", &DatagramSendStatistics::failed}};
+	for (const auto &metric : sendMetrics)
+	{
+		writeType(stream, metric.name, "counter");
+		for (std::size_t i = 0; i < sent.size(); ++i)
+		{
+			writeSample(stream, metric.name, "socket", std::to_string(i),
+			            sent[i].*metric.value);
+		}
+	}
+
+	writeType(stream, "socket_send_queue_depth", "gauge");
+	for (std::size_t i = 0; i < m_externalServers.size(); ++i)
+	{
+		writeSample(stream, "socket_send_queue_depth", "socket",
+		            std::to_string(i), m_externalServers[i]->sendQueueDepth());
+	}
+
+	// Per virtual interface queue.
+	std::vector<StreamStatistics> queues;
+	for (const auto &server : m_virtualServers)
+	{
+		queues.push_back(server->statistics());
+	}
+
+	const struct
+	{
+		const char *name;
+		std::uint64_t StreamStatistics::*value;
+	} queueMetrics[] = {
+		{"queue_read_packets_total", &StreamStatistics::packetsRead},
+		{"queue_read_bytes_total", &StreamStatistics::bytesRead},
+		{"queue_read_errors_total", &StreamStatistics::readErrors},
+		{"queue_written_packets_total", &StreamStatistics::packetsWritten},
+		{"queue_written_bytes_total", &StreamStatistics::bytesWritten},
+		{"queue_dropped_writes_total", &StreamStatistics::droppedWrites},
+		{"queue_write_errors_total", &StreamStatistics::writeErrors}};
+	for (const auto &metric : queueMetrics)
+	{
+		writeType(stream, metric.name, "counter");
+		for (std::size_t i = 0; i < queues.size(); ++i)
+		{
+			writeSample(stream, metric.name, "queue", std::to_string(i),
+			            queues[i].*metric.value);
+		}
+	}
+
+	writeType(stream, "queue_pending_writes", "gauge");
+	for (std::size_t i = 0; i < m_virtualServers.size(); ++i)
+	{
+		writeSample(stream, "queue_pending_writes", "queue", std::to_string(i),
+		            m_virtualServers[i]->pendingWrites());
+	}
+
+	// Drops by reason (anything but forwarded).
+	writeType(stream, "dropped_packets_total", "counter");
+	for (std::size_t i = 1; i < ROUTING_RESULT_COUNT; ++i)
+	{
+		RoutingResult reason = static_cast<RoutingResult>(i);
+		writeSample(stream, "dropped_packets_total", "reason",
+		            toString(reason), m_router->dropCount(reason));
+	}
+
+	if (m_sessions)
+	{
+		const struct
+		{
+			const char *name;
+			std::uint64_t value;
+		} sessionMetrics[] = {
+			{"authentication_failures_total",
+			 m_sessions->authenticationFailures()},
+			{"replayed_packets_total", m_sessions->replayedPackets()},
+			{"packets_without_session_total",
+			 m_sessions->packetsWithoutSession()},
+			{"handshakes_completed_total", m_sessions->handshakesCompleted()},
+			{"cookie_replies_total", m_sessions->cookieReplies()}};
+		for (const auto &metric : sessionMetrics)
+		{
+			writeType(stream, metric.name, "counter");
+			writeSample(stream, metric.name, "", "", metric.value);
+		}
+	}
+
+	// Latencies, per path. Each server dispatches the packets it reads,
+	// and routes and sends those it writes.
+	if (m_options.traceLatency)
+	{
+		writeType(stream, "latency_seconds", "summary");
+		writeLatency(stream, "external_to_virtual", LatencyStage::Dispatch,
+		             mergeLatency(m_externalServers, LatencyStage::Dispatch));
+		writeLatency(stream, "virtual_to_external", LatencyStage::Dispatch,
+		             mergeLatency(m_virtualServers, LatencyStage::Dispatch));
+		const LatencyStage writerStages[] = {
+			LatencyStage::Route, LatencyStage::Send, LatencyStage::Total};
+		for (LatencyStage stage : writerStages)
+		{
+			writeLatency(stream, "external_to_virtual", stage,
+			             mergeLatency(m_virtualServers, stage));
+			writeLatency(stream, "virtual_to_external", stage,
+			             mergeLatency(m_externalServers, stage));
+		}
+	}
+
+	// Buffer pool, per size class (0 for buffers too large for any).
+	std::vector<BufferPool::Statistics> pool =
+	      BufferPool::instance().statistics();
+	const struct
+	{
+		const char *name;
+		const char *type;
+		std::uint64_t BufferPool::Statistics::*value;
+	} poolMetrics[] = {
+		{"buffer_pool_hits_total", "counter", &BufferPool::Statistics::hits},
+		{"buffer_pool_misses_total", "counter", &BufferPool::Statistics::misses},
+		{"buffer_pool_buffers_total", "counter",
+		 &BufferPool::Statistics::buffers},
+		{"buffer_pool_idle_buffers", "gauge",
+		 &BufferPool::Statistics::idleBuffers}};
+	for (const auto &metric : poolMetrics)
+	{
+		writeType(stream, metric.name, metric.type);
+		for (const auto &sizeClass : pool)
+		{
+			writeSample(stream, metric.name, "size",
+			            std::to_string(sizeClass.bufferSize),
+			            sizeClass.*metric.value);
+		}
+	}
+}
+
+void OverpassServerPrivate::sendKeepalive(Keepalive *keepalive)
+{
+	boost::asio::ip::udp::endpoint endpoint;
+	if (!m_router->clientEndpoint(keepalive->externalAddress, endpoint))
+	{
+		// The client is gone, so its keepalive goes too, but not from
+		// within its own timer's callback.
+		keepalive->wheel.post(std::bind(&OverpassServerPrivate::dropKeepalive,
+		                                this, keepalive));
+		return;
+	}
+
+	sendToExternal(endpoint, SharedBuffer(0));
+	keepalive->wheel.arm(keepalive->timer, m_options.keepaliveInterval);
+}
+
+void OverpassServerPrivate::dropKeepalive(Keepalive *keepalive)
+{
+	// A client added again meanwhile (which happens before its keepalive is
+	// looked for) found this one still there, so it keeps it.
+	std::lock_guard<std::mutex> lock(m_keepalivesMutex);
+	boost::asio::ip::udp::endpoint endpoint;
+	if (m_router->clientEndpoint(keepalive->externalAddress, endpoint))
+	{
+		keepalive->wheel.arm(keepalive->timer, m_options.keepaliveInterval);
+		return;
+	}
+
+	m_keepalives.erase(keepalive->externalAddress);
 }
 
 void OverpassServerPrivate::handleReadFromVirtual(const SharedBuffer &buffer)
 {
 	// Traffic coming in from the virtual interface. This means some software
 	// running on the host is reaching out to an Overpass client.
-	Tins::IP packet(buffer->data(), buffer->size());
-	try
+	// Whatever can't be routed is dropped (and accounted for) by the router.
+	if (!m_options.virtualOffload)
+	{
+		m_router->handlePacketFromVirtual(PacketView(buffer));
+		return;
+	}
+
+	// Super-packets are split into segments that fit on the wire. With UDP
+	// segmentation, those are then sent together so the kernel gets them
+	// in as few system calls as possible. With a cipher, they're also
+	// sealed together.
+	t_segments.clear();
+	segmentFromVirtual(buffer, t_segments);
+
+	if (m_segmentingExternal || m_sessions)
+	{
+		t_outgoing = &t_outgoingBatch;
+	}
+
+	// Routed together, so segments for the same peer go out together.
+	t_packets.clear();
+	for (const SharedBuffer &segment : t_segments)
 	{
-		m_router->handlePacketFromVirtual(packet);
+		t_packets.emplace_back(segment);
 	}
-	catch (const UnknownClientException &exception)
+
+	m_router->handlePacketsFromVirtual(t_packets.data(), t_packets.size());
+
+	if (t_outgoing)
 	{
-		std::cerr << exception.what() << std::endl;
+		t_outgoing = nullptr;
+		sendBatchToExternal(t_outgoingBatch);
+		t_outgoingBatch.clear();
 	}
 }
 
-void OverpassServerPrivate::handleReadFromExternal(
-      const boost::asio::ip::udp::endpoint &/*endpoint*/,
-      const SharedBuffer &buffer)
+void OverpassServerPrivate::VirtualSender::operator()(
+      const SharedBuffer &buffer) const
+{
+	// The router owns this policy and we own the router, so holding on to
+	// the server is safe.
+	server->writeToVirtual(buffer);
+}
+
+void OverpassServerPrivate::writeToVirtual(const SharedBuffer &buffer)
+{
+	if (!m_options.virtualOffload)
+	{
+		writeToVirtualQueue(buffer, buffer);
+		return;
+	}
+
+	// While a batch is being routed, segments are held to be merged until
+	// it's done (see handleBatchFromExternal()).
+	if (t_coalescer)
+	{
+		t_coalescer->add(buffer, std::bind(
+		                    &OverpassServerPrivate::writeOffloadedToVirtual,
+		                    this, std::placeholders::_1));
+		return;
+	}
+
+	writeToVirtualQueue(prependEmptyVirtioHeader(buffer), buffer);
+}
+
+void OverpassServerPrivate::writeOffloadedToVirtual(const SharedBuffer &buffer)
+{
+	SharedBuffer packet(buffer);
+	packet.trimFront(VIRTIO_NET_HEADER_SIZE);
+	writeToVirtualQueue(buffer, packet);
+}
+
+void OverpassServerPrivate::writeToVirtualQueue(const SharedBuffer &buffer,
+                                                const SharedBuffer &packet)
+{
+	if (m_virtualServers.size() == 1)
+	{
+		m_virtualServers.front()->write(buffer);
+		return;
+	}
+
+	// Any queue will do. When sharded, the peer this came from belongs to
+	// the current shard, so using its own queue keeps the peer's packets in
+	// order without handing off.
+	std::size_t shard = ShardedRuntime::currentShard();
+	if (m_sharded && shard < m_virtualServers.size())
+	{
+		m_virtualServers[shard]->write(buffer);
+		return;
+	}
+
+	std::size_t queue = PacketView(packet).flowHash() % m_virtualServers.size();
+	m_virtualServers[queue]->write(buffer);
+}
+
+void OverpassServerPrivate::handleBatchFromExternal(
+      const DatagramBatch<boost::asio::ip::udp::endpoint> &batch)
 {
 	// Traffic coming in from the external interface contains a nested IP packet
 	// destined for some software running on our host, bound to the virtual
-	// interface.
-	Tins::IP packet(buffer->data(), buffer->size());
-	m_router->handlePacketFromExternal(packet);
+	// interface. With a cipher, the whole batch is opened first, which also
+	// tells which client each packet is from (only then are clients known
+	// to have moved). Empty packets are keepalives, and go no further.
+	const DatagramBatch<boost::asio::ip::udp::endpoint> &packets =
+	      m_sessions ? openBatch(batch) : batch;
+	t_packets.clear();
+	t_sources.clear();
+	t_peers.clear();
+	for (std::size_t i = 0; i < packets.size(); ++i)
+	{
+		if (packets[i].buffer.size() != 0)
+		{
+			t_packets.emplace_back(packets[i].buffer);
+			t_sources.push_back(packets[i].endpoint);
+			if (m_sessions)
+			{
+				t_peers.push_back(t_openedPeers[i]);
+			}
+		}
+	}
+
+	const boost::asio::ip::address *peers = m_sessions ? t_peers.data() :
+	                                                     nullptr;
+	if (!m_options.virtualOffload)
+	{
+		m_router->handlePacketsFromExternal(t_packets.data(), t_sources.data(),
+		                                    peers, t_packets.size());
+		return;
+	}
+
+	// Consecutive segments of a flow are merged as they're routed, and
+	// whatever is left is written once the batch is done.
+	t_coalescer = &t_batchCoalescer;
+	m_router->handlePacketsFromExternal(t_packets.data(), t_sources.data(),
+	                                    peers, t_packets.size());
+	t_coalescer = nullptr;
+	t_batchCoalescer.flush(std::bind(
+	                          &OverpassServerPrivate::writeOffloadedToVirtual,
+	                          this, std::placeholders::_1));
+}
+
+const Overpass::DatagramBatch<boost::asio::ip::udp::endpoint> &
+OverpassServerPrivate::openBatch(
+      const DatagramBatch<boost::asio::ip::udp::endpoint> &batch)
+{
+	t_openedBatch = batch;
+	m_sessions->open(t_openedBatch, &t_openedPeers);
+	return t_openedBatch;
+}
+
+void OverpassServerPrivate::ExternalSender::operator()(
+      const boost::asio::ip::udp::endpoint &endpoint,
+      const SharedBuffer &buffer) const
+{
+	// Same as VirtualSender: the router can't outlive us.
+	server->sendToExternal(endpoint, buffer);
+}
+
+void OverpassServerPrivate::sendToExternal(
+      const boost::asio::ip::udp::endpoint &endpoint,
+      const SharedBuffer &buffer)
+{
+	if (t_outgoing)
+	{
+		t_outgoing->push_back(Datagram<boost::asio::ip::udp::endpoint>{
+		                         endpoint, buffer});
+		return;
+	}
+
+	if (!m_sessions)
+	{
+		sendMessageToExternal(endpoint, buffer);
+		return;
+	}
+
+	t_sealedBatch.push_back(Datagram<boost::asio::ip::udp::endpoint>{
+	                           endpoint, buffer});
+	m_sessions->seal(t_sealedBatch);
+	if (!t_sealedBatch.empty())
+	{
+		sendMessageToExternal(endpoint, t_sealedBatch.front().buffer);
+	}
+
+	t_sealedBatch.clear();
+}
+
+void OverpassServerPrivate::sendMessageToExternal(
+      const boost::asio::ip::udp::endpoint &endpoint,
+      const SharedBuffer &message)
+{
+	std::size_t shard = peerShard(endpoint.address(), m_externalServers.size());
+	if (m_sharded && shard != ShardedRuntime::currentShard())
+	{
+		// The peer belongs to another shard: hand the packet over rather
+		// than touching its socket from here.
+		shardIoService(shard)->post(std::bind(&UdpServer::sendTo,
+		                                      m_externalServers[shard],
+		                                      endpoint, message));
+		return;
+	}
+
+	m_externalServers[shard]->sendTo(endpoint, message);
+}
+
+void OverpassServerPrivate::sendHandshakeMessage(
+      const boost::asio::ip::udp::endpoint &endpoint,
+      const SharedBuffer &message)
+{
+	// The handshake thread doesn't run any of the servers' IO services.
+	std::size_t shard = peerShard(endpoint.address(), m_externalServers.size());
+	shardIoService(shard)->post(std::bind(&UdpServer::sendTo,
+	                                      m_externalServers[shard],
+	                                      endpoint, message));
+}
+
+void OverpassServerPrivate::sendBatchToExternal(
+      DatagramBatch<boost::asio::ip::udp::endpoint> &batch)
+{
+	if (m_sessions)
+	{
+		m_sessions->seal(batch);
+	}
+
+	// Each run of datagrams for peers of the same socket is sent in one go.
+	for (std::size_t first = 0; first < batch.size();)
+	{
+		std::size_t shard = peerShard(batch[first].endpoint.address(),
+		                              m_externalServers.size());
+		std::size_t last = first + 1;
+		while (last < batch.size() &&
+		       peerShard(batch[last].endpoint.address(),
+		                 m_externalServers.size()) == shard)
+		{
+			++last;
+		}
+
+		bool local = !m_sharded || shard == ShardedRuntime::currentShard();
+		if (local && first == 0 && last == batch.size())
+		{
+			// The usual case: a single peer.
+			m_externalServers[shard]->sendBatch(batch);
+			return;
+		}
+
+		UdpServer::Batch run(batch.begin() + first, batch.begin() + last);
+		if (local)
+		{
+			m_externalServers[shard]->sendBatch(run);
+		}
+		else
+		{
+			shardIoService(shard)->post(std::bind(&UdpServer::sendBatch,
+			                                      m_externalServers[shard],
+			                                      std::move(run)));
+		}
+
+		first = last;
+	}
+}
+
+const Overpass::SharedIoService &OverpassServerPrivate::shardIoService(
+      std::size_t shard) const
+{
+	return m_ioServices[m_sharded ? shard : 0];
 }
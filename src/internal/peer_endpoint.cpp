@@ -0,0 +1,74 @@
+#include <cstring>
+
+#include "internal/peer_endpoint.h"
+
+using namespace Overpass::internal;
+
+PeerEndpoint::PeerEndpoint(const boost::asio::ip::udp::endpoint &endpoint) :
+   m_sequence(0)
+{
+	for (auto &word : m_words)
+	{
+		word.store(0, std::memory_order_relaxed);
+	}
+
+	update(endpoint);
+}
+
+void PeerEndpoint::load(boost::asio::ip::udp::endpoint &endpoint) const
+{
+	std::uint64_t words[WORD_COUNT];
+	for (;;)
+	{
+		std::uint32_t sequence = m_sequence.load(std::memory_order_acquire);
+		if (sequence & 1)
+		{
+			continue;
+		}
+
+		for (std::size_t i = 0; i < WORD_COUNT; ++i)
+		{
+			words[i] = m_words[i].load(std::memory_order_relaxed);
+		}
+
+		// The copy is only good if nothing changed while it was taken.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (m_sequence.load(std::memory_order_relaxed) == sequence)
+		{
+			break;
+		}
+	}
+
+	std::memcpy(endpoint.data(), words, sizeof(endpoint));
+}
+
+bool PeerEndpoint::update(const boost::asio::ip::udp::endpoint &endpoint)
+{
+	std::uint64_t words[WORD_COUNT] = {};
+	std::memcpy(words, endpoint.data(), endpoint.size());
+
+	std::uint32_t sequence = m_sequence.load(std::memory_order_acquire);
+	bool same = !(sequence & 1);
+	for (std::size_t i = 0; same && i < WORD_COUNT; ++i)
+	{
+		same = m_words[i].load(std::memory_order_relaxed) == words[i];
+	}
+
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if ((same && m_sequence.load(std::memory_order_relaxed) == sequence) ||
+	    (sequence & 1) ||
+	    !m_sequence.compare_exchange_strong(sequence, sequence + 1,
+	                                        std::memory_order_relaxed))
+	{
+		return false;
+	}
+
+	std::atomic_thread_fence(std::memory_order_release);
+	for (std::size_t i = 0; i < WORD_COUNT; ++i)
+	{
+		m_words[i].store(words[i], std::memory_order_relaxed);
+	}
+
+	m_sequence.store(sequence + 2, std::memory_order_release);
+	return true;
+}
@@ -0,0 +1,94 @@
+#include <mutex>
+
+#include "internal/rcu.h"
+
+using namespace Overpass;
+
+// Starts at one so a reader's epoch is never mistaken for "not reading".
+std::atomic<std::uint64_t> internal::g_rcuEpoch(1);
+
+namespace
+{
+	/*!
+	 * \brief Every thread that has ever read, so writers can check on them.
+	 *
+	 * Leaked on purpose: threads may still be exiting during static
+	 * destruction.
+	 */
+	struct ReaderRegistry
+	{
+		std::mutex mutex;
+		internal::RcuReader *readers = nullptr;
+	};
+
+	ReaderRegistry &registry()
+	{
+		static ReaderRegistry *registry = new ReaderRegistry;
+		return *registry;
+	}
+
+	/*!
+	 * \brief Registers the thread's reader on construction and unregisters it
+	 *        when the thread exits.
+	 */
+	struct ThreadReader
+	{
+		ThreadReader()
+		{
+			reader.epoch.store(0, std::memory_order_relaxed);
+			reader.depth = 0;
+
+			ReaderRegistry &readers = registry();
+			std::lock_guard<std::mutex> lock(readers.mutex);
+			reader.next = readers.readers;
+			readers.readers = &reader;
+		}
+
+		~ThreadReader()
+		{
+			ReaderRegistry &readers = registry();
+			std::lock_guard<std::mutex> lock(readers.mutex);
+			for (internal::RcuReader **current = &readers.readers; *current;
+			     current = &(*current)->next)
+			{
+				if (*current == &reader)
+				{
+					*current = reader.next;
+					break;
+				}
+			}
+		}
+
+		internal::RcuReader reader;
+	};
+}
+
+internal::RcuReader &internal::rcuReader()
+{
+	thread_local ThreadReader t_reader;
+	return t_reader.reader;
+}
+
+std::uint64_t internal::advanceRcuEpoch()
+{
+	return g_rcuEpoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+}
+
+bool internal::rcuQuiescent(std::uint64_t epoch)
+{
+	// Anyone who could have loaded something unpublished before the epoch
+	// began reading in an earlier one. Readers that are idle, or began since,
+	// can only see what's currently published.
+	ReaderRegistry &readers = registry();
+	std::lock_guard<std::mutex> lock(readers.mutex);
+	for (RcuReader *reader = readers.readers; reader; reader = reader->next)
+	{
+		std::uint64_t observed = reader->epoch.load(std::memory_order_seq_cst);
+		if (observed != 0 && observed < epoch)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
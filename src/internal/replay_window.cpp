@@ -0,0 +1,90 @@
+#include "internal/replay_window.h"
+
+using namespace Overpass::internal;
+
+const std::size_t ReplayWindow::WORD_COUNT;
+const std::size_t ReplayWindow::BITS_PER_WORD;
+const std::uint64_t ReplayWindow::WINDOW_SIZE;
+
+namespace
+{
+	// Whether or not block a comes after block b, in serial number
+	// arithmetic (as words only keep the low bits of their block).
+	bool isAfter(std::uint32_t a, std::uint32_t b)
+	{
+		return static_cast<std::int32_t>(a - b) > 0;
+	}
+}
+
+ReplayWindow::ReplayWindow() :
+   m_end(0)
+{
+	for (auto &word : m_words)
+	{
+		word.store(0, std::memory_order_relaxed);
+	}
+}
+
+bool ReplayWindow::accept(std::uint64_t counter)
+{
+	if (counter == UINT64_MAX)
+	{
+		return false;
+	}
+
+	std::uint64_t end = m_end.load(std::memory_order_acquire);
+	if (end > counter && end - 1 - counter > WINDOW_SIZE)
+	{
+		return false; // Too old
+	}
+
+	// Slide the window first, so that whoever sees this counter's block in
+	// a word also sees an end at least that far.
+	while (counter >= end &&
+	       !m_end.compare_exchange_weak(end, counter + 1,
+	                                    std::memory_order_acq_rel,
+	                                    std::memory_order_acquire))
+	{
+	}
+
+	std::uint64_t block = counter / BITS_PER_WORD;
+	std::uint32_t tag = static_cast<std::uint32_t>(block);
+	std::uint64_t bit = std::uint64_t(1) << (counter % BITS_PER_WORD);
+	std::atomic<std::uint64_t> &word = m_words[block % WORD_COUNT];
+
+	std::uint64_t current = word.load(std::memory_order_acquire);
+	for (;;)
+	{
+		std::uint32_t currentTag = static_cast<std::uint32_t>(current >> 32);
+		std::uint64_t desired;
+		if (currentTag == tag)
+		{
+			if (current & bit)
+			{
+				return false; // Replayed
+			}
+
+			desired = current | bit;
+		}
+		else if (isAfter(tag, currentTag) ||
+		         isAfter(currentTag, static_cast<std::uint32_t>(
+		                    (m_end.load(std::memory_order_acquire) - 1) /
+		                    BITS_PER_WORD)))
+		{
+			// The word holds an older block (or one so old its tag wrapped
+			// around): recycle it.
+			desired = (std::uint64_t(tag) << 32) | bit;
+		}
+		else
+		{
+			return false; // The window slid past this block meanwhile
+		}
+
+		if (word.compare_exchange_weak(current, desired,
+		                               std::memory_order_acq_rel,
+		                               std::memory_order_acquire))
+		{
+			return true;
+		}
+	}
+}
@@ -0,0 +1,808 @@
+#include <limits>
+#include <iostream>
+
+#include <openssl/rand.h>
+
+#include "internal/session_manager.h"
+
+using namespace Overpass;
+using namespace Overpass::internal;
+
+namespace
+{
+	//! Messages sealed with a session before a new one is negotiated.
+	const std::uint64_t REKEY_AFTER_MESSAGES = Aead::MAXIMUM_MESSAGES / 2;
+
+	const std::int64_t NEVER = std::numeric_limits<std::int64_t>::min();
+
+	// Scratch space for sealing and opening runs of a batch.
+	thread_local std::vector<SharedBuffer> t_buffers;
+	thread_local std::vector<std::uint64_t> t_counters;
+	thread_local std::vector<void*> t_sessions;
+
+	std::int64_t steadyNow()
+	{
+		using namespace std::chrono;
+		return duration_cast<nanoseconds>(
+		          steady_clock::now().time_since_epoch()).count();
+	}
+
+	std::int64_t nanoseconds(std::chrono::milliseconds duration)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		          duration).count();
+	}
+
+	/*!
+	 * \brief Remove the datagrams whose buffer was cleared, keeping the
+	 *        others in order.
+	 */
+	void compact(DatagramBatch<boost::asio::ip::udp::endpoint> &batch)
+	{
+		std::size_t kept = 0;
+		for (std::size_t i = 0; i < batch.size(); ++i)
+		{
+			if (batch[i].buffer)
+			{
+				if (kept != i)
+				{
+					batch[kept] = std::move(batch[i]);
+				}
+
+				++kept;
+			}
+		}
+
+		batch.resize(kept);
+	}
+}
+
+SessionOptions::SessionOptions() :
+   rekeyAfter(120000),
+   rejectAfter(180000),
+   handshakeTimeout(5000),
+   handshakeAttempts(18),
+   cookieLifetime(120000),
+   loadThreshold(64),
+   maximumPending(4096)
+{
+}
+
+SessionManager::Session::Session(Cipher cipher, const SessionKeys &keys,
+                                 Peer *peer, bool initiator) :
+   peer(peer),
+   localIndex(keys.localIndex),
+   initiator(initiator),
+   created(steadyNow()),
+   sending(cipher, keys.sending, keys.remoteIndex),
+   receiving(cipher, keys.receiving, keys.localIndex),
+   confirming(false)
+{
+}
+
+SessionManager::Peer::Peer(const boost::asio::ip::address &address,
+                           SessionManager &manager) :
+   address(address),
+   current(nullptr),
+   previous(nullptr),
+   next(nullptr),
+   handshaking(false),
+   roaming(false),
+   attempts(0),
+   retryTimer(std::bind(&SessionManager::retryInitiation, &manager, this)),
+   expiryTimer(std::bind(&SessionManager::expireSessions, &manager, this)),
+   cookie(),
+   cookieReceived(NEVER),
+   lastTimestamp(0)
+{
+}
+
+SessionManager::SessionManager(Cipher cipher, const AeadKey &presharedKey,
+                               boost::asio::io_service &executor,
+                               Sender sender, const SessionOptions &options) :
+   m_cipher(cipher),
+   m_protocol(presharedKey),
+   m_executor(executor),
+   m_sender(sender),
+   m_options(options),
+   m_wheel(executor),
+   m_pending(0),
+   m_cookieTimer(std::bind(&SessionManager::rotateCookieSecret, this)),
+   m_lastTimestamp(0),
+   m_counters(COUNTER_COUNT)
+{
+	m_wheel.post([this]()
+	{
+		m_wheel.arm(m_cookieTimer, m_options.cookieLifetime);
+	});
+}
+
+SessionManager::~SessionManager()
+{
+	// The executor isn't running anymore, and neither is the data path.
+	for (const auto &peer : m_peerStorage)
+	{
+		delete peer->current.load(std::memory_order_relaxed);
+		delete peer->previous.load(std::memory_order_relaxed);
+		delete peer->next.load(std::memory_order_relaxed);
+	}
+
+	for (const auto &retired : m_retired)
+	{
+		delete retired.second;
+	}
+}
+
+void SessionManager::addPeer(const boost::asio::ip::address &address)
+{
+	std::lock_guard<std::mutex> lock(m_peersMutex);
+	Peer *existing = m_peers.find(address);
+	if (existing && existing->address == address)
+	{
+		return;
+	}
+
+	// Another peer that moved there doesn't keep the address.
+	if (existing)
+	{
+		existing->alias = boost::asio::ip::address();
+		m_peers.erase(address);
+	}
+
+	m_peerStorage.emplace_back(new Peer(address, *this));
+	m_peers.insert(address, m_peerStorage.back().get());
+}
+
+void SessionManager::seal(DatagramBatch<boost::asio::ip::udp::endpoint> &batch)
+{
+	RcuReadGuard guard;
+	std::int64_t time = now();
+
+	// Find each packet's session (once per run of the same peer).
+	t_sessions.resize(batch.size());
+	boost::asio::ip::address address;
+	Session *session = nullptr;
+	for (std::size_t i = 0; i < batch.size(); ++i)
+	{
+		if (i == 0 || address != batch[i].endpoint.address())
+		{
+			address = batch[i].endpoint.address();
+			Peer *peer = m_peers.find(address);
+			session = peer ? peer->current.load(std::memory_order_acquire) :
+			                 nullptr;
+			if (session && expired(*session, time))
+			{
+				session = nullptr;
+			}
+
+			if (peer && (!session || needsRekey(*session, time)))
+			{
+				requestHandshake(*peer, batch[i].endpoint);
+			}
+		}
+
+		t_sessions[i] = session;
+	}
+
+	// Seal each run of packets for the same session at once.
+	for (std::size_t first = 0; first < batch.size();)
+	{
+		std::size_t last = first + 1;
+		while (last < batch.size() && t_sessions[last] == t_sessions[first])
+		{
+			++last;
+		}
+
+		Session *runSession = static_cast<Session*>(t_sessions[first]);
+		if (!runSession)
+		{
+			m_counters.add(PACKETS_WITHOUT_SESSION, last - first);
+			for (std::size_t i = first; i < last; ++i)
+			{
+				batch[i].buffer = SharedBuffer();
+			}
+		}
+		else
+		{
+			t_buffers.resize(last - first);
+			for (std::size_t i = first; i < last; ++i)
+			{
+				t_buffers[i - first] = batch[i].buffer;
+			}
+
+			runSession->sending.seal(t_buffers.data(), t_buffers.size(),
+			                         t_buffers.data());
+			for (std::size_t i = first; i < last; ++i)
+			{
+				batch[i].buffer = t_buffers[i - first];
+			}
+		}
+
+		first = last;
+	}
+
+	t_buffers.clear();
+	compact(batch);
+}
+
+void SessionManager::open(DatagramBatch<boost::asio::ip::udp::endpoint> &batch,
+                          std::vector<boost::asio::ip::address> *peers)
+{
+	RcuReadGuard guard;
+	std::int64_t time = now();
+	std::uint64_t failures = 0;
+
+	// Find each message's session, by index (once per run of the same
+	// index). Anything but data messages is taken out of the batch.
+	t_sessions.resize(batch.size());
+	std::uint32_t index = 0;
+	Session *session = nullptr;
+	for (std::size_t i = 0; i < batch.size(); ++i)
+	{
+		SharedBuffer &message = batch[i].buffer;
+		t_sessions[i] = nullptr;
+
+		std::uint8_t type = message.size() > 0 ? message[0] : 0;
+		if (type == HANDSHAKE_INITIATION_TYPE ||
+		    type == HANDSHAKE_RESPONSE_TYPE || type == COOKIE_REPLY_TYPE)
+		{
+			dispatchHandshakeMessage(batch[i].endpoint, message);
+			message = SharedBuffer();
+			continue;
+		}
+
+		if (type != AEAD_MESSAGE_TYPE || message.size() < AEAD_OVERHEAD)
+		{
+			++failures;
+			message = SharedBuffer();
+			continue;
+		}
+
+		if (!session || aeadKeyIndex(message) != index)
+		{
+			index = aeadKeyIndex(message);
+			session = m_sessions.find(index);
+			if (session && expired(*session, time))
+			{
+				session = nullptr;
+			}
+		}
+
+		if (!session)
+		{
+			++failures;
+			message = SharedBuffer();
+			continue;
+		}
+
+		t_sessions[i] = session;
+	}
+
+	if (failures > 0)
+	{
+		m_counters.add(AUTHENTICATION_FAILURES, failures);
+	}
+
+	// Open each run of messages for the same session at once.
+	for (std::size_t first = 0; first < batch.size();)
+	{
+		std::size_t last = first + 1;
+		while (last < batch.size() && t_sessions[last] == t_sessions[first])
+		{
+			++last;
+		}
+
+		if (t_sessions[first])
+		{
+			openRun(batch, first, last, static_cast<Session*>(t_sessions[first]),
+			        time);
+		}
+
+		first = last;
+	}
+
+	// Every packet left was opened by a session, which says who it's from.
+	if (peers)
+	{
+		peers->clear();
+		for (std::size_t i = 0; i < batch.size(); ++i)
+		{
+			if (batch[i].buffer)
+			{
+				peers->push_back(
+				         static_cast<Session*>(t_sessions[i])->peer->address);
+			}
+		}
+	}
+
+	compact(batch);
+}
+
+std::int64_t SessionManager::now() const
+{
+	return steadyNow();
+}
+
+bool SessionManager::expired(const Session &session, std::int64_t now) const
+{
+	return now - session.created > nanoseconds(m_options.rejectAfter) ||
+	       session.sending.sealedCount() >= Aead::MAXIMUM_MESSAGES;
+}
+
+bool SessionManager::needsRekey(const Session &session, std::int64_t now) const
+{
+	// The responder gives the initiator a head start, so that both don't
+	// start handshakes at once.
+	std::int64_t age = nanoseconds(m_options.rekeyAfter);
+	if (!session.initiator)
+	{
+		age = (age + nanoseconds(m_options.rejectAfter)) / 2;
+	}
+
+	return now - session.created > age ||
+	       session.sending.sealedCount() >= REKEY_AFTER_MESSAGES;
+}
+
+void SessionManager::requestHandshake(
+      Peer &peer, const boost::asio::ip::udp::endpoint &endpoint)
+{
+	// Only the first request goes to the executor, until it's done.
+	if (!peer.handshaking.load(std::memory_order_relaxed) &&
+	    !peer.handshaking.exchange(true, std::memory_order_acq_rel))
+	{
+		m_executor.post(std::bind(&SessionManager::startHandshake, this,
+		                          &peer, endpoint));
+	}
+}
+
+void SessionManager::openRun(
+      DatagramBatch<boost::asio::ip::udp::endpoint> &batch, std::size_t first,
+      std::size_t last, Session *session, std::int64_t)
+{
+	t_buffers.resize(last - first);
+	t_counters.resize(last - first);
+	for (std::size_t i = first; i < last; ++i)
+	{
+		t_buffers[i - first] = batch[i].buffer;
+	}
+
+	session->receiving.open(t_buffers.data(), t_buffers.size(),
+	                        t_buffers.data(), t_counters.data());
+
+	std::uint64_t failures = 0;
+	std::uint64_t replayed = 0;
+	std::size_t accepted = last;
+	for (std::size_t i = first; i < last; ++i)
+	{
+		SharedBuffer &packet = t_buffers[i - first];
+		if (!packet)
+		{
+			++failures;
+		}
+		else if (!session->window.accept(t_counters[i - first]))
+		{
+			++replayed;
+			packet = SharedBuffer();
+		}
+		else
+		{
+			accepted = i;
+		}
+
+		batch[i].buffer = packet;
+	}
+
+	t_buffers.clear();
+
+	if (failures > 0)
+	{
+		m_counters.add(AUTHENTICATION_FAILURES, failures);
+	}
+
+	if (replayed > 0)
+	{
+		m_counters.add(REPLAYED_PACKETS, replayed);
+	}
+
+	if (accepted == last)
+	{
+		return;
+	}
+
+	// Authentic packets from elsewhere mean the peer moved.
+	Peer *peer = session->peer;
+	boost::asio::ip::address source = batch[accepted].endpoint.address();
+	if (source != peer->address)
+	{
+		learnAddress(*peer, source);
+	}
+
+	// A packet sealed with the next session means the initiator has its
+	// keys: it can take over.
+	if (session == peer->next.load(std::memory_order_acquire) &&
+	    !session->confirming.exchange(true, std::memory_order_acq_rel))
+	{
+		m_executor.post(std::bind(&SessionManager::confirmSession, this, peer,
+		                          session->localIndex));
+	}
+}
+
+void SessionManager::dispatchHandshakeMessage(
+      const boost::asio::ip::udp::endpoint &endpoint,
+      const SharedBuffer &message)
+{
+	// Past the limit, handshake messages are dropped before they cost
+	// anything. (The count can overshoot a little, which doesn't matter.)
+	if (m_pending.load(std::memory_order_relaxed) >= m_options.maximumPending)
+	{
+		return;
+	}
+
+	m_pending.fetch_add(1, std::memory_order_relaxed);
+	m_executor.post(std::bind(&SessionManager::handleMessage, this, endpoint,
+	                          message));
+}
+
+void SessionManager::learnAddress(Peer &peer,
+                                  const boost::asio::ip::address &address)
+{
+	// Adding it takes a lock, so it's left to the executor. (Addresses of
+	// other peers are left alone.)
+	if (!m_peers.find(address) &&
+	    !peer.roaming.load(std::memory_order_relaxed) &&
+	    !peer.roaming.exchange(true, std::memory_order_acq_rel))
+	{
+		m_executor.post(std::bind(&SessionManager::addAddress, this, &peer,
+		                          address));
+	}
+}
+
+void SessionManager::startHandshake(
+      Peer *peer, const boost::asio::ip::udp::endpoint &endpoint)
+{
+	peer->endpoint = endpoint;
+	if (!peer->handshake)
+	{
+		peer->attempts = 0;
+		sendInitiation(peer);
+	}
+}
+
+void SessionManager::sendInitiation(Peer *peer)
+{
+	if (peer->handshake)
+	{
+		m_handshakes.erase(peer->handshake->localIndex());
+	}
+
+	if (peer->attempts >= m_options.handshakeAttempts)
+	{
+		// Give up until there's something to send again.
+		endHandshake(peer);
+		return;
+	}
+
+	++peer->attempts;
+
+	// Timestamps only ever increase, even if the clock doesn't.
+	std::uint64_t timestamp = std::chrono::duration_cast<
+	                             std::chrono::nanoseconds>(
+	                                std::chrono::system_clock::now()
+	                                   .time_since_epoch()).count();
+	timestamp = std::max(timestamp, m_lastTimestamp + 1);
+	m_lastTimestamp = timestamp;
+
+	bool hasCookie = peer->cookieReceived != NEVER &&
+	                 now() - peer->cookieReceived <
+	                    nanoseconds(m_options.cookieLifetime);
+
+	try
+	{
+		std::unique_ptr<HandshakeState> handshake(new HandshakeState);
+		std::uint32_t index = allocateIndex();
+		SharedBuffer initiation = m_protocol.createInitiation(
+		                             *handshake, index, timestamp,
+		                             hasCookie ? &peer->cookie : nullptr);
+
+		peer->handshake = std::move(handshake);
+		m_handshakes[index] = peer;
+		m_sender(peer->endpoint, initiation);
+	}
+	catch (const Exception &exception)
+	{
+		std::cerr << "Unable to initiate handshake: " << exception.what()
+		          << std::endl;
+		peer->handshake.reset();
+	}
+
+	m_wheel.arm(peer->retryTimer, m_options.handshakeTimeout);
+}
+
+void SessionManager::retryInitiation(Peer *peer)
+{
+	sendInitiation(peer);
+}
+
+void SessionManager::endHandshake(Peer *peer)
+{
+	if (peer->handshake)
+	{
+		m_handshakes.erase(peer->handshake->localIndex());
+		peer->handshake.reset();
+	}
+
+	m_wheel.cancel(peer->retryTimer);
+	peer->attempts = 0;
+	peer->handshaking.store(false, std::memory_order_release);
+}
+
+void SessionManager::handleMessage(
+      const boost::asio::ip::udp::endpoint &endpoint,
+      const SharedBuffer &message)
+{
+	bool underLoad = m_pending.load(std::memory_order_relaxed) >
+	                 m_options.loadThreshold;
+	m_pending.fetch_sub(1, std::memory_order_relaxed);
+
+	try
+	{
+		switch (message[0])
+		{
+			case HANDSHAKE_INITIATION_TYPE:
+				handleInitiation(endpoint, message, underLoad);
+				break;
+			case HANDSHAKE_RESPONSE_TYPE:
+				handleResponse(endpoint, message);
+				break;
+			case COOKIE_REPLY_TYPE:
+				handleCookieReply(message);
+				break;
+		}
+	}
+	catch (const Exception &exception)
+	{
+		std::cerr << "Unable to handle handshake message: "
+		          << exception.what() << std::endl;
+	}
+}
+
+void SessionManager::handleInitiation(
+      const boost::asio::ip::udp::endpoint &endpoint,
+      const SharedBuffer &message, bool underLoad)
+{
+	Peer *peer = m_peers.find(endpoint.address());
+	HandshakeState state;
+	std::uint64_t timestamp;
+	if (!peer || !m_protocol.consumeInitiation(message, state, timestamp))
+	{
+		m_counters.add(AUTHENTICATION_FAILURES);
+		return;
+	}
+
+	// Under load, only go through with it (and its asymmetric crypto) if
+	// the initiator proves it can receive at its address.
+	Cookie cookie = m_cookieSecret.cookie(endpoint);
+	if (underLoad && !HandshakeProtocol::hasValidMac2(message, cookie))
+	{
+		m_sender(endpoint, m_protocol.createCookieReply(message, cookie));
+		m_counters.add(COOKIE_REPLIES);
+		return;
+	}
+
+	if (timestamp <= peer->lastTimestamp)
+	{
+		m_counters.add(REPLAYED_PACKETS);
+		return;
+	}
+
+	peer->lastTimestamp = timestamp;
+	peer->endpoint = endpoint;
+
+	SessionKeys keys;
+	SharedBuffer response = m_protocol.createResponse(state, allocateIndex(),
+	                                                  keys);
+	install(peer, keys, false);
+	m_sender(endpoint, response);
+	m_counters.add(HANDSHAKES_COMPLETED);
+}
+
+void SessionManager::handleResponse(
+      const boost::asio::ip::udp::endpoint &endpoint,
+      const SharedBuffer &message)
+{
+	// Responses are only looked at for handshakes we started (by random
+	// index), so they don't need cookies.
+	auto handshake = m_handshakes.find(
+	                    HandshakeProtocol::receiverIndex(message));
+	if (handshake == m_handshakes.end())
+	{
+		m_counters.add(AUTHENTICATION_FAILURES);
+		return;
+	}
+
+	Peer *peer = handshake->second;
+	SessionKeys keys;
+	if (!m_protocol.consumeResponse(message, *peer->handshake, keys))
+	{
+		m_counters.add(AUTHENTICATION_FAILURES);
+		return;
+	}
+
+	peer->endpoint = endpoint;
+	install(peer, keys, true);
+	endHandshake(peer);
+	m_counters.add(HANDSHAKES_COMPLETED);
+}
+
+void SessionManager::handleCookieReply(const SharedBuffer &message)
+{
+	auto handshake = m_handshakes.find(
+	                    HandshakeProtocol::receiverIndex(message));
+	Cookie cookie;
+	if (handshake == m_handshakes.end() ||
+	    !m_protocol.consumeCookieReply(message, *handshake->second->handshake,
+	                                   cookie))
+	{
+		m_counters.add(AUTHENTICATION_FAILURES);
+		return;
+	}
+
+	// It's used from the next initiation on.
+	Peer *peer = handshake->second;
+	peer->cookie = cookie;
+	peer->cookieReceived = now();
+}
+
+void SessionManager::confirmSession(Peer *peer, std::uint32_t localIndex)
+{
+	Session *next = peer->next.load(std::memory_order_relaxed);
+	if (!next || next->localIndex != localIndex)
+	{
+		return; // Replaced meanwhile
+	}
+
+	Session *old = peer->previous.load(std::memory_order_relaxed);
+	peer->previous.store(peer->current.load(std::memory_order_relaxed),
+	                     std::memory_order_release);
+	peer->current.store(next, std::memory_order_release);
+	peer->next.store(nullptr, std::memory_order_release);
+	if (old)
+	{
+		retire(old);
+	}
+}
+
+void SessionManager::addAddress(Peer *peer,
+                                const boost::asio::ip::address &address)
+{
+	{
+		// The peer isn't known by where it was before anymore, so
+		// addresses don't pile up as it moves around.
+		std::lock_guard<std::mutex> lock(m_peersMutex);
+		if (!peer->alias.is_unspecified())
+		{
+			m_peers.erase(peer->alias);
+			peer->alias = boost::asio::ip::address();
+		}
+
+		// Unless another peer got the address meanwhile.
+		if (m_peers.insert(address, peer))
+		{
+			peer->alias = address;
+		}
+	}
+
+	peer->roaming.store(false, std::memory_order_release);
+}
+
+std::uint32_t SessionManager::allocateIndex()
+{
+	for (;;)
+	{
+		std::uint32_t index;
+		if (RAND_bytes(reinterpret_cast<unsigned char*>(&index),
+		               sizeof(index)) != 1)
+		{
+			throw HandshakeException("failed to generate an index");
+		}
+
+		if (index != 0 && !m_sessions.find(index) && !m_handshakes.count(index))
+		{
+			return index;
+		}
+	}
+}
+
+void SessionManager::install(Peer *peer, const SessionKeys &keys,
+                             bool initiator)
+{
+	// The session is published whole before anything refers to it.
+	Session *session = new Session(m_cipher, keys, peer, initiator);
+	m_sessions.insert(keys.localIndex, session);
+
+	// Any older session expires first.
+	if (!peer->expiryTimer.armed())
+	{
+		m_wheel.arm(peer->expiryTimer, m_options.rejectAfter);
+	}
+
+	if (initiator)
+	{
+		Session *old = peer->previous.load(std::memory_order_relaxed);
+		peer->previous.store(peer->current.load(std::memory_order_relaxed),
+		                     std::memory_order_release);
+		peer->current.store(session, std::memory_order_release);
+		if (old)
+		{
+			retire(old);
+		}
+	}
+	else
+	{
+		Session *old = peer->next.exchange(session, std::memory_order_acq_rel);
+		if (old)
+		{
+			retire(old);
+		}
+	}
+}
+
+void SessionManager::retire(Session *session)
+{
+	// The data path may still be using it.
+	m_sessions.erase(session->localIndex);
+	m_retired.push_back(std::make_pair(advanceRcuEpoch(), session));
+	reclaim();
+}
+
+void SessionManager::reclaim()
+{
+	while (!m_retired.empty() && rcuQuiescent(m_retired.front().first))
+	{
+		delete m_retired.front().second;
+		m_retired.pop_front();
+	}
+}
+
+void SessionManager::expireSessions(Peer *peer)
+{
+	// Keys of idle peers don't linger past their expiry. The timer is armed
+	// again for the oldest session left, if any.
+	std::int64_t time = now();
+	Session *oldest = nullptr;
+	for (std::atomic<Session*> *slot : {&peer->current, &peer->previous,
+	                                    &peer->next})
+	{
+		Session *session = slot->load(std::memory_order_relaxed);
+		if (!session)
+		{
+			continue;
+		}
+
+		if (expired(*session, time))
+		{
+			slot->store(nullptr, std::memory_order_release);
+			retire(session);
+		}
+		else if (!oldest || session->created < oldest->created)
+		{
+			oldest = session;
+		}
+	}
+
+	if (oldest)
+	{
+		m_wheel.arm(peer->expiryTimer,
+		            std::chrono::nanoseconds(oldest->created - time) +
+		               m_options.rejectAfter);
+	}
+
+	reclaim();
+}
+
+void SessionManager::rotateCookieSecret()
+{
+	m_cookieSecret.rotate();
+	reclaim();
+	m_wheel.arm(m_cookieTimer, m_options.cookieLifetime);
+}
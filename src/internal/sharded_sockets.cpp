@@ -0,0 +1,151 @@
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#include <cerrno>
+
+#include <boost/asio/socket_base.hpp>
+#include <boost/system/system_error.hpp>
+
+#include "internal/sharded_sockets.h"
+
+using namespace Overpass;
+
+namespace
+{
+	typedef boost::asio::detail::socket_option::boolean<
+	   SOL_SOCKET, SO_REUSEPORT> ReusePort;
+
+	// Offsets (relative to the network header) of the source address.
+	const std::uint32_t IPV4_SOURCE_OFFSET = 12;
+	const std::uint32_t IPV6_SOURCE_OFFSET = 8;
+
+	std::uint32_t fold(std::uint32_t word)
+	{
+		return word ^ (word >> 16);
+	}
+
+	/*!
+	 * \brief Build the classic BPF program steering datagrams by sender
+	 *        address.
+	 *
+	 * The program returns the index of the socket (within the reuseport group)
+	 * that should receive the datagram. It must stay in sync with
+	 * peerShard().
+	 */
+	std::vector<sock_filter> steeringProgram(bool ipv6, std::uint32_t count)
+	{
+		std::vector<sock_filter> program;
+		if (!ipv6)
+		{
+			// A = source address
+			program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			                           SKF_NET_OFF + IPV4_SOURCE_OFFSET));
+		}
+		else
+		{
+			// A = XOR of the source address' four words
+			program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			                           SKF_NET_OFF + IPV6_SOURCE_OFFSET));
+			for (std::uint32_t word = 1; word < 4; ++word)
+			{
+				program.push_back(BPF_STMT(BPF_MISC | BPF_TAX, 0));
+				program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+				                           SKF_NET_OFF + IPV6_SOURCE_OFFSET +
+				                           4 * word));
+				program.push_back(BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0));
+			}
+		}
+
+		// A = (A ^ (A >> 16)) % count
+		program.push_back(BPF_STMT(BPF_MISC | BPF_TAX, 0));
+		program.push_back(BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16));
+		program.push_back(BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0));
+		program.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count));
+		program.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+		return program;
+	}
+
+	void attachSteeringProgram(boost::asio::ip::udp::socket &socket,
+	                           std::size_t count)
+	{
+		std::vector<sock_filter> program = steeringProgram(
+		                                      socket.local_endpoint().address().is_v6(),
+		                                      count);
+
+		sock_fprog filter;
+		filter.len = program.size();
+		filter.filter = program.data();
+		if (setsockopt(socket.native_handle(), SOL_SOCKET,
+		               SO_ATTACH_REUSEPORT_CBPF, &filter, sizeof(filter)) < 0)
+		{
+			throw boost::system::system_error(
+			         errno, boost::system::system_category(),
+			         "unable to attach steering program");
+		}
+	}
+}
+
+internal::ShardedSockets internal::openShardedSockets(
+      const std::vector<SharedIoService> &ioServices,
+      const boost::asio::ip::udp::endpoint &endpoint,
+      std::size_t count, bool steerByPeer)
+{
+	ShardedSockets sockets;
+	if (count <= 1)
+	{
+		sockets.emplace_back(new boost::asio::ip::udp::socket(
+		                        *ioServices.front(), endpoint));
+		return sockets;
+	}
+
+	boost::asio::ip::udp::endpoint bindEndpoint(endpoint);
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		// The option needs to be set on every socket before it's bound.
+		std::unique_ptr<boost::asio::ip::udp::socket> socket(
+		         new boost::asio::ip::udp::socket(
+		            *ioServices[i % ioServices.size()], bindEndpoint.protocol()));
+		socket->set_option(ReusePort(true));
+		socket->bind(bindEndpoint);
+
+		bindEndpoint = socket->local_endpoint();
+		sockets.push_back(std::move(socket));
+	}
+
+	if (steerByPeer)
+	{
+		// The program applies to the whole group, so any socket will do.
+		attachSteeringProgram(*sockets.front(), count);
+	}
+
+	return sockets;
+}
+
+std::size_t internal::peerShard(const boost::asio::ip::address &peer,
+                                std::size_t count)
+{
+	if (count <= 1)
+	{
+		return 0;
+	}
+
+	std::uint32_t word = 0;
+	if (peer.is_v4())
+	{
+		word = peer.to_v4().to_ulong();
+	}
+	else
+	{
+		// Words are read in network byte order, like the filter does.
+		boost::asio::ip::address_v6::bytes_type bytes = peer.to_v6().to_bytes();
+		for (std::size_t i = 0; i < bytes.size(); i += 4)
+		{
+			word ^= (static_cast<std::uint32_t>(bytes[i]) << 24) |
+			        (static_cast<std::uint32_t>(bytes[i + 1]) << 16) |
+			        (static_cast<std::uint32_t>(bytes[i + 2]) << 8) |
+			        bytes[i + 3];
+		}
+	}
+
+	return fold(word) % count;
+}
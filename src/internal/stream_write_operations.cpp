@@ -0,0 +1,126 @@
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+
+#include <boost/asio/error.hpp>
+
+#include "internal/stream_write_operations.h"
+
+using namespace Overpass;
+
+namespace
+{
+	// Scratch space for writev, only ever grown.
+	thread_local std::vector<iovec> t_vectors;
+
+	boost::system::error_code lastError()
+	{
+		return boost::system::error_code(errno,
+		                                 boost::system::system_category());
+	}
+
+	/*!
+	 * \brief Make sure writes return rather than wait when the descriptor is
+	 *        full. Asio remembers the mode, so this only costs a system call
+	 *        the first time.
+	 */
+	bool makeNonBlocking(boost::asio::posix::stream_descriptor &descriptor,
+	                     boost::system::error_code &error)
+	{
+		if (!descriptor.non_blocking())
+		{
+			descriptor.non_blocking(true, error);
+		}
+
+		return !error;
+	}
+
+	boost::system::error_code translate(const boost::system::error_code &error)
+	{
+		if (error == boost::system::errc::resource_unavailable_try_again ||
+		    error == boost::system::errc::operation_would_block)
+		{
+			return boost::asio::error::would_block;
+		}
+
+		return error;
+	}
+}
+
+std::size_t internal::writePackets(
+      boost::asio::posix::stream_descriptor &descriptor,
+      const SharedBuffer *packets, std::size_t count,
+      boost::system::error_code &error)
+{
+	error = boost::system::error_code();
+	if (!makeNonBlocking(descriptor, error))
+	{
+		return 0;
+	}
+
+	std::size_t written = 0;
+	while (written < count)
+	{
+		const SharedBuffer &packet = packets[written];
+		ssize_t result = ::write(descriptor.native_handle(), packet.data(),
+		                         packet.size());
+		if (result >= 0)
+		{
+			++written;
+			continue;
+		}
+
+		if (errno == EINTR)
+		{
+			continue;
+		}
+
+		error = translate(lastError());
+		break;
+	}
+
+	return written;
+}
+
+std::size_t internal::writeGathered(
+      boost::asio::posix::stream_descriptor &descriptor,
+      const SharedBuffer *buffers, std::size_t count, std::size_t offset,
+      boost::system::error_code &error)
+{
+	error = boost::system::error_code();
+	if (!makeNonBlocking(descriptor, error))
+	{
+		return 0;
+	}
+
+	count = std::min(count, static_cast<std::size_t>(IOV_MAX));
+	if (t_vectors.size() < count)
+	{
+		t_vectors.resize(count);
+	}
+
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		std::size_t skip = i == 0 ? offset : 0;
+		t_vectors[i].iov_base = buffers[i].data() + skip;
+		t_vectors[i].iov_len = buffers[i].size() - skip;
+	}
+
+	ssize_t result;
+	do
+	{
+		result = ::writev(descriptor.native_handle(), t_vectors.data(), count);
+	} while (result < 0 && errno == EINTR);
+
+	if (result < 0)
+	{
+		error = translate(lastError());
+		return 0;
+	}
+
+	return result;
+}
@@ -0,0 +1,313 @@
+#include <limits>
+#include <algorithm>
+
+#include "internal/timer_wheel.h"
+
+using namespace Overpass::internal;
+
+namespace
+{
+	//! Longest delay a timer is armed for (longer ones are shortened), so
+	//! that ticks can't overflow.
+	const TimerWheel::Clock::duration MAXIMUM_DELAY =
+	      std::chrono::hours(24 * 365 * 100);
+
+	const std::uint64_t NO_EVENT = std::numeric_limits<std::uint64_t>::max();
+
+	unsigned int lowestBit(std::uint64_t word)
+	{
+		return __builtin_ctzll(word);
+	}
+
+	unsigned int highestBit(std::uint64_t word)
+	{
+		return 63 - __builtin_clzll(word);
+	}
+}
+
+TimerWheel::Timer::Timer(std::function<void ()> callback) :
+   m_expiry(0),
+   m_wheel(nullptr),
+   m_level(0),
+   m_slot(0),
+   m_callback(std::move(callback))
+{
+	previous = this;
+	next = this;
+}
+
+TimerWheel::Timer::~Timer()
+{
+	if (m_wheel)
+	{
+		m_wheel->cancel(*this);
+	}
+}
+
+TimerWheel::TimerWheel(boost::asio::io_service &ioService,
+                       Clock::duration resolution) :
+   m_strand(ioService),
+   m_timer(ioService),
+   m_resolution(resolution),
+   m_start(Clock::now()),
+   m_now(0),
+   m_scheduled(0),
+   m_armedCount(0)
+{
+	for (Level &level : m_levels)
+	{
+		level.occupied = 0;
+		for (Link &slot : level.slots)
+		{
+			slot.previous = &slot;
+			slot.next = &slot;
+		}
+	}
+}
+
+TimerWheel::~TimerWheel()
+{
+	for (Level &level : m_levels)
+	{
+		for (Link &slot : level.slots)
+		{
+			while (!empty(slot))
+			{
+				Timer &timer = static_cast<Timer&>(*slot.next);
+				unlink(timer);
+				timer.m_wheel = nullptr;
+			}
+		}
+	}
+}
+
+void TimerWheel::arm(Timer &timer, Clock::duration delay)
+{
+	if (timer.m_wheel)
+	{
+		timer.m_wheel->cancel(timer);
+	}
+
+	// The tick the delay ends in, so that the timer never fires early (the
+	// wheels may be behind, but never ahead).
+	Clock::duration end = Clock::now() - m_start +
+	                      std::min(std::max(delay, Clock::duration::zero()),
+	                               MAXIMUM_DELAY);
+	std::uint64_t expiry = (end + m_resolution - Clock::duration(1)) /
+	                       m_resolution;
+
+	timer.m_expiry = std::max(expiry, m_now + 1);
+	timer.m_wheel = this;
+	++m_armedCount;
+	link(timer);
+	schedule();
+}
+
+void TimerWheel::cancel(Timer &timer)
+{
+	if (!timer.m_wheel)
+	{
+		return;
+	}
+
+	unlink(timer);
+	if (timer.m_level != FIRING)
+	{
+		Level &level = m_levels[timer.m_level];
+		if (empty(level.slots[timer.m_slot]))
+		{
+			level.occupied &= ~(std::uint64_t(1) << timer.m_slot);
+		}
+	}
+
+	timer.m_wheel = nullptr;
+	--m_armedCount;
+
+	// Nothing to wait for keeps the IO service busy anymore.
+	if (m_armedCount == 0 && m_scheduled)
+	{
+		m_scheduled = 0;
+		m_timer.cancel();
+	}
+}
+
+void TimerWheel::post(std::function<void ()> function)
+{
+	m_strand.post(std::move(function));
+}
+
+void TimerWheel::unlink(Link &link)
+{
+	link.previous->next = link.next;
+	link.next->previous = link.previous;
+	link.previous = &link;
+	link.next = &link;
+}
+
+bool TimerWheel::empty(const Link &slot)
+{
+	return slot.next == &slot;
+}
+
+std::uint64_t TimerWheel::currentTick() const
+{
+	return (Clock::now() - m_start) / m_resolution;
+}
+
+void TimerWheel::link(Timer &timer)
+{
+	// The level is that of the highest digit the expiry differs from now
+	// in (so timers due now go to the current slot of the first one).
+	std::uint64_t difference = timer.m_expiry ^ m_now;
+	unsigned int level = difference ? highestBit(difference) / LEVEL_BITS : 0;
+	unsigned int slot = (timer.m_expiry >> (level * LEVEL_BITS)) &
+	                    (SLOT_COUNT - 1);
+
+	Link &head = m_levels[level].slots[slot];
+	timer.previous = head.previous;
+	timer.next = &head;
+	head.previous->next = &timer;
+	head.previous = &timer;
+
+	m_levels[level].occupied |= std::uint64_t(1) << slot;
+	timer.m_level = level;
+	timer.m_slot = slot;
+}
+
+std::uint64_t TimerWheel::nextEvent() const
+{
+	// Slots in use are always ahead of the current one, and a level's are
+	// all reached before anything of the levels above: the first slot in
+	// use of the first level with any is next.
+	for (unsigned int level = 0; level < LEVEL_COUNT; ++level)
+	{
+		std::uint64_t occupied = m_levels[level].occupied;
+		if (!occupied)
+		{
+			continue;
+		}
+
+		unsigned int shift = level * LEVEL_BITS;
+		unsigned int digit = (m_now >> shift) & (SLOT_COUNT - 1);
+		std::uint64_t ahead = occupied & ~((std::uint64_t(2) << digit) - 1);
+		if (!ahead)
+		{
+			continue;
+		}
+
+		// The digits above stay the same, those below are 0.
+		unsigned int above = shift + LEVEL_BITS;
+		std::uint64_t base = above < 64 ? (m_now >> above) << above : 0;
+		return base | (std::uint64_t(lowestBit(ahead)) << shift);
+	}
+
+	return NO_EVENT;
+}
+
+void TimerWheel::advance(std::uint64_t tick)
+{
+	for (;;)
+	{
+		std::uint64_t event = nextEvent();
+		if (event > tick)
+		{
+			m_now = std::max(m_now, tick);
+			return;
+		}
+
+		m_now = event;
+		for (unsigned int level = LEVEL_COUNT - 1; level > 0; --level)
+		{
+			unsigned int shift = level * LEVEL_BITS;
+			if (!(m_now & ((std::uint64_t(1) << shift) - 1)))
+			{
+				cascade(level);
+			}
+		}
+
+		fire();
+	}
+}
+
+void TimerWheel::cascade(unsigned int level)
+{
+	unsigned int slot = (m_now >> (level * LEVEL_BITS)) & (SLOT_COUNT - 1);
+	std::uint64_t bit = std::uint64_t(1) << slot;
+	if (!(m_levels[level].occupied & bit))
+	{
+		return;
+	}
+
+	// Every timer in the slot goes to a lower level.
+	m_levels[level].occupied &= ~bit;
+	Link &head = m_levels[level].slots[slot];
+	while (!empty(head))
+	{
+		Timer &timer = static_cast<Timer&>(*head.next);
+		unlink(timer);
+		link(timer);
+	}
+}
+
+void TimerWheel::fire()
+{
+	unsigned int slot = m_now & (SLOT_COUNT - 1);
+	std::uint64_t bit = std::uint64_t(1) << slot;
+	if (!(m_levels[0].occupied & bit))
+	{
+		return;
+	}
+
+	// The slot's timers are moved aside first, as callbacks may arm and
+	// cancel timers (including these).
+	m_levels[0].occupied &= ~bit;
+	Link &head = m_levels[0].slots[slot];
+	Link firing;
+	firing.next = head.next;
+	firing.previous = head.previous;
+	firing.next->previous = &firing;
+	firing.previous->next = &firing;
+	head.next = &head;
+	head.previous = &head;
+
+	for (Link *link = firing.next; link != &firing; link = link->next)
+	{
+		static_cast<Timer*>(link)->m_level = FIRING;
+	}
+
+	while (!empty(firing))
+	{
+		Timer &timer = static_cast<Timer&>(*firing.next);
+		unlink(timer);
+		timer.m_wheel = nullptr;
+		--m_armedCount;
+		timer.m_callback();
+	}
+}
+
+void TimerWheel::schedule()
+{
+	std::uint64_t event = nextEvent();
+	if (event == NO_EVENT || (m_scheduled && m_scheduled <= event))
+	{
+		return;
+	}
+
+	// Setting the expiry cancels the wait for the later one, if any.
+	m_scheduled = event;
+	m_timer.expires_at(m_start + m_resolution * Clock::rep(event));
+	m_timer.async_wait(m_strand.wrap(std::bind(&TimerWheel::handleTimeout,
+	                                           this, std::placeholders::_1)));
+}
+
+void TimerWheel::handleTimeout(const boost::system::error_code &error)
+{
+	if (error == boost::asio::error::operation_aborted)
+	{
+		return;
+	}
+
+	m_scheduled = 0;
+	advance(currentTick());
+	schedule();
+}
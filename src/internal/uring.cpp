@@ -0,0 +1,391 @@
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include <boost/system/system_error.hpp>
+
+#include "internal/uring.h"
+
+using namespace Overpass::internal;
+
+namespace
+{
+	const std::uint64_t CANCEL_USER_DATA = ~static_cast<std::uint64_t>(0);
+
+	void throwLastError(const char *what)
+	{
+		throw boost::system::system_error(
+		         errno, boost::system::system_category(), what);
+	}
+
+	int setup(unsigned int entries, io_uring_params &parameters)
+	{
+		return syscall(__NR_io_uring_setup, entries, &parameters);
+	}
+
+	int registerWith(int descriptor, unsigned int opcode, const void *argument,
+	                 unsigned int count)
+	{
+		return syscall(__NR_io_uring_register, descriptor, opcode, argument,
+		               count);
+	}
+
+	// The rings are shared with the kernel, which expects these orderings.
+	unsigned int loadAcquire(const unsigned int *value)
+	{
+		return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+	}
+
+	void storeRelease(unsigned int *value, unsigned int newValue)
+	{
+		__atomic_store_n(value, newValue, __ATOMIC_RELEASE);
+	}
+
+	bool probe()
+	{
+		io_uring_params parameters;
+		std::memset(&parameters, 0, sizeof(parameters));
+		int descriptor = setup(8, parameters);
+		if (descriptor < 0)
+		{
+			return false;
+		}
+
+		// Every operation the backend uses must be there.
+		std::vector<std::uint8_t> memory(
+		         sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+		io_uring_probe *operations =
+		      reinterpret_cast<io_uring_probe*>(memory.data());
+		bool supported = registerWith(descriptor, IORING_REGISTER_PROBE,
+		                              operations, 256) == 0;
+
+		const int required[] = {IORING_OP_READ, IORING_OP_WRITE,
+		                        IORING_OP_RECVMSG, IORING_OP_ASYNC_CANCEL};
+		for (int operation : required)
+		{
+			supported = supported && operation <= operations->last_op &&
+			            (operations->ops[operation].flags & IO_URING_OP_SUPPORTED);
+		}
+
+		// Provided buffer rings (5.19) are the newest feature relied on, bar
+		// multishot receives, whose absence only shows once one is tried.
+		if (supported)
+		{
+			Uring *ring = nullptr;
+			try
+			{
+				ring = new Uring(8);
+				ring->registerBufferRing(8);
+			}
+			catch (const boost::system::system_error&)
+			{
+				supported = false;
+			}
+
+			delete ring;
+		}
+
+		close(descriptor);
+		return supported;
+	}
+}
+
+Uring::Uring(unsigned int entries) :
+   m_descriptor(-1),
+   m_submissionRing(MAP_FAILED),
+   m_submissionRingSize(0),
+   m_entries(static_cast<io_uring_sqe*>(MAP_FAILED)),
+   m_preparedTail(0),
+   m_submittedTail(0),
+   m_completionRing(MAP_FAILED),
+   m_completionRingSize(0),
+   m_bufferRing(nullptr),
+   m_bufferRingSize(0),
+   m_bufferMask(0),
+   m_bufferTail(0),
+   m_inFlight(0)
+{
+	io_uring_params parameters;
+	std::memset(&parameters, 0, sizeof(parameters));
+	m_descriptor = setup(entries, parameters);
+	if (m_descriptor < 0)
+	{
+		throwLastError("io_uring_setup");
+	}
+
+	m_submissionEntries = parameters.sq_entries;
+	m_submissionRingSize = parameters.sq_off.array +
+	                       parameters.sq_entries * sizeof(unsigned int);
+	m_completionRingSize = parameters.cq_off.cqes +
+	                       parameters.cq_entries * sizeof(io_uring_cqe);
+
+	bool singleMapping = parameters.features & IORING_FEAT_SINGLE_MMAP;
+	if (singleMapping)
+	{
+		m_submissionRingSize = m_completionRingSize =
+		      std::max(m_submissionRingSize, m_completionRingSize);
+	}
+
+	m_submissionRing = mmap(nullptr, m_submissionRingSize,
+	                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                        m_descriptor, IORING_OFF_SQ_RING);
+	if (m_submissionRing == MAP_FAILED)
+	{
+		int error = errno;
+		close(m_descriptor);
+		errno = error;
+		throwLastError("mmap");
+	}
+
+	m_completionRing = singleMapping ? m_submissionRing :
+	                   mmap(nullptr, m_completionRingSize,
+	                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                        m_descriptor, IORING_OFF_CQ_RING);
+	m_entries = static_cast<io_uring_sqe*>(
+	               mmap(nullptr, parameters.sq_entries * sizeof(io_uring_sqe),
+	                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                    m_descriptor, IORING_OFF_SQES));
+	if (m_completionRing == MAP_FAILED || m_entries == MAP_FAILED)
+	{
+		int error = errno;
+		if (!singleMapping && m_completionRing != MAP_FAILED)
+		{
+			munmap(m_completionRing, m_completionRingSize);
+		}
+
+		munmap(m_submissionRing, m_submissionRingSize);
+		close(m_descriptor);
+		errno = error;
+		throwLastError("mmap");
+	}
+
+	std::uint8_t *submission = static_cast<std::uint8_t*>(m_submissionRing);
+	m_submissionHead = reinterpret_cast<unsigned int*>(
+	                      submission + parameters.sq_off.head);
+	m_submissionTail = reinterpret_cast<unsigned int*>(
+	                      submission + parameters.sq_off.tail);
+	m_submissionFlags = reinterpret_cast<unsigned int*>(
+	                       submission + parameters.sq_off.flags);
+	m_submissionMask = *reinterpret_cast<unsigned int*>(
+	                      submission + parameters.sq_off.ring_mask);
+
+	// Entries are always used in order, so the indirection array can be set
+	// up once and for all.
+	unsigned int *array = reinterpret_cast<unsigned int*>(
+	                         submission + parameters.sq_off.array);
+	for (unsigned int i = 0; i < parameters.sq_entries; ++i)
+	{
+		array[i] = i;
+	}
+
+	m_preparedTail = m_submittedTail = *m_submissionTail;
+
+	std::uint8_t *completion = static_cast<std::uint8_t*>(m_completionRing);
+	m_completionHead = reinterpret_cast<unsigned int*>(
+	                      completion + parameters.cq_off.head);
+	m_completionTail = reinterpret_cast<unsigned int*>(
+	                      completion + parameters.cq_off.tail);
+	m_completionMask = *reinterpret_cast<unsigned int*>(
+	                      completion + parameters.cq_off.ring_mask);
+	m_completions = completion + parameters.cq_off.cqes;
+}
+
+Uring::~Uring()
+{
+	if (m_inFlight > 0)
+	{
+		// Anything still in flight may be using memory about to be freed.
+		try
+		{
+			submit();
+
+			io_uring_sqe *entry = prepare(CANCEL_USER_DATA);
+			if (entry)
+			{
+				entry->opcode = IORING_OP_ASYNC_CANCEL;
+				entry->fd = -1;
+				entry->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+				submit();
+			}
+
+			UringCompletion completions[64];
+			while (m_inFlight > 0)
+			{
+				enter(0, 1, IORING_ENTER_GETEVENTS);
+				complete(completions, 64);
+			}
+		}
+		catch (const boost::system::system_error&)
+		{
+			// Nothing more can be done, closing the ring will have to do.
+		}
+	}
+
+	if (m_bufferRing)
+	{
+		munmap(m_bufferRing, m_bufferRingSize);
+	}
+
+	munmap(m_entries, m_submissionEntries * sizeof(io_uring_sqe));
+	if (m_completionRing != m_submissionRing)
+	{
+		munmap(m_completionRing, m_completionRingSize);
+	}
+
+	munmap(m_submissionRing, m_submissionRingSize);
+	close(m_descriptor);
+}
+
+bool Uring::isSupported()
+{
+	static const bool supported = probe();
+	return supported;
+}
+
+io_uring_sqe *Uring::prepare(std::uint64_t userData)
+{
+	if (m_preparedTail - loadAcquire(m_submissionHead) >= m_submissionEntries)
+	{
+		return nullptr;
+	}
+
+	io_uring_sqe *entry = &m_entries[m_preparedTail & m_submissionMask];
+	std::memset(entry, 0, sizeof(*entry));
+	entry->user_data = userData;
+
+	++m_preparedTail;
+	++m_inFlight;
+	return entry;
+}
+
+void Uring::submit()
+{
+	unsigned int count = m_preparedTail - m_submittedTail;
+	if (count == 0)
+	{
+		return;
+	}
+
+	storeRelease(m_submissionTail, m_preparedTail);
+	m_submittedTail = m_preparedTail;
+	enter(count, 0, 0);
+}
+
+std::size_t Uring::complete(UringCompletion *completions, std::size_t maximum)
+{
+	// If the completion queue overflowed, the kernel holds on to the rest
+	// until asked for them.
+	if (loadAcquire(m_submissionFlags) & IORING_SQ_CQ_OVERFLOW)
+	{
+		enter(0, 0, IORING_ENTER_GETEVENTS);
+	}
+
+	unsigned int head = *m_completionHead;
+	unsigned int tail = loadAcquire(m_completionTail);
+	const io_uring_cqe *entries = static_cast<const io_uring_cqe*>(
+	                                 m_completions);
+
+	std::size_t count = 0;
+	while (head != tail && count < maximum)
+	{
+		const io_uring_cqe &entry = entries[head & m_completionMask];
+		if (!(entry.flags & IORING_CQE_F_MORE))
+		{
+			--m_inFlight;
+		}
+
+		if (entry.user_data != CANCEL_USER_DATA)
+		{
+			completions[count++] = UringCompletion{entry.user_data, entry.res,
+			                                       entry.flags};
+		}
+
+		++head;
+	}
+
+	storeRelease(m_completionHead, head);
+	return count;
+}
+
+void Uring::registerEventFd(int eventFd)
+{
+	if (registerWith(m_descriptor, IORING_REGISTER_EVENTFD, &eventFd, 1) < 0)
+	{
+		throwLastError("io_uring_register (eventfd)");
+	}
+}
+
+void Uring::registerFile(int descriptor)
+{
+	if (registerWith(m_descriptor, IORING_REGISTER_FILES, &descriptor, 1) < 0)
+	{
+		throwLastError("io_uring_register (files)");
+	}
+}
+
+void Uring::registerBufferRing(std::uint16_t entries)
+{
+	m_bufferRingSize = entries * sizeof(io_uring_buf);
+	void *memory = mmap(nullptr, m_bufferRingSize, PROT_READ | PROT_WRITE,
+	                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (memory == MAP_FAILED)
+	{
+		throwLastError("mmap");
+	}
+
+	io_uring_buf_reg registration;
+	std::memset(&registration, 0, sizeof(registration));
+	registration.ring_addr = reinterpret_cast<std::uint64_t>(memory);
+	registration.ring_entries = entries;
+	registration.bgid = 0;
+	if (registerWith(m_descriptor, IORING_REGISTER_PBUF_RING, &registration,
+	                 1) < 0)
+	{
+		int error = errno;
+		munmap(memory, m_bufferRingSize);
+		errno = error;
+		throwLastError("io_uring_register (buffer ring)");
+	}
+
+	m_bufferRing = static_cast<io_uring_buf_ring*>(memory);
+	m_bufferMask = entries - 1;
+	m_bufferTail = 0;
+}
+
+void Uring::provideBuffer(void *data, std::uint32_t size, std::uint16_t id)
+{
+	// Not m_bufferRing->bufs: in C++ the flexible array macro leaves it
+	// offset from the start of the ring, where the kernel expects it.
+	io_uring_buf &buffer = reinterpret_cast<io_uring_buf*>(
+	                          m_bufferRing)[m_bufferTail & m_bufferMask];
+	buffer.addr = reinterpret_cast<std::uint64_t>(data);
+	buffer.len = size;
+	buffer.bid = id;
+	++m_bufferTail;
+}
+
+void Uring::commitBuffers()
+{
+	__atomic_store_n(&m_bufferRing->tail, m_bufferTail, __ATOMIC_RELEASE);
+}
+
+void Uring::enter(unsigned int submit, unsigned int wait, unsigned int flags)
+{
+	int result;
+	do
+	{
+		result = syscall(__NR_io_uring_enter, m_descriptor, submit, wait,
+		                 flags, nullptr, 0);
+	} while (result < 0 && errno == EINTR);
+
+	if (result < 0)
+	{
+		throwLastError("io_uring_enter");
+	}
+}
@@ -0,0 +1,1006 @@
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <boost/asio/error.hpp>
+#include <boost/system/system_error.hpp>
+
+#include "internal/uring.h"
+#include "internal/uring_sockets.h"
+#include "internal/stream_write_operations.h"
+#include "internal/datagram_batch_operations.h"
+
+using namespace Overpass;
+using namespace Overpass::internal;
+
+namespace
+{
+	// Completions are reaped this many at a time.
+	const std::size_t COMPLETION_BATCH = 64;
+
+	// Buffers in a datagram socket's provided buffer ring (a power of two).
+	const std::uint16_t RECEIVE_BUFFERS = 256;
+
+	// Writes a stream descriptor keeps in flight before asking the writer to
+	// wait. This bounds the packets (and memory) held by the kernel.
+	const std::size_t MAXIMUM_WRITES_IN_FLIGHT = 128;
+
+	const std::uint64_t RECEIVE_USER_DATA = 1;
+	const std::uint64_t READ_TAG = static_cast<std::uint64_t>(1) << 32;
+	const std::uint64_t WRITE_TAG = static_cast<std::uint64_t>(2) << 32;
+
+	boost::system::error_code errorFor(std::int32_t result)
+	{
+		if (result == -ECANCELED)
+		{
+			return boost::asio::error::operation_aborted;
+		}
+
+		return boost::system::error_code(-result,
+		                                 boost::system::system_category());
+	}
+
+	boost::system::error_code resultError(std::int32_t result)
+	{
+		return result < 0 ? errorFor(result) : boost::system::error_code();
+	}
+
+	/*!
+	 * \brief Create an eventfd signalled by the ring for every completion,
+	 *        so Asio can tell when there's something to reap.
+	 */
+	int registerEvents(Uring &ring)
+	{
+		int eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (eventFd < 0)
+		{
+			throw boost::system::system_error(
+			         errno, boost::system::system_category(), "eventfd");
+		}
+
+		try
+		{
+			ring.registerEventFd(eventFd);
+		}
+		catch (...)
+		{
+			close(eventFd);
+			throw;
+		}
+
+		return eventFd;
+	}
+
+	/*!
+	 * \brief Reset an eventfd's counter. Done before reaping, so completions
+	 *        posted meanwhile signal it again.
+	 */
+	void clearEvents(int eventFd)
+	{
+		std::uint64_t count;
+		if (read(eventFd, &count, sizeof(count)) < 0)
+		{
+			// Nothing was pending.
+		}
+	}
+}
+
+struct UringDatagramSocket::Private :
+      public std::enable_shared_from_this<UringDatagramSocket::Private>
+{
+	// Someone waiting for datagrams: either to be told they're ready (batch
+	// mode), or to have one copied out.
+	struct Waiter
+	{
+		UringHandler handler;
+		bool copy;
+		boost::asio::mutable_buffer buffer;
+		boost::asio::ip::udp::endpoint *sender;
+	};
+
+	struct Received
+	{
+		std::uint16_t id;
+		std::int32_t length;
+	};
+
+	Private(boost::asio::io_service &ioService,
+	        boost::asio::ip::udp::socket &socket, std::size_t bufferSize) :
+	   ioService(ioService),
+	   socket(socket),
+	   events(ioService),
+	   bufferSize(bufferSize),
+	   ringBufferSize(sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in6) +
+	                  bufferSize),
+	   kernelBuffers(0),
+	   receiving(false),
+	   receivedAny(false),
+	   fallback(false)
+	{
+		std::memset(&header, 0, sizeof(header));
+		header.msg_namelen = sizeof(sockaddr_in6);
+	}
+
+	void start()
+	{
+		ring.reset(new Uring(64));
+		ring->registerFile(socket.native_handle());
+		ring->registerBufferRing(RECEIVE_BUFFERS);
+
+		buffers.resize(RECEIVE_BUFFERS);
+		for (std::uint16_t id = 0; id < RECEIVE_BUFFERS; ++id)
+		{
+			recycle(id, SharedBuffer());
+		}
+
+		ring->commitBuffers();
+
+		events.assign(registerEvents(*ring));
+		armReceive();
+	}
+
+	void stop()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		// Cancels (and waits for) the receive, so the buffers can go.
+		ring.reset();
+		buffers.clear();
+		ready.clear();
+
+		boost::system::error_code error;
+		events.close(error);
+	}
+
+	void armReceive()
+	{
+		if (receiving || fallback || kernelBuffers == 0)
+		{
+			return;
+		}
+
+		io_uring_sqe *entry = ring->prepare(RECEIVE_USER_DATA);
+		if (!entry)
+		{
+			return;
+		}
+
+		// One request, completed once per datagram, each landing in a
+		// buffer picked from the ring.
+		entry->opcode = IORING_OP_RECVMSG;
+		entry->fd = 0;
+		entry->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+		entry->ioprio = IORING_RECV_MULTISHOT;
+		entry->addr = reinterpret_cast<std::uint64_t>(&header);
+		entry->len = 1;
+		entry->buf_group = 0;
+
+		ring->submit();
+		receiving = true;
+	}
+
+	void reap()
+	{
+		UringCompletion completions[COMPLETION_BATCH];
+		std::size_t count;
+		while ((count = ring->complete(completions, COMPLETION_BATCH)) > 0)
+		{
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				const UringCompletion &completion = completions[i];
+				if (!(completion.flags & IORING_CQE_F_MORE))
+				{
+					receiving = false;
+				}
+
+				if (completion.flags & IORING_CQE_F_BUFFER)
+				{
+					--kernelBuffers;
+				}
+
+				if (completion.result >= 0 &&
+				    (completion.flags & IORING_CQE_F_BUFFER))
+				{
+					ready.push_back(Received{static_cast<std::uint16_t>(
+					                            completion.flags >>
+					                            IORING_CQE_BUFFER_SHIFT),
+					                         completion.result});
+					receivedAny = true;
+				}
+				else if (completion.result == -EINVAL && !receivedAny)
+				{
+					// Multishot receives predate nothing else relied on, so
+					// this is only found out now.
+					std::cerr << "io_uring multishot receive unsupported, "
+					          << "falling back to asio" << std::endl;
+					fallback = true;
+				}
+				else if (completion.result < 0 &&
+				         completion.result != -ENOBUFS &&
+				         completion.result != -ECANCELED)
+				{
+					std::cerr << "Error receiving: "
+					          << errorFor(completion.result) << std::endl;
+				}
+			}
+		}
+
+		// Out of buffers, the receive stops until some are given back.
+		armReceive();
+	}
+
+	/*!
+	 * \brief Turn a received buffer into the datagram's payload.
+	 *
+	 * \return Whether or not the datagram is usable (not truncated).
+	 */
+	bool unpack(SharedBuffer &buffer, std::int32_t length,
+	            boost::asio::ip::udp::endpoint &sender) const
+	{
+		const std::size_t payloadOffset = sizeof(io_uring_recvmsg_out) +
+		                                  header.msg_namelen;
+		if (static_cast<std::size_t>(length) < payloadOffset)
+		{
+			return false;
+		}
+
+		io_uring_recvmsg_out out;
+		std::memcpy(&out, buffer.data(), sizeof(out));
+		if ((out.flags & MSG_TRUNC) || out.namelen > header.msg_namelen ||
+		    out.payloadlen > length - payloadOffset)
+		{
+			return false;
+		}
+
+		std::memcpy(sender.data(), buffer.data() + sizeof(out), out.namelen);
+		sender.resize(out.namelen);
+
+		buffer.trimFront(payloadOffset);
+		buffer.resize(out.payloadlen);
+		return true;
+	}
+
+	/*!
+	 * \brief Hand a buffer (or a new one, if it won't do) to the kernel in
+	 *        place of the one with the given ID.
+	 */
+	void recycle(std::uint16_t id, SharedBuffer buffer)
+	{
+		if (!buffer || buffer.capacity() < ringBufferSize)
+		{
+			buffer = SharedBuffer(ringBufferSize);
+		}
+		else
+		{
+			buffer.resize(ringBufferSize);
+		}
+
+		ring->provideBuffer(buffer.data(), ringBufferSize, id);
+		buffers[id] = std::move(buffer);
+		++kernelBuffers;
+	}
+
+	std::size_t receive(DatagramBatch<boost::asio::ip::udp::endpoint> &batch,
+	                    boost::system::error_code &error)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!ring)
+		{
+			error = boost::asio::error::bad_descriptor;
+			return 0;
+		}
+
+		reap();
+
+		std::size_t count = 0;
+		bool recycled = !ready.empty();
+		while (count < batch.size() && !ready.empty())
+		{
+			Received received = ready.front();
+			ready.pop_front();
+
+			// The slot's buffer replaces the received one in the ring.
+			SharedBuffer buffer = std::move(buffers[received.id]);
+			Datagram<boost::asio::ip::udp::endpoint> &datagram = batch[count];
+			if (unpack(buffer, received.length, datagram.endpoint))
+			{
+				datagram.buffer.swap(buffer);
+				++count;
+			}
+
+			recycle(received.id, std::move(buffer));
+		}
+
+		if (recycled)
+		{
+			ring->commitBuffers();
+			armReceive();
+		}
+
+		if (count == 0)
+		{
+			error = boost::asio::error::would_block;
+		}
+
+		return count;
+	}
+
+	/*!
+	 * \brief Copy the next usable datagram out, if any.
+	 */
+	bool receiveOne(const Waiter &waiter, std::size_t &length)
+	{
+		bool found = false;
+		bool recycled = !ready.empty();
+		while (!found && !ready.empty())
+		{
+			Received received = ready.front();
+			ready.pop_front();
+
+			SharedBuffer buffer = buffers[received.id];
+			if (unpack(buffer, received.length, *waiter.sender))
+			{
+				length = std::min(buffer.size(),
+				                  boost::asio::buffer_size(waiter.buffer));
+				std::memcpy(boost::asio::buffer_cast<void*>(waiter.buffer),
+				            buffer.data(), length);
+				found = true;
+			}
+
+			recycle(received.id, std::move(buffers[received.id]));
+		}
+
+		if (recycled)
+		{
+			ring->commitBuffers();
+			armReceive();
+		}
+
+		return found;
+	}
+
+	void wait(Waiter waiter)
+	{
+		boost::system::error_code error;
+		std::size_t length = 0;
+		bool done = false;
+		bool fellBack = false;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!ring)
+			{
+				error = boost::asio::error::bad_descriptor;
+				done = true;
+			}
+			else
+			{
+				reap();
+				fellBack = fallback;
+				if (!fellBack)
+				{
+					done = waiter.copy ? receiveOne(waiter, length) :
+					                     !ready.empty();
+				}
+			}
+
+			if (!done && !fellBack)
+			{
+				// The waiter lives in the pending wait rather than in here,
+				// so the IO service owns it like any other handler.
+				events.async_read_some(
+				         boost::asio::null_buffers(),
+				         std::bind(&Private::handleEvents, shared_from_this(),
+				                   waiter, std::placeholders::_1));
+			}
+		}
+
+		if (fellBack)
+		{
+			waitOnSocket(waiter);
+		}
+		else if (done)
+		{
+			ioService.post(std::bind(waiter.handler, error, length));
+		}
+	}
+
+	void handleEvents(const Waiter &waiter,
+	                  const boost::system::error_code &error)
+	{
+		if (error)
+		{
+			waiter.handler(error, 0);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (ring)
+			{
+				clearEvents(events.native_handle());
+			}
+		}
+
+		wait(waiter);
+	}
+
+	void waitOnSocket(const Waiter &waiter)
+	{
+		if (waiter.copy)
+		{
+			socket.async_receive_from(
+			         boost::asio::buffer(waiter.buffer), *waiter.sender,
+			         waiter.handler);
+		}
+		else
+		{
+			socket.async_receive(boost::asio::null_buffers(), waiter.handler);
+		}
+	}
+
+	boost::asio::io_service &ioService;
+	boost::asio::ip::udp::socket &socket;
+
+	std::mutex mutex;
+	std::unique_ptr<Uring> ring;
+	boost::asio::posix::stream_descriptor events;
+	msghdr header;
+
+	std::size_t bufferSize;
+	std::size_t ringBufferSize;
+
+	// Buffers handed to the kernel, by ID, and datagrams received into them
+	// not yet handed out.
+	std::vector<SharedBuffer> buffers;
+	std::size_t kernelBuffers;
+	std::deque<Received> ready;
+
+	bool receiving;
+	bool receivedAny;
+	std::atomic<bool> fallback;
+};
+
+UringDatagramSocket::UringDatagramSocket(
+      boost::asio::io_service &ioService,
+      std::unique_ptr<boost::asio::ip::udp::socket> socket, bool useUring,
+      std::size_t bufferSize) :
+   m_socket(std::move(socket)),
+   m_segmenting(false),
+   m_coalescing(false)
+{
+	if (!useUring || !Uring::isSupported())
+	{
+		return;
+	}
+
+	m_data = std::make_shared<Private>(ioService, *m_socket, bufferSize);
+	try
+	{
+		m_data->start();
+	}
+	catch (const boost::system::system_error &error)
+	{
+		std::cerr << "Unable to use io_uring (" << error.what()
+		          << "), falling back to asio" << std::endl;
+		m_data->stop();
+		m_data.reset();
+	}
+}
+
+UringDatagramSocket::~UringDatagramSocket()
+{
+	if (m_data)
+	{
+		m_data->stop();
+	}
+}
+
+bool UringDatagramSocket::usingUring() const
+{
+	return m_data && !m_data->fallback;
+}
+
+bool UringDatagramSocket::enableSegmentation()
+{
+	m_segmenting = supportsSegmentation(*m_socket);
+	return m_segmenting;
+}
+
+bool UringDatagramSocket::enableCoalescing()
+{
+	m_coalescing = !m_data && enableReceiveCoalescing(*m_socket);
+	return m_coalescing;
+}
+
+void UringDatagramSocket::receiveFrom(
+      const boost::asio::mutable_buffers_1 &buffers,
+      boost::asio::ip::udp::endpoint &sender, UringHandler handler)
+{
+	m_data->wait(Private::Waiter{handler, true, buffers, &sender});
+}
+
+void UringDatagramSocket::waitForDatagrams(UringHandler handler)
+{
+	m_data->wait(Private::Waiter{handler, false,
+	                             boost::asio::mutable_buffer(), nullptr});
+}
+
+std::size_t internal::receiveDatagrams(
+      UringDatagramSocket &socket,
+      DatagramBatch<boost::asio::ip::udp::endpoint> &batch,
+      boost::system::error_code &error)
+{
+	if (socket.m_coalescing)
+	{
+		return receiveCoalescedDatagrams(socket.socket(), batch, error);
+	}
+
+	if (!socket.usingUring())
+	{
+		return receiveDatagrams(socket.socket(), batch, error);
+	}
+
+	return socket.m_data->receive(batch, error);
+}
+
+bool internal::sendDatagram(UringDatagramSocket &socket,
+                            const boost::asio::ip::udp::endpoint &destination,
+                            const SharedBuffer &buffer,
+                            boost::system::error_code &error)
+{
+	return sendDatagram(socket.socket(), destination, buffer, error);
+}
+
+std::size_t internal::sendDatagrams(
+      UringDatagramSocket &socket,
+      const Datagram<boost::asio::ip::udp::endpoint> *datagrams,
+      std::size_t count, boost::system::error_code &error)
+{
+	if (socket.m_segmenting)
+	{
+		return sendSegmentedDatagrams(socket.socket(), datagrams, count, error);
+	}
+
+	return sendDatagrams(socket.socket(), datagrams, count, error);
+}
+
+struct UringStreamDescriptor::Private :
+      public std::enable_shared_from_this<UringStreamDescriptor::Private>
+{
+	// Handlers waiting for completions. They're only referenced by the
+	// pending wait on the eventfd (the Private merely keeps track of it), so
+	// the IO service owns them like any other handler, and handlers holding
+	// on to the descriptor don't keep it alive forever.
+	typedef std::pair<UringHandler, std::int32_t> Completed;
+
+	struct Pending
+	{
+		std::vector<UringHandler> reads;
+		UringHandler writable;
+	};
+
+	Private(boost::asio::io_service &ioService, int descriptor) :
+	   ioService(ioService),
+	   descriptor(descriptor),
+	   events(ioService),
+	   writes(MAXIMUM_WRITES_IN_FLIGHT),
+	   failedWrites(0),
+	   readsInFlight(0),
+	   waiting(false)
+	{
+		freeWrites.reserve(MAXIMUM_WRITES_IN_FLIGHT);
+		for (std::size_t i = MAXIMUM_WRITES_IN_FLIGHT; i > 0; --i)
+		{
+			freeWrites.push_back(i - 1);
+		}
+	}
+
+	void start()
+	{
+		// Room for every write in flight plus a few reads.
+		ring.reset(new Uring(MAXIMUM_WRITES_IN_FLIGHT * 2));
+		ring->registerFile(descriptor);
+		events.assign(registerEvents(*ring));
+	}
+
+	void stop()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		// Cancels (and waits for) reads and writes, so their memory can go.
+		ring.reset();
+		writes.clear();
+
+		boost::system::error_code error;
+		events.close(error);
+	}
+
+	std::shared_ptr<Pending> pendingHandlers()
+	{
+		std::shared_ptr<Pending> handlers = pending.lock();
+		if (!handlers)
+		{
+			handlers = std::make_shared<Pending>();
+			pending = handlers;
+			waiting = false;
+		}
+
+		return handlers;
+	}
+
+	void waitForEvents(const std::shared_ptr<Pending> &handlers)
+	{
+		if (waiting)
+		{
+			return;
+		}
+
+		events.async_read_some(boost::asio::null_buffers(),
+		                       std::bind(&Private::handleEvents,
+		                                 shared_from_this(), handlers,
+		                                 std::placeholders::_1));
+		waiting = true;
+	}
+
+	void post(const UringHandler &handler, boost::system::error_code error)
+	{
+		ioService.post(std::bind(handler, error, 0));
+	}
+
+	void post(const UringHandler &handler, std::int32_t result)
+	{
+		ioService.post(std::bind(handler, resultError(result),
+		                         result < 0 ? 0 : result));
+	}
+
+	void read(const boost::asio::mutable_buffers_1 &buffers,
+	          const UringHandler &handler)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!ring)
+		{
+			post(handler, boost::asio::error::bad_descriptor);
+			return;
+		}
+
+		std::shared_ptr<Pending> handlers = pendingHandlers();
+		std::size_t slot = 0;
+		while (slot < handlers->reads.size() && handlers->reads[slot])
+		{
+			++slot;
+		}
+
+		io_uring_sqe *entry = ring->prepare(READ_TAG | slot);
+		if (!entry)
+		{
+			post(handler, boost::asio::error::no_buffer_space);
+			return;
+		}
+
+		// Straight into the caller's buffer.
+		entry->opcode = IORING_OP_READ;
+		entry->fd = 0;
+		entry->flags = IOSQE_FIXED_FILE;
+		entry->addr = reinterpret_cast<std::uint64_t>(
+		                 boost::asio::buffer_cast<void*>(buffers));
+		entry->len = boost::asio::buffer_size(buffers);
+		entry->off = static_cast<std::uint64_t>(-1);
+
+		try
+		{
+			ring->submit();
+		}
+		catch (const boost::system::system_error &error)
+		{
+			post(handler, error.code());
+			return;
+		}
+
+		if (slot == handlers->reads.size())
+		{
+			handlers->reads.push_back(handler);
+		}
+		else
+		{
+			handlers->reads[slot] = handler;
+		}
+
+		++readsInFlight;
+		waitForEvents(handlers);
+	}
+
+	std::size_t write(const SharedBuffer *packets, std::size_t count,
+	                  boost::system::error_code &error)
+	{
+		std::vector<Completed> completed;
+		std::size_t queued = 0;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!ring)
+			{
+				error = boost::asio::error::bad_descriptor;
+				return 0;
+			}
+
+			// Writes to a TUN device complete as they're submitted, so the
+			// previous batch is usually done already.
+			std::shared_ptr<Pending> handlers = pendingHandlers();
+			reap(*handlers, completed);
+
+			// Independent requests may complete in any order, so only one
+			// batch is in flight at a time, its writes linked to keep
+			// packets in order. The links are hard ones, so a packet that
+			// can't be written doesn't take the rest of the batch with it.
+			io_uring_sqe *last = nullptr;
+			while (freeWrites.size() == MAXIMUM_WRITES_IN_FLIGHT &&
+			       queued < count && queued < MAXIMUM_WRITES_IN_FLIGHT)
+			{
+				std::size_t slot = freeWrites[freeWrites.size() - 1 - queued];
+				io_uring_sqe *entry = ring->prepare(WRITE_TAG | slot);
+				if (!entry)
+				{
+					break;
+				}
+
+				last = entry;
+
+				const SharedBuffer &packet = packets[queued];
+				entry->opcode = IORING_OP_WRITE;
+				entry->fd = 0;
+				entry->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+				entry->addr = reinterpret_cast<std::uint64_t>(packet.data());
+				entry->len = packet.size();
+				entry->off = static_cast<std::uint64_t>(-1);
+
+				// The kernel reads from it until the write completes.
+				writes[slot] = packet;
+				++queued;
+			}
+
+			if (queued > 0)
+			{
+				freeWrites.resize(freeWrites.size() - queued);
+				last->flags &= ~IOSQE_IO_HARDLINK;
+
+				// The whole batch in one go.
+				try
+				{
+					ring->submit();
+				}
+				catch (const boost::system::system_error &systemError)
+				{
+					error = systemError.code();
+				}
+
+				waitForEvents(handlers);
+			}
+			else if (count > 0)
+			{
+				error = boost::asio::error::would_block;
+			}
+		}
+
+		for (const Completed &entry : completed)
+		{
+			post(entry.first, entry.second);
+		}
+
+		return queued;
+	}
+
+	std::size_t takeFailedWrites()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::size_t failed = failedWrites;
+		failedWrites = 0;
+		return failed;
+	}
+
+	void waitForRoom(const UringHandler &handler)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!ring)
+		{
+			post(handler, boost::asio::error::bad_descriptor);
+			return;
+		}
+
+		if (freeWrites.size() == MAXIMUM_WRITES_IN_FLIGHT)
+		{
+			post(handler, boost::system::error_code());
+			return;
+		}
+
+		std::shared_ptr<Pending> handlers = pendingHandlers();
+		handlers->writable = handler;
+		waitForEvents(handlers);
+	}
+
+	/*!
+	 * \brief Collect completed requests, releasing written packets and
+	 *        taking the handlers of completed reads (and of the writer, if
+	 *        it's waiting and there's room).
+	 */
+	void reap(Pending &handlers, std::vector<Completed> &completed)
+	{
+		UringCompletion completions[COMPLETION_BATCH];
+		std::size_t count;
+		while ((count = ring->complete(completions, COMPLETION_BATCH)) > 0)
+		{
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				const UringCompletion &completion = completions[i];
+				std::size_t slot = completion.userData & 0xffffffff;
+				if ((completion.userData & ~0xffffffffull) == READ_TAG)
+				{
+					completed.push_back(Completed(
+					      std::move(handlers.reads[slot]), completion.result));
+					handlers.reads[slot] = nullptr;
+					--readsInFlight;
+				}
+				else
+				{
+					writes[slot].reset();
+					freeWrites.push_back(slot);
+
+					// Cancelled writes (the ring going away, or a batch the
+					// kernel refused outright) are lost just the same.
+					if (completion.result < 0)
+					{
+						++failedWrites;
+						if (completion.result != -ECANCELED)
+						{
+							std::cerr << "Error writing: "
+							          << errorFor(completion.result)
+							          << std::endl;
+						}
+					}
+				}
+			}
+		}
+
+		if (handlers.writable &&
+		    freeWrites.size() == MAXIMUM_WRITES_IN_FLIGHT)
+		{
+			completed.push_back(Completed(std::move(handlers.writable), 0));
+			handlers.writable = nullptr;
+		}
+	}
+
+	void handleEvents(const std::shared_ptr<Pending> &handlers,
+	                  const boost::system::error_code &error)
+	{
+		std::vector<Completed> completed;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			waiting = false;
+			if (error || !ring)
+			{
+				return;
+			}
+
+			clearEvents(events.native_handle());
+			reap(*handlers, completed);
+
+			if (readsInFlight > 0 ||
+			    freeWrites.size() < MAXIMUM_WRITES_IN_FLIGHT ||
+			    handlers->writable)
+			{
+				waitForEvents(handlers);
+			}
+		}
+
+		for (const Completed &entry : completed)
+		{
+			entry.first(resultError(entry.second),
+			            entry.second < 0 ? 0 : entry.second);
+		}
+	}
+
+	boost::asio::io_service &ioService;
+	int descriptor;
+
+	std::mutex mutex;
+	std::unique_ptr<Uring> ring;
+	boost::asio::posix::stream_descriptor events;
+
+	// Packets being written, by slot, and the slots free.
+	std::vector<SharedBuffer> writes;
+	std::vector<std::size_t> freeWrites;
+
+	// Queued packets that couldn't be written, since last taken.
+	std::size_t failedWrites;
+
+	std::size_t readsInFlight;
+	std::weak_ptr<Pending> pending;
+	bool waiting;
+};
+
+UringStreamDescriptor::UringStreamDescriptor(boost::asio::io_service &ioService,
+                                             int descriptor, bool useUring) :
+   m_descriptor(ioService, descriptor)
+{
+	if (!useUring || !Uring::isSupported())
+	{
+		return;
+	}
+
+	m_data = std::make_shared<Private>(ioService, descriptor);
+	try
+	{
+		m_data->start();
+	}
+	catch (const boost::system::system_error &error)
+	{
+		std::cerr << "Unable to use io_uring (" << error.what()
+		          << "), falling back to asio" << std::endl;
+		m_data->stop();
+		m_data.reset();
+	}
+}
+
+UringStreamDescriptor::~UringStreamDescriptor()
+{
+	if (m_data)
+	{
+		m_data->stop();
+	}
+}
+
+bool UringStreamDescriptor::usingUring() const
+{
+	return static_cast<bool>(m_data);
+}
+
+void UringStreamDescriptor::read(const boost::asio::mutable_buffers_1 &buffers,
+                                 UringHandler handler)
+{
+	m_data->read(buffers, handler);
+}
+
+void UringStreamDescriptor::waitForRoom(UringHandler handler)
+{
+	m_data->waitForRoom(handler);
+}
+
+std::size_t internal::writePackets(UringStreamDescriptor &descriptor,
+                                   const SharedBuffer *packets,
+                                   std::size_t count,
+                                   boost::system::error_code &error)
+{
+	if (!descriptor.usingUring())
+	{
+		return writePackets(descriptor.descriptor(), packets, count, error);
+	}
+
+	return descriptor.m_data->write(packets, count, error);
+}
+
+std::size_t internal::writeGathered(UringStreamDescriptor &descriptor,
+                                    const SharedBuffer *buffers,
+                                    std::size_t count, std::size_t offset,
+                                    boost::system::error_code &error)
+{
+	return writeGathered(descriptor.descriptor(), buffers, count, offset,
+	                     error);
+}
+
+std::size_t internal::takeFailedWrites(UringStreamDescriptor &descriptor)
+{
+	if (!descriptor.usingUring())
+	{
+		return 0;
+	}
+
+	return descriptor.m_data->takeFailedWrites();
+}
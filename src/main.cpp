@@ -1,3 +1,5 @@
+#include <cctype>
+#include <fstream>
 #include <iostream>
 #include <thread>
 
@@ -8,6 +10,7 @@
 
 #include "version.h"
 #include "overpass_server.h"
+#include "sharded_runtime.h"
 
 void parseParameters(
       int argc, char *argv[],
@@ -21,7 +24,68 @@ void parseParameters(
 	      ("version,v", "Print version number")
 	      ("address", value<std::string>(), "Selected Overpass address")
 	      ("client,c", value<std::vector<std::string>>(),
-	       "<overpass client IP>:<external IP>");
+	       "<overpass client IP>:<external IP>")
+	      ("route,r", value<std::vector<std::string>>(),
+	       "<network>/<prefix length>:<external IP> (route a network behind "
+	       "a client; the host must route it to the Overpass interface)")
+	      ("batch-size", value<std::size_t>()->default_value(32),
+	       "Maximum number of datagrams to read from the external socket at once")
+	      ("virtual-queues", value<std::size_t>()->default_value(1),
+	       "Number of queues to open on the virtual interface (0 for one per "
+	       "thread)")
+	      ("external-sockets", value<std::size_t>()->default_value(1),
+	       "Number of SO_REUSEPORT sockets to open for external traffic (0 for "
+	       "one per thread)")
+	      ("steer-by-peer",
+	       "Steer external traffic to sockets by peer address rather than "
+	       "address and port")
+	      ("send-queue-depth", value<std::size_t>()->default_value(256),
+	       "Maximum number of packets per external socket waiting for room "
+	       "to be sent")
+	      ("send-drop-policy", value<std::string>()->default_value("tail"),
+	       "What to drop when a send queue is full: 'tail' (the packet being "
+	       "sent) or 'oldest' (the packet that has waited longest)")
+	      ("dispatch", value<std::string>()->default_value("post"),
+	       "How packets read are handed to the router: 'post' (through the "
+	       "IO service) or 'inline' (on the thread that read them)")
+	      ("read-depth", value<std::size_t>()->default_value(1),
+	       "Number of reads to keep outstanding on each external socket and "
+	       "virtual interface queue")
+	      ("ordered-reads",
+	       "Route packets from each socket and queue in the order they were "
+	       "read, whatever the read depth and number of threads")
+	      ("log-drops", "Log dropped packets (at most once a second)")
+	      ("keepalive", value<unsigned int>()->default_value(0),
+	       "Seconds between keepalives sent to each client, keeping NAT "
+	       "mappings open (0 disables them)")
+	      ("icmp-unreachable",
+	       "Answer packets without a route with ICMP destination unreachable")
+	      ("io-backend", value<std::string>()->default_value("asio"),
+	       "I/O backend: 'asio' (readiness and system calls) or 'io_uring' "
+	       "(falls back to asio if the kernel doesn't support it)")
+	      ("tun-offload",
+	       "Enable offloads on the virtual interface (TCP segmentation and "
+	       "receive coalescing)")
+	      ("udp-offload",
+	       "Use UDP segmentation and receive coalescing offloads on the "
+	       "external sockets, if supported")
+	      ("cipher", value<std::string>()->default_value("none"),
+	       "Cipher sealing traffic between peers: 'none', "
+	       "'chacha20-poly1305' or 'aes-256-gcm'")
+	      ("key-file", value<std::string>(),
+	       "File holding the key shared with peers, authenticating the "
+	       "handshakes that agree on session keys, as 64 hexadecimal digits "
+	       "(required with a cipher)")
+	      ("metrics-socket", value<std::string>(),
+	       "Path of a Unix socket serving traffic counters (in the Prometheus "
+	       "text format) to whoever connects")
+	      ("runtime", value<std::string>()->default_value("shared"),
+	       "Execution model: 'shared' (one IO service run by a pool of "
+	       "threads) or 'per-core' (one IO service per core, each on its own "
+	       "pinned thread)")
+	      ("trace-latency",
+	       "Time packets through each stage of forwarding, serving latency "
+	       "percentiles on the metrics socket");
 
 	using boost::program_options::store;
 	using boost::program_options::parse_command_line;
@@ -32,6 +96,30 @@ void parseParameters(
 	notify(parameters);
 }
 
+bool readKeyFile(const std::string &path, std::vector<std::uint8_t> &key)
+{
+	std::ifstream file(path);
+	std::string hex;
+	if (!(file >> hex) || hex.size() != 64)
+	{
+		return false;
+	}
+
+	key.clear();
+	for (std::size_t i = 0; i < hex.size(); i += 2)
+	{
+		std::string digits = hex.substr(i, 2);
+		if (!std::isxdigit(digits[0]) || !std::isxdigit(digits[1]))
+		{
+			return false;
+		}
+
+		key.push_back(std::uint8_t(std::stoul(digits, nullptr, 16)));
+	}
+
+	return true;
+}
+
 int main(int argc, char *argv[])
 {
 	boost::program_options::options_description availableParameters("Parameters");
@@ -67,15 +155,146 @@ int main(int argc, char *argv[])
 
 	std::string overpassAddress = parameters["address"].as<std::string>();
 
-	std::shared_ptr<boost::asio::io_service> ioService(
-	         new boost::asio::io_service);
+	Overpass::OverpassServerOptions options;
+	options.externalBatchSize = std::max(
+	         static_cast<std::size_t>(1), parameters["batch-size"].as<std::size_t>());
+
+	// Make sure we have at least two threads
+	auto numberOfCores = std::max(static_cast<unsigned int>(2),
+	                              std::thread::hardware_concurrency());
+
+	options.virtualQueueCount = parameters["virtual-queues"].as<std::size_t>();
+	if (options.virtualQueueCount == 0)
+	{
+		// One queue per thread, including this one.
+		options.virtualQueueCount = numberOfCores + 1;
+	}
+
+	options.externalSocketCount = parameters["external-sockets"].as<std::size_t>();
+	if (options.externalSocketCount == 0)
+	{
+		options.externalSocketCount = numberOfCores + 1;
+	}
+
+	options.steerExternalByPeer = parameters.count("steer-by-peer") > 0;
+	options.externalSendQueueDepth = parameters["send-queue-depth"].as<std::size_t>();
+
+	std::string dropPolicy = parameters["send-drop-policy"].as<std::string>();
+	if (dropPolicy == "oldest")
+	{
+		options.externalSendDropPolicy = Overpass::SendDropPolicy::DropOldest;
+	}
+	else if (dropPolicy != "tail")
+	{
+		std::cerr << "Invalid send drop policy: " << dropPolicy << std::endl;
+		return 1;
+	}
+
+	std::string dispatchMode = parameters["dispatch"].as<std::string>();
+	if (dispatchMode == "inline")
+	{
+		options.dispatchMode = Overpass::DispatchMode::Inline;
+	}
+	else if (dispatchMode != "post")
+	{
+		std::cerr << "Invalid dispatch mode: " << dispatchMode << std::endl;
+		return 1;
+	}
+
+	options.readDepth = std::max(
+	         static_cast<std::size_t>(1), parameters["read-depth"].as<std::size_t>());
+	options.orderedReads = parameters.count("ordered-reads") > 0;
+
+	options.logDrops = parameters.count("log-drops") > 0;
+	options.keepaliveInterval = std::chrono::seconds(
+	                               parameters["keepalive"].as<unsigned int>());
+	options.sendUnreachable = parameters.count("icmp-unreachable") > 0;
+	if (parameters.count("metrics-socket"))
+	{
+		options.metricsSocket = parameters["metrics-socket"].as<std::string>();
+	}
+
+	options.traceLatency = parameters.count("trace-latency") > 0;
+
+	std::string ioBackend = parameters["io-backend"].as<std::string>();
+	if (ioBackend == "io_uring")
+	{
+		options.useIoUring = true;
+	}
+	else if (ioBackend != "asio")
+	{
+		std::cerr << "Invalid I/O backend: " << ioBackend << std::endl;
+		return 1;
+	}
+
+	options.virtualOffload = parameters.count("tun-offload") > 0;
+	options.externalUdpOffload = parameters.count("udp-offload") > 0;
+
+	std::string cipherName = parameters["cipher"].as<std::string>();
+	for (auto cipher : {Overpass::Cipher::ChaCha20Poly1305,
+	                    Overpass::Cipher::Aes256Gcm})
+	{
+		if (cipherName == Overpass::toString(cipher))
+		{
+			options.cipher = cipher;
+		}
+	}
+
+	if (options.cipher == Overpass::Cipher::None && cipherName != "none")
+	{
+		std::cerr << "Invalid cipher: " << cipherName << std::endl;
+		return 1;
+	}
+
+	if (options.cipher != Overpass::Cipher::None)
+	{
+		if (!parameters.count("key-file") ||
+		    !readKeyFile(parameters["key-file"].as<std::string>(), options.key))
+		{
+			std::cerr << "A key file holding 64 hexadecimal digits is required "
+			          << "with a cipher" << std::endl;
+			return 1;
+		}
+	}
+
+	std::string runtimeName = parameters["runtime"].as<std::string>();
+	if (runtimeName != "shared" && runtimeName != "per-core")
+	{
+		std::cerr << "Invalid runtime: " << runtimeName << std::endl;
+		return 1;
+	}
+
+	// In per-core mode the runtime owns the IO services, and the first one
+	// doubles as the home of the signal handling below.
+	std::unique_ptr<Overpass::ShardedRuntime> runtime;
+	std::shared_ptr<boost::asio::io_service> ioService;
+	if (runtimeName == "per-core")
+	{
+		runtime.reset(new Overpass::ShardedRuntime(
+		                 Overpass::ShardedRuntime::availableShards()));
+		ioService = runtime->ioService(0);
+	}
+	else
+	{
+		ioService.reset(new boost::asio::io_service);
+	}
+
 	std::unique_ptr<Overpass::OverpassServer> server;
 
 	try
 	{
-		server.reset(new Overpass::OverpassServer(
-		                ioService, "ovp%d", overpassAddress, "255.255.255.0",
-		                "0.0.0.0", 14358));
+		if (runtime)
+		{
+			server.reset(new Overpass::OverpassServer(
+			                *runtime, "ovp%d", overpassAddress, "255.255.255.0",
+			                "0.0.0.0", 14358, options));
+		}
+		else
+		{
+			server.reset(new Overpass::OverpassServer(
+			                ioService, "ovp%d", overpassAddress, "255.255.255.0",
+			                "0.0.0.0", 14358, options));
+		}
 	}
 	catch (const Overpass::Exception &exception)
 	{
@@ -114,13 +333,49 @@ int main(int argc, char *argv[])
 		          << "limited." << std::endl;
 	}
 
+	if (parameters.count("route"))
+	{
+		std::vector<std::string> routes = parameters["route"].as<std::vector<std::string>>();
+		for (const auto &route : routes)
+		{
+			std::vector<std::string> substrings;
+			boost::split(substrings, route, boost::is_any_of("/:"));
+			if (substrings.size() != 3)
+			{
+				std::cerr << "Invalid route specification: " << route
+				          << std::endl;
+				return 1;
+			}
+
+			try
+			{
+				auto network = boost::asio::ip::address::from_string(
+				                  substrings.at(0));
+				unsigned int prefixLength = std::stoul(substrings.at(1));
+				auto externalAddress = boost::asio::ip::address::from_string(
+				                          substrings.at(2));
+
+				std::cout << "Adding route " << network.to_string() << "/"
+				          << prefixLength << " -> "
+				          << externalAddress.to_string() << std::endl;
+				server->addRoute(network, prefixLength, externalAddress);
+			}
+			catch (const std::exception &exception)
+			{
+				std::cerr << "Invalid route specification: " << route << " ("
+				          << exception.what() << ")" << std::endl;
+				return 1;
+			}
+		}
+	}
+
 	// Construct a signal set registered for process termination.
 	boost::asio::signal_set signal_set(*ioService, SIGINT, SIGTERM);
 
 	// Start an asynchronous wait for one of the signals to occur.
 	using boost::system::error_code;
 	signal_set.async_wait(
-	         [&ioService](const error_code& error, int /*signalNumber*/)
+	         [&ioService, &runtime](const error_code& error, int /*signalNumber*/)
 	{
 		if (error)
 		{
@@ -129,32 +384,99 @@ int main(int argc, char *argv[])
 
 		std::cout << "Caught signal: requesting stop" << std::endl;
 
-		ioService->stop();
+		if (runtime)
+		{
+			runtime->stop();
+		}
+		else
+		{
+			ioService->stop();
+		}
 	});
 
-	// Make sure we have at least two threads
-	auto numberOfCores = std::max(static_cast<unsigned int>(2),
-	                              std::thread::hardware_concurrency());
+	if (runtime)
+	{
+		std::cout << "Firing up " << runtime->shardCount()
+		          << " pinned shards..." << std::endl;
+
+		// This will block until every shard is stopped.
+		runtime->run();
+
+		std::cout << "Stopping..." << std::endl;
+	}
+	else
+	{
+		std::cout << "Firing up " << numberOfCores << " threads..." << std::endl;
+
+		std::vector<std::thread> threadPool;
+		for (unsigned int i = 0; i < numberOfCores; ++i)
+		{
+			threadPool.push_back(std::thread([ioService](){ioService->run();}));
+		}
 
-	std::cout << "Firing up " << numberOfCores << " threads..." << std::endl;
+		// This will block, and the current thread will begin serving the IO
+		// service until it is stopped, at which time execution will resume
+		// here.
+		ioService->run();
+
+		std::cout << "Stopping..." << std::endl;
+
+		std::for_each(threadPool.begin(), threadPool.end(),
+		              [](std::thread &thread)
+		{
+			thread.join();
+		});
+	}
 
-	std::vector<std::thread> threadPool;
-	for (unsigned int i = 0; i < numberOfCores; ++i)
+	// Report what was dropped, and why.
+	for (auto reason : {Overpass::RoutingResult::Malformed,
+	                    Overpass::RoutingResult::Multicast,
+	                    Overpass::RoutingResult::NoRoute,
+	                    Overpass::RoutingResult::SpoofedSource})
 	{
-		threadPool.push_back(std::thread([ioService](){ioService->run();}));
+		std::uint64_t dropped = server->dropCount(reason);
+		if (dropped > 0)
+		{
+			std::cout << "Dropped " << dropped << " packet(s): "
+			          << Overpass::toString(reason) << std::endl;
+		}
 	}
 
-	// This will block, and the current thread will begin serving the IO service
-	// until it is stopped, at which time execution will resume here.
-	ioService->run();
+	std::uint64_t unauthentic = server->authenticationFailures();
+	if (unauthentic > 0)
+	{
+		std::cout << "Dropped " << unauthentic << " packet(s): failed "
+		          << "authentication" << std::endl;
+	}
 
-	std::cout << "Stopping..." << std::endl;
+	std::uint64_t replayed = server->replayedPackets();
+	if (replayed > 0)
+	{
+		std::cout << "Dropped " << replayed << " packet(s): replayed"
+		          << std::endl;
+	}
 
-	std::for_each(threadPool.begin(), threadPool.end(),
-	              [](std::thread &thread)
+	// Report how the packet buffer pool fared, to help with sizing it.
+	for (const auto &entry : Overpass::BufferPool::instance().statistics())
 	{
-		thread.join();
-	});
+		if (entry.hits == 0 && entry.misses == 0)
+		{
+			continue;
+		}
+
+		std::cout << "Buffer pool ";
+		if (entry.bufferSize > 0)
+		{
+			std::cout << "(" << entry.bufferSize << " bytes)";
+		}
+		else
+		{
+			std::cout << "(oversized)";
+		}
+
+		std::cout << ": " << entry.hits << " hits, " << entry.misses
+		          << " misses, " << entry.buffers << " buffers" << std::endl;
+	}
 
 	return 0;
 }
@@ -1,16 +1,52 @@
 #include "internal/overpass_server_private.h"
+#include "sharded_runtime.h"
 #include "overpass_server.h"
 
 using namespace Overpass;
 
+OverpassServerOptions::OverpassServerOptions() :
+   externalBatchSize(1),
+   virtualQueueCount(1),
+   externalSocketCount(1),
+   steerExternalByPeer(false),
+   externalSendQueueDepth(256),
+   externalSendDropPolicy(SendDropPolicy::DropNewest),
+   dispatchMode(DispatchMode::Post),
+   readDepth(1),
+   orderedReads(false),
+   logDrops(false),
+   keepaliveInterval(0),
+   traceLatency(false),
+   sendUnreachable(false),
+   useIoUring(false),
+   virtualOffload(false),
+   externalUdpOffload(false),
+   cipher(Cipher::None)
+{
+}
+
 OverpassServer::OverpassServer(
       const SharedIoService &ioService,
       const std::string &overpassInterfacePattern,
       const std::string &overpassIpAddress, const std::string &overpassNetmask,
-      const std::string &bindIpAddress, std::uint16_t bindPort) :
+      const std::string &bindIpAddress, std::uint16_t bindPort,
+      const OverpassServerOptions &options) :
    m_data(new internal::OverpassServerPrivate(
-             ioService, overpassInterfacePattern, overpassIpAddress,
-             overpassNetmask, bindIpAddress, bindPort))
+             {ioService}, overpassInterfacePattern, overpassIpAddress,
+             overpassNetmask, bindIpAddress, bindPort, options))
+{
+	m_data->start(); // Start server
+}
+
+OverpassServer::OverpassServer(
+      const ShardedRuntime &runtime,
+      const std::string &overpassInterfacePattern,
+      const std::string &overpassIpAddress, const std::string &overpassNetmask,
+      const std::string &bindIpAddress, std::uint16_t bindPort,
+      const OverpassServerOptions &options) :
+   m_data(new internal::OverpassServerPrivate(
+             runtime.ioServices(), overpassInterfacePattern, overpassIpAddress,
+             overpassNetmask, bindIpAddress, bindPort, options))
 {
 	m_data->start(); // Start server
 }
@@ -21,3 +57,30 @@ void OverpassServer::addKnownClient(
 {
 	m_data->addKnownClient(overpassAddress, externalAddress);
 }
+
+void OverpassServer::addRoute(const boost::asio::ip::address &network,
+                              unsigned int prefixLength,
+                              const boost::asio::ip::address &externalAddress)
+{
+	m_data->addRoute(network, prefixLength, externalAddress);
+}
+
+std::uint64_t OverpassServer::dropCount(RoutingResult reason) const
+{
+	return m_data->dropCount(reason);
+}
+
+std::uint64_t OverpassServer::authenticationFailures() const
+{
+	return m_data->authenticationFailures();
+}
+
+std::uint64_t OverpassServer::replayedPackets() const
+{
+	return m_data->replayedPackets();
+}
+
+void OverpassServer::writeMetrics(std::ostream &stream) const
+{
+	m_data->writeMetrics(stream);
+}
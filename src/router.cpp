@@ -1,14 +1,32 @@
+#include <chrono>
 #include <iostream>
 
-#include <boost/asio/detail/socket_ops.hpp>
-
 #include <tins/ip.h>
-#include <tins/udp.h>
 
+#include "packet_view.h"
 #include "router.h"
+#include "internal/icmp.h"
 
 using namespace Overpass;
 
+namespace
+{
+	const std::int64_t LOG_INTERVAL_NANOSECONDS = 1000000000;
+
+	std::int64_t steadyNanoseconds()
+	{
+		using namespace std::chrono;
+		return duration_cast<nanoseconds>(
+		         steady_clock::now().time_since_epoch()).count();
+	}
+}
+
+RouterOptions::RouterOptions() :
+   logDrops(false),
+   sendUnreachable(false)
+{
+}
+
 RoutingException::RoutingException(const std::string &what) :
    Exception("unable to route packet: " + what)
 {
@@ -20,51 +38,138 @@ UnknownClientException::UnknownClientException(
 {
 }
 
-Router::Router(ExternalSender externalSender, VirtualSender virtualSender,
-               std::uint16_t overpassPort) :
-   m_externalSender(externalSender),
-   m_virtualSender(virtualSender),
-   m_overpassPort(overpassPort)
+const std::size_t RouterBase::BATCH_CHUNK_SIZE;
+
+RouterBase::RouterBase(std::uint16_t overpassPort,
+                       const RouterOptions &options) :
+   m_knownClients(overpassPort),
+   m_options(options),
+   m_counts(ROUTING_RESULT_COUNT),
+   m_nextLogTime(0),
+   m_loggedDrops(0)
 {
 }
 
-void Router::addKnownClient(const boost::asio::ip::address &overpassAddress,
-                            const boost::asio::ip::address &externalAddress)
+void RouterBase::addKnownClient(
+      const boost::asio::ip::address &overpassAddress,
+      const boost::asio::ip::address &externalAddress)
 {
-	m_knownClients[overpassAddress] = externalAddress;
+	m_knownClients.insert(overpassAddress, externalAddress);
 }
 
-void Router::handlePacketFromVirtual(Tins::IP &packet)
+bool RouterBase::removeKnownClient(
+      const boost::asio::ip::address &overpassAddress)
 {
-	// Extract the destination of this packet
-	boost::asio::ip::address_v4 destination(
-	         boost::asio::detail::socket_ops::network_to_host_long(
-	            packet.dst_addr()));
+	return m_knownClients.remove(overpassAddress);
+}
+
+void RouterBase::addRoute(const boost::asio::ip::address &network,
+                          unsigned int prefixLength,
+                          const boost::asio::ip::address &externalAddress)
+{
+	m_knownClients.insert(network, prefixLength, externalAddress);
+}
 
-	// Coming from the virtual interface, the destination will be an IP address
-	// on the Overpass network. We need to look it up in our routing table to
-	// determine where this packet actually needs to go.
-	boost::asio::ip::address clientAddress;
-	try
+bool RouterBase::removeRoute(const boost::asio::ip::address &network,
+                             unsigned int prefixLength)
+{
+	return m_knownClients.remove(network, prefixLength);
+}
+
+bool RouterBase::clientEndpoint(
+      const boost::asio::ip::address &externalAddress,
+      boost::asio::ip::udp::endpoint &endpoint) const
+{
+	return m_knownClients.clientEndpoint(externalAddress, endpoint);
+}
+
+std::map<boost::asio::ip::address, RoutingTable::Traffic>
+RouterBase::clientTraffic() const
+{
+	return m_knownClients.traffic();
+}
+
+RoutingTable::Traffic RouterBase::removedClientTraffic() const
+{
+	return m_knownClients.removedTraffic();
+}
+
+std::uint64_t RouterBase::dropCount(RoutingResult reason) const
+{
+	return m_counts.value(static_cast<std::size_t>(reason));
+}
+
+SharedBuffer RouterBase::countDrop(RoutingResult reason,
+                                   const PacketView &packet)
+{
+	m_counts.add(static_cast<std::size_t>(reason));
+
+	if (m_options.logDrops)
+	{
+		logDrop(reason, packet);
+	}
+
+	if (m_options.sendUnreachable && reason == RoutingResult::NoRoute)
+	{
+		return internal::makeHostUnreachable(packet, m_options.localAddress);
+	}
+
+	return SharedBuffer();
+}
+
+SharedBuffer RouterBase::serialize(Tins::IP &packet)
+{
+	Tins::PDU::serialization_type serialized = packet.serialize();
+	return SharedBuffer(serialized.data(), serialized.size());
+}
+
+void RouterBase::check(RoutingResult result, const PacketView &packet)
+{
+	if (result == RoutingResult::NoRoute)
+	{
+		throw UnknownClientException(packet.destinationAddress());
+	}
+	else if (result != RoutingResult::Forwarded)
+	{
+		throw RoutingException(toString(result));
+	}
+}
+
+void RouterBase::logDrop(RoutingResult reason, const PacketView &packet)
+{
+	std::int64_t now = steadyNanoseconds();
+	std::int64_t nextLogTime = m_nextLogTime.load(std::memory_order_relaxed);
+
+	// Only the thread that wins the race gets to log.
+	if (now < nextLogTime ||
+	    !m_nextLogTime.compare_exchange_strong(
+	        nextLogTime, now + LOG_INTERVAL_NANOSECONDS,
+	        std::memory_order_relaxed))
 	{
-		clientAddress = m_knownClients.at(destination);
+		return;
 	}
-	catch (const std::out_of_range&)
+
+	std::uint64_t total = 0;
+	for (std::size_t reason = 0; reason < m_counts.size(); ++reason)
+	{
+		total += m_counts.value(reason);
+	}
+
+	std::uint64_t dropped = total - m_loggedDrops.exchange(
+	                                   total, std::memory_order_relaxed);
+
+	std::cerr << "Dropped " << dropped << " packet(s) since the last report ("
+	          << toString(reason);
+	if (reason != RoutingResult::Malformed)
 	{
-		throw UnknownClientException(destination);
+		std::cerr << ": " << packet.sourceAddress().to_string() << " -> "
+		          << packet.destinationAddress().to_string();
 	}
 
-	auto buffer = std::make_shared<Overpass::Buffer>(
-	                 std::move(packet.serialize()));
-	boost::asio::ip::udp::endpoint endpoint(clientAddress, m_overpassPort);
-	m_externalSender(endpoint, buffer);
+	std::cerr << ")" << std::endl;
 }
 
-void Router::handlePacketFromExternal(Tins::IP &packet)
+namespace Overpass
 {
-	// This packet is destined for something listening on our virtual interface.
-	// Send it there.
-	auto buffer = std::make_shared<Overpass::Buffer>(
-	                 std::move(packet.serialize()));
-	m_virtualSender(buffer);
+	template class BasicRouter<Router::ExternalSender, Router::VirtualSender>;
 }
@@ -0,0 +1,22 @@
+#include "routing_result.h"
+
+using namespace Overpass;
+
+const char *Overpass::toString(RoutingResult result)
+{
+	switch (result)
+	{
+		case RoutingResult::Forwarded:
+			return "forwarded";
+		case RoutingResult::Malformed:
+			return "malformed packet";
+		case RoutingResult::Multicast:
+			return "multicast or broadcast destination";
+		case RoutingResult::NoRoute:
+			return "no route to destination";
+		case RoutingResult::SpoofedSource:
+			return "source not routed to sender";
+	}
+
+	return "unknown";
+}
@@ -0,0 +1,517 @@
+#include <algorithm>
+
+#include "internal/rcu.h"
+#include "internal/prefix_trie.h"
+#include "routing_table.h"
+
+using namespace Overpass;
+
+namespace
+{
+	internal::Ipv6Key::Type ipv6Key(const boost::asio::ip::address_v6 &address)
+	{
+		boost::asio::ip::address_v6::bytes_type bytes = address.to_bytes();
+
+		internal::Ipv6Key::Type key = {0, 0};
+		for (std::size_t i = 0; i < 8; ++i)
+		{
+			key.high = (key.high << 8) | bytes[i];
+			key.low = (key.low << 8) | bytes[i + 8];
+		}
+
+		return key;
+	}
+
+	unsigned int addressBits(const boost::asio::ip::address &address)
+	{
+		return address.is_v4() ? 32 : 128;
+	}
+
+	/*!
+	 * \brief Clear the bits of an address past the prefix length, so
+	 *        equivalent routes compare equal.
+	 */
+	boost::asio::ip::address networkAddress(
+	      const boost::asio::ip::address &address, unsigned int prefixLength)
+	{
+		if (address.is_v4())
+		{
+			return boost::asio::ip::address_v4(internal::Ipv4Key::mask(
+			                                      static_cast<std::uint32_t>(
+			                                         address.to_v4().to_ulong()),
+			                                      prefixLength));
+		}
+
+		boost::asio::ip::address_v6::bytes_type bytes =
+		      address.to_v6().to_bytes();
+		for (std::size_t i = 0; i < bytes.size(); ++i)
+		{
+			unsigned int bit = i * 8;
+			if (bit >= prefixLength)
+			{
+				bytes[i] = 0;
+			}
+			else if (prefixLength - bit < 8)
+			{
+				bytes[i] &= 0xff << (8 - (prefixLength - bit));
+			}
+		}
+
+		return boost::asio::ip::address_v6(bytes);
+	}
+
+	/*!
+	 * \brief Add a client's traffic counters to a total.
+	 */
+	void addTraffic(RoutingTable::Traffic &traffic,
+	                const internal::Counters &counters)
+	{
+		traffic.packetsReceived +=
+		      counters.value(RoutingTable::PACKETS_RECEIVED);
+		traffic.bytesReceived += counters.value(RoutingTable::BYTES_RECEIVED);
+		traffic.packetsSent += counters.value(RoutingTable::PACKETS_SENT);
+		traffic.bytesSent += counters.value(RoutingTable::BYTES_SENT);
+	}
+}
+
+/*!
+ * \brief What the table keeps of a client besides its routes.
+ */
+struct RoutingTable::Client
+{
+	explicit Client(const boost::asio::ip::udp::endpoint &initial) :
+	   endpoint(initial),
+	   traffic(TRAFFIC_COUNTER_COUNT)
+	{
+	}
+
+	internal::PeerEndpoint endpoint;
+	internal::Counters traffic;
+};
+
+/*!
+ * \brief Immutable state of the table at some point in time.
+ */
+struct RoutingTable::Snapshot
+{
+	//! Every route, from which the tries are built.
+	RouteMap routes;
+
+	//! Distinct external addresses, indexed by the tries' results (index 0
+	//! is unused, as it means "no route").
+	std::vector<boost::asio::ip::address> externalAddresses;
+
+	//! Their endpoints and counters, indexed the same way (owned by the
+	//! table, or by the retired entry of the last snapshot to refer to
+	//! them).
+	std::vector<Client*> clients;
+
+	//! Indexes of the external addresses.
+	std::map<boost::asio::ip::address, std::uint32_t> indexes;
+
+	internal::PrefixTrie<internal::Ipv4Key> ipv4;
+	internal::PrefixTrie<internal::Ipv6Key> ipv6;
+};
+
+RoutingTableException::RoutingTableException(const std::string &what) :
+   Exception("routing table: " + what)
+{
+}
+
+RoutingTable::RoutingTable(std::uint16_t port) :
+   m_port(port),
+   m_snapshot(new Snapshot),
+   m_removedTraffic{0, 0, 0, 0}
+{
+}
+
+RoutingTable::~RoutingTable()
+{
+	// Nothing may be looking anything up by now.
+	for (const auto &retired : m_retired)
+	{
+		delete retired.snapshot;
+	}
+
+	delete m_snapshot.load(std::memory_order_relaxed);
+}
+
+bool RoutingTable::lookup(const boost::asio::ip::address &overpassAddress,
+                          boost::asio::ip::address &externalAddress) const
+{
+	internal::RcuReadGuard guard;
+
+	const Snapshot *snapshot = m_snapshot.load(std::memory_order_seq_cst);
+	std::uint32_t result = find(*snapshot, overpassAddress);
+	if (result == 0)
+	{
+		return false;
+	}
+
+	externalAddress = snapshot->externalAddresses[result];
+	return true;
+}
+
+bool RoutingTable::lookup(const boost::asio::ip::address &overpassAddress,
+                          boost::asio::ip::udp::endpoint &endpoint,
+                          internal::Counters **traffic) const
+{
+	internal::RcuReadGuard guard;
+
+	const Snapshot *snapshot = m_snapshot.load(std::memory_order_seq_cst);
+	std::uint32_t result = find(*snapshot, overpassAddress);
+	if (result == 0)
+	{
+		return false;
+	}
+
+	Client *client = snapshot->clients[result];
+	client->endpoint.load(endpoint);
+	if (traffic)
+	{
+		*traffic = &client->traffic;
+	}
+
+	return true;
+}
+
+void RoutingTable::lookup(const boost::asio::ip::address *overpassAddresses,
+                          std::size_t count,
+                          boost::asio::ip::udp::endpoint *endpoints,
+                          internal::Counters **traffic) const
+{
+	internal::RcuReadGuard guard;
+
+	const Snapshot *snapshot = m_snapshot.load(std::memory_order_seq_cst);
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		prefetch(*snapshot, overpassAddresses[i]);
+	}
+
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		Client *client = snapshot->clients[find(*snapshot,
+		                                        overpassAddresses[i])];
+		if (client)
+		{
+			client->endpoint.load(endpoints[i]);
+		}
+
+		traffic[i] = client ? &client->traffic : nullptr;
+	}
+}
+
+bool RoutingTable::learnEndpoint(
+      const boost::asio::ip::address &externalAddress,
+      const boost::asio::ip::udp::endpoint &endpoint,
+      internal::Counters **traffic)
+{
+	internal::RcuReadGuard guard;
+
+	const Snapshot *snapshot = m_snapshot.load(std::memory_order_seq_cst);
+	Client *client = findClient(*snapshot, externalAddress);
+	if (traffic)
+	{
+		*traffic = client ? &client->traffic : nullptr;
+	}
+
+	return client && client->endpoint.update(endpoint);
+}
+
+void RoutingTable::learnEndpoints(
+      const boost::asio::ip::address *externalAddresses,
+      const boost::asio::ip::udp::endpoint *endpoints, std::size_t count,
+      internal::Counters **traffic)
+{
+	internal::RcuReadGuard guard;
+
+	const Snapshot *snapshot = m_snapshot.load(std::memory_order_seq_cst);
+	Client *client = nullptr;
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		if (i == 0 || externalAddresses[i] != externalAddresses[i - 1])
+		{
+			client = findClient(*snapshot, externalAddresses[i]);
+		}
+
+		if (client)
+		{
+			client->endpoint.update(endpoints[i]);
+		}
+
+		traffic[i] = client ? &client->traffic : nullptr;
+	}
+}
+
+bool RoutingTable::routesTo(const boost::asio::ip::address &overpassAddress,
+                            const boost::asio::ip::address &externalAddress) const
+{
+	internal::RcuReadGuard guard;
+
+	const Snapshot *snapshot = m_snapshot.load(std::memory_order_seq_cst);
+	std::uint32_t result = find(*snapshot, overpassAddress);
+	return result != 0 && snapshot->externalAddresses[result] == externalAddress;
+}
+
+void RoutingTable::routesTo(const boost::asio::ip::address *overpassAddresses,
+                            const boost::asio::ip::address *externalAddresses,
+                            std::size_t count, bool *results) const
+{
+	internal::RcuReadGuard guard;
+
+	const Snapshot *snapshot = m_snapshot.load(std::memory_order_seq_cst);
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		prefetch(*snapshot, overpassAddresses[i]);
+	}
+
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		std::uint32_t result = find(*snapshot, overpassAddresses[i]);
+		results[i] = result != 0 &&
+		             snapshot->externalAddresses[result] == externalAddresses[i];
+	}
+}
+
+bool RoutingTable::clientEndpoint(
+      const boost::asio::ip::address &externalAddress,
+      boost::asio::ip::udp::endpoint &endpoint) const
+{
+	internal::RcuReadGuard guard;
+
+	const Snapshot *snapshot = m_snapshot.load(std::memory_order_seq_cst);
+	Client *client = findClient(*snapshot, externalAddress);
+	if (!client)
+	{
+		return false;
+	}
+
+	client->endpoint.load(endpoint);
+	return true;
+}
+
+std::map<boost::asio::ip::address, RoutingTable::Traffic>
+RoutingTable::traffic() const
+{
+	std::lock_guard<std::mutex> lock(m_writeMutex);
+
+	std::map<boost::asio::ip::address, Traffic> traffic;
+	for (const auto &client : m_clients)
+	{
+		Traffic &clientTraffic = traffic[client.first];
+		clientTraffic = Traffic{0, 0, 0, 0};
+		addTraffic(clientTraffic, client.second->traffic);
+	}
+
+	return traffic;
+}
+
+RoutingTable::Traffic RoutingTable::removedTraffic() const
+{
+	std::lock_guard<std::mutex> lock(m_writeMutex);
+
+	// Clients retired but not yet freed may still be counted in, so they're
+	// summed as they are now.
+	Traffic traffic = m_removedTraffic;
+	for (const auto &retired : m_retired)
+	{
+		for (const auto &client : retired.clients)
+		{
+			addTraffic(traffic, client->traffic);
+		}
+	}
+
+	return traffic;
+}
+
+void RoutingTable::insert(const boost::asio::ip::address &overpassAddress,
+                          const boost::asio::ip::address &externalAddress)
+{
+	insert(overpassAddress, addressBits(overpassAddress), externalAddress);
+}
+
+void RoutingTable::insert(const boost::asio::ip::address &network,
+                          unsigned int prefixLength,
+                          const boost::asio::ip::address &externalAddress)
+{
+	insert(std::vector<Route>{Route{network, prefixLength, externalAddress}});
+}
+
+void RoutingTable::insert(const std::vector<Route> &routes)
+{
+	for (const auto &route : routes)
+	{
+		if (route.prefixLength > addressBits(route.network))
+		{
+			throw RoutingTableException(
+			         "invalid prefix length for " + route.network.to_string() +
+			         ": " + std::to_string(route.prefixLength));
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_writeMutex);
+
+	RouteMap updated(m_snapshot.load(std::memory_order_relaxed)->routes);
+	for (const auto &route : routes)
+	{
+		updated[Prefix(networkAddress(route.network, route.prefixLength),
+		               route.prefixLength)] = route.externalAddress;
+	}
+
+	publish(std::move(updated));
+}
+
+bool RoutingTable::remove(const boost::asio::ip::address &overpassAddress)
+{
+	return remove(overpassAddress, addressBits(overpassAddress));
+}
+
+bool RoutingTable::remove(const boost::asio::ip::address &network,
+                          unsigned int prefixLength)
+{
+	if (prefixLength > addressBits(network))
+	{
+		return false;
+	}
+
+	Prefix prefix(networkAddress(network, prefixLength), prefixLength);
+
+	std::lock_guard<std::mutex> lock(m_writeMutex);
+
+	const RouteMap &current = m_snapshot.load(std::memory_order_relaxed)->routes;
+	if (current.find(prefix) == current.end())
+	{
+		return false;
+	}
+
+	RouteMap updated(current);
+	updated.erase(prefix);
+	publish(std::move(updated));
+	return true;
+}
+
+std::size_t RoutingTable::size() const
+{
+	internal::RcuReadGuard guard;
+	return m_snapshot.load(std::memory_order_seq_cst)->routes.size();
+}
+
+std::uint32_t RoutingTable::find(const Snapshot &snapshot,
+                                 const boost::asio::ip::address &address)
+{
+	if (address.is_v4())
+	{
+		return snapshot.ipv4.lookup(static_cast<std::uint32_t>(
+		                               address.to_v4().to_ulong()));
+	}
+
+	return snapshot.ipv6.lookup(ipv6Key(address.to_v6()));
+}
+
+RoutingTable::Client *RoutingTable::findClient(
+      const Snapshot &snapshot, const boost::asio::ip::address &externalAddress)
+{
+	auto index = snapshot.indexes.find(externalAddress);
+	return index == snapshot.indexes.end() ? nullptr :
+	                                          snapshot.clients[index->second];
+}
+
+void RoutingTable::prefetch(const Snapshot &snapshot,
+                            const boost::asio::ip::address &address)
+{
+	if (address.is_v4())
+	{
+		snapshot.ipv4.prefetch(static_cast<std::uint32_t>(
+		                          address.to_v4().to_ulong()));
+		return;
+	}
+
+	snapshot.ipv6.prefetch(ipv6Key(address.to_v6()));
+}
+
+void RoutingTable::publish(RouteMap routes)
+{
+	Snapshot *snapshot = new Snapshot;
+	snapshot->routes = std::move(routes);
+	snapshot->externalAddresses.push_back(boost::asio::ip::address());
+	snapshot->clients.push_back(nullptr);
+
+	// Routes to the same client share a result, which lets the tries merge
+	// them.
+	std::map<boost::asio::ip::address, std::uint32_t> &results =
+	      snapshot->indexes;
+	std::vector<internal::PrefixTrie<internal::Ipv4Key>::Prefix> ipv4;
+	std::vector<internal::PrefixTrie<internal::Ipv6Key>::Prefix> ipv6;
+	for (const auto &route : snapshot->routes)
+	{
+		std::uint32_t &result = results[route.second];
+		if (result == 0)
+		{
+			result = snapshot->externalAddresses.size();
+			snapshot->externalAddresses.push_back(route.second);
+
+			std::unique_ptr<Client> &client = m_clients[route.second];
+			if (!client)
+			{
+				client.reset(new Client(
+				                boost::asio::ip::udp::endpoint(route.second,
+				                                               m_port)));
+			}
+
+			snapshot->clients.push_back(client.get());
+		}
+
+		const boost::asio::ip::address &network = route.first.first;
+		if (network.is_v4())
+		{
+			ipv4.push_back({static_cast<std::uint32_t>(network.to_v4().to_ulong()),
+			                route.first.second, result});
+		}
+		else
+		{
+			ipv6.push_back({ipv6Key(network.to_v6()), route.first.second,
+			                result});
+		}
+	}
+
+	snapshot->ipv4.build(std::move(ipv4));
+	snapshot->ipv6.build(std::move(ipv6));
+
+	// Clients the new snapshot has no route to leave with the old one.
+	std::vector<std::unique_ptr<Client>> removed;
+	for (auto client = m_clients.begin(); client != m_clients.end();)
+	{
+		if (results.find(client->first) == results.end())
+		{
+			removed.push_back(std::move(client->second));
+			client = m_clients.erase(client);
+		}
+		else
+		{
+			++client;
+		}
+	}
+
+	const Snapshot *old = m_snapshot.exchange(snapshot,
+	                                          std::memory_order_seq_cst);
+
+	// Lookups that started before the exchange may still be using the old
+	// snapshot (and those holding on to counters, its clients), so they
+	// can't be freed yet.
+	m_retired.push_back(Retired{internal::advanceRcuEpoch(), old,
+	                            std::move(removed)});
+
+	// Snapshots were retired in epoch order, so stop at the first one that
+	// may still be in use. Nothing counts in a freed client's counters
+	// anymore, so their totals are final.
+	while (!m_retired.empty() && internal::rcuQuiescent(m_retired.front().epoch))
+	{
+		for (const auto &client : m_retired.front().clients)
+		{
+			addTraffic(m_removedTraffic, client->traffic);
+		}
+
+		delete m_retired.front().snapshot;
+		m_retired.pop_front();
+	}
+}
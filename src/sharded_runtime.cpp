@@ -0,0 +1,140 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstring>
+#include <iostream>
+
+#include <boost/asio/io_service.hpp>
+
+#include "sharded_runtime.h"
+
+using namespace Overpass;
+
+namespace
+{
+	thread_local std::size_t t_currentShard = ShardedRuntime::NO_SHARD;
+
+	/*!
+	 * \brief List the CPUs this process is allowed to run on.
+	 */
+	std::vector<int> availableCpus()
+	{
+		std::vector<int> cpus;
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		{
+			for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			{
+				if (CPU_ISSET(cpu, &set))
+				{
+					cpus.push_back(cpu);
+				}
+			}
+		}
+
+		return cpus;
+	}
+}
+
+const std::size_t ShardedRuntime::NO_SHARD;
+
+ShardedRuntime::ShardedRuntime(std::size_t shardCount, bool pinThreads) :
+   m_cpus(availableCpus()),
+   m_pinThreads(pinThreads)
+{
+	shardCount = std::max(static_cast<std::size_t>(1), shardCount);
+	for (std::size_t i = 0; i < shardCount; ++i)
+	{
+		// Each shard only has one thread, so tell Asio not to bother with
+		// locking where it can avoid it.
+		SharedIoService ioService(new boost::asio::io_service(1));
+		m_ioServices.push_back(ioService);
+
+		// Keep the IO service running even when it has nothing to do.
+		m_work.push_back(std::make_shared<boost::asio::io_service::work>(
+		                    *ioService));
+	}
+}
+
+ShardedRuntime::~ShardedRuntime()
+{
+	stop();
+}
+
+std::size_t ShardedRuntime::shardCount() const
+{
+	return m_ioServices.size();
+}
+
+const SharedIoService &ShardedRuntime::ioService(std::size_t shard) const
+{
+	return m_ioServices.at(shard);
+}
+
+const std::vector<SharedIoService> &ShardedRuntime::ioServices() const
+{
+	return m_ioServices;
+}
+
+void ShardedRuntime::run()
+{
+	std::vector<std::thread> threads;
+	for (std::size_t shard = 0; shard < m_ioServices.size(); ++shard)
+	{
+		threads.push_back(std::thread(&ShardedRuntime::runShard, this, shard));
+	}
+
+	for (auto &thread : threads)
+	{
+		thread.join();
+	}
+}
+
+void ShardedRuntime::stop()
+{
+	for (const auto &ioService : m_ioServices)
+	{
+		ioService->stop();
+	}
+}
+
+std::size_t ShardedRuntime::currentShard()
+{
+	return t_currentShard;
+}
+
+std::size_t ShardedRuntime::availableShards()
+{
+	std::size_t cpus = availableCpus().size();
+	if (cpus == 0)
+	{
+		cpus = std::thread::hardware_concurrency();
+	}
+
+	return std::max(static_cast<std::size_t>(1), cpus);
+}
+
+void ShardedRuntime::runShard(std::size_t shard)
+{
+	if (m_pinThreads && !m_cpus.empty())
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(m_cpus[shard % m_cpus.size()], &set);
+
+		// Not being able to pin isn't fatal, the shard still works. It just
+		// may migrate between cores.
+		int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (error != 0)
+		{
+			std::cerr << "Unable to pin shard " << shard << ": "
+			          << strerror(error) << std::endl;
+		}
+	}
+
+	t_currentShard = shard;
+	m_ioServices[shard]->run();
+	t_currentShard = NO_SHARD;
+}
@@ -7,6 +7,7 @@
 #include <linux/if_tun.h>
 #include <arpa/inet.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include <cstring>
 #include <string>
@@ -19,6 +20,80 @@ using namespace Overpass;
 namespace
 {
 	const char *CLONE_DEVICE = "/dev/net/tun";
+
+	// Size of struct virtio_net_hdr, without the mergeable buffers field.
+	const int VNET_HEADER_SIZE = 10;
+
+	/*!
+	 * \brief Open the clone device and attach it to an interface.
+	 *
+	 * \param[in,out] interfaceName
+	 * Interface name (or template), set to the actual name on return.
+	 *
+	 * \param[in] flags
+	 * Interface flags to request.
+	 *
+	 * \return The file descriptor representing the interface (queue).
+	 *
+	 * \exception VirtualInterfaceException
+	 * If the interface can't be created or attached to.
+	 */
+	int openQueue(std::string &interfaceName, short flags)
+	{
+		// First open the clone device RW
+		int descriptor = open(CLONE_DEVICE, O_RDWR);
+		if (descriptor < 0)
+		{
+			throw Overpass::VirtualInterfaceException(
+			         "failed to open clone device");
+		}
+
+		// Zero-out the request (so our strings are null-terminated)
+		ifreq request;
+		memset(&request, 0, sizeof(request));
+
+		// Create a TUN device = layer-3 IP packets (not layer 2). Also, tell the
+		// kernel not to include the extra packet info (flags and protocol).
+		request.ifr_flags = flags;
+
+		// Tell it what name we'd like (or template to satisfy)
+		interfaceName.copy(request.ifr_name, IFNAMSIZ);
+
+		// Finally, clone the device and setup the new virtual interface
+		if (ioctl(descriptor, TUNSETIFF, &request) < 0)
+		{
+			// Build the exception before closing, which may clobber errno.
+			Overpass::VirtualInterfaceException exception(
+			         "failed to create virtual interface");
+			close(descriptor);
+			throw exception;
+		}
+
+		// Set the name that we actually received
+		interfaceName = std::string(request.ifr_name);
+		return descriptor;
+	}
+
+	/*!
+	 * \brief Enable checksum and TCP segmentation offloads on a queue opened
+	 *        with IFF_VNET_HDR.
+	 *
+	 * \exception VirtualInterfaceException
+	 * If the kernel refuses. The descriptor is closed in that case.
+	 */
+	void enableOffload(int descriptor)
+	{
+		int headerSize = VNET_HEADER_SIZE;
+		if (ioctl(descriptor, TUNSETVNETHDRSZ, &headerSize) < 0 ||
+		    ioctl(descriptor, TUNSETOFFLOAD,
+		          TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) < 0)
+		{
+			Overpass::VirtualInterfaceException exception(
+			         "failed to enable offloads");
+			close(descriptor);
+			throw exception;
+		}
+	}
 }
 
 VirtualInterfaceException::VirtualInterfaceException(const std::string &what) :
@@ -29,33 +104,56 @@ VirtualInterfaceException::VirtualInterfaceException(const std::string &what) :
 void Overpass::createVirtualInterface(std::string &interfaceName,
                                       int &interfaceFileDescriptor)
 {
-	// First open the clone device RW
-	interfaceFileDescriptor = open(CLONE_DEVICE, O_RDWR);
-	if (interfaceFileDescriptor < 0)
-	{
-		throw Overpass::VirtualInterfaceException("failed to open clone device");
-	}
-
-	// Zero-out the request (so our strings are null-terminated)
-	ifreq request;
-	memset(&request, 0, sizeof(request));
+	interfaceFileDescriptor = openQueue(interfaceName, IFF_TUN | IFF_NO_PI);
+}
 
-	// Create a TUN device = layer-3 IP packets (not layer 2). Also, tell the
-	// kernel not to include the extra packet info (flags and protocol).
-	request.ifr_flags = IFF_TUN | IFF_NO_PI;
+void Overpass::createVirtualInterface(std::string &interfaceName,
+                                      std::vector<int> &queueFileDescriptors,
+                                      std::size_t queueCount, bool offload)
+{
+	queueFileDescriptors.clear();
 
-	// Tell it what name we'd like (or template to satisfy)
-	interfaceName.copy(request.ifr_name, IFNAMSIZ);
+	short flags = IFF_TUN | IFF_NO_PI;
+	if (offload)
+	{
+		flags |= IFF_VNET_HDR;
+	}
 
-	// Finally, clone the device and setup the new virtual interface
-	if (ioctl(interfaceFileDescriptor, TUNSETIFF, &request) < 0)
+	if (queueCount > 1)
 	{
-		throw Overpass::VirtualInterfaceException(
-		         "failed to create virtual interface");
+		flags |= IFF_MULTI_QUEUE;
+	}
+	else
+	{
+		queueCount = 1;
 	}
 
-	// Set the name that we actually received
-	interfaceName = std::string(request.ifr_name);
+	try
+	{
+		// The first queue creates the interface. The rest attach to it by the
+		// name it was given, which must be requested with identical flags.
+		for (std::size_t i = 0; i < queueCount; ++i)
+		{
+			int descriptor = openQueue(interfaceName, flags);
+			if (offload)
+			{
+				enableOffload(descriptor);
+			}
+
+			queueFileDescriptors.push_back(descriptor);
+		}
+	}
+	catch (const VirtualInterfaceException&)
+	{
+		// Closing every queue tears the interface down again.
+		for (int descriptor : queueFileDescriptors)
+		{
+			close(descriptor);
+		}
+
+		queueFileDescriptors.clear();
+		throw;
+	}
 }
 
 void Overpass::assignDeviceAddress(const std::string &interfaceName,
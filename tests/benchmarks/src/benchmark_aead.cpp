@@ -0,0 +1,112 @@
+#include <benchmark/benchmark.h>
+
+#include "internal/aead.h"
+
+using Overpass::internal::Aead;
+
+namespace
+{
+	const std::size_t BATCH_SIZE = 32;
+
+	Overpass::internal::AeadKey makeKey()
+	{
+		Overpass::internal::AeadKey key;
+		key.fill(0x42);
+		return key;
+	}
+
+	std::vector<Overpass::SharedBuffer> makeBatch(std::size_t packetSize)
+	{
+		std::vector<Overpass::SharedBuffer> batch;
+		for (std::size_t i = 0; i < BATCH_SIZE; ++i)
+		{
+			Overpass::SharedBuffer packet(packetSize);
+			std::fill(packet.begin(), packet.end(), 0xab);
+			batch.push_back(packet);
+		}
+
+		return batch;
+	}
+
+	// Throughput of a single thread, i.e. per core (reported as Gbit/s).
+	void setThroughput(benchmark::State &state, std::size_t packetSize)
+	{
+		std::size_t bytes = state.iterations() * BATCH_SIZE * packetSize;
+		state.SetBytesProcessed(bytes);
+		state.counters["Gbit"] = benchmark::Counter(
+		                              bytes * 8 / 1e9,
+		                              benchmark::Counter::kIsRate);
+	}
+
+	void sealBatches(benchmark::State &state, Overpass::Cipher cipher)
+	{
+		Aead aead(cipher, makeKey());
+		std::size_t packetSize = state.range(0);
+		std::vector<Overpass::SharedBuffer> packets = makeBatch(packetSize);
+		std::vector<Overpass::SharedBuffer> messages(BATCH_SIZE);
+
+		for (auto _ : state)
+		{
+			benchmark::DoNotOptimize(aead.seal(packets.data(), BATCH_SIZE,
+			                                   messages.data()));
+		}
+
+		setThroughput(state, packetSize);
+	}
+
+	void openBatches(benchmark::State &state, Overpass::Cipher cipher)
+	{
+		Aead aead(cipher, makeKey());
+		std::size_t packetSize = state.range(0);
+		std::vector<Overpass::SharedBuffer> packets = makeBatch(packetSize);
+		std::vector<Overpass::SharedBuffer> messages(BATCH_SIZE);
+		aead.seal(packets.data(), BATCH_SIZE, messages.data());
+
+		// Messages are opened in place, so open copies of them.
+		std::vector<Overpass::SharedBuffer> copies(BATCH_SIZE);
+		std::vector<Overpass::SharedBuffer> opened(BATCH_SIZE);
+		std::vector<std::uint64_t> counters(BATCH_SIZE);
+		for (auto _ : state)
+		{
+			state.PauseTiming();
+			for (std::size_t i = 0; i < BATCH_SIZE; ++i)
+			{
+				copies[i] = Overpass::SharedBuffer(messages[i].data(),
+				                                   messages[i].size());
+			}
+			state.ResumeTiming();
+
+			benchmark::DoNotOptimize(aead.open(copies.data(), BATCH_SIZE,
+			                                   opened.data(), counters.data()));
+		}
+
+		setThroughput(state, packetSize);
+	}
+}
+
+// Seal batches of packets of the size given as argument.
+static void AeadSealChaCha20Poly1305(benchmark::State &state)
+{
+	sealBatches(state, Overpass::Cipher::ChaCha20Poly1305);
+}
+BENCHMARK(AeadSealChaCha20Poly1305)->Arg(64)->Arg(512)->Arg(1420)->Arg(8192);
+
+static void AeadSealAes256Gcm(benchmark::State &state)
+{
+	sealBatches(state, Overpass::Cipher::Aes256Gcm);
+}
+BENCHMARK(AeadSealAes256Gcm)->Arg(64)->Arg(512)->Arg(1420)->Arg(8192);
+
+// Authenticate and decrypt batches of messages holding packets of the size
+// given as argument.
+static void AeadOpenChaCha20Poly1305(benchmark::State &state)
+{
+	openBatches(state, Overpass::Cipher::ChaCha20Poly1305);
+}
+BENCHMARK(AeadOpenChaCha20Poly1305)->Arg(64)->Arg(512)->Arg(1420)->Arg(8192);
+
+static void AeadOpenAes256Gcm(benchmark::State &state)
+{
+	openBatches(state, Overpass::Cipher::Aes256Gcm);
+}
+BENCHMARK(AeadOpenAes256Gcm)->Arg(64)->Arg(512)->Arg(1420)->Arg(8192);
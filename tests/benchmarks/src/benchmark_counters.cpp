@@ -0,0 +1,52 @@
+#include <atomic>
+
+#include <benchmark/benchmark.h>
+
+#include "internal/counters.h"
+
+using Overpass::internal::Counters;
+
+namespace
+{
+	// Counts per packet: packets and bytes.
+	const std::uint64_t PACKET_SIZE = 1400;
+}
+
+// Count packets and bytes from several threads sharing a set of counters.
+static void CountersShared(benchmark::State &state)
+{
+	static Counters *counters;
+	if (state.thread_index() == 0)
+	{
+		counters = new Counters(2);
+	}
+
+	for (auto _ : state)
+	{
+		counters->add(0);
+		counters->add(1, PACKET_SIZE);
+	}
+
+	state.SetItemsProcessed(state.iterations());
+
+	if (state.thread_index() == 0)
+	{
+		benchmark::DoNotOptimize(counters->value(0));
+		delete counters;
+	}
+}
+BENCHMARK(CountersShared)->Threads(1)->Threads(2)->Threads(4);
+
+// The same with plain atomics, which every thread increments.
+static void AtomicCountersShared(benchmark::State &state)
+{
+	static std::atomic<std::uint64_t> counters[2];
+	for (auto _ : state)
+	{
+		counters[0].fetch_add(1, std::memory_order_relaxed);
+		counters[1].fetch_add(PACKET_SIZE, std::memory_order_relaxed);
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(AtomicCountersShared)->Threads(1)->Threads(2)->Threads(4);
@@ -0,0 +1,130 @@
+#include <algorithm>
+
+#include <benchmark/benchmark.h>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/udp.hpp>
+
+#include "datagram_server.h"
+
+using boost::asio::ip::udp;
+
+namespace
+{
+	const std::size_t BURST_SIZE = 64;
+	const std::size_t PACKET_SIZE = 1400;
+
+	std::unique_ptr<udp::socket> makeLoopbackSocket(
+	      const Overpass::SharedIoService &ioService)
+	{
+		std::unique_ptr<udp::socket> socket(new udp::socket(
+		         *ioService, udp::endpoint(boost::asio::ip::address_v4::loopback(),
+		                                   0)));
+
+		// Make sure a whole burst fits in the socket buffer so none of it is
+		// dropped.
+		socket->set_option(udp::socket::receive_buffer_size(
+		                      4 * BURST_SIZE * PACKET_SIZE));
+		return socket;
+	}
+}
+
+// Receive bursts of datagrams over loopback. The first argument is the server's
+// batch size: 1 is the one-at-a-time path, anything else uses recvmmsg. The
+// second is whether datagrams are dispatched inline rather than posted.
+static void DatagramServerReceive(benchmark::State &state)
+{
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+
+	auto socket = makeLoopbackSocket(ioService);
+	udp::endpoint serverEndpoint = socket->local_endpoint();
+
+	std::size_t received = 0;
+	auto callback = [&received](const udp::endpoint&,
+	                            const Overpass::SharedBuffer&)
+	{
+		++received;
+	};
+
+	Overpass::DatagramServerOptions options;
+	options.batchSize = state.range(0);
+	options.dispatchMode = state.range(1) ? Overpass::DispatchMode::Inline :
+	                                        Overpass::DispatchMode::Post;
+	Overpass::DatagramServer<udp> server(ioService, std::move(socket), callback,
+	                                     options);
+
+	auto sender = makeLoopbackSocket(ioService);
+	Overpass::Buffer payload(PACKET_SIZE, 0xab);
+
+	for (auto _ : state)
+	{
+		received = 0;
+		for (std::size_t i = 0; i < BURST_SIZE; ++i)
+		{
+			sender->send_to(boost::asio::buffer(payload), serverEndpoint);
+		}
+
+		while (received < BURST_SIZE)
+		{
+			ioService->run_one();
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations() * BURST_SIZE);
+}
+BENCHMARK(DatagramServerReceive)
+   ->ArgNames({"batch", "inline"})
+   ->ArgsProduct({{1, 8, 32, 64}, {0, 1}});
+
+// Send bursts of datagrams over loopback one at a time.
+static void DatagramServerSendTo(benchmark::State &state)
+{
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+
+	auto sink = makeLoopbackSocket(ioService);
+	udp::endpoint sinkEndpoint = sink->local_endpoint();
+
+	Overpass::DatagramServer<udp> server(
+	         ioService, makeLoopbackSocket(ioService),
+	         [](const udp::endpoint&, const Overpass::SharedBuffer&){});
+
+	Overpass::SharedBuffer buffer(PACKET_SIZE);
+	std::fill(buffer.begin(), buffer.end(), 0xab);
+
+	for (auto _ : state)
+	{
+		for (std::size_t i = 0; i < BURST_SIZE; ++i)
+		{
+			server.sendTo(sinkEndpoint, buffer);
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations() * BURST_SIZE);
+}
+BENCHMARK(DatagramServerSendTo);
+
+// Send the same bursts with a single sendmmsg per burst.
+static void DatagramServerSendBatch(benchmark::State &state)
+{
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+
+	auto sink = makeLoopbackSocket(ioService);
+	udp::endpoint sinkEndpoint = sink->local_endpoint();
+
+	Overpass::DatagramServer<udp> server(
+	         ioService, makeLoopbackSocket(ioService),
+	         [](const udp::endpoint&, const Overpass::SharedBuffer&){});
+
+	Overpass::SharedBuffer buffer(PACKET_SIZE);
+	std::fill(buffer.begin(), buffer.end(), 0xab);
+	Overpass::DatagramBatch<udp::endpoint> batch(
+	         BURST_SIZE, Overpass::Datagram<udp::endpoint>{sinkEndpoint, buffer});
+
+	for (auto _ : state)
+	{
+		server.sendBatch(batch);
+	}
+
+	state.SetItemsProcessed(state.iterations() * BURST_SIZE);
+}
+BENCHMARK(DatagramServerSendBatch);
@@ -0,0 +1,99 @@
+#include <algorithm>
+
+#include <benchmark/benchmark.h>
+
+#include "internal/replay_window.h"
+
+using Overpass::internal::ReplayWindow;
+
+namespace
+{
+	const std::size_t BATCH_SIZE = 1024;
+}
+
+// Accept counters in order, the usual case.
+static void ReplayWindowInOrder(benchmark::State &state)
+{
+	ReplayWindow window;
+	std::uint64_t counter = 0;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(window.accept(counter++));
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(ReplayWindowInOrder);
+
+// Accept batches of counters shuffled within the window, as when packets
+// of a peer are received on several cores.
+static void ReplayWindowReordered(benchmark::State &state)
+{
+	std::vector<std::uint64_t> offsets(BATCH_SIZE);
+	for (std::size_t i = 0; i < BATCH_SIZE; ++i)
+	{
+		offsets[i] = i;
+	}
+
+	std::random_shuffle(offsets.begin(), offsets.end());
+
+	ReplayWindow window;
+	std::uint64_t base = 0;
+	for (auto _ : state)
+	{
+		for (std::uint64_t offset : offsets)
+		{
+			benchmark::DoNotOptimize(window.accept(base + offset));
+		}
+
+		base += BATCH_SIZE;
+	}
+
+	state.SetItemsProcessed(state.iterations() * BATCH_SIZE);
+}
+BENCHMARK(ReplayWindowReordered);
+
+// Reject replayed counters.
+static void ReplayWindowReplayed(benchmark::State &state)
+{
+	ReplayWindow window;
+	for (std::uint64_t counter = 0; counter < BATCH_SIZE; ++counter)
+	{
+		window.accept(counter);
+	}
+
+	std::uint64_t counter = 0;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(window.accept(counter++ % BATCH_SIZE));
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(ReplayWindowReplayed);
+
+// Accept counters from several threads sharing a window (each thread gets
+// every n-th counter).
+static void ReplayWindowShared(benchmark::State &state)
+{
+	static ReplayWindow *window;
+	if (state.thread_index() == 0)
+	{
+		window = new ReplayWindow;
+	}
+
+	std::uint64_t counter = state.thread_index();
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(window->accept(counter));
+		counter += state.threads();
+	}
+
+	state.SetItemsProcessed(state.iterations());
+
+	if (state.thread_index() == 0)
+	{
+		delete window;
+	}
+}
+BENCHMARK(ReplayWindowShared)->Threads(1)->Threads(2)->Threads(4);
@@ -0,0 +1,184 @@
+#include <memory>
+#include <algorithm>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "router.h"
+#include "packet_view.h"
+
+namespace
+{
+	const std::size_t BATCH_SIZE = 64;
+
+	/*!
+	 * \brief A minimal UDP over IPv4 packet to a given destination.
+	 */
+	Overpass::SharedBuffer makePacket(std::uint32_t destination)
+	{
+		Overpass::SharedBuffer buffer(28);
+		std::fill(buffer.begin(), buffer.end(), 0);
+		buffer[0] = 0x45;
+		buffer[3] = 28;
+		buffer[8] = 64;
+		buffer[9] = 17;
+		buffer[12] = 11;
+		buffer[13] = 11;
+		buffer[14] = 11;
+		buffer[15] = 1;
+		buffer[16] = destination >> 24;
+		buffer[17] = destination >> 16;
+		buffer[18] = destination >> 8;
+		buffer[19] = destination;
+		return buffer;
+	}
+
+	std::unique_ptr<Overpass::Router> makeRouter()
+	{
+		std::unique_ptr<Overpass::Router> router(new Overpass::Router(
+		         [](const boost::asio::ip::udp::endpoint&,
+		            const Overpass::SharedBuffer &buffer)
+		{
+			benchmark::DoNotOptimize(buffer.data());
+		},
+		         [](const Overpass::SharedBuffer &buffer)
+		{
+			benchmark::DoNotOptimize(buffer.data());
+		},
+		         1234));
+
+		router->addRoute(boost::asio::ip::address::from_string("11.11.0.0"), 16,
+		                boost::asio::ip::address::from_string("1.2.3.4"));
+		return router;
+	}
+
+	// Sender policies the compiler can see through.
+	struct ExternalSender
+	{
+		void operator()(const boost::asio::ip::udp::endpoint&,
+		                const Overpass::SharedBuffer &buffer) const
+		{
+			benchmark::DoNotOptimize(buffer.data());
+		}
+	};
+
+	struct VirtualSender
+	{
+		void operator()(const Overpass::SharedBuffer &buffer) const
+		{
+			benchmark::DoNotOptimize(buffer.data());
+		}
+	};
+
+	typedef Overpass::BasicRouter<ExternalSender, VirtualSender>
+	      SpecializedRouter;
+}
+
+// Forwarding, for reference.
+static void RouterForward(benchmark::State &state)
+{
+	std::unique_ptr<Overpass::Router> router = makeRouter();
+	Overpass::SharedBuffer buffer = makePacket(0x0b0b0b02);
+
+	for (auto _ : state)
+	{
+		Overpass::PacketView packet(buffer);
+		benchmark::DoNotOptimize(router->handlePacketFromVirtual(packet));
+	}
+}
+BENCHMARK(RouterForward);
+
+// Forwarding without going through std::function.
+static void RouterForwardSpecialized(benchmark::State &state)
+{
+	SpecializedRouter router(ExternalSender(), VirtualSender(), 1234);
+	router.addRoute(boost::asio::ip::address::from_string("11.11.0.0"), 16,
+	                boost::asio::ip::address::from_string("1.2.3.4"));
+	Overpass::SharedBuffer buffer = makePacket(0x0b0b0b02);
+
+	for (auto _ : state)
+	{
+		Overpass::PacketView packet(buffer);
+		benchmark::DoNotOptimize(router.handlePacketFromVirtual(packet));
+	}
+}
+BENCHMARK(RouterForwardSpecialized);
+
+// Forwarding batches to a number of clients scattered over 10.0.0.0/8,
+// either a packet at a time or a batch at once. With many clients, the
+// packets cycle through all of them so lookups miss the cache.
+static void RouterForwardBatch(benchmark::State &state)
+{
+	SpecializedRouter router(ExternalSender(), VirtualSender(), 1234);
+
+	std::uint32_t clients = state.range(0);
+	std::vector<std::uint32_t> destinations;
+	for (std::uint32_t client = 0; client < clients; ++client)
+	{
+		std::uint32_t destination = 0x0a000000 |
+		                            ((client * 2654435761u) & 0x00ffffff);
+		router.addKnownClient(boost::asio::ip::address_v4(destination),
+		                      boost::asio::ip::address_v4(0xc0000000 + client));
+		destinations.push_back(destination);
+	}
+
+	std::size_t packetCount = std::max<std::size_t>(clients, BATCH_SIZE);
+	std::vector<Overpass::SharedBuffer> buffers;
+	buffers.reserve(packetCount);
+	std::vector<Overpass::PacketView> packets;
+	for (std::size_t i = 0; i < packetCount; ++i)
+	{
+		buffers.push_back(makePacket(destinations[(i * 7919) % clients]));
+		packets.emplace_back(buffers.back());
+	}
+
+	bool batched = state.range(1);
+	std::size_t first = 0;
+	for (auto _ : state)
+	{
+		const Overpass::PacketView *batch = packets.data() + first;
+		first = (first + BATCH_SIZE) % (packetCount - packetCount % BATCH_SIZE);
+		if (batched)
+		{
+			router.handlePacketsFromVirtual(batch, BATCH_SIZE);
+			continue;
+		}
+
+		for (std::size_t i = 0; i < BATCH_SIZE; ++i)
+		{
+			benchmark::DoNotOptimize(router.handlePacketFromVirtual(batch[i]));
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations() * BATCH_SIZE);
+}
+BENCHMARK(RouterForwardBatch)->ArgNames({"clients", "batched"})
+                             ->ArgsProduct({{1, 8, 1024}, {0, 1}});
+
+// A flood of traffic nobody can route.
+static void RouterDropNoRoute(benchmark::State &state)
+{
+	std::unique_ptr<Overpass::Router> router = makeRouter();
+	Overpass::SharedBuffer buffer = makePacket(0x0c0c0c02);
+
+	for (auto _ : state)
+	{
+		Overpass::PacketView packet(buffer);
+		benchmark::DoNotOptimize(router->handlePacketFromVirtual(packet));
+	}
+}
+BENCHMARK(RouterDropNoRoute);
+
+// A flood of multicast traffic, turned away before any lookup.
+static void RouterDropMulticast(benchmark::State &state)
+{
+	std::unique_ptr<Overpass::Router> router = makeRouter();
+	Overpass::SharedBuffer buffer = makePacket(0xefff0001);
+
+	for (auto _ : state)
+	{
+		Overpass::PacketView packet(buffer);
+		benchmark::DoNotOptimize(router->handlePacketFromVirtual(packet));
+	}
+}
+BENCHMARK(RouterDropMulticast);
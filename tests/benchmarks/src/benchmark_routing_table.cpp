@@ -0,0 +1,225 @@
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+#include "routing_table.h"
+#include "internal/prefix_trie.h"
+
+namespace
+{
+	const std::uint32_t CLIENTS = 256;
+
+	boost::asio::ip::address overpassAddress(std::uint32_t index)
+	{
+		return boost::asio::ip::address_v4(0x0b0b0000 + index);
+	}
+
+	boost::asio::ip::address externalAddress(std::uint32_t index)
+	{
+		return boost::asio::ip::address_v4(0xc0000000 + index);
+	}
+
+	/*!
+	 * \brief What the router used before: a map behind a lock (the lock being
+	 *        the least it would need to support updates).
+	 */
+	class LockedMap
+	{
+		public:
+			bool lookup(const boost::asio::ip::address &overpassAddress,
+			            boost::asio::ip::address &externalAddress)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto entry = m_map.find(overpassAddress);
+				if (entry == m_map.end())
+				{
+					return false;
+				}
+
+				externalAddress = entry->second;
+				return true;
+			}
+
+			void insert(const boost::asio::ip::address &overpassAddress,
+			            const boost::asio::ip::address &externalAddress)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_map[overpassAddress] = externalAddress;
+			}
+
+			bool remove(const boost::asio::ip::address &overpassAddress)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				return m_map.erase(overpassAddress) > 0;
+			}
+
+		private:
+			std::mutex m_mutex;
+			std::map<boost::asio::ip::address, boost::asio::ip::address> m_map;
+	};
+
+	/*!
+	 * \brief Run lookups from every benchmark thread while the first one also
+	 *        runs a background thread that keeps churning one client.
+	 */
+	template <typename Table>
+	void lookupDuringUpdates(benchmark::State &state)
+	{
+		static Table *table;
+		static std::atomic<bool> stop;
+		static std::thread updater;
+
+		if (state.thread_index() == 0)
+		{
+			table = new Table;
+			for (std::uint32_t i = 0; i < CLIENTS; ++i)
+			{
+				table->insert(overpassAddress(i), externalAddress(i));
+			}
+
+			stop = false;
+			updater = std::thread([]()
+			{
+				while (!stop)
+				{
+					table->remove(overpassAddress(CLIENTS));
+					table->insert(overpassAddress(CLIENTS),
+					              externalAddress(CLIENTS));
+				}
+			});
+		}
+
+		std::uint32_t index = state.thread_index();
+		boost::asio::ip::address found;
+		for (auto _ : state)
+		{
+			index = (index + 1) % CLIENTS;
+			benchmark::DoNotOptimize(table->lookup(overpassAddress(index),
+			                                       found));
+		}
+
+		state.SetItemsProcessed(state.iterations());
+
+		if (state.thread_index() == 0)
+		{
+			stop = true;
+			updater.join();
+			delete table;
+		}
+	}
+}
+
+static void RoutingTableLookup(benchmark::State &state)
+{
+	lookupDuringUpdates<Overpass::RoutingTable>(state);
+}
+BENCHMARK(RoutingTableLookup)->ThreadRange(1, 8)->UseRealTime();
+
+static void LockedMapLookup(benchmark::State &state)
+{
+	lookupDuringUpdates<LockedMap>(state);
+}
+BENCHMARK(LockedMapLookup)->ThreadRange(1, 8)->UseRealTime();
+
+namespace
+{
+	/*!
+	 * \brief A table shaped roughly like an Internet routing table: mostly /24s
+	 *        with a spread of shorter prefixes.
+	 */
+	std::vector<Overpass::RoutingTable::Route> manyRoutes(std::size_t count)
+	{
+		std::mt19937 random(1234);
+		std::vector<Overpass::RoutingTable::Route> routes;
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			unsigned int prefixLength = random() % 4 ? 24 : 8 + random() % 25;
+			routes.push_back({boost::asio::ip::address_v4(random()),
+			                  prefixLength, externalAddress(i % CLIENTS)});
+		}
+
+		return routes;
+	}
+
+	std::vector<std::uint32_t> randomAddresses()
+	{
+		std::mt19937 random(4321);
+		std::vector<std::uint32_t> addresses(4096);
+		for (auto &address : addresses)
+		{
+			address = random();
+		}
+
+		return addresses;
+	}
+}
+
+// Longest-prefix matches against a large table. The argument is the number of
+// prefixes.
+static void RoutingTableLongestPrefix(benchmark::State &state)
+{
+	Overpass::RoutingTable table;
+	table.insert(manyRoutes(state.range(0)));
+
+	auto addresses = randomAddresses();
+	std::size_t index = 0;
+	boost::asio::ip::address found;
+	for (auto _ : state)
+	{
+		index = (index + 1) % addresses.size();
+		benchmark::DoNotOptimize(table.lookup(
+		                            boost::asio::ip::address_v4(addresses[index]),
+		                            found));
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(RoutingTableLongestPrefix)->Arg(1000)->Arg(100000);
+
+// The same, but straight against the trie (no address conversion or RCU).
+static void PrefixTrieLookup(benchmark::State &state)
+{
+	typedef Overpass::internal::PrefixTrie<Overpass::internal::Ipv4Key> Trie;
+
+	std::vector<Trie::Prefix> prefixes;
+	std::uint32_t value = 1;
+	for (const auto &route : manyRoutes(state.range(0)))
+	{
+		prefixes.push_back({static_cast<std::uint32_t>(
+		                       route.network.to_v4().to_ulong()),
+		                    route.prefixLength, value++});
+	}
+
+	Trie trie;
+	trie.build(prefixes);
+
+	auto addresses = randomAddresses();
+	std::size_t index = 0;
+	for (auto _ : state)
+	{
+		index = (index + 1) % addresses.size();
+		benchmark::DoNotOptimize(trie.lookup(addresses[index]));
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(PrefixTrieLookup)->Arg(1000)->Arg(100000);
+
+// How long it takes to rebuild a table of the given size (i.e. the cost of
+// every change).
+static void RoutingTableRebuild(benchmark::State &state)
+{
+	Overpass::RoutingTable table;
+	table.insert(manyRoutes(state.range(0)));
+
+	for (auto _ : state)
+	{
+		table.insert(overpassAddress(0), externalAddress(0));
+	}
+}
+BENCHMARK(RoutingTableRebuild)->Arg(1000)->Arg(100000)
+                              ->Unit(benchmark::kMillisecond);
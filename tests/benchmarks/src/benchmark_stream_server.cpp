@@ -0,0 +1,82 @@
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <benchmark/benchmark.h>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+#include "stream_server.h"
+
+typedef boost::asio::posix::stream_descriptor Descriptor;
+
+namespace
+{
+	const std::size_t BURST_SIZE = 64;
+	const std::size_t PACKET_SIZE = 1400;
+}
+
+// Read bursts of packets from a sequenced packet socket, which keeps packet
+// boundaries like a TUN device. The argument is whether packets are
+// dispatched inline rather than posted.
+static void StreamServerReceive(benchmark::State &state)
+{
+	int descriptors[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, descriptors) != 0)
+	{
+		state.SkipWithError("Unable to create socket pair");
+		return;
+	}
+
+	// Make sure a whole burst fits in the socket buffer.
+	int bufferSize = 4 * BURST_SIZE * PACKET_SIZE;
+	setsockopt(descriptors[1], SOL_SOCKET, SO_SNDBUF, &bufferSize,
+	           sizeof(bufferSize));
+
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+	std::unique_ptr<Descriptor> socket(new Descriptor(*ioService,
+	                                                  descriptors[0]));
+
+	std::size_t received = 0;
+	Overpass::StreamServerOptions options;
+	options.dispatchMode = state.range(0) ? Overpass::DispatchMode::Inline :
+	                                        Overpass::DispatchMode::Post;
+	auto server = Overpass::makeStreamServer(
+	                 ioService, [&received](const Overpass::SharedBuffer&)
+	                 {
+	                    ++received;
+	                 },
+	                 std::move(socket), options);
+
+	Overpass::Buffer payload(PACKET_SIZE, 0xab);
+
+	for (auto _ : state)
+	{
+		received = 0;
+		for (std::size_t i = 0; i < BURST_SIZE; ++i)
+		{
+			if (write(descriptors[1], payload.data(), payload.size()) < 0)
+			{
+				state.SkipWithError("Unable to write");
+				break;
+			}
+		}
+
+		if (state.error_occurred())
+		{
+			break;
+		}
+
+		while (received < BURST_SIZE)
+		{
+			ioService->run_one();
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations() * BURST_SIZE);
+
+	// Pending reads hold on to the server until the IO service goes.
+	ioService->stop();
+	close(descriptors[1]);
+}
+BENCHMARK(StreamServerReceive)->ArgName("inline")->Arg(0)->Arg(1);
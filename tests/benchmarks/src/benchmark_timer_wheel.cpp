@@ -0,0 +1,62 @@
+#include <memory>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <boost/asio/steady_timer.hpp>
+
+#include "internal/timer_wheel.h"
+
+using Overpass::internal::TimerWheel;
+
+namespace
+{
+	const std::size_t TIMER_COUNT = 10000;
+}
+
+// Arm (and so cancel) one of many peer timers again, as when traffic
+// pushes a peer's keepalive back.
+static void TimerWheelRearm(benchmark::State &state)
+{
+	boost::asio::io_service ioService;
+	TimerWheel wheel(ioService);
+	std::vector<std::unique_ptr<TimerWheel::Timer>> timers;
+	for (std::size_t i = 0; i < TIMER_COUNT; ++i)
+	{
+		timers.emplace_back(new TimerWheel::Timer([]() {}));
+		wheel.arm(*timers.back(), std::chrono::seconds(10 + i % 20));
+	}
+
+	std::size_t i = 0;
+	for (auto _ : state)
+	{
+		wheel.arm(*timers[i], std::chrono::seconds(25));
+		i = (i + 1) % TIMER_COUNT;
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(TimerWheelRearm);
+
+// The same with an Asio timer per peer, for comparison.
+static void SteadyTimerRearm(benchmark::State &state)
+{
+	boost::asio::io_service ioService;
+	std::vector<std::unique_ptr<boost::asio::steady_timer>> timers;
+	for (std::size_t i = 0; i < TIMER_COUNT; ++i)
+	{
+		timers.emplace_back(new boost::asio::steady_timer(ioService));
+		timers.back()->expires_from_now(std::chrono::seconds(10 + i % 20));
+		timers.back()->async_wait([](const boost::system::error_code &) {});
+	}
+
+	std::size_t i = 0;
+	for (auto _ : state)
+	{
+		timers[i]->expires_from_now(std::chrono::seconds(25));
+		timers[i]->async_wait([](const boost::system::error_code &) {});
+		i = (i + 1) % TIMER_COUNT;
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(SteadyTimerRearm);
@@ -0,0 +1,189 @@
+#include <set>
+#include <mutex>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "internal/aead.h"
+
+using Overpass::internal::Aead;
+using Overpass::internal::AeadKey;
+using Overpass::internal::AEAD_OVERHEAD;
+using Overpass::internal::AEAD_COUNTER_OFFSET;
+
+namespace
+{
+	const Overpass::Cipher CIPHERS[] = {
+		Overpass::Cipher::ChaCha20Poly1305,
+		Overpass::Cipher::Aes256Gcm,
+	};
+
+	AeadKey makeKey(std::uint8_t seed)
+	{
+		AeadKey key;
+		for (std::size_t i = 0; i < key.size(); ++i)
+		{
+			key[i] = std::uint8_t(seed + i);
+		}
+
+		return key;
+	}
+
+	std::vector<Overpass::SharedBuffer> makePackets(std::size_t count)
+	{
+		std::vector<Overpass::SharedBuffer> packets;
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			// Include an empty packet.
+			Overpass::SharedBuffer packet(i * 100);
+			std::fill(packet.begin(), packet.end(), std::uint8_t(i));
+			packets.push_back(packet);
+		}
+
+		return packets;
+	}
+
+	std::vector<Overpass::SharedBuffer> seal(
+	      Aead &aead, const std::vector<Overpass::SharedBuffer> &packets)
+	{
+		std::vector<Overpass::SharedBuffer> messages(packets.size());
+		EXPECT_EQ(packets.size(), aead.seal(packets.data(), packets.size(),
+		                                    messages.data()));
+		return messages;
+	}
+}
+
+// Test that sealed packets open back into the original packets.
+TEST(Aead, RoundTrip)
+{
+	for (Overpass::Cipher cipher : CIPHERS)
+	{
+		SCOPED_TRACE(Overpass::toString(cipher));
+		Aead sender(cipher, makeKey(1));
+		Aead receiver(cipher, makeKey(1));
+
+		std::vector<Overpass::SharedBuffer> packets = makePackets(16);
+		std::vector<Overpass::SharedBuffer> messages = seal(sender, packets);
+
+		std::vector<Overpass::SharedBuffer> opened(messages.size());
+		std::vector<std::uint64_t> counters(messages.size());
+		ASSERT_EQ(packets.size(), receiver.open(messages.data(), messages.size(),
+		                                        opened.data(),
+		                                        counters.data()));
+
+		for (std::size_t i = 0; i < packets.size(); ++i)
+		{
+			EXPECT_EQ(packets[i].size() + AEAD_OVERHEAD, messages[i].size());
+			ASSERT_EQ(packets[i].size(), opened[i].size());
+			EXPECT_TRUE(std::equal(packets[i].begin(), packets[i].end(),
+			                       opened[i].begin()));
+			EXPECT_EQ(i, counters[i]);
+		}
+	}
+}
+
+// Test that messages hold the index of the key they're sealed with.
+TEST(Aead, KeyIndex)
+{
+	Aead aead(Overpass::Cipher::ChaCha20Poly1305, makeKey(1), 0x01020304);
+	std::vector<Overpass::SharedBuffer> messages = seal(aead, makePackets(2));
+	EXPECT_EQ(0x01020304u, Overpass::internal::aeadKeyIndex(messages[1]));
+	EXPECT_EQ(Overpass::internal::AEAD_MESSAGE_TYPE, messages[1][0]);
+	EXPECT_EQ(2u, aead.sealedCount());
+}
+
+// Test that batches can be sealed and opened in place.
+TEST(Aead, InPlace)
+{
+	Aead aead(Overpass::Cipher::ChaCha20Poly1305, makeKey(1));
+
+	std::vector<Overpass::SharedBuffer> buffers = makePackets(4);
+	ASSERT_EQ(4u, aead.seal(buffers.data(), buffers.size(), buffers.data()));
+
+	std::vector<std::uint64_t> counters(buffers.size());
+	ASSERT_EQ(4u, aead.open(buffers.data(), buffers.size(), buffers.data(),
+	                        counters.data()));
+	EXPECT_EQ(300u, buffers[3].size());
+	EXPECT_EQ(3, buffers[3][0]);
+}
+
+// Test that tampered messages, messages sealed with another key or cipher,
+// and messages too short to be sealed aren't opened.
+TEST(Aead, RejectUnauthentic)
+{
+	for (Overpass::Cipher cipher : CIPHERS)
+	{
+		SCOPED_TRACE(Overpass::toString(cipher));
+		Aead sender(cipher, makeKey(1));
+		Aead receiver(cipher, makeKey(1));
+		Aead stranger(cipher, makeKey(2));
+		Aead other(cipher == Overpass::Cipher::Aes256Gcm ?
+		           Overpass::Cipher::ChaCha20Poly1305 :
+		           Overpass::Cipher::Aes256Gcm, makeKey(1));
+
+		std::vector<Overpass::SharedBuffer> messages = seal(
+		         sender, makePackets(6));
+		messages[1][messages[1].size() / 2] ^= 1; // Ciphertext
+		messages[2][AEAD_COUNTER_OFFSET] ^= 1; // Counter
+		messages[3][messages[3].size() - 1] ^= 1; // Tag
+		messages[4][0] ^= 1; // Type
+		messages[5][4] ^= 1; // Key index
+
+		messages.push_back(seal(stranger, makePackets(2))[1]);
+		messages.push_back(seal(other, makePackets(2))[1]);
+		messages.push_back(Overpass::SharedBuffer(AEAD_OVERHEAD - 1));
+
+		std::vector<Overpass::SharedBuffer> opened(messages.size());
+		std::vector<std::uint64_t> counters(messages.size());
+		EXPECT_EQ(1u, receiver.open(messages.data(), messages.size(),
+		                            opened.data(), counters.data()));
+		EXPECT_TRUE(opened[0]);
+		for (std::size_t i = 1; i < opened.size(); ++i)
+		{
+			EXPECT_FALSE(opened[i]) << i;
+		}
+	}
+}
+
+// Test that no counter (hence nonce) is used twice, even when sealing from
+// several threads at once.
+TEST(Aead, UniqueCounters)
+{
+	Aead sender(Overpass::Cipher::Aes256Gcm, makeKey(1));
+	Aead receiver(Overpass::Cipher::Aes256Gcm, makeKey(1));
+
+	std::mutex mutex;
+	std::set<std::uint64_t> seen;
+	std::size_t total = 0;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; ++i)
+	{
+		threads.emplace_back([&]()
+		{
+			for (int j = 0; j < 50; ++j)
+			{
+				std::vector<Overpass::SharedBuffer> messages = seal(
+				         sender, makePackets(8));
+
+				std::vector<Overpass::SharedBuffer> opened(messages.size());
+				std::vector<std::uint64_t> counters(messages.size());
+				std::size_t count = receiver.open(messages.data(),
+				                                  messages.size(),
+				                                  opened.data(),
+				                                  counters.data());
+
+				std::lock_guard<std::mutex> lock(mutex);
+				total += count;
+				seen.insert(counters.begin(), counters.end());
+			}
+		});
+	}
+
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+
+	EXPECT_EQ(4u * 50 * 8, total);
+	EXPECT_EQ(total, seen.size());
+}
@@ -0,0 +1,164 @@
+#include <thread>
+#include <numeric>
+#include <type_traits>
+
+#include <gtest/gtest.h>
+
+#include <boost/asio/ip/udp.hpp>
+
+#include "buffer_pool.h"
+#include "datagram.h"
+
+namespace
+{
+	Overpass::BufferPool::Statistics statisticsFor(std::size_t size)
+	{
+		for (const auto &entry : Overpass::BufferPool::instance().statistics())
+		{
+			if (entry.bufferSize >= size)
+			{
+				return entry;
+			}
+		}
+
+		return Overpass::BufferPool::Statistics();
+	}
+}
+
+TEST(BufferPool, CopiesShareData)
+{
+	Overpass::SharedBuffer buffer(4);
+	buffer[0] = 0xab;
+
+	Overpass::SharedBuffer copy(buffer);
+	EXPECT_EQ(buffer.data(), copy.data());
+	EXPECT_EQ(0xab, copy.at(0));
+
+	// Each handle keeps its own size.
+	copy.resize(1);
+	EXPECT_EQ(4u, buffer.size());
+	EXPECT_EQ(1u, copy.size());
+}
+
+// Test that vectors of buffers (and of datagrams) move them when they grow,
+// rather than copying them (and touching their reference counts).
+TEST(BufferPool, MovesDontThrow)
+{
+	typedef Overpass::Datagram<boost::asio::ip::udp::endpoint> Datagram;
+	EXPECT_TRUE(std::is_nothrow_move_constructible<
+	               Overpass::SharedBuffer>::value);
+	EXPECT_TRUE(std::is_nothrow_move_assignable<
+	               Overpass::SharedBuffer>::value);
+	EXPECT_TRUE(std::is_nothrow_move_constructible<Datagram>::value);
+}
+
+TEST(BufferPool, CopyData)
+{
+	const uint8_t data[] = {1, 2, 3};
+	Overpass::SharedBuffer buffer(data, sizeof(data));
+	ASSERT_EQ(3u, buffer.size());
+	EXPECT_TRUE(std::equal(buffer.begin(), buffer.end(), data));
+}
+
+TEST(BufferPool, ResizeWithinCapacity)
+{
+	Overpass::SharedBuffer buffer(1500);
+	EXPECT_LE(1500u, buffer.capacity());
+
+	buffer.resize(10);
+	EXPECT_EQ(10u, buffer.size());
+	buffer.resize(1500);
+	EXPECT_EQ(1500u, buffer.size());
+
+	EXPECT_THROW(buffer.resize(buffer.capacity() + 1), std::length_error);
+	EXPECT_THROW(buffer.at(1500), std::out_of_range);
+}
+
+TEST(BufferPool, TrimFront)
+{
+	Overpass::SharedBuffer buffer(100);
+	std::uint8_t *data = buffer.data();
+	std::size_t capacity = buffer.capacity();
+
+	buffer.trimFront(16);
+	EXPECT_EQ(data + 16, buffer.data());
+	EXPECT_EQ(84u, buffer.size());
+	EXPECT_EQ(capacity - 16, buffer.capacity());
+
+	EXPECT_THROW(buffer.trimFront(85), std::length_error);
+}
+
+TEST(BufferPool, Reset)
+{
+	Overpass::SharedBuffer buffer(10);
+	EXPECT_TRUE(static_cast<bool>(buffer));
+
+	buffer.reset();
+	EXPECT_FALSE(static_cast<bool>(buffer));
+	EXPECT_EQ(0u, buffer.size());
+	EXPECT_EQ(0u, buffer.capacity());
+}
+
+// Releasing a buffer and acquiring another of the same size should reuse it
+// without allocating.
+TEST(BufferPool, RecyclesBuffers)
+{
+	std::uint8_t *data;
+	{
+		Overpass::SharedBuffer buffer(1500);
+		data = buffer.data();
+	}
+
+	auto before = statisticsFor(1500);
+
+	Overpass::SharedBuffer buffer(1500);
+	EXPECT_EQ(data, buffer.data());
+
+	auto after = statisticsFor(1500);
+	EXPECT_EQ(before.hits + 1, after.hits);
+	EXPECT_EQ(before.misses, after.misses);
+	EXPECT_EQ(before.buffers, after.buffers);
+}
+
+TEST(BufferPool, Reserve)
+{
+	Overpass::BufferPool::instance().reserve(16000, 64);
+	auto statistics = statisticsFor(16000);
+	EXPECT_LE(64u, statistics.buffers);
+	EXPECT_LE(64u, statistics.idleBuffers);
+}
+
+// Larger than any size class: still usable, just not pooled.
+TEST(BufferPool, Oversized)
+{
+	auto before = Overpass::BufferPool::instance().statistics().back();
+
+	Overpass::SharedBuffer buffer(1024 * 1024);
+	buffer[1024 * 1024 - 1] = 0xff;
+	EXPECT_EQ(1024u * 1024u, buffer.capacity());
+
+	auto after = Overpass::BufferPool::instance().statistics().back();
+	EXPECT_EQ(0u, after.bufferSize);
+	EXPECT_EQ(before.misses + 1, after.misses);
+}
+
+// Buffers acquired on one thread can be released on another, and buffers held
+// by a thread's cache go back to the pool when it exits.
+TEST(BufferPool, AcrossThreads)
+{
+	std::vector<Overpass::SharedBuffer> buffers;
+	std::thread producer([&buffers]()
+	{
+		for (int i = 0; i < 1000; ++i)
+		{
+			buffers.push_back(Overpass::SharedBuffer(1500));
+		}
+	});
+	producer.join();
+
+	auto before = statisticsFor(1500);
+	buffers.clear();
+	auto after = statisticsFor(1500);
+	EXPECT_EQ(before.idleBuffers + 1000, after.idleBuffers);
+	EXPECT_EQ(after.buffers, before.buffers);
+}
@@ -0,0 +1,60 @@
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "internal/counters.h"
+
+using Overpass::internal::Counters;
+
+// Test that counts from many threads (including ones that have exited) all
+// add up.
+TEST(Counters, Threads)
+{
+	const std::size_t threadCount = 8;
+	const std::uint64_t countsPerThread = 100000;
+
+	Counters counters(2);
+	std::vector<std::thread> threads;
+	for (std::size_t i = 0; i < threadCount; ++i)
+	{
+		threads.emplace_back([&counters, countsPerThread]()
+		{
+			for (std::uint64_t count = 0; count < countsPerThread; ++count)
+			{
+				counters.add(0);
+				counters.add(1, 3);
+			}
+		});
+	}
+
+	for (auto &thread : threads)
+	{
+		thread.join();
+	}
+
+	counters.add(0);
+	EXPECT_EQ(threadCount * countsPerThread + 1, counters.value(0));
+	EXPECT_EQ(3 * threadCount * countsPerThread, counters.value(1));
+}
+
+// Test that sets don't share counters, and that a set's counters start at 0
+// even if they were used before.
+TEST(Counters, Reuse)
+{
+	std::unique_ptr<Counters> first(new Counters(4));
+	Counters second(4);
+	first->add(3, 10);
+	second.add(3, 20);
+	EXPECT_EQ(10u, first->value(3));
+	EXPECT_EQ(20u, second.value(3));
+
+	first.reset();
+	Counters third(4);
+	for (std::size_t counter = 0; counter < third.size(); ++counter)
+	{
+		EXPECT_EQ(0u, third.value(counter));
+	}
+
+	EXPECT_EQ(20u, second.value(3));
+}
@@ -0,0 +1,132 @@
+#include <poll.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/asio/io_service.hpp>
+
+#include "internal/datagram_batch_operations.h"
+
+using boost::asio::ip::udp;
+using Overpass::Datagram;
+using Overpass::DatagramBatch;
+
+namespace
+{
+	const std::size_t SEGMENT_SIZE = 1000;
+
+	Overpass::SharedBuffer makeDatagram(std::uint8_t index, std::size_t size)
+	{
+		Overpass::SharedBuffer buffer(size);
+		std::fill(buffer.begin(), buffer.end(), index);
+		return buffer;
+	}
+
+	/*!
+	 * \brief Send a run of full-sized datagrams (and a short one) to each of
+	 *        two destinations, segmented if the kernel supports it.
+	 */
+	void sendRuns(udp::socket &sender, const udp::endpoint &first,
+	              const udp::endpoint &second)
+	{
+		DatagramBatch<udp::endpoint> batch;
+		for (std::uint8_t i = 0; i < 20; ++i)
+		{
+			std::size_t size = (i == 9 || i == 19) ? 300 : SEGMENT_SIZE;
+			batch.push_back(Datagram<udp::endpoint>{i < 10 ? first : second,
+			                                        makeDatagram(i, size)});
+		}
+
+		boost::system::error_code error;
+		std::size_t sent;
+		if (Overpass::internal::supportsSegmentation(sender))
+		{
+			sent = Overpass::internal::sendSegmentedDatagrams(
+			          sender, batch.data(), batch.size(), error);
+		}
+		else
+		{
+			sent = Overpass::internal::sendDatagrams(
+			          sender, batch.data(), batch.size(), error);
+		}
+
+		EXPECT_FALSE(error) << error.message();
+		EXPECT_EQ(batch.size(), sent);
+	}
+
+	/*!
+	 * \brief Receive the datagrams of one of the runs, and check they come
+	 *        out whole and in order.
+	 */
+	void expectRun(udp::socket &receiver, std::uint8_t firstIndex,
+	               bool coalesced)
+	{
+		std::vector<Overpass::SharedBuffer> received;
+		for (int attempt = 0; received.size() < 10 && attempt < 100; ++attempt)
+		{
+			pollfd descriptor{receiver.native_handle(), POLLIN, 0};
+			poll(&descriptor, 1, 10);
+
+			DatagramBatch<udp::endpoint> batch(8);
+			for (auto &datagram : batch)
+			{
+				datagram.buffer = Overpass::SharedBuffer(
+				                     coalesced ?
+				                     Overpass::internal::MAXIMUM_COALESCED_SIZE :
+				                     SEGMENT_SIZE);
+			}
+
+			boost::system::error_code error;
+			std::size_t count =
+			      coalesced ?
+			      Overpass::internal::receiveCoalescedDatagrams(receiver, batch,
+			                                                    error) :
+			      Overpass::internal::receiveDatagrams(receiver, batch, error);
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				received.push_back(batch[i].buffer);
+			}
+		}
+
+		ASSERT_EQ(10u, received.size());
+		for (std::uint8_t i = 0; i < 10; ++i)
+		{
+			const Overpass::SharedBuffer &buffer = received[i];
+			ASSERT_EQ(i == 9 ? 300 : SEGMENT_SIZE, buffer.size());
+			EXPECT_EQ(firstIndex + i, buffer[0]);
+			EXPECT_EQ(firstIndex + i, buffer[buffer.size() - 1]);
+		}
+	}
+
+	void sendAndReceive(bool coalesced)
+	{
+		boost::asio::io_service ioService;
+		udp::endpoint loopback(boost::asio::ip::address_v4::loopback(), 0);
+		udp::socket first(ioService, loopback);
+		udp::socket second(ioService, loopback);
+		udp::socket sender(ioService, loopback);
+
+		if (coalesced &&
+		    (!Overpass::internal::enableReceiveCoalescing(first) ||
+		     !Overpass::internal::enableReceiveCoalescing(second)))
+		{
+			return;
+		}
+
+		sendRuns(sender, first.local_endpoint(), second.local_endpoint());
+		expectRun(first, 0, coalesced);
+		expectRun(second, 10, coalesced);
+	}
+}
+
+// Test that runs of datagrams to the same destination sent in one go (with
+// UDP segmentation, if supported) arrive as the original datagrams.
+TEST(DatagramBatchOperations, SegmentedSend)
+{
+	sendAndReceive(false);
+}
+
+// Test that datagrams the kernel coalesced are split back apart.
+TEST(DatagramBatchOperations, CoalescedReceive)
+{
+	sendAndReceive(true);
+}
@@ -1,10 +1,12 @@
 #include <thread>
+#include <vector>
 #include <condition_variable>
 #include <chrono>
 
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
+#include <boost/asio/error.hpp>
 #include <boost/asio/buffer.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/asio/posix/stream_descriptor.hpp>
@@ -19,10 +21,35 @@ class FakeDatagramSocket
 		{
 		}
 
+		// Unless a fake says otherwise, nothing is ever received.
+		void async_receive_from(
+		      boost::asio::mutable_buffers_1 /*buffers*/,
+		      std::string &/*endpoint*/,
+		      std::function<void (
+		         boost::system::error_code, std::size_t)> /*callback*/)
+		{
+		}
+
+		// Batch mode waits for readability, then calls receiveDatagrams().
+		void async_receive(
+		      boost::asio::null_buffers,
+		      std::function<void (
+		         boost::system::error_code, std::size_t)> /*callback*/)
+		{
+		}
+
 	protected:
 		Overpass::SharedIoService m_ioService;
 };
 
+std::size_t receiveDatagrams(FakeDatagramSocket &/*socket*/,
+                             Overpass::DatagramBatch<std::string> &/*batch*/,
+                             boost::system::error_code &error)
+{
+	error = boost::asio::error::would_block;
+	return 0;
+}
+
 class FakeDatagram
 {
 	public:
@@ -141,6 +168,62 @@ class FakeDatagramReceiveNothing
 		typedef FakeDatagramSocketReceiveNothing socket;
 };
 
+class FakeDatagramSocketReceiveBatch : public FakeDatagramSocket
+{
+	public:
+		FakeDatagramSocketReceiveBatch(
+		      const Overpass::SharedIoService &ioService) :
+		   FakeDatagramSocket(ioService),
+		   pendingDatagrams(3)
+		{
+		}
+
+		void async_receive(
+		      boost::asio::null_buffers,
+		      std::function<void (
+		         boost::system::error_code, std::size_t)> callback)
+		{
+			m_ioService->post([callback](){
+				callback(boost::system::error_code(), 0);
+			});
+		}
+
+		std::size_t pendingDatagrams;
+};
+
+class FakeDatagramReceiveBatch
+{
+	public:
+		typedef std::string endpoint;
+		typedef FakeDatagramSocketReceiveBatch socket;
+};
+
+// Found via argument-dependent lookup, this is how the batch-mode server reads
+// from the fake socket.
+std::size_t receiveDatagrams(FakeDatagramSocketReceiveBatch &socket,
+                             Overpass::DatagramBatch<std::string> &batch,
+                             boost::system::error_code &error)
+{
+	if (socket.pendingDatagrams == 0)
+	{
+		error = boost::asio::error::would_block;
+		return 0;
+	}
+
+	std::size_t received = std::min(socket.pendingDatagrams, batch.size());
+	for (std::size_t i = 0; i < received; ++i)
+	{
+		EXPECT_LT(1, batch[i].buffer.size());
+		batch[i].buffer.resize(1);
+		batch[i].buffer.at(0) = static_cast<uint8_t>(i);
+		batch[i].endpoint = "test-sender-" + std::to_string(i);
+	}
+
+	socket.pendingDatagrams -= received;
+	error = boost::system::error_code();
+	return received;
+}
+
 TEST(DatagramServer, ReadCallback)
 {
 	Overpass::SharedIoService ioService(new boost::asio::io_service);
@@ -148,14 +231,16 @@ TEST(DatagramServer, ReadCallback)
 
 	std::mutex mutex;
 	std::condition_variable condition;
+	bool called = false;
 
 	auto callback = [&](const std::string &endpoint, const Overpass::SharedBuffer &buffer)
 	{
 		EXPECT_EQ("test-sender", endpoint);
-		EXPECT_LT(1, buffer->size());
-		EXPECT_EQ(0xff, buffer->at(0));
+		EXPECT_EQ(1u, buffer.size());
+		EXPECT_EQ(0xff, buffer.at(0));
 		ioService->stop();
 		std::unique_lock<std::mutex> lock(mutex);
+		called = true;
 		condition.notify_one();
 	};
 
@@ -168,8 +253,9 @@ TEST(DatagramServer, ReadCallback)
 	std::thread thread([&ioService](){ioService->run();});
 
 	std::unique_lock<std::mutex> lock(mutex);
-	auto status = condition.wait_for(lock, std::chrono::seconds(1));
-	EXPECT_EQ(std::cv_status::no_timeout, status) << "Unexpectedly timed out";
+	EXPECT_TRUE(condition.wait_for(lock, std::chrono::seconds(1),
+	                               [&called](){return called;}))
+	      << "Unexpectedly timed out";
 	ioService->stop();
 	thread.join();
 }
@@ -237,3 +323,440 @@ TEST(DatagramServer, ReadNothing)
 	ioService->stop();
 	thread.join();
 }
+
+TEST(DatagramServer, ReadBatchCallback)
+{
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+
+	std::mutex mutex;
+	std::condition_variable condition;
+
+	auto callback = [&](const Overpass::DatagramBatch<std::string> &batch)
+	{
+		EXPECT_EQ(3u, batch.size());
+		for (std::size_t i = 0; i < batch.size(); ++i)
+		{
+			EXPECT_EQ("test-sender-" + std::to_string(i), batch[i].endpoint);
+			EXPECT_EQ(1u, batch[i].buffer.size());
+			EXPECT_EQ(i, batch[i].buffer.at(0));
+		}
+
+		ioService->stop();
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.notify_one();
+	};
+
+	std::unique_ptr<FakeDatagramSocketReceiveBatch> socket(
+	         new FakeDatagramSocketReceiveBatch(ioService));
+
+	Overpass::DatagramServerOptions options;
+	options.batchSize = 8;
+	auto server = std::make_shared<Overpass::DatagramServer<FakeDatagramReceiveBatch>>(
+	                 ioService, std::move(socket), callback, options);
+
+	std::thread thread([&ioService](){ioService->run();});
+
+	std::unique_lock<std::mutex> lock(mutex);
+	auto status = condition.wait_for(lock, std::chrono::seconds(1));
+	EXPECT_EQ(std::cv_status::no_timeout, status) << "Unexpectedly timed out";
+	ioService->stop();
+	thread.join();
+}
+
+// A per-datagram callback should still see every datagram when the server is
+// reading in batches.
+TEST(DatagramServer, ReadCallbackInBatchMode)
+{
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::size_t datagramsReceived = 0;
+
+	auto callback = [&](const std::string &endpoint,
+	                    const Overpass::SharedBuffer &buffer)
+	{
+		EXPECT_EQ("test-sender-" + std::to_string(datagramsReceived), endpoint);
+		EXPECT_EQ(datagramsReceived, buffer.at(0));
+		if (++datagramsReceived == 3)
+		{
+			ioService->stop();
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.notify_one();
+		}
+	};
+
+	std::unique_ptr<FakeDatagramSocketReceiveBatch> socket(
+	         new FakeDatagramSocketReceiveBatch(ioService));
+
+	Overpass::DatagramServerOptions options;
+	options.batchSize = 8;
+	auto server = std::make_shared<Overpass::DatagramServer<FakeDatagramReceiveBatch>>(
+	                 ioService, std::move(socket), callback, options);
+
+	std::thread thread([&ioService](){ioService->run();});
+
+	std::unique_lock<std::mutex> lock(mutex);
+	auto status = condition.wait_for(lock, std::chrono::seconds(1));
+	EXPECT_EQ(std::cv_status::no_timeout, status) << "Unexpectedly timed out";
+	EXPECT_EQ(3u, datagramsReceived);
+	ioService->stop();
+	thread.join();
+}
+
+// Test that datagrams are handed to the callback by the handler completing
+// the read in inline mode, and only by a handler of their own otherwise.
+TEST(DatagramServer, DispatchModes)
+{
+	const struct
+	{
+		Overpass::DispatchMode mode;
+		std::size_t expected;
+	} modes[] = {
+		{Overpass::DispatchMode::Post, 0},
+		{Overpass::DispatchMode::Inline, 1}};
+	for (const auto &mode : modes)
+	{
+		Overpass::SharedIoService ioService(new boost::asio::io_service);
+		std::size_t datagramsReceived = 0;
+
+		Overpass::DatagramServerOptions options;
+		options.dispatchMode = mode.mode;
+		std::unique_ptr<FakeDatagramSocketReceiveSuccess> socket(
+		         new FakeDatagramSocketReceiveSuccess(ioService));
+		auto server = std::make_shared<
+		                 Overpass::DatagramServer<FakeDatagramReceiveSuccess>>(
+		                 ioService, std::move(socket),
+		                 [&datagramsReceived](const std::string &endpoint,
+		                                      const Overpass::SharedBuffer&)
+		                 {
+		                    EXPECT_EQ("test-sender", endpoint);
+		                    ++datagramsReceived;
+		                 }, options);
+
+		ASSERT_EQ(1u, ioService->run_one());
+		EXPECT_EQ(mode.expected, datagramsReceived);
+
+		// Batches go the same way.
+		Overpass::SharedIoService batchIoService(new boost::asio::io_service);
+		std::size_t batchesReceived = 0;
+
+		options.batchSize = 8;
+		std::unique_ptr<FakeDatagramSocketReceiveBatch> batchSocket(
+		         new FakeDatagramSocketReceiveBatch(batchIoService));
+		auto batchServer = std::make_shared<
+		                      Overpass::DatagramServer<FakeDatagramReceiveBatch>>(
+		                      batchIoService, std::move(batchSocket),
+		                      [&batchesReceived](
+		                         const Overpass::DatagramBatch<std::string> &batch)
+		                      {
+		                         EXPECT_EQ(3u, batch.size());
+		                         ++batchesReceived;
+		                      }, options);
+
+		ASSERT_EQ(1u, batchIoService->run_one());
+		EXPECT_EQ(mode.expected, batchesReceived);
+	}
+}
+
+// A socket whose reads only complete when the test says so.
+class FakeDatagramSocketHeld : public FakeDatagramSocket
+{
+	public:
+		struct Read
+		{
+			boost::asio::mutable_buffers_1 buffers;
+			std::string *endpoint;
+			std::function<void (boost::system::error_code, std::size_t)> callback;
+		};
+
+		FakeDatagramSocketHeld(const Overpass::SharedIoService &ioService) :
+		   FakeDatagramSocket(ioService)
+		{
+		}
+
+		void async_receive_from(
+		      boost::asio::mutable_buffers_1 buffers,
+		      std::string &endpoint,
+		      std::function<void (
+		         boost::system::error_code, std::size_t)> callback)
+		{
+			reads.push_back(Read{buffers, &endpoint, callback});
+		}
+
+		// Complete a read with a single byte from a sender named after it.
+		void complete(std::size_t read, std::uint8_t value)
+		{
+			Read completed = reads[read];
+			boost::asio::buffer_cast<std::uint8_t*>(completed.buffers)[0] = value;
+			*completed.endpoint = "sender-" + std::to_string(value);
+			completed.callback(boost::system::error_code(), 1);
+		}
+
+		std::vector<Read> reads;
+};
+
+class FakeDatagramHeld
+{
+	public:
+		typedef std::string endpoint;
+		typedef FakeDatagramSocketHeld socket;
+};
+
+// Test that several reads are kept outstanding, each with its own buffer and
+// sender, and that datagrams reach the callback in the order the reads were
+// started only if asked to.
+TEST(DatagramServer, ReadDepth)
+{
+	for (bool ordered : {false, true})
+	{
+		Overpass::SharedIoService ioService(new boost::asio::io_service);
+
+		Overpass::DatagramServerOptions options;
+		options.readDepth = 3;
+		options.orderedReads = ordered;
+		options.dispatchMode = Overpass::DispatchMode::Inline;
+
+		std::vector<int> received;
+		std::unique_ptr<FakeDatagramSocketHeld> ownedSocket(
+		         new FakeDatagramSocketHeld(ioService));
+		FakeDatagramSocketHeld *socket = ownedSocket.get();
+		auto server = std::make_shared<Overpass::DatagramServer<FakeDatagramHeld>>(
+		                 ioService, std::move(ownedSocket),
+		                 [&received](const std::string &endpoint,
+		                             const Overpass::SharedBuffer &buffer)
+		                 {
+		                    EXPECT_EQ("sender-" + std::to_string(buffer.at(0)),
+		                              endpoint);
+		                    received.push_back(buffer.at(0));
+		                 }, options);
+
+		ASSERT_EQ(3u, socket->reads.size());
+		EXPECT_NE(socket->reads[0].endpoint, socket->reads[1].endpoint);
+		EXPECT_NE(boost::asio::buffer_cast<void*>(socket->reads[0].buffers),
+		          boost::asio::buffer_cast<void*>(socket->reads[1].buffers));
+
+		socket->complete(2, 2);
+		socket->complete(1, 1);
+		if (ordered)
+		{
+			EXPECT_TRUE(received.empty());
+		}
+		else
+		{
+			EXPECT_EQ((std::vector<int>{2, 1}), received);
+		}
+
+		socket->complete(0, 0);
+		std::vector<int> expected = ordered ? std::vector<int>({0, 1, 2}) :
+		                                      std::vector<int>({2, 1, 0});
+		EXPECT_EQ(expected, received);
+
+		// Every read completed was started again.
+		EXPECT_EQ(6u, socket->reads.size());
+	}
+}
+
+// A socket with room for a limited number of datagrams, which only frees up
+// when the test says so.
+class FakeDatagramSocketSend : public FakeDatagramSocket
+{
+	public:
+		FakeDatagramSocketSend(const Overpass::SharedIoService &ioService) :
+		   FakeDatagramSocket(ioService),
+		   room(0)
+		{
+		}
+
+		void async_send(
+		      boost::asio::null_buffers,
+		      std::function<void (
+		         boost::system::error_code, std::size_t)> callback)
+		{
+			waiting.push_back(callback);
+		}
+
+		void makeRoom(std::size_t datagrams)
+		{
+			room = datagrams;
+			for (const auto &callback : waiting)
+			{
+				m_ioService->post([callback](){
+					callback(boost::system::error_code(), 0);
+				});
+			}
+
+			waiting.clear();
+		}
+
+		std::size_t room;
+		std::vector<std::string> sent;
+		std::vector<std::function<void (
+		   boost::system::error_code, std::size_t)>> waiting;
+};
+
+class FakeDatagramSend
+{
+	public:
+		typedef std::string endpoint;
+		typedef FakeDatagramSocketSend socket;
+};
+
+// Found via argument-dependent lookup, these are how the server sends over the
+// fake socket. Datagrams to "unreachable" are refused.
+bool sendDatagram(FakeDatagramSocketSend &socket, const std::string &destination,
+                  const Overpass::SharedBuffer &buffer,
+                  boost::system::error_code &error)
+{
+	if (destination == "unreachable")
+	{
+		error = boost::system::errc::make_error_code(
+		           boost::system::errc::host_unreachable);
+		return false;
+	}
+
+	if (socket.room == 0)
+	{
+		error = boost::asio::error::would_block;
+		return false;
+	}
+
+	--socket.room;
+	socket.sent.push_back(destination + ":" + std::string(
+	                         buffer.begin(), buffer.end()));
+	error = boost::system::error_code();
+	return true;
+}
+
+std::size_t sendDatagrams(FakeDatagramSocketSend &socket,
+                          const Overpass::Datagram<std::string> *datagrams,
+                          std::size_t count, boost::system::error_code &error)
+{
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		if (!sendDatagram(socket, datagrams[i].endpoint, datagrams[i].buffer,
+		                  error))
+		{
+			return i;
+		}
+	}
+
+	error = boost::system::error_code();
+	return count;
+}
+
+namespace
+{
+	Overpass::SharedBuffer payload(const std::string &text)
+	{
+		return Overpass::SharedBuffer(
+		          reinterpret_cast<const std::uint8_t*>(text.data()),
+		          text.size());
+	}
+
+	std::shared_ptr<Overpass::DatagramServer<FakeDatagramSend>> makeSendServer(
+	      const Overpass::SharedIoService &ioService,
+	      FakeDatagramSocketSend *&socket,
+	      const Overpass::DatagramServerOptions &options)
+	{
+		std::unique_ptr<FakeDatagramSocketSend> ownedSocket(
+		         new FakeDatagramSocketSend(ioService));
+		socket = ownedSocket.get();
+
+		return std::make_shared<Overpass::DatagramServer<FakeDatagramSend>>(
+		          ioService, std::move(ownedSocket),
+		          [](const std::string&, const Overpass::SharedBuffer&){},
+		          options);
+	}
+}
+
+// Test that datagrams the socket has no room for wait, in order, until it
+// does, and that newer ones are dropped once the queue is full.
+TEST(DatagramServer, SendQueuesWhenFull)
+{
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+
+	Overpass::DatagramServerOptions options;
+	options.sendQueueDepth = 2;
+	FakeDatagramSocketSend *socket;
+	auto server = makeSendServer(ioService, socket, options);
+
+	socket->room = 1;
+	server->sendTo("peer", payload("a"));
+	server->sendTo("peer", payload("b"));
+	server->sendTo("peer", payload("c"));
+	server->sendTo("peer", payload("d"));
+
+	ASSERT_EQ(1u, socket->sent.size());
+	EXPECT_EQ(1u, socket->waiting.size());
+
+	// Nothing may overtake the queue, even once there's room.
+	socket->room = 10;
+	server->sendTo("peer", payload("e"));
+	EXPECT_EQ(1u, socket->sent.size());
+
+	socket->makeRoom(10);
+	ioService->poll();
+
+	std::vector<std::string> expected{"peer:a", "peer:b", "peer:c"};
+	EXPECT_EQ(expected, socket->sent);
+	EXPECT_TRUE(socket->waiting.empty());
+
+	// The queue is empty again, so this goes straight out.
+	server->sendTo("peer", payload("f"));
+	EXPECT_EQ(4u, socket->sent.size());
+
+	Overpass::DatagramSendStatistics statistics = server->sendStatistics();
+	EXPECT_EQ(4u, statistics.sent);
+	EXPECT_EQ(2u, statistics.queued);
+	EXPECT_EQ(2u, statistics.dropped);
+	EXPECT_EQ(0u, statistics.failed);
+}
+
+// Test that the oldest datagrams make way for new ones when so configured.
+TEST(DatagramServer, SendDropOldest)
+{
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+
+	Overpass::DatagramServerOptions options;
+	options.sendQueueDepth = 2;
+	options.sendDropPolicy = Overpass::SendDropPolicy::DropOldest;
+	FakeDatagramSocketSend *socket;
+	auto server = makeSendServer(ioService, socket, options);
+
+	Overpass::DatagramBatch<std::string> batch{
+	   {"peer", payload("a")}, {"peer", payload("b")}, {"peer", payload("c")}};
+	server->sendBatch(batch);
+	EXPECT_TRUE(socket->sent.empty());
+
+	socket->makeRoom(10);
+	ioService->poll();
+
+	std::vector<std::string> expected{"peer:b", "peer:c"};
+	EXPECT_EQ(expected, socket->sent);
+	EXPECT_EQ(1u, server->sendStatistics().dropped);
+}
+
+// Test that datagrams the kernel refuses are counted rather than thrown, and
+// don't hold up the rest.
+TEST(DatagramServer, SendFailure)
+{
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+
+	FakeDatagramSocketSend *socket;
+	auto server = makeSendServer(ioService, socket,
+	                             Overpass::DatagramServerOptions());
+
+	socket->room = 10;
+	server->sendTo("unreachable", payload("a"));
+
+	Overpass::DatagramBatch<std::string> batch{
+	   {"peer", payload("b")}, {"unreachable", payload("c")},
+	   {"peer", payload("d")}};
+	server->sendBatch(batch);
+
+	std::vector<std::string> expected{"peer:b", "peer:d"};
+	EXPECT_EQ(expected, socket->sent);
+	EXPECT_EQ(2u, server->sendStatistics().failed);
+	EXPECT_EQ(0u, server->sendStatistics().queued);
+}
@@ -0,0 +1,180 @@
+#include <gtest/gtest.h>
+
+#include "internal/handshake.h"
+
+using namespace Overpass::internal;
+
+namespace
+{
+	AeadKey makeKey(std::uint8_t seed)
+	{
+		AeadKey key;
+		for (std::size_t i = 0; i < key.size(); ++i)
+		{
+			key[i] = std::uint8_t(seed + i);
+		}
+
+		return key;
+	}
+
+	Overpass::SharedBuffer copy(const Overpass::SharedBuffer &buffer)
+	{
+		Overpass::SharedBuffer result(buffer.size());
+		std::copy(buffer.begin(), buffer.end(), result.begin());
+		return result;
+	}
+
+	const boost::asio::ip::udp::endpoint INITIATOR(
+	      boost::asio::ip::address::from_string("192.168.1.2"), 4567);
+}
+
+// Test that a handshake gives both sides matching keys and indices.
+TEST(Handshake, Complete)
+{
+	HandshakeProtocol protocol(makeKey(1));
+	HandshakeState initiator;
+	HandshakeState responder;
+
+	Overpass::SharedBuffer initiation = protocol.createInitiation(
+	                                       initiator, 11, 1234, nullptr);
+	EXPECT_EQ(HANDSHAKE_INITIATION_SIZE, initiation.size());
+	EXPECT_EQ(HANDSHAKE_INITIATION_TYPE, initiation[0]);
+
+	std::uint64_t timestamp = 0;
+	ASSERT_TRUE(protocol.consumeInitiation(initiation, responder, timestamp));
+	EXPECT_EQ(1234u, timestamp);
+
+	SessionKeys responderKeys;
+	Overpass::SharedBuffer response = protocol.createResponse(responder, 22,
+	                                                          responderKeys);
+	EXPECT_EQ(HANDSHAKE_RESPONSE_SIZE, response.size());
+	EXPECT_EQ(11u, HandshakeProtocol::receiverIndex(response));
+
+	SessionKeys initiatorKeys;
+	ASSERT_TRUE(protocol.consumeResponse(response, initiator, initiatorKeys));
+
+	EXPECT_EQ(initiatorKeys.sending, responderKeys.receiving);
+	EXPECT_EQ(initiatorKeys.receiving, responderKeys.sending);
+	EXPECT_NE(initiatorKeys.sending, initiatorKeys.receiving);
+	EXPECT_EQ(11u, initiatorKeys.localIndex);
+	EXPECT_EQ(22u, initiatorKeys.remoteIndex);
+	EXPECT_EQ(22u, responderKeys.localIndex);
+	EXPECT_EQ(11u, responderKeys.remoteIndex);
+
+	// Every handshake has fresh keys.
+	HandshakeState again;
+	ASSERT_TRUE(protocol.consumeInitiation(
+	               protocol.createInitiation(initiator, 11, 1235, nullptr),
+	               again, timestamp));
+	SessionKeys otherKeys;
+	protocol.createResponse(again, 22, otherKeys);
+	EXPECT_NE(responderKeys.sending, otherKeys.sending);
+}
+
+// Test that peers without the same pre-shared key (or ephemeral keys) can't
+// complete a handshake.
+TEST(Handshake, WrongKey)
+{
+	HandshakeProtocol protocol(makeKey(1));
+	HandshakeProtocol impostor(makeKey(2));
+	HandshakeState initiator;
+	HandshakeState responder;
+	std::uint64_t timestamp;
+
+	Overpass::SharedBuffer initiation = impostor.createInitiation(
+	                                       initiator, 1, 1, nullptr);
+	EXPECT_FALSE(protocol.consumeInitiation(initiation, responder, timestamp));
+
+	initiation = protocol.createInitiation(initiator, 1, 1, nullptr);
+	EXPECT_FALSE(impostor.consumeInitiation(initiation, responder, timestamp));
+
+	// A response to someone else's initiation doesn't decrypt either.
+	ASSERT_TRUE(protocol.consumeInitiation(initiation, responder, timestamp));
+	SessionKeys keys;
+	Overpass::SharedBuffer response = protocol.createResponse(responder, 2,
+	                                                          keys);
+	HandshakeState other;
+	protocol.createInitiation(other, 1, 2, nullptr);
+	EXPECT_FALSE(protocol.consumeResponse(response, other, keys));
+}
+
+// Test that tampered messages are rejected, without spoiling the handshake.
+TEST(Handshake, Tampering)
+{
+	HandshakeProtocol protocol(makeKey(1));
+	HandshakeState initiator;
+	HandshakeState responder;
+	std::uint64_t timestamp;
+
+	Overpass::SharedBuffer initiation = protocol.createInitiation(
+	                                       initiator, 1, 1, nullptr);
+	for (std::size_t i = 0; i < HANDSHAKE_INITIATION_SIZE - MAC_SIZE; i += 7)
+	{
+		Overpass::SharedBuffer tampered = copy(initiation);
+		tampered[i] ^= 1;
+		EXPECT_FALSE(protocol.consumeInitiation(tampered, responder, timestamp))
+		      << i;
+	}
+
+	ASSERT_TRUE(protocol.consumeInitiation(initiation, responder, timestamp));
+	SessionKeys responderKeys;
+	Overpass::SharedBuffer response = protocol.createResponse(responder, 2,
+	                                                          responderKeys);
+
+	SessionKeys initiatorKeys;
+	for (std::size_t i = 0; i < HANDSHAKE_RESPONSE_SIZE - 2 * MAC_SIZE; ++i)
+	{
+		Overpass::SharedBuffer tampered = copy(response);
+		tampered[i] ^= 1;
+		EXPECT_FALSE(protocol.consumeResponse(tampered, initiator,
+		                                      initiatorKeys)) << i;
+	}
+
+	EXPECT_FALSE(protocol.consumeResponse(initiation, initiator,
+	                                      initiatorKeys));
+	ASSERT_TRUE(protocol.consumeResponse(response, initiator, initiatorKeys));
+	EXPECT_EQ(initiatorKeys.sending, responderKeys.receiving);
+}
+
+// Test that a cookie reply gets the cookie to the initiator (and only it),
+// which can then prove it's at its address with mac2.
+TEST(Handshake, Cookie)
+{
+	HandshakeProtocol protocol(makeKey(1));
+	CookieSecret secret;
+	HandshakeState initiator;
+
+	Overpass::SharedBuffer initiation = protocol.createInitiation(
+	                                       initiator, 7, 1, nullptr);
+	Cookie cookie = secret.cookie(INITIATOR);
+	EXPECT_FALSE(HandshakeProtocol::hasValidMac2(initiation, cookie));
+
+	Overpass::SharedBuffer reply = protocol.createCookieReply(initiation,
+	                                                          cookie);
+	EXPECT_EQ(COOKIE_REPLY_SIZE, reply.size());
+	EXPECT_EQ(7u, HandshakeProtocol::receiverIndex(reply));
+
+	// It's bound to the initiation it answers.
+	Cookie received;
+	HandshakeState other;
+	protocol.createInitiation(other, 7, 2, nullptr);
+	EXPECT_FALSE(protocol.consumeCookieReply(reply, other, received));
+
+	Overpass::SharedBuffer tampered = copy(reply);
+	tampered[COOKIE_REPLY_SIZE - 1] ^= 1;
+	EXPECT_FALSE(protocol.consumeCookieReply(tampered, initiator, received));
+
+	ASSERT_TRUE(protocol.consumeCookieReply(reply, initiator, received));
+	EXPECT_EQ(cookie, received);
+
+	initiation = protocol.createInitiation(initiator, 7, 3, &received);
+	EXPECT_TRUE(HandshakeProtocol::hasValidMac2(initiation, cookie));
+
+	// Cookies are bound to the address and port, and the secret.
+	boost::asio::ip::udp::endpoint moved(INITIATOR.address(), 4568);
+	EXPECT_FALSE(HandshakeProtocol::hasValidMac2(initiation,
+	                                             secret.cookie(moved)));
+	secret.rotate();
+	EXPECT_FALSE(HandshakeProtocol::hasValidMac2(initiation,
+	                                             secret.cookie(INITIATOR)));
+}
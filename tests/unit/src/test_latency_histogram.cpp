@@ -0,0 +1,150 @@
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "buffer_pool.h"
+#include "internal/latency_histogram.h"
+
+using Overpass::SharedBuffer;
+using Overpass::internal::LatencyStage;
+using Overpass::internal::LatencyTracer;
+using Overpass::internal::LatencySnapshot;
+using Overpass::internal::LatencyHistogram;
+
+// Test that buckets cover every value, in order, and are never wider than
+// a sixteenth of the values they hold.
+TEST(LatencyHistogram, Buckets)
+{
+	std::uint64_t lowest = 0;
+	for (std::size_t bucket = 0; bucket < LatencyHistogram::BUCKET_COUNT;
+	     ++bucket)
+	{
+		std::uint64_t highest = LatencyHistogram::highestValue(bucket);
+		ASSERT_LE(lowest, highest);
+		EXPECT_EQ(bucket, LatencyHistogram::bucket(lowest));
+		EXPECT_EQ(bucket, LatencyHistogram::bucket(highest));
+		EXPECT_LE(highest - lowest, lowest / 16);
+
+		lowest = highest + 1;
+	}
+
+	// Anything larger is clamped to the last bucket.
+	EXPECT_EQ(LatencyHistogram::BUCKET_COUNT - 1,
+	          LatencyHistogram::bucket(lowest));
+	EXPECT_EQ(LatencyHistogram::BUCKET_COUNT - 1,
+	          LatencyHistogram::bucket(UINT64_MAX));
+}
+
+// Test that percentiles are found to within a bucket, across threads.
+TEST(LatencyHistogram, Percentiles)
+{
+	LatencyHistogram histogram;
+	EXPECT_EQ(0u, histogram.snapshot().percentile(0.5));
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; ++i)
+	{
+		threads.emplace_back([&histogram, i]()
+		{
+			for (std::int64_t value = 1 + i; value <= 10000; value += 4)
+			{
+				histogram.record(value * 1000);
+			}
+		});
+	}
+
+	for (auto &thread : threads)
+	{
+		thread.join();
+	}
+
+	histogram.record(-5);
+
+	LatencySnapshot snapshot = histogram.snapshot();
+	EXPECT_EQ(10001u, snapshot.count);
+	EXPECT_EQ(std::uint64_t(10000) * 10001 / 2 * 1000, snapshot.sum);
+
+	const struct
+	{
+		double fraction;
+		std::uint64_t value;
+	} expected[] = {
+		{0.0, 0},
+		{0.5, 5000000},
+		{0.99, 9900000},
+		{0.999, 9990000},
+		{1.0, 10000000}};
+	for (const auto &percentile : expected)
+	{
+		std::uint64_t value = snapshot.percentile(percentile.fraction);
+		EXPECT_GE(value, percentile.value) << percentile.fraction;
+		EXPECT_LE(value, percentile.value + percentile.value / 16)
+		   << percentile.fraction;
+	}
+}
+
+// Test that merged snapshots add up.
+TEST(LatencyHistogram, Merge)
+{
+	LatencyHistogram first;
+	LatencyHistogram second;
+	for (int i = 0; i < 99; ++i)
+	{
+		first.record(100);
+	}
+
+	second.record(1000000);
+
+	LatencySnapshot merged;
+	merged.merge(first.snapshot());
+	merged.merge(second.snapshot());
+	EXPECT_EQ(100u, merged.count);
+	EXPECT_EQ(99u * 100 + 1000000, merged.sum);
+	EXPECT_LE(100u, merged.percentile(0.99));
+	EXPECT_GT(110u, merged.percentile(0.99));
+	EXPECT_LE(1000000u, merged.percentile(0.999));
+}
+
+// Test that stages are timed from the stamps packets carry, and that
+// packets which weren't read by a tracing server aren't.
+TEST(LatencyTracer, Stages)
+{
+	LatencyTracer reader;
+	LatencyTracer writer;
+
+	SharedBuffer packet(64);
+	LatencyTracer::read(packet, 1000);
+	reader.dispatched(packet, 3000);
+
+	// Derived buffers (e.g. sealed ones) carry the stamps along.
+	SharedBuffer sealed(80);
+	sealed.times() = packet.times();
+	writer.queued(sealed, 10000);
+	writer.written(sealed, 15000);
+
+	SharedBuffer untraced(64);
+	reader.dispatched(untraced, 3000);
+	writer.queued(untraced, 10000);
+	writer.written(untraced, 15000);
+
+	const struct
+	{
+		const LatencyTracer &tracer;
+		LatencyStage stage;
+		std::uint64_t count;
+		std::uint64_t sum;
+	} expected[] = {
+		{reader, LatencyStage::Dispatch, 1, 2000},
+		{reader, LatencyStage::Route, 0, 0},
+		{writer, LatencyStage::Dispatch, 0, 0},
+		{writer, LatencyStage::Route, 1, 7000},
+		{writer, LatencyStage::Send, 1, 5000},
+		{writer, LatencyStage::Total, 1, 14000}};
+	for (const auto &stage : expected)
+	{
+		LatencySnapshot snapshot = stage.tracer.snapshot(stage.stage);
+		EXPECT_EQ(stage.count, snapshot.count) << toString(stage.stage);
+		EXPECT_EQ(stage.sum, snapshot.sum) << toString(stage.stage);
+	}
+}
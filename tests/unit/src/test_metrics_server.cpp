@@ -0,0 +1,98 @@
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <boost/asio/read.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/buffers_iterator.hpp>
+
+#include "internal/metrics_server.h"
+
+using Overpass::internal::MetricsServer;
+
+// Test that every connection gets a fresh snapshot, that only the owner can
+// connect, and that the socket goes away with the server.
+TEST(MetricsServer, Snapshots)
+{
+	std::string path = "/tmp/overpass-metrics-test-" +
+	                   std::to_string(getpid()) + ".sock";
+
+	std::unique_ptr<boost::asio::io_service> ioService(
+	      new boost::asio::io_service);
+	int snapshots = 0;
+	auto server = std::make_shared<MetricsServer>(
+	                 *ioService, path, [&](std::ostream &stream)
+	                 {
+	                    stream << "overpass_snapshots_total " << ++snapshots
+	                           << "\n";
+	                 });
+	server->start();
+	std::thread thread([&]() { ioService->run(); });
+
+	struct stat status;
+	ASSERT_EQ(0, lstat(path.c_str(), &status));
+	EXPECT_TRUE(S_ISSOCK(status.st_mode));
+	EXPECT_EQ(S_IRUSR | S_IWUSR, status.st_mode & 0777);
+
+	for (int i = 1; i <= 2; ++i)
+	{
+		boost::asio::io_service clientService;
+		boost::asio::local::stream_protocol::socket socket(clientService);
+		socket.connect(boost::asio::local::stream_protocol::endpoint(path));
+
+		boost::asio::streambuf snapshot;
+		boost::system::error_code error;
+		boost::asio::read(socket, snapshot, error);
+		EXPECT_EQ(boost::asio::error::eof, error);
+
+		std::string text(boost::asio::buffers_begin(snapshot.data()),
+		                 boost::asio::buffers_end(snapshot.data()));
+		EXPECT_EQ("overpass_snapshots_total " + std::to_string(i) + "\n",
+		          text);
+	}
+
+	// The server is gone once nothing of it is waiting on the IO service.
+	ioService->stop();
+	thread.join();
+	server.reset();
+	ioService.reset();
+
+	EXPECT_NE(0, access(path.c_str(), F_OK));
+}
+
+// Test that a stale socket is replaced, but other files aren't.
+TEST(MetricsServer, ExistingFiles)
+{
+	std::string path = "/tmp/overpass-metrics-test-" +
+	                   std::to_string(getpid()) + ".sock";
+	boost::asio::io_service ioService;
+	auto writer = [](std::ostream&) {};
+
+	{
+		boost::asio::local::stream_protocol::acceptor stale(ioService);
+		stale.open();
+		stale.bind(boost::asio::local::stream_protocol::endpoint(path));
+	}
+
+	{
+		MetricsServer server(ioService, path, writer);
+	}
+
+	{
+		std::ofstream file(path);
+		file << "keep";
+	}
+
+	EXPECT_THROW(MetricsServer(ioService, path, writer),
+	             boost::system::system_error);
+
+	std::ifstream file(path);
+	std::string text;
+	file >> text;
+	EXPECT_EQ("keep", text);
+	unlink(path.c_str());
+}
@@ -0,0 +1,381 @@
+#include <cstring>
+
+#include <gtest/gtest.h>
+
+#include "packet_view.h"
+#include "internal/offload.h"
+#include "internal/checksum.h"
+
+using namespace Overpass::internal;
+
+namespace
+{
+	const std::uint8_t TCP_PSH = 0x08;
+	const std::uint8_t TCP_ACK = 0x10;
+	const std::uint8_t TCP_SYN = 0x02;
+
+	const std::size_t TCP_HEADER_SIZE = 32; // With timestamps.
+
+	/*!
+	 * \brief Build a TCP segment whose payload bytes follow the sequence
+	 *        numbers, with valid checksums.
+	 */
+	Overpass::SharedBuffer makeSegment(unsigned int version,
+	                                   std::uint32_t sequence,
+	                                   std::size_t payloadSize,
+	                                   std::uint8_t flags = TCP_ACK,
+	                                   std::uint16_t identification = 0,
+	                                   std::uint16_t sourcePort = 1234)
+	{
+		std::size_t ipHeaderLength = version == 4 ? 20 : 40;
+		std::size_t length = ipHeaderLength + TCP_HEADER_SIZE + payloadSize;
+		Overpass::SharedBuffer buffer(length);
+		std::fill(buffer.begin(), buffer.end(), 0);
+
+		std::uint8_t *data = buffer.data();
+		if (version == 4)
+		{
+			data[0] = 0x45;
+			writeShort(data + 2, length);
+			writeShort(data + 4, identification);
+			data[6] = 0x40; // Don't fragment
+			data[8] = 64;
+			data[9] = 6;
+			const std::uint8_t addresses[] = {10, 0, 0, 1, 10, 0, 0, 2};
+			std::memcpy(data + 12, addresses, sizeof(addresses));
+			writeShort(data + 10, checksumFinish(checksumAdd(data, 20)));
+		}
+		else
+		{
+			data[0] = 0x60;
+			writeShort(data + 4, length - 40);
+			data[6] = 6;
+			data[7] = 64;
+			data[8] = 0xfd;
+			data[23] = 1;
+			data[24] = 0xfd;
+			data[39] = 2;
+		}
+
+		std::uint8_t *tcp = data + ipHeaderLength;
+		writeShort(tcp, sourcePort);
+		writeShort(tcp + 2, 80);
+		writeLong(tcp + 4, sequence);
+		writeLong(tcp + 8, 42);
+		tcp[12] = (TCP_HEADER_SIZE / 4) << 4;
+		tcp[13] = flags;
+		writeShort(tcp + 14, 512);
+
+		// Timestamps.
+		tcp[20] = 1;
+		tcp[21] = 1;
+		tcp[22] = 8;
+		tcp[23] = 10;
+		writeLong(tcp + 24, 7);
+
+		for (std::size_t i = 0; i < payloadSize; ++i)
+		{
+			tcp[TCP_HEADER_SIZE + i] = (sequence + i) & 0xff;
+		}
+
+		std::size_t tcpLength = length - ipHeaderLength;
+		writeShort(tcp + 16, checksumFinish(
+		              checksumAdd(tcp, tcpLength,
+		                          pseudoHeaderSum(data, 6, tcpLength))));
+		return buffer;
+	}
+
+	/*!
+	 * \brief Turn a segment into a super-packet holding the given payload,
+	 *        as the kernel would hand it over.
+	 */
+	Overpass::SharedBuffer makeSuperPacket(unsigned int version,
+	                                       std::uint32_t sequence,
+	                                       std::size_t payloadSize,
+	                                       std::uint16_t segmentSize)
+	{
+		Overpass::SharedBuffer packet = makeSegment(version, sequence,
+		                                            payloadSize,
+		                                            TCP_ACK | TCP_PSH);
+
+		VirtioNetHeader header;
+		std::memset(&header, 0, sizeof(header));
+		header.flags = VIRTIO_NET_HEADER_NEEDS_CHECKSUM;
+		header.gsoType = version == 4 ? VIRTIO_NET_GSO_TCPV4 :
+		                                 VIRTIO_NET_GSO_TCPV6;
+		header.gsoSize = segmentSize;
+
+		Overpass::SharedBuffer buffer(VIRTIO_NET_HEADER_SIZE + packet.size());
+		std::memcpy(buffer.data(), &header, sizeof(header));
+		std::memcpy(buffer.data() + VIRTIO_NET_HEADER_SIZE, packet.data(),
+		            packet.size());
+		return buffer;
+	}
+
+	VirtioNetHeader readHeader(const Overpass::SharedBuffer &buffer)
+	{
+		VirtioNetHeader header;
+		std::memcpy(&header, buffer.data(), sizeof(header));
+		return header;
+	}
+
+	Overpass::SharedBuffer stripHeader(const Overpass::SharedBuffer &buffer)
+	{
+		Overpass::SharedBuffer packet(buffer);
+		packet.trimFront(VIRTIO_NET_HEADER_SIZE);
+		return packet;
+	}
+
+	void expectValidChecksums(const Overpass::SharedBuffer &packet)
+	{
+		Overpass::PacketView view(packet);
+		ASSERT_TRUE(view.isValid());
+		ASSERT_EQ(view.totalLength(), packet.size());
+
+		const std::uint8_t *data = packet.data();
+		if (view.version() == 4)
+		{
+			EXPECT_EQ(0xffff, checksumFold(checksumAdd(data, 20)));
+		}
+
+		std::size_t tcpLength = packet.size() - view.headerLength();
+		EXPECT_EQ(0xffff, checksumFold(
+		             checksumAdd(data + view.headerLength(), tcpLength,
+		                         pseudoHeaderSum(data, 6, tcpLength))));
+	}
+
+	void expectSegment(const Overpass::SharedBuffer &packet,
+	                   std::uint32_t sequence, std::size_t payloadSize,
+	                   std::uint8_t flags)
+	{
+		Overpass::PacketView view(packet);
+		ASSERT_TRUE(view.isValid());
+		ASSERT_EQ(view.headerLength() + TCP_HEADER_SIZE + payloadSize,
+		          packet.size());
+		expectValidChecksums(packet);
+
+		const std::uint8_t *tcp = packet.data() + view.headerLength();
+		EXPECT_EQ(sequence, readLong(tcp + 4));
+		EXPECT_EQ(flags, tcp[13]);
+		for (std::size_t i = 0; i < payloadSize; ++i)
+		{
+			ASSERT_EQ((sequence + i) & 0xff, tcp[TCP_HEADER_SIZE + i]);
+		}
+	}
+
+	void segmentSuperPacket(unsigned int version)
+	{
+		std::vector<Overpass::SharedBuffer> packets;
+		segmentFromVirtual(makeSuperPacket(version, 1000, 2500, 1000),
+		                   packets);
+
+		ASSERT_EQ(3u, packets.size());
+		expectSegment(packets[0], 1000, 1000, TCP_ACK);
+		expectSegment(packets[1], 2000, 1000, TCP_ACK);
+		expectSegment(packets[2], 3000, 500, TCP_ACK | TCP_PSH);
+
+		if (version == 4)
+		{
+			for (std::size_t i = 0; i < packets.size(); ++i)
+			{
+				EXPECT_EQ(i, readShort(packets[i].data() + 4));
+			}
+		}
+	}
+
+	struct Writes
+	{
+		std::vector<Overpass::SharedBuffer> buffers;
+
+		GroCoalescer::Writer writer()
+		{
+			return [this](const Overpass::SharedBuffer &buffer)
+			{
+				buffers.push_back(buffer);
+			};
+		}
+	};
+
+	void coalesceSegments(unsigned int version)
+	{
+		Writes writes;
+		GroCoalescer coalescer;
+		for (std::uint16_t i = 0; i < 4; ++i)
+		{
+			coalescer.add(makeSegment(version, 1000 + i * 1000, 1000, TCP_ACK,
+			                          i), writes.writer());
+		}
+
+		coalescer.add(makeSegment(version, 5000, 300, TCP_ACK | TCP_PSH, 4),
+		              writes.writer());
+		EXPECT_TRUE(writes.buffers.empty());
+		EXPECT_EQ(1u, coalescer.pendingFlows());
+
+		coalescer.flush(writes.writer());
+		EXPECT_EQ(0u, coalescer.pendingFlows());
+		ASSERT_EQ(1u, writes.buffers.size());
+
+		std::size_t ipHeaderLength = version == 4 ? 20 : 40;
+		VirtioNetHeader header = readHeader(writes.buffers[0]);
+		EXPECT_EQ(VIRTIO_NET_HEADER_NEEDS_CHECKSUM, header.flags);
+		EXPECT_EQ(version == 4 ? VIRTIO_NET_GSO_TCPV4 :
+		                         VIRTIO_NET_GSO_TCPV6, header.gsoType);
+		EXPECT_EQ(1000, header.gsoSize);
+		EXPECT_EQ(ipHeaderLength + TCP_HEADER_SIZE, header.headerLength);
+		EXPECT_EQ(ipHeaderLength, header.checksumStart);
+		EXPECT_EQ(16, header.checksumOffset);
+
+		Overpass::SharedBuffer packet = stripHeader(writes.buffers[0]);
+		Overpass::PacketView view(packet);
+		ASSERT_TRUE(view.isValid());
+		EXPECT_EQ(ipHeaderLength + TCP_HEADER_SIZE + 4300, view.totalLength());
+
+		// Splitting it again, as the kernel would, gives the segments back.
+		std::vector<Overpass::SharedBuffer> packets;
+		segmentFromVirtual(writes.buffers[0], packets);
+		ASSERT_EQ(5u, packets.size());
+		for (std::size_t i = 0; i < 4; ++i)
+		{
+			expectSegment(packets[i], 1000 + i * 1000, 1000, TCP_ACK);
+		}
+
+		expectSegment(packets[4], 5000, 300, TCP_ACK | TCP_PSH);
+	}
+}
+
+// Test that IPv4 super-packets are split into valid segments.
+TEST(Offload, SegmentIpv4)
+{
+	segmentSuperPacket(4);
+}
+
+// Test that IPv6 super-packets are split into valid segments.
+TEST(Offload, SegmentIpv6)
+{
+	segmentSuperPacket(6);
+}
+
+// Test that checksums left for us to complete are completed.
+TEST(Offload, CompleteChecksum)
+{
+	Overpass::SharedBuffer packet = makeSegment(4, 1, 100);
+	std::uint8_t *tcp = packet.data() + 20;
+	writeShort(tcp + 16, checksumFold(pseudoHeaderSum(packet.data(), 6,
+	                                                  packet.size() - 20)));
+
+	VirtioNetHeader header;
+	std::memset(&header, 0, sizeof(header));
+	header.flags = VIRTIO_NET_HEADER_NEEDS_CHECKSUM;
+	header.checksumStart = 20;
+	header.checksumOffset = 16;
+
+	Overpass::SharedBuffer buffer(VIRTIO_NET_HEADER_SIZE + packet.size());
+	std::memcpy(buffer.data(), &header, sizeof(header));
+	std::memcpy(buffer.data() + VIRTIO_NET_HEADER_SIZE, packet.data(),
+	            packet.size());
+
+	std::vector<Overpass::SharedBuffer> packets;
+	segmentFromVirtual(buffer, packets);
+	ASSERT_EQ(1u, packets.size());
+	expectSegment(packets[0], 1, 100, TCP_ACK);
+}
+
+// Test that packets without offloads are only stripped of their header, and
+// that truncated ones are passed on for the router to drop.
+TEST(Offload, PassThrough)
+{
+	Overpass::SharedBuffer packet = makeSegment(6, 1, 100);
+
+	std::vector<Overpass::SharedBuffer> packets;
+	segmentFromVirtual(prependEmptyVirtioHeader(packet), packets);
+	ASSERT_EQ(1u, packets.size());
+	ASSERT_EQ(packet.size(), packets[0].size());
+	EXPECT_EQ(0, std::memcmp(packet.data(), packets[0].data(), packet.size()));
+
+	Overpass::SharedBuffer truncated = makeSuperPacket(4, 1, 2500, 1000);
+	truncated.resize(VIRTIO_NET_HEADER_SIZE + 30);
+	packets.clear();
+	segmentFromVirtual(truncated, packets);
+	ASSERT_EQ(1u, packets.size());
+	EXPECT_FALSE(Overpass::PacketView(packets[0]).isValid());
+}
+
+// Test that contiguous IPv4 segments are merged into a super-packet.
+TEST(Offload, CoalesceIpv4)
+{
+	coalesceSegments(4);
+}
+
+// Test that contiguous IPv6 segments are merged into a super-packet.
+TEST(Offload, CoalesceIpv6)
+{
+	coalesceSegments(6);
+}
+
+// Test that segments the kernel couldn't split back into the same ones are
+// written as they are, in order.
+TEST(Offload, RefuseToCoalesce)
+{
+	Writes writes;
+	GroCoalescer coalescer;
+
+	// A gap in the sequence numbers.
+	coalescer.add(makeSegment(4, 1000, 1000), writes.writer());
+	coalescer.add(makeSegment(4, 3000, 1000), writes.writer());
+	ASSERT_EQ(1u, writes.buffers.size());
+
+	// A short segment may end a super-packet, but nothing may follow it.
+	coalescer.add(makeSegment(4, 4000, 500), writes.writer());
+	coalescer.add(makeSegment(4, 4500, 500), writes.writer());
+	ASSERT_EQ(2u, writes.buffers.size());
+
+	// Other flags, or no payload.
+	coalescer.add(makeSegment(4, 5000, 0, TCP_ACK | TCP_SYN), writes.writer());
+	ASSERT_EQ(4u, writes.buffers.size());
+
+	coalescer.flush(writes.writer());
+	ASSERT_EQ(4u, writes.buffers.size());
+
+	const std::uint32_t sequences[] = {1000, 3000, 4500, 5000};
+	for (std::size_t i = 0; i < writes.buffers.size(); ++i)
+	{
+		Overpass::SharedBuffer packet = stripHeader(writes.buffers[i]);
+		EXPECT_EQ(sequences[i], readLong(packet.data() + 24));
+
+		VirtioNetHeader header = readHeader(writes.buffers[i]);
+		if (i == 1)
+		{
+			EXPECT_EQ(VIRTIO_NET_GSO_TCPV4, header.gsoType);
+			EXPECT_EQ(20u + TCP_HEADER_SIZE + 1500, packet.size());
+			continue;
+		}
+
+		EXPECT_EQ(VIRTIO_NET_GSO_NONE, header.gsoType);
+		EXPECT_EQ(0, header.flags);
+		expectValidChecksums(packet);
+	}
+}
+
+// Test that interleaved flows are merged separately.
+TEST(Offload, CoalesceFlows)
+{
+	Writes writes;
+	GroCoalescer coalescer;
+	for (std::uint32_t i = 0; i < 3; ++i)
+	{
+		coalescer.add(makeSegment(4, i * 100, 100, TCP_ACK, 0, 1),
+		              writes.writer());
+		coalescer.add(makeSegment(4, i * 100, 100, TCP_ACK, 0, 2),
+		              writes.writer());
+	}
+
+	EXPECT_EQ(2u, coalescer.pendingFlows());
+	coalescer.flush(writes.writer());
+	ASSERT_EQ(2u, writes.buffers.size());
+
+	for (const auto &buffer : writes.buffers)
+	{
+		EXPECT_EQ(VIRTIO_NET_GSO_TCPV4, readHeader(buffer).gsoType);
+		EXPECT_EQ(20u + TCP_HEADER_SIZE + 300, stripHeader(buffer).size());
+	}
+}
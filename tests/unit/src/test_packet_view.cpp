@@ -0,0 +1,149 @@
+#include <gtest/gtest.h>
+
+#include "packet_view.h"
+
+namespace
+{
+	Overpass::SharedBuffer makeIpv4Packet(std::size_t payloadSize,
+	                                      std::size_t bufferSize = 0)
+	{
+		std::size_t totalLength = 20 + payloadSize;
+		Overpass::SharedBuffer buffer(std::max(totalLength, bufferSize));
+		std::fill(buffer.begin(), buffer.end(), 0);
+
+		buffer[0] = 0x45; // Version 4, 5 word header
+		buffer[2] = totalLength >> 8;
+		buffer[3] = totalLength & 0xff;
+		buffer[8] = 64; // TTL
+		buffer[9] = 17; // UDP
+		const uint8_t source[] = {10, 0, 0, 1};
+		const uint8_t destination[] = {11, 11, 11, 2};
+		std::copy(source, source + 4, buffer.begin() + 12);
+		std::copy(destination, destination + 4, buffer.begin() + 16);
+		return buffer;
+	}
+
+	Overpass::SharedBuffer makeIpv6Packet(std::size_t payloadSize)
+	{
+		Overpass::SharedBuffer buffer(40 + payloadSize);
+		std::fill(buffer.begin(), buffer.end(), 0);
+
+		buffer[0] = 0x60; // Version 6
+		buffer[4] = payloadSize >> 8;
+		buffer[5] = payloadSize & 0xff;
+		buffer[6] = 58; // ICMPv6
+		buffer[7] = 255; // Hop limit
+		buffer[23] = 1; // Source ::1
+		buffer[24] = 0xfd; // Destination fd00::2
+		buffer[39] = 2;
+		return buffer;
+	}
+}
+
+TEST(PacketView, Ipv4)
+{
+	auto buffer = makeIpv4Packet(8);
+	Overpass::PacketView packet(buffer);
+
+	ASSERT_TRUE(packet.isValid());
+	EXPECT_EQ(4u, packet.version());
+	EXPECT_EQ(20u, packet.headerLength());
+	EXPECT_EQ(28u, packet.totalLength());
+	EXPECT_EQ(17u, packet.protocol());
+	EXPECT_EQ(64u, packet.timeToLive());
+	EXPECT_EQ(boost::asio::ip::address::from_string("10.0.0.1"),
+	          packet.sourceAddress());
+	EXPECT_EQ(boost::asio::ip::address::from_string("11.11.11.2"),
+	          packet.destinationAddress());
+}
+
+TEST(PacketView, Ipv6)
+{
+	auto buffer = makeIpv6Packet(8);
+	Overpass::PacketView packet(buffer);
+
+	ASSERT_TRUE(packet.isValid());
+	EXPECT_EQ(6u, packet.version());
+	EXPECT_EQ(40u, packet.headerLength());
+	EXPECT_EQ(48u, packet.totalLength());
+	EXPECT_EQ(58u, packet.protocol());
+	EXPECT_EQ(255u, packet.timeToLive());
+	EXPECT_EQ(boost::asio::ip::address::from_string("::1"),
+	          packet.sourceAddress());
+	EXPECT_EQ(boost::asio::ip::address::from_string("fd00::2"),
+	          packet.destinationAddress());
+}
+
+// The buffer a packet was read into is usually larger than the packet itself.
+// The packet handle should refer to the same bytes, trimmed to fit.
+TEST(PacketView, PacketIsTrimmedWithoutCopying)
+{
+	auto buffer = makeIpv4Packet(8, 1500);
+	Overpass::PacketView packet(buffer);
+	ASSERT_TRUE(packet.isValid());
+
+	Overpass::SharedBuffer trimmed = packet.packet();
+	EXPECT_EQ(buffer.data(), trimmed.data());
+	EXPECT_EQ(28u, trimmed.size());
+	EXPECT_EQ(1500u, buffer.size());
+}
+
+TEST(PacketView, FlowHash)
+{
+	auto first = makeIpv4Packet(8);
+	auto second = makeIpv4Packet(100);
+	EXPECT_EQ(Overpass::PacketView(first).flowHash(),
+	          Overpass::PacketView(second).flowHash());
+
+	// A different destination is a different flow.
+	second[19] = 3;
+	EXPECT_NE(Overpass::PacketView(first).flowHash(),
+	          Overpass::PacketView(second).flowHash());
+}
+
+TEST(PacketView, Empty)
+{
+	Overpass::SharedBuffer buffer(0);
+	EXPECT_FALSE(Overpass::PacketView(buffer).isValid());
+}
+
+TEST(PacketView, UnknownVersion)
+{
+	auto buffer = makeIpv4Packet(8);
+	buffer[0] = 0x55;
+	EXPECT_FALSE(Overpass::PacketView(buffer).isValid());
+}
+
+TEST(PacketView, TruncatedHeader)
+{
+	auto ipv4 = makeIpv4Packet(0);
+	ipv4.resize(19);
+	EXPECT_FALSE(Overpass::PacketView(ipv4).isValid());
+
+	auto ipv6 = makeIpv6Packet(0);
+	ipv6.resize(39);
+	EXPECT_FALSE(Overpass::PacketView(ipv6).isValid());
+}
+
+TEST(PacketView, TruncatedPayload)
+{
+	auto ipv4 = makeIpv4Packet(8);
+	ipv4.resize(27);
+	EXPECT_FALSE(Overpass::PacketView(ipv4).isValid());
+
+	auto ipv6 = makeIpv6Packet(8);
+	ipv6.resize(47);
+	EXPECT_FALSE(Overpass::PacketView(ipv6).isValid());
+}
+
+TEST(PacketView, BadHeaderLength)
+{
+	// Header length shorter than the minimum
+	auto buffer = makeIpv4Packet(8);
+	buffer[0] = 0x44;
+	EXPECT_FALSE(Overpass::PacketView(buffer).isValid());
+
+	// Header length longer than the total length
+	buffer[0] = 0x4f;
+	EXPECT_FALSE(Overpass::PacketView(buffer).isValid());
+}
@@ -0,0 +1,68 @@
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "internal/peer_endpoint.h"
+
+using Overpass::internal::PeerEndpoint;
+
+// Test that endpoints of both families are kept as they were given.
+TEST(PeerEndpoint, Update)
+{
+	boost::asio::ip::udp::endpoint first(
+	      boost::asio::ip::address::from_string("1.2.3.4"), 1234);
+	boost::asio::ip::udp::endpoint second(
+	      boost::asio::ip::address::from_string("2001:db8::1"), 5678);
+
+	PeerEndpoint peerEndpoint(first);
+	boost::asio::ip::udp::endpoint endpoint;
+	peerEndpoint.load(endpoint);
+	EXPECT_EQ(first, endpoint);
+
+	EXPECT_FALSE(peerEndpoint.update(first));
+	EXPECT_TRUE(peerEndpoint.update(second));
+	peerEndpoint.load(endpoint);
+	EXPECT_EQ(second, endpoint);
+
+	EXPECT_TRUE(peerEndpoint.update(first));
+	peerEndpoint.load(endpoint);
+	EXPECT_EQ(first, endpoint);
+}
+
+// Test that readers never see an endpoint halfway through a change.
+TEST(PeerEndpoint, Concurrent)
+{
+	boost::asio::ip::udp::endpoint endpoints[] = {
+		boost::asio::ip::udp::endpoint(
+		      boost::asio::ip::address::from_string("1.2.3.4"), 1234),
+		boost::asio::ip::udp::endpoint(
+		      boost::asio::ip::address::from_string("2001:db8::1"), 5678),
+	};
+
+	PeerEndpoint peerEndpoint(endpoints[0]);
+	std::atomic<bool> done(false);
+	std::vector<std::thread> threads;
+	for (std::size_t i = 0; i < 2; ++i)
+	{
+		threads.push_back(std::thread([&, i]()
+		{
+			while (!done.load())
+			{
+				peerEndpoint.update(endpoints[i]);
+			}
+		}));
+	}
+
+	for (std::size_t i = 0; i < 100000; ++i)
+	{
+		boost::asio::ip::udp::endpoint endpoint;
+		peerEndpoint.load(endpoint);
+		ASSERT_TRUE(endpoint == endpoints[0] || endpoint == endpoints[1]);
+	}
+
+	done.store(true);
+	for (auto &thread : threads)
+	{
+		thread.join();
+	}
+}
@@ -0,0 +1,143 @@
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include "internal/prefix_trie.h"
+
+using Overpass::internal::Ipv4Key;
+using Overpass::internal::Ipv6Key;
+using Overpass::internal::PrefixTrie;
+
+namespace
+{
+	// Longest-prefix match the slow way, to check the trie against.
+	template <typename Key>
+	std::uint32_t bruteForce(
+	      const std::vector<typename PrefixTrie<Key>::Prefix> &prefixes,
+	      const typename Key::Type &key)
+	{
+		std::uint32_t result = 0;
+		int longest = -1;
+		for (const auto &prefix : prefixes)
+		{
+			auto masked = Key::mask(key, prefix.length);
+			auto network = Key::mask(prefix.key, prefix.length);
+			if (!(masked < network) && !(network < masked) &&
+			    static_cast<int>(prefix.length) >= longest)
+			{
+				longest = prefix.length;
+				result = prefix.value;
+			}
+		}
+
+		return result;
+	}
+
+	Ipv6Key::Type ipv6(std::uint64_t high, std::uint64_t low)
+	{
+		Ipv6Key::Type key = {high, low};
+		return key;
+	}
+}
+
+TEST(PrefixTrie, Empty)
+{
+	PrefixTrie<Ipv4Key> trie;
+	EXPECT_EQ(0u, trie.lookup(0x0a000001));
+	EXPECT_EQ(0u, trie.lookup(0xffffffff));
+}
+
+TEST(PrefixTrie, LongestMatchWins)
+{
+	PrefixTrie<Ipv4Key> trie;
+	trie.build({
+	              {0x00000000, 0, 1},  // Default
+	              {0x0a000000, 8, 2},  // 10.0.0.0/8
+	              {0x0a010000, 16, 3}, // 10.1.0.0/16
+	              {0x0a010200, 24, 4}, // 10.1.2.0/24
+	              {0x0a010203, 32, 5}, // 10.1.2.3/32
+	              {0x0a010280, 25, 6}, // 10.1.2.128/25
+	           });
+
+	EXPECT_EQ(1u, trie.lookup(0x0b000000));
+	EXPECT_EQ(2u, trie.lookup(0x0a020000));
+	EXPECT_EQ(3u, trie.lookup(0x0a01ff00));
+	EXPECT_EQ(4u, trie.lookup(0x0a010201));
+	EXPECT_EQ(5u, trie.lookup(0x0a010203));
+	EXPECT_EQ(4u, trie.lookup(0x0a010204));
+	EXPECT_EQ(6u, trie.lookup(0x0a010280));
+	EXPECT_EQ(6u, trie.lookup(0x0a0102ff));
+}
+
+TEST(PrefixTrie, HostBitsIgnored)
+{
+	PrefixTrie<Ipv4Key> trie;
+	trie.build({{0x0a0102ff, 24, 1}});
+	EXPECT_EQ(1u, trie.lookup(0x0a010200));
+	EXPECT_EQ(0u, trie.lookup(0x0a010300));
+}
+
+TEST(PrefixTrie, Ipv6)
+{
+	PrefixTrie<Ipv6Key> trie;
+	trie.build({
+	              {ipv6(0, 0), 0, 1},                                      // ::/0
+	              {ipv6(0xfd00000000000000, 0), 8, 2},                     // fd00::/8
+	              {ipv6(0xfd00000000000001, 0), 64, 3},                    // fd00:0:0:1::/64
+	              {ipv6(0xfd00000000000001, 0x8000000000000000), 66, 4},   // Straddling
+	              {ipv6(0xfd00000000000001, 0xc000000000000001), 128, 5},  // Host
+	           });
+
+	EXPECT_EQ(1u, trie.lookup(ipv6(0x2001000000000000, 1)));
+	EXPECT_EQ(2u, trie.lookup(ipv6(0xfd00000000000002, 1)));
+	EXPECT_EQ(3u, trie.lookup(ipv6(0xfd00000000000001, 1)));
+	EXPECT_EQ(4u, trie.lookup(ipv6(0xfd00000000000001, 0x8000000000000001)));
+	EXPECT_EQ(5u, trie.lookup(ipv6(0xfd00000000000001, 0xc000000000000001)));
+	EXPECT_EQ(3u, trie.lookup(ipv6(0xfd00000000000001, 0xc000000000000002)));
+}
+
+TEST(PrefixTrie, RandomIpv4)
+{
+	std::mt19937 random(1234);
+	std::vector<PrefixTrie<Ipv4Key>::Prefix> prefixes;
+	for (std::uint32_t i = 1; i <= 2000; ++i)
+	{
+		// Cluster the prefixes so they overlap a lot.
+		std::uint32_t key = (random() & 0x0f0f0fff) | 0x0a000000;
+		prefixes.push_back({key, static_cast<unsigned int>(random() % 33), i});
+	}
+
+	PrefixTrie<Ipv4Key> trie;
+	trie.build(prefixes);
+
+	for (int i = 0; i < 20000; ++i)
+	{
+		std::uint32_t key = i % 2 ? random() :
+		                            prefixes[random() % prefixes.size()].key ^
+		                            (random() & 0xff);
+		ASSERT_EQ(bruteForce<Ipv4Key>(prefixes, key), trie.lookup(key))
+		      << "Lookup of " << std::hex << key;
+	}
+}
+
+TEST(PrefixTrie, RandomIpv6)
+{
+	std::mt19937_64 random(1234);
+	std::vector<PrefixTrie<Ipv6Key>::Prefix> prefixes;
+	for (std::uint32_t i = 1; i <= 2000; ++i)
+	{
+		auto key = ipv6(0xfd00000000000000 | (random() & 0xff00ff), random());
+		prefixes.push_back({key, static_cast<unsigned int>(random() % 129), i});
+	}
+
+	PrefixTrie<Ipv6Key> trie;
+	trie.build(prefixes);
+
+	for (int i = 0; i < 20000; ++i)
+	{
+		auto key = prefixes[random() % prefixes.size()].key;
+		key.low ^= random() >> (random() % 64);
+		ASSERT_EQ(bruteForce<Ipv6Key>(prefixes, key), trie.lookup(key))
+		      << "Lookup of " << std::hex << key.high << ":" << key.low;
+	}
+}
@@ -0,0 +1,57 @@
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "internal/rcu_map.h"
+
+using Overpass::internal::RcuMap;
+
+// Test that keys can be added, found and removed.
+TEST(RcuMap, InsertFindErase)
+{
+	RcuMap<int, int*> map;
+	int first = 1;
+	int second = 2;
+
+	EXPECT_EQ(nullptr, map.find(1));
+	EXPECT_TRUE(map.insert(1, &first));
+	EXPECT_TRUE(map.insert(2, &second));
+	EXPECT_FALSE(map.insert(1, &second));
+	EXPECT_EQ(2u, map.size());
+
+	EXPECT_EQ(&first, map.find(1));
+	EXPECT_EQ(&second, map.find(2));
+	EXPECT_EQ(nullptr, map.find(3));
+
+	EXPECT_TRUE(map.erase(1));
+	EXPECT_FALSE(map.erase(1));
+	EXPECT_EQ(nullptr, map.find(1));
+	EXPECT_EQ(&second, map.find(2));
+	EXPECT_EQ(1u, map.size());
+}
+
+// Test that lookups keep working while the map changes.
+TEST(RcuMap, ConcurrentLookups)
+{
+	RcuMap<int, int> map;
+	map.insert(0, 100);
+
+	std::atomic<bool> done(false);
+	std::thread reader([&map, &done]()
+	{
+		while (!done.load())
+		{
+			ASSERT_EQ(100, map.find(0));
+		}
+	});
+
+	for (int i = 1; i < 1000; ++i)
+	{
+		map.insert(i, i);
+		map.erase(i);
+	}
+
+	done.store(true);
+	reader.join();
+	EXPECT_EQ(1u, map.size());
+}
@@ -0,0 +1,144 @@
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <gtest/gtest.h>
+
+#include "internal/read_sequencer.h"
+
+using Overpass::internal::ReadSequencer;
+
+// Test that reads completing out of order are handed over in the order they
+// were started.
+TEST(ReadSequencer, Order)
+{
+	ReadSequencer<int> sequencer(4);
+
+	std::vector<std::uint64_t> sequences;
+	for (int i = 0; i < 4; ++i)
+	{
+		sequencer.start([&sequences](std::uint64_t sequence)
+		{
+			sequences.push_back(sequence);
+		});
+	}
+
+	EXPECT_EQ((std::vector<std::uint64_t>{0, 1, 2, 3}), sequences);
+
+	std::vector<int> delivered;
+	auto deliver = [&delivered](int &read)
+	{
+		delivered.push_back(read);
+	};
+
+	sequencer.complete(2, 20, deliver);
+	sequencer.complete(1, 10, deliver);
+	EXPECT_TRUE(delivered.empty());
+
+	sequencer.complete(0, 0, deliver);
+	EXPECT_EQ((std::vector<int>{0, 10, 20}), delivered);
+
+	// Reads started while handing over take the slots freed.
+	sequencer.start([](std::uint64_t sequence)
+	{
+		EXPECT_EQ(4u, sequence);
+	});
+
+	sequencer.complete(4, 40, deliver);
+	sequencer.complete(3, 30, deliver);
+	EXPECT_EQ((std::vector<int>{0, 10, 20, 30, 40}), delivered);
+}
+
+// Test that reads completed from many threads are handed over in order, one
+// at a time, with every read handed over starting the next.
+TEST(ReadSequencer, Threads)
+{
+	const std::size_t DEPTH = 8;
+	const std::uint64_t READS = 20000;
+
+	ReadSequencer<std::uint64_t> sequencer(DEPTH);
+
+	// Reads waiting to complete, which the threads take in any order.
+	std::mutex mutex;
+	std::vector<std::uint64_t> started;
+	auto start = [&]()
+	{
+		sequencer.start([&](std::uint64_t sequence)
+		{
+			if (sequence < READS)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				started.push_back(sequence);
+			}
+		});
+	};
+
+	for (std::size_t i = 0; i < DEPTH; ++i)
+	{
+		start();
+	}
+
+	std::vector<std::uint64_t> delivered;
+	std::atomic<int> delivering(0);
+	auto deliver = [&](std::uint64_t &read)
+	{
+		EXPECT_EQ(0, delivering++);
+		delivered.push_back(read);
+		start();
+		--delivering;
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; ++i)
+	{
+		threads.emplace_back([&, i]()
+		{
+			for (;;)
+			{
+				bool idle = false;
+				std::uint64_t sequence = 0;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (started.empty())
+					{
+						// Reads are only started while handing others over.
+						if (delivering == 0)
+						{
+							break;
+						}
+
+						idle = true;
+					}
+					else
+					{
+						// Take them out of order.
+						std::size_t index = (i * 7) % started.size();
+						sequence = started[index];
+						started.erase(started.begin() + index);
+					}
+				}
+
+				if (idle)
+				{
+					std::this_thread::yield();
+					continue;
+				}
+
+				sequencer.complete(sequence, sequence, deliver);
+			}
+		});
+	}
+
+	for (auto &thread : threads)
+	{
+		thread.join();
+	}
+
+	ASSERT_EQ(READS, delivered.size());
+	for (std::uint64_t i = 0; i < READS; ++i)
+	{
+		ASSERT_EQ(i, delivered[i]);
+	}
+}
@@ -0,0 +1,125 @@
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "internal/replay_window.h"
+
+using Overpass::internal::ReplayWindow;
+
+// Test that counters in order are accepted once each.
+TEST(ReplayWindow, InOrder)
+{
+	ReplayWindow window;
+	for (std::uint64_t counter = 0; counter < 10000; ++counter)
+	{
+		ASSERT_TRUE(window.accept(counter)) << counter;
+		ASSERT_FALSE(window.accept(counter)) << counter;
+	}
+}
+
+// Test that counters arriving out of order are accepted once each, as long
+// as they're within the window.
+TEST(ReplayWindow, Reordering)
+{
+	ReplayWindow window;
+	EXPECT_TRUE(window.accept(100));
+	EXPECT_TRUE(window.accept(5));
+	EXPECT_TRUE(window.accept(99));
+	EXPECT_TRUE(window.accept(0));
+	EXPECT_FALSE(window.accept(5));
+	EXPECT_FALSE(window.accept(100));
+
+	// Fill every other counter going forward, then the gaps going back.
+	for (std::uint64_t counter = 1000; counter < 1000 + 2048; counter += 2)
+	{
+		ASSERT_TRUE(window.accept(counter));
+	}
+
+	for (std::uint64_t counter = 1000 + 2047; counter > 1000; counter -= 2)
+	{
+		ASSERT_TRUE(window.accept(counter)) << counter;
+	}
+
+	for (std::uint64_t counter = 1000; counter < 1000 + 2048; ++counter)
+	{
+		ASSERT_FALSE(window.accept(counter)) << counter;
+	}
+}
+
+// Test that counters too far behind the highest one are rejected, even if
+// they were never seen.
+TEST(ReplayWindow, TooOld)
+{
+	ReplayWindow window;
+	const std::uint64_t highest = 100000;
+	ASSERT_TRUE(window.accept(highest));
+
+	EXPECT_TRUE(window.accept(highest - ReplayWindow::WINDOW_SIZE));
+	EXPECT_FALSE(window.accept(highest - ReplayWindow::WINDOW_SIZE - 1));
+	EXPECT_FALSE(window.accept(0));
+	EXPECT_FALSE(window.accept(UINT64_MAX));
+	EXPECT_LE(2048u, ReplayWindow::WINDOW_SIZE);
+}
+
+// Test that the ring of words wraps around correctly, both when sliding a
+// little at a time and when jumping far ahead.
+TEST(ReplayWindow, Wraparound)
+{
+	ReplayWindow window;
+	const std::uint64_t ring = ReplayWindow::WORD_COUNT *
+	                           ReplayWindow::BITS_PER_WORD;
+	for (std::uint64_t counter = 0; counter < 5 * ring; counter += 3)
+	{
+		ASSERT_TRUE(window.accept(counter)) << counter;
+	}
+
+	// Gaps just behind the highest counter are still open, the ones that
+	// slid out of the window aren't.
+	std::uint64_t highest = 5 * ring - 1;
+	highest -= highest % 3;
+	EXPECT_TRUE(window.accept(highest - 1));
+	EXPECT_FALSE(window.accept(highest - 3));
+	EXPECT_FALSE(window.accept(ring + 1));
+
+	// Jump ahead by more than a ring: recycled words must not hold on to
+	// what they held before.
+	std::uint64_t far = highest + 10 * ring + 7;
+	EXPECT_TRUE(window.accept(far));
+	EXPECT_TRUE(window.accept(far - 3 * ring / 4));
+	EXPECT_FALSE(window.accept(far - 3 * ring / 4));
+	EXPECT_FALSE(window.accept(highest));
+	EXPECT_TRUE(window.accept(far - ring / 2));
+}
+
+// Test that counters received on several threads at once are accepted
+// exactly once in total.
+TEST(ReplayWindow, Concurrent)
+{
+	ReplayWindow window;
+	const std::uint64_t count = 200000;
+	std::atomic<std::uint64_t> accepted(0);
+
+	// Every thread tries every counter in order, so they race on the same
+	// words. Whichever thread gets to a counter first must accept it.
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; ++i)
+	{
+		threads.emplace_back([&window, &accepted, count]()
+		{
+			for (std::uint64_t counter = 0; counter < count; ++counter)
+			{
+				if (window.accept(counter))
+				{
+					accepted.fetch_add(1);
+				}
+			}
+		});
+	}
+
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+
+	EXPECT_EQ(count, accepted.load());
+}
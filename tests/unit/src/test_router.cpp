@@ -6,6 +6,7 @@
 #include <tins/rawpdu.h>
 
 #include "router.h"
+#include "packet_view.h"
 
 // Test that a packet from the external interface gets sent to the virtual
 // interface.
@@ -26,7 +27,7 @@ TEST(Router, FromExternal)
 		virtualSenderCalled = true;
 
 		// Reconstruct the IP packet from the buffer
-		Tins::IP packet(buffer->data(), buffer->size());
+		Tins::IP packet(buffer.data(), buffer.size());
 		const Tins::UDP udpPacket = packet.rfind_pdu<Tins::UDP>();
 
 		// Verify that this packet is the nested one.
@@ -76,7 +77,7 @@ TEST(Router, FromVirtual)
 
 		// Reconstruct the packet from the buffer, and verify it's the one we
 		// sent.
-		Tins::IP ipPacket(buffer->data(), buffer->size());
+		Tins::IP ipPacket(buffer.data(), buffer.size());
 		const Tins::UDP &udpPacket = ipPacket.rfind_pdu<Tins::UDP>();
 
 		EXPECT_EQ(destinationPort, udpPacket.dport());
@@ -142,3 +143,724 @@ TEST(Router, UnknownClient)
 		FAIL() << "Expected router to throw Overpass::UnknownClientException";
 	}
 }
+
+// Test that packets are forwarded without being copied, trimmed to their own
+// length rather than that of the buffer they were read into.
+TEST(Router, ForwardsOriginalBuffer)
+{
+	auto overpassAddress = boost::asio::ip::address::from_string("11.11.11.2");
+	auto externalAddress = boost::asio::ip::address::from_string("1.2.3.4");
+
+	Tins::IP packet = Tins::IP(overpassAddress.to_string()) /
+	                  Tins::UDP(1000, 1001) /
+	                  Tins::RawPDU("test-packet");
+	Tins::PDU::serialization_type serialized = packet.serialize();
+
+	Overpass::SharedBuffer buffer(1500);
+	std::copy(serialized.begin(), serialized.end(), buffer.begin());
+
+	std::vector<Overpass::SharedBuffer> sent;
+	auto externalSender = [&](const boost::asio::ip::udp::endpoint&,
+	                      const Overpass::SharedBuffer &buffer)
+	{
+		sent.push_back(buffer);
+	};
+
+	auto virtualSender = [&](const Overpass::SharedBuffer &buffer)
+	{
+		sent.push_back(buffer);
+	};
+
+	Overpass::Router router(externalSender, virtualSender, 1234);
+	router.addKnownClient(overpassAddress, externalAddress);
+
+	router.handlePacketFromVirtual(Overpass::PacketView(buffer));
+	router.handlePacketFromExternal(Overpass::PacketView(buffer));
+
+	ASSERT_EQ(2u, sent.size());
+	for (const auto &forwarded : sent)
+	{
+		EXPECT_EQ(buffer.data(), forwarded.data());
+		EXPECT_EQ(serialized.size(), forwarded.size());
+	}
+}
+
+// Test that IPv6 packets are routed by their destination address.
+TEST(Router, FromVirtualIpv6)
+{
+	auto overpassAddress = boost::asio::ip::address::from_string("fd00::2");
+	auto externalAddress = boost::asio::ip::address::from_string("2001:db8::1");
+
+	Overpass::SharedBuffer buffer(40);
+	std::fill(buffer.begin(), buffer.end(), 0);
+	buffer[0] = 0x60;
+	auto destination = overpassAddress.to_v6().to_bytes();
+	std::copy(destination.begin(), destination.end(), buffer.begin() + 24);
+
+	bool externalSenderCalled = false;
+	auto externalSender = [&](const boost::asio::ip::udp::endpoint &endpoint,
+	                      const Overpass::SharedBuffer&)
+	{
+		externalSenderCalled = true;
+		EXPECT_EQ(externalAddress, endpoint.address());
+		EXPECT_EQ(1234, endpoint.port());
+	};
+
+	auto virtualSender = [&](const Overpass::SharedBuffer&)
+	{
+		FAIL() << "Router unexpectedly sent data to the virtual interface";
+	};
+
+	Overpass::Router router(externalSender, virtualSender, 1234);
+	router.addKnownClient(overpassAddress, externalAddress);
+
+	router.handlePacketFromVirtual(Overpass::PacketView(buffer));
+	EXPECT_TRUE(externalSenderCalled) << "Expected external sender to be called";
+}
+
+// Test that malformed packets are refused in both directions.
+TEST(Router, MalformedPacket)
+{
+	auto externalSender = [&](const boost::asio::ip::udp::endpoint&,
+	                      const Overpass::SharedBuffer&)
+	{
+		FAIL() << "Router unexpectedly sent data to the external interface";
+	};
+
+	auto virtualSender = [&](const Overpass::SharedBuffer&)
+	{
+		FAIL() << "Router unexpectedly sent data to the virtual interface";
+	};
+
+	Overpass::Router router(externalSender, virtualSender, 1234);
+
+	Overpass::SharedBuffer buffer(10);
+	std::fill(buffer.begin(), buffer.end(), 0);
+	EXPECT_EQ(Overpass::RoutingResult::Malformed,
+	          router.handlePacketFromVirtual(Overpass::PacketView(buffer)));
+	EXPECT_EQ(Overpass::RoutingResult::Malformed,
+	          router.handlePacketFromExternal(Overpass::PacketView(buffer)));
+	EXPECT_EQ(2u, router.dropCount(Overpass::RoutingResult::Malformed));
+}
+
+// Test that packets to a network behind a client are routed to that client.
+TEST(Router, FromVirtualToNetwork)
+{
+	auto networkAddress = boost::asio::ip::address::from_string("192.168.7.0");
+	auto hostAddress = boost::asio::ip::address::from_string("192.168.7.42");
+	auto externalAddress = boost::asio::ip::address::from_string("1.2.3.4");
+
+	bool externalSenderCalled = false;
+	auto externalSender = [&](const boost::asio::ip::udp::endpoint &endpoint,
+	                      const Overpass::SharedBuffer&)
+	{
+		externalSenderCalled = true;
+		EXPECT_EQ(externalAddress, endpoint.address());
+	};
+
+	auto virtualSender = [&](const Overpass::SharedBuffer&)
+	{
+		FAIL() << "Router unexpectedly sent data to the virtual interface";
+	};
+
+	Overpass::Router router(externalSender, virtualSender, 1234);
+	router.addRoute(networkAddress, 24, externalAddress);
+
+	Tins::IP packet = Tins::IP(hostAddress.to_string()) /
+	                  Tins::UDP(1000, 1001) /
+	                  Tins::RawPDU("test-packet");
+	router.handlePacketFromVirtual(packet);
+	EXPECT_TRUE(externalSenderCalled) << "Expected external sender to be called";
+
+	EXPECT_TRUE(router.removeRoute(networkAddress, 24));
+	EXPECT_THROW(router.handlePacketFromVirtual(packet),
+	             Overpass::UnknownClientException);
+}
+
+namespace
+{
+	Overpass::SharedBuffer serialize(Tins::IP &packet)
+	{
+		Tins::PDU::serialization_type serialized = packet.serialize();
+		return Overpass::SharedBuffer(serialized.data(), serialized.size());
+	}
+
+	// Ones' complement sum of some data, which is 0xffff for data including
+	// a correct Internet checksum.
+	std::uint32_t checksumSum(const std::uint8_t *data, std::size_t size,
+	                          std::uint32_t sum = 0)
+	{
+		for (std::size_t i = 0; i < size; i += 2)
+		{
+			sum += data[i] << 8 | (i + 1 < size ? data[i + 1] : 0);
+		}
+
+		while (sum >> 16)
+		{
+			sum = (sum & 0xffff) + (sum >> 16);
+		}
+
+		return sum;
+	}
+}
+
+// Test that dropped packets are counted by reason, without anything being
+// thrown or sent.
+TEST(Router, DropCounters)
+{
+	auto externalSender = [&](const boost::asio::ip::udp::endpoint&,
+	                      const Overpass::SharedBuffer&)
+	{
+		FAIL() << "Router unexpectedly sent data to the external interface";
+	};
+
+	auto virtualSender = [&](const Overpass::SharedBuffer&)
+	{
+		FAIL() << "Router unexpectedly sent data to the virtual interface";
+	};
+
+	Overpass::Router router(externalSender, virtualSender, 1234);
+
+	Tins::IP unknown = Tins::IP("11.11.11.2") / Tins::UDP(1000, 1001);
+	Tins::IP multicast = Tins::IP("239.1.2.3") / Tins::UDP(1000, 1001);
+	Tins::IP broadcast = Tins::IP("255.255.255.255") / Tins::UDP(1000, 1001);
+
+	Overpass::SharedBuffer unknownBuffer = serialize(unknown);
+	for (int i = 0; i < 3; ++i)
+	{
+		EXPECT_EQ(Overpass::RoutingResult::NoRoute,
+		          router.handlePacketFromVirtual(
+		             Overpass::PacketView(unknownBuffer)));
+	}
+
+	EXPECT_EQ(Overpass::RoutingResult::Multicast,
+	          router.handlePacketFromVirtual(
+	             Overpass::PacketView(serialize(multicast))));
+	EXPECT_EQ(Overpass::RoutingResult::Multicast,
+	          router.handlePacketFromVirtual(
+	             Overpass::PacketView(serialize(broadcast))));
+
+	EXPECT_EQ(3u, router.dropCount(Overpass::RoutingResult::NoRoute));
+	EXPECT_EQ(2u, router.dropCount(Overpass::RoutingResult::Multicast));
+	EXPECT_EQ(0u, router.dropCount(Overpass::RoutingResult::Malformed));
+	EXPECT_EQ(0u, router.dropCount(Overpass::RoutingResult::Forwarded));
+}
+
+// Test that packets without a route are answered with an ICMP host
+// unreachable message when so configured, but multicast packets and ICMP
+// errors aren't.
+TEST(Router, HostUnreachable)
+{
+	auto externalSender = [&](const boost::asio::ip::udp::endpoint&,
+	                      const Overpass::SharedBuffer&)
+	{
+		FAIL() << "Router unexpectedly sent data to the external interface";
+	};
+
+	std::vector<Overpass::SharedBuffer> replies;
+	auto virtualSender = [&](const Overpass::SharedBuffer &buffer)
+	{
+		replies.push_back(buffer);
+	};
+
+	Overpass::RouterOptions options;
+	options.sendUnreachable = true;
+	options.localAddress = boost::asio::ip::address::from_string("11.11.11.1");
+	Overpass::Router router(externalSender, virtualSender, 1234, options);
+
+	Tins::IP packet = Tins::IP("11.11.11.2", "11.11.11.1") /
+	                  Tins::UDP(1000, 1001) /
+	                  Tins::RawPDU("test-packet");
+	Overpass::SharedBuffer original = serialize(packet);
+	EXPECT_EQ(Overpass::RoutingResult::NoRoute,
+	          router.handlePacketFromVirtual(Overpass::PacketView(original)));
+	ASSERT_EQ(1u, replies.size());
+
+	Overpass::PacketView reply(replies.front());
+	ASSERT_TRUE(reply.isValid());
+	EXPECT_EQ(1, reply.protocol());
+	EXPECT_EQ("11.11.11.1", reply.sourceAddress().to_string());
+	EXPECT_EQ("11.11.11.1", reply.destinationAddress().to_string());
+	EXPECT_EQ(0xffffu, checksumSum(reply.data(), reply.headerLength()));
+
+	const std::uint8_t *icmp = reply.data() + reply.headerLength();
+	std::size_t icmpSize = reply.totalLength() - reply.headerLength();
+	EXPECT_EQ(3, icmp[0]); // Destination unreachable
+	EXPECT_EQ(1, icmp[1]); // Host unreachable
+	EXPECT_EQ(0xffffu, checksumSum(icmp, icmpSize));
+
+	// The original packet is quoted in full, being small.
+	ASSERT_EQ(8 + original.size(), icmpSize);
+	EXPECT_TRUE(std::equal(original.begin(), original.end(), icmp + 8));
+
+	// Nobody answers multicast packets or ICMP errors.
+	Tins::IP multicast = Tins::IP("239.1.2.3", "11.11.11.1") /
+	                     Tins::UDP(1000, 1001);
+	router.handlePacketFromVirtual(Overpass::PacketView(serialize(multicast)));
+
+	Overpass::SharedBuffer error = serialize(packet);
+	error[9] = 1; // ICMP
+	error[20] = 3; // Destination unreachable
+	router.handlePacketFromVirtual(Overpass::PacketView(error));
+
+	EXPECT_EQ(1u, replies.size());
+	EXPECT_EQ(2u, router.dropCount(Overpass::RoutingResult::NoRoute));
+}
+
+// Test that IPv6 packets without a route get an ICMPv6 address unreachable
+// message with a valid checksum.
+TEST(Router, HostUnreachableIpv6)
+{
+	auto externalSender = [&](const boost::asio::ip::udp::endpoint&,
+	                      const Overpass::SharedBuffer&)
+	{
+		FAIL() << "Router unexpectedly sent data to the external interface";
+	};
+
+	std::vector<Overpass::SharedBuffer> replies;
+	auto virtualSender = [&](const Overpass::SharedBuffer &buffer)
+	{
+		replies.push_back(buffer);
+	};
+
+	auto localAddress = boost::asio::ip::address::from_string("fd00::1");
+	Overpass::RouterOptions options;
+	options.sendUnreachable = true;
+	options.localAddress = localAddress;
+	Overpass::Router router(externalSender, virtualSender, 1234, options);
+
+	// A UDP header and nothing else, from fd00::1 to fd00::2.
+	Overpass::SharedBuffer original(48);
+	std::fill(original.begin(), original.end(), 0);
+	original[0] = 0x60;
+	original[5] = 8;
+	original[6] = 17;
+	auto source = localAddress.to_v6().to_bytes();
+	std::copy(source.begin(), source.end(), original.begin() + 8);
+	auto destination = boost::asio::ip::address::from_string(
+	                      "fd00::2").to_v6().to_bytes();
+	std::copy(destination.begin(), destination.end(), original.begin() + 24);
+
+	EXPECT_EQ(Overpass::RoutingResult::NoRoute,
+	          router.handlePacketFromVirtual(Overpass::PacketView(original)));
+	ASSERT_EQ(1u, replies.size());
+
+	Overpass::PacketView reply(replies.front());
+	ASSERT_TRUE(reply.isValid());
+	EXPECT_EQ(6, reply.version());
+	EXPECT_EQ(58, reply.protocol());
+	EXPECT_EQ(localAddress, reply.destinationAddress());
+
+	const std::uint8_t *icmp = reply.data() + reply.headerLength();
+	std::size_t icmpSize = reply.totalLength() - reply.headerLength();
+	EXPECT_EQ(1, icmp[0]); // Destination unreachable
+	EXPECT_EQ(3, icmp[1]); // Address unreachable
+	ASSERT_EQ(8 + original.size(), icmpSize);
+
+	// The checksum covers the addresses, length and next header as well.
+	std::uint32_t pseudoHeader = checksumSum(reply.data() + 8, 32) +
+	                             icmpSize + 58;
+	EXPECT_EQ(0xffffu, checksumSum(icmp, icmpSize, pseudoHeader));
+}
+
+// Test that replies go to wherever a client was last heard from, as long as
+// the packets heard were authenticated as its own.
+TEST(Router, Roaming)
+{
+	auto overpassAddress = boost::asio::ip::address::from_string("fd00::2");
+	auto externalAddress = boost::asio::ip::address::from_string("2001:db8::1");
+	auto makePacket = [](const boost::asio::ip::address &source,
+	                     const boost::asio::ip::address &destination)
+	{
+		Overpass::SharedBuffer buffer(40);
+		std::fill(buffer.begin(), buffer.end(), 0);
+		buffer[0] = 0x60;
+		buffer[6] = 59; // No next header
+		auto sourceBytes = source.to_v6().to_bytes();
+		std::copy(sourceBytes.begin(), sourceBytes.end(), buffer.begin() + 8);
+		auto destinationBytes = destination.to_v6().to_bytes();
+		std::copy(destinationBytes.begin(), destinationBytes.end(),
+		          buffer.begin() + 24);
+		return buffer;
+	};
+
+	std::vector<boost::asio::ip::udp::endpoint> endpoints;
+	auto externalSender = [&](const boost::asio::ip::udp::endpoint &endpoint,
+	                      const Overpass::SharedBuffer&)
+	{
+		endpoints.push_back(endpoint);
+	};
+
+	auto virtualSender = [&](const Overpass::SharedBuffer&) {};
+
+	Overpass::Router router(externalSender, virtualSender, 1234);
+	router.addKnownClient(overpassAddress, externalAddress);
+
+	auto local = boost::asio::ip::address::from_string("fd00::1");
+	Overpass::SharedBuffer outgoing = makePacket(local, overpassAddress);
+	router.handlePacketFromVirtual(Overpass::PacketView(outgoing));
+
+	// The client moved behind a NAT.
+	boost::asio::ip::udp::endpoint moved(
+	      boost::asio::ip::address::from_string("2001:db8::99"), 40000);
+	EXPECT_EQ(Overpass::RoutingResult::Forwarded,
+	          router.handlePacketFromExternal(
+	             Overpass::PacketView(makePacket(overpassAddress, local)),
+	             moved, externalAddress));
+	router.handlePacketFromVirtual(Overpass::PacketView(outgoing));
+
+	// Packets from other peers don't move it, whatever their source.
+	auto stranger = boost::asio::ip::address::from_string("2001:db8::3");
+	router.handlePacketFromExternal(
+	   Overpass::PacketView(makePacket(overpassAddress, local)),
+	   boost::asio::ip::udp::endpoint(stranger, 5555), stranger);
+	router.handlePacketFromVirtual(Overpass::PacketView(outgoing));
+
+	ASSERT_EQ(3u, endpoints.size());
+	EXPECT_EQ(boost::asio::ip::udp::endpoint(externalAddress, 1234),
+	          endpoints[0]);
+	EXPECT_EQ(moved, endpoints[1]);
+	EXPECT_EQ(moved, endpoints[2]);
+
+	boost::asio::ip::udp::endpoint endpoint;
+	ASSERT_TRUE(router.clientEndpoint(externalAddress, endpoint));
+	EXPECT_EQ(moved, endpoint);
+	EXPECT_FALSE(router.clientEndpoint(stranger, endpoint));
+}
+
+// Test that packets nothing authenticated never move a client, even with
+// its source address.
+TEST(Router, RoamingSpoofedSource)
+{
+	auto overpassAddress = boost::asio::ip::address::from_string("11.11.11.2");
+	auto externalAddress = boost::asio::ip::address::from_string("1.2.3.4");
+
+	auto externalSender = [](const boost::asio::ip::udp::endpoint&,
+	                         const Overpass::SharedBuffer&) {};
+	auto virtualSender = [](const Overpass::SharedBuffer&) {};
+
+	Overpass::Router router(externalSender, virtualSender, 1234);
+	router.addKnownClient(overpassAddress, externalAddress);
+
+	Tins::IP spoofed = Tins::IP("11.11.11.1", overpassAddress.to_string()) /
+	                   Tins::UDP(1001, 1000);
+	Overpass::SharedBuffer buffer = serialize(spoofed);
+	boost::asio::ip::udp::endpoint attacker(
+	      boost::asio::ip::address::from_string("6.6.6.6"), 6666);
+	EXPECT_EQ(Overpass::RoutingResult::Forwarded,
+	          router.handlePacketFromExternal(Overpass::PacketView(buffer),
+	                                          attacker));
+
+	const Overpass::PacketView packets[] = {Overpass::PacketView(buffer)};
+	router.handlePacketsFromExternal(packets, &attacker, nullptr, 1);
+
+	boost::asio::ip::udp::endpoint endpoint;
+	ASSERT_TRUE(router.clientEndpoint(externalAddress, endpoint));
+	EXPECT_EQ(boost::asio::ip::udp::endpoint(externalAddress, 1234), endpoint);
+}
+
+// Test that a client holding a default route isn't moved by packets from
+// other peers, and that peers can only send from addresses routed to them
+// (so not from those only the default route covers).
+TEST(Router, RoamingDefaultRoute)
+{
+	auto gateway = boost::asio::ip::address::from_string("1.2.3.4");
+	auto other = boost::asio::ip::address::from_string("1.2.3.5");
+
+	auto externalSender = [](const boost::asio::ip::udp::endpoint&,
+	                         const Overpass::SharedBuffer&) {};
+	auto virtualSender = [](const Overpass::SharedBuffer&) {};
+
+	Overpass::Router router(externalSender, virtualSender, 1234);
+	router.addRoute(boost::asio::ip::address::from_string("0.0.0.0"), 0,
+	                gateway);
+	router.addKnownClient(boost::asio::ip::address::from_string("11.11.11.3"),
+	                      other);
+
+	Tins::IP ownPacket = Tins::IP("11.11.11.1", "11.11.11.3") /
+	                     Tins::UDP(1001, 1000);
+	Tins::IP foreignPacket = Tins::IP("11.11.11.1", "192.168.7.7") /
+	                         Tins::UDP(1001, 1000);
+	Overpass::SharedBuffer own = serialize(ownPacket);
+	Overpass::SharedBuffer foreign = serialize(foreignPacket);
+	boost::asio::ip::udp::endpoint moved(
+	      boost::asio::ip::address::from_string("6.6.6.6"), 6666);
+	EXPECT_EQ(Overpass::RoutingResult::Forwarded,
+	          router.handlePacketFromExternal(Overpass::PacketView(own), moved,
+	                                          other));
+
+	boost::asio::ip::udp::endpoint endpoint;
+	ASSERT_TRUE(router.clientEndpoint(gateway, endpoint));
+	EXPECT_EQ(boost::asio::ip::udp::endpoint(gateway, 1234), endpoint);
+	ASSERT_TRUE(router.clientEndpoint(other, endpoint));
+	EXPECT_EQ(moved, endpoint);
+
+	// The gateway sends from anywhere, but nobody else does.
+	EXPECT_EQ(Overpass::RoutingResult::Forwarded,
+	          router.handlePacketFromExternal(
+	             Overpass::PacketView(foreign),
+	             boost::asio::ip::udp::endpoint(gateway, 1234), gateway));
+	EXPECT_EQ(Overpass::RoutingResult::SpoofedSource,
+	          router.handlePacketFromExternal(Overpass::PacketView(foreign),
+	                                          moved, other));
+
+	// Peers that aren't clients move nobody, and get nothing in.
+	auto stranger = boost::asio::ip::address::from_string("1.2.3.6");
+	EXPECT_EQ(Overpass::RoutingResult::SpoofedSource,
+	          router.handlePacketFromExternal(
+	             Overpass::PacketView(foreign),
+	             boost::asio::ip::udp::endpoint(stranger, 1), stranger));
+	ASSERT_TRUE(router.clientEndpoint(gateway, endpoint));
+	EXPECT_EQ(boost::asio::ip::udp::endpoint(gateway, 1234), endpoint);
+	EXPECT_EQ(2u, router.dropCount(Overpass::RoutingResult::SpoofedSource));
+}
+
+// Test that traffic is counted per client: sent as it's handed to the
+// external sender, and received only from the client's own addresses.
+TEST(Router, ClientTraffic)
+{
+	auto overpassAddress = boost::asio::ip::address::from_string("11.11.11.2");
+	auto externalAddress = boost::asio::ip::address::from_string("1.2.3.4");
+	auto local = boost::asio::ip::address::from_string("11.11.11.1");
+
+	auto externalSender = [](const boost::asio::ip::udp::endpoint&,
+	                         const Overpass::SharedBuffer&) {};
+	auto virtualSender = [](const Overpass::SharedBuffer&) {};
+
+	Overpass::Router router(externalSender, virtualSender, 1234);
+	router.addKnownClient(overpassAddress, externalAddress);
+	EXPECT_EQ(0u, router.clientTraffic()[externalAddress].packetsSent);
+
+	Tins::IP outgoing = Tins::IP(overpassAddress.to_string(), local.to_string()) /
+	                    Tins::UDP(1000, 1001) / Tins::RawPDU("out");
+	router.handlePacketFromVirtual(outgoing);
+	router.handlePacketFromVirtual(outgoing);
+
+	Tins::PDU::serialization_type incoming =
+	      (Tins::IP(local.to_string(), overpassAddress.to_string()) /
+	       Tins::UDP(1001, 1000) / Tins::RawPDU("in")).serialize();
+	Overpass::SharedBuffer buffer(incoming.data(), incoming.size());
+	boost::asio::ip::udp::endpoint source(externalAddress, 1234);
+	router.handlePacketFromExternal(Overpass::PacketView(buffer), source);
+
+	// Not from the client's addresses.
+	Tins::PDU::serialization_type stray =
+	      (Tins::IP(local.to_string(), "11.11.11.3") /
+	       Tins::UDP(1001, 1000) / Tins::RawPDU("in")).serialize();
+	Overpass::SharedBuffer strayBuffer(stray.data(), stray.size());
+	router.handlePacketFromExternal(Overpass::PacketView(strayBuffer), source);
+
+	auto traffic = router.clientTraffic();
+	ASSERT_EQ(1u, traffic.size());
+	EXPECT_EQ(2u, traffic[externalAddress].packetsSent);
+	EXPECT_EQ(2 * outgoing.serialize().size(), traffic[externalAddress].bytesSent);
+	EXPECT_EQ(1u, traffic[externalAddress].packetsReceived);
+	EXPECT_EQ(incoming.size(), traffic[externalAddress].bytesReceived);
+}
+
+namespace
+{
+	// Sender policies that record where packets went, with no
+	// std::function in between.
+	struct RecordingExternalSender
+	{
+		void operator()(const boost::asio::ip::udp::endpoint &endpoint,
+		                const Overpass::SharedBuffer &buffer) const
+		{
+			sent->push_back(std::make_pair(endpoint, buffer));
+		}
+
+		std::vector<std::pair<boost::asio::ip::udp::endpoint,
+		                      Overpass::SharedBuffer>> *sent;
+	};
+
+	struct RecordingVirtualSender
+	{
+		void operator()(const Overpass::SharedBuffer &buffer) const
+		{
+			written->push_back(buffer);
+		}
+
+		std::vector<Overpass::SharedBuffer> *written;
+	};
+}
+
+// Test that a router specialized for concrete sender policies routes, drops
+// and answers packets like the type-erased one.
+TEST(Router, SenderPolicies)
+{
+	std::vector<std::pair<boost::asio::ip::udp::endpoint,
+	                      Overpass::SharedBuffer>> sent;
+	std::vector<Overpass::SharedBuffer> written;
+
+	Overpass::RouterOptions options;
+	options.sendUnreachable = true;
+	options.localAddress = boost::asio::ip::address::from_string("11.11.11.1");
+	Overpass::BasicRouter<RecordingExternalSender, RecordingVirtualSender>
+	      router(RecordingExternalSender{&sent},
+	             RecordingVirtualSender{&written}, 1234, options);
+
+	auto externalAddress = boost::asio::ip::address::from_string("1.2.3.4");
+	router.addKnownClient(boost::asio::ip::address::from_string("11.11.11.2"),
+	                      externalAddress);
+
+	Tins::IP outgoingPacket = Tins::IP("11.11.11.2", "11.11.11.1") /
+	                          Tins::UDP(1000, 1001);
+	Overpass::SharedBuffer outgoing = serialize(outgoingPacket);
+	EXPECT_EQ(Overpass::RoutingResult::Forwarded,
+	          router.handlePacketFromVirtual(Overpass::PacketView(outgoing)));
+	ASSERT_EQ(1u, sent.size());
+	EXPECT_EQ(boost::asio::ip::udp::endpoint(externalAddress, 1234),
+	          sent.front().first);
+	EXPECT_EQ(outgoing.data(), sent.front().second.data());
+
+	Tins::IP incomingPacket = Tins::IP("11.11.11.1", "11.11.11.2") /
+	                          Tins::UDP(1001, 1000);
+	Overpass::SharedBuffer incoming = serialize(incomingPacket);
+	EXPECT_EQ(Overpass::RoutingResult::Forwarded,
+	          router.handlePacketFromExternal(Overpass::PacketView(incoming)));
+	ASSERT_EQ(1u, written.size());
+	EXPECT_EQ(incoming.data(), written.front().data());
+
+	// Unreachable replies go through the virtual sender policy too.
+	Tins::IP unknown = Tins::IP("11.11.11.3", "11.11.11.1") /
+	                   Tins::UDP(1000, 1001);
+	EXPECT_THROW(router.handlePacketFromVirtual(unknown),
+	             Overpass::UnknownClientException);
+	EXPECT_EQ(1u, sent.size());
+	EXPECT_EQ(2u, written.size());
+	EXPECT_EQ(1u, router.dropCount(Overpass::RoutingResult::NoRoute));
+}
+
+// Test that a batch from the virtual interface is routed like packets one at
+// a time, with what's forwarded grouped by client and each client's packets
+// kept in order.
+TEST(Router, BatchFromVirtual)
+{
+	std::vector<std::pair<boost::asio::ip::udp::endpoint,
+	                      Overpass::SharedBuffer>> sent;
+	std::vector<Overpass::SharedBuffer> written;
+	Overpass::BasicRouter<RecordingExternalSender, RecordingVirtualSender>
+	      router(RecordingExternalSender{&sent},
+	             RecordingVirtualSender{&written}, 1234);
+
+	auto first = boost::asio::ip::address::from_string("1.2.3.4");
+	auto second = boost::asio::ip::address::from_string("1.2.3.3");
+	router.addKnownClient(boost::asio::ip::address::from_string("11.11.11.2"),
+	                      first);
+	router.addKnownClient(boost::asio::ip::address::from_string("11.11.11.3"),
+	                      second);
+
+	const char *destinations[] = {"11.11.11.2", "11.11.11.3", "11.11.11.9",
+	                              "11.11.11.2", "239.1.2.3", "11.11.11.3",
+	                              "11.11.11.2"};
+	std::vector<Overpass::SharedBuffer> buffers;
+	for (const char *destination : destinations)
+	{
+		Tins::IP packet = Tins::IP(destination, "11.11.11.1") /
+		                  Tins::UDP(1000, 1001);
+		buffers.push_back(serialize(packet));
+	}
+
+	buffers.push_back(Overpass::SharedBuffer(3));
+
+	std::vector<Overpass::PacketView> packets;
+	for (const auto &buffer : buffers)
+	{
+		packets.emplace_back(buffer);
+	}
+
+	std::vector<Overpass::RoutingResult> results(packets.size());
+	router.handlePacketsFromVirtual(packets.data(), packets.size(),
+	                                results.data());
+
+	const Overpass::RoutingResult expected[] = {
+		Overpass::RoutingResult::Forwarded,
+		Overpass::RoutingResult::Forwarded,
+		Overpass::RoutingResult::NoRoute,
+		Overpass::RoutingResult::Forwarded,
+		Overpass::RoutingResult::Multicast,
+		Overpass::RoutingResult::Forwarded,
+		Overpass::RoutingResult::Forwarded,
+		Overpass::RoutingResult::Malformed};
+	for (std::size_t i = 0; i < packets.size(); ++i)
+	{
+		EXPECT_EQ(expected[i], results[i]) << i;
+	}
+
+	const std::size_t order[] = {0, 3, 6, 1, 5};
+	ASSERT_EQ(5u, sent.size());
+	for (std::size_t i = 0; i < sent.size(); ++i)
+	{
+		EXPECT_EQ(buffers[order[i]].data(), sent[i].second.data()) << i;
+		EXPECT_EQ(i < 3 ? first : second, sent[i].first.address()) << i;
+	}
+
+	EXPECT_TRUE(written.empty());
+	EXPECT_EQ(3u, router.clientTraffic()[first].packetsSent);
+	EXPECT_EQ(2u, router.clientTraffic()[second].packetsSent);
+	EXPECT_EQ(1u, router.dropCount(Overpass::RoutingResult::NoRoute));
+
+	// Batches larger than what's routed at once are routed all the same.
+	sent.clear();
+	std::vector<Overpass::PacketView> many(200, packets.front());
+	router.handlePacketsFromVirtual(many.data(), many.size());
+	EXPECT_EQ(200u, sent.size());
+}
+
+// Test that a batch from the external interface is written out in order,
+// learning where its clients are from the peers the packets are from, but
+// only letting in packets from the peers' own addresses.
+TEST(Router, BatchFromExternal)
+{
+	std::vector<std::pair<boost::asio::ip::udp::endpoint,
+	                      Overpass::SharedBuffer>> sent;
+	std::vector<Overpass::SharedBuffer> written;
+	Overpass::BasicRouter<RecordingExternalSender, RecordingVirtualSender>
+	      router(RecordingExternalSender{&sent},
+	             RecordingVirtualSender{&written}, 1234);
+
+	auto externalAddress = boost::asio::ip::address::from_string("1.2.3.4");
+	router.addKnownClient(boost::asio::ip::address::from_string("11.11.11.2"),
+	                      externalAddress);
+
+	const char *sources[] = {"11.11.11.2", "11.11.11.5", "11.11.11.2"};
+	std::vector<Overpass::SharedBuffer> buffers;
+	for (const char *source : sources)
+	{
+		Tins::IP packet = Tins::IP("11.11.11.1", source) /
+		                  Tins::UDP(1000, 1001);
+		buffers.push_back(serialize(packet));
+	}
+
+	buffers.insert(buffers.begin() + 1, Overpass::SharedBuffer(3));
+
+	std::vector<Overpass::PacketView> packets;
+	for (const auto &buffer : buffers)
+	{
+		packets.emplace_back(buffer);
+	}
+
+	boost::asio::ip::udp::endpoint moved(externalAddress, 4321);
+	std::vector<boost::asio::ip::udp::endpoint> endpoints(packets.size(),
+	                                                      moved);
+	std::vector<boost::asio::ip::address> peers(packets.size(),
+	                                            externalAddress);
+	std::vector<Overpass::RoutingResult> results(packets.size());
+	router.handlePacketsFromExternal(packets.data(), endpoints.data(),
+	                                 peers.data(), packets.size(),
+	                                 results.data());
+
+	EXPECT_EQ(Overpass::RoutingResult::Malformed, results[1]);
+	EXPECT_EQ(Overpass::RoutingResult::SpoofedSource, results[2]);
+	ASSERT_EQ(2u, written.size());
+	EXPECT_EQ(buffers[0].data(), written[0].data());
+	EXPECT_EQ(buffers[3].data(), written[1].data());
+	EXPECT_TRUE(sent.empty());
+
+	boost::asio::ip::udp::endpoint endpoint;
+	ASSERT_TRUE(router.clientEndpoint(externalAddress, endpoint));
+	EXPECT_EQ(moved, endpoint);
+	EXPECT_EQ(2u, router.clientTraffic()[externalAddress].packetsReceived);
+	EXPECT_EQ(1u, router.dropCount(Overpass::RoutingResult::SpoofedSource));
+}
@@ -0,0 +1,376 @@
+#include <atomic>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "routing_table.h"
+#include "internal/rcu.h"
+
+namespace
+{
+	boost::asio::ip::address overpassAddress(std::uint32_t index)
+	{
+		return boost::asio::ip::address_v4(0x0b0b0000 + index);
+	}
+
+	boost::asio::ip::address externalAddress(std::uint32_t index,
+	                                         std::uint32_t generation = 0)
+	{
+		return boost::asio::ip::address_v4(0xc0000000 + (generation << 16) +
+		                                    index);
+	}
+}
+
+TEST(RoutingTable, InsertAndLookup)
+{
+	Overpass::RoutingTable table;
+	boost::asio::ip::address found;
+	EXPECT_FALSE(table.lookup(overpassAddress(1), found));
+
+	table.insert(overpassAddress(1), externalAddress(1));
+	table.insert(overpassAddress(2), externalAddress(2));
+	EXPECT_EQ(2u, table.size());
+
+	ASSERT_TRUE(table.lookup(overpassAddress(1), found));
+	EXPECT_EQ(externalAddress(1), found);
+	ASSERT_TRUE(table.lookup(overpassAddress(2), found));
+	EXPECT_EQ(externalAddress(2), found);
+}
+
+TEST(RoutingTable, Update)
+{
+	Overpass::RoutingTable table;
+	table.insert(overpassAddress(1), externalAddress(1));
+	table.insert(overpassAddress(1), externalAddress(1, 1));
+	EXPECT_EQ(1u, table.size());
+
+	boost::asio::ip::address found;
+	ASSERT_TRUE(table.lookup(overpassAddress(1), found));
+	EXPECT_EQ(externalAddress(1, 1), found);
+}
+
+TEST(RoutingTable, Remove)
+{
+	Overpass::RoutingTable table;
+	table.insert(overpassAddress(1), externalAddress(1));
+
+	EXPECT_TRUE(table.remove(overpassAddress(1)));
+	EXPECT_FALSE(table.remove(overpassAddress(1)));
+	EXPECT_EQ(0u, table.size());
+
+	boost::asio::ip::address found;
+	EXPECT_FALSE(table.lookup(overpassAddress(1), found));
+}
+
+TEST(RoutingTable, Endpoints)
+{
+	Overpass::RoutingTable table(1234);
+	table.insert(overpassAddress(1), externalAddress(1));
+	table.insert(overpassAddress(0), 16, externalAddress(1));
+
+	boost::asio::ip::udp::endpoint endpoint;
+	ASSERT_TRUE(table.lookup(overpassAddress(1), endpoint));
+	EXPECT_EQ(boost::asio::ip::udp::endpoint(externalAddress(1), 1234),
+	          endpoint);
+
+	// Clients move by external address, for every route, and never by
+	// the addresses routed to them.
+	boost::asio::ip::udp::endpoint moved(externalAddress(9), 4321);
+	Overpass::internal::Counters *traffic = nullptr;
+	EXPECT_FALSE(table.learnEndpoint(overpassAddress(1), moved, &traffic));
+	EXPECT_EQ(nullptr, traffic);
+	EXPECT_TRUE(table.learnEndpoint(externalAddress(1), moved, &traffic));
+	EXPECT_NE(nullptr, traffic);
+	EXPECT_FALSE(table.learnEndpoint(externalAddress(1), moved));
+	ASSERT_TRUE(table.lookup(overpassAddress(1), endpoint));
+	EXPECT_EQ(moved, endpoint);
+	ASSERT_TRUE(table.clientEndpoint(externalAddress(1), endpoint));
+	EXPECT_EQ(moved, endpoint);
+
+	// Nothing learned from addresses without a route, and the endpoint
+	// survives changes to the table.
+	EXPECT_FALSE(table.learnEndpoint(externalAddress(2), endpoint));
+	EXPECT_FALSE(table.lookup(externalAddress(2), endpoint));
+	EXPECT_FALSE(table.clientEndpoint(externalAddress(2), endpoint));
+	table.insert(overpassAddress(2), externalAddress(2));
+	ASSERT_TRUE(table.lookup(overpassAddress(1), endpoint));
+	EXPECT_EQ(moved, endpoint);
+}
+
+// Test that clients without routes are dropped, their traffic going to the
+// removed total, and that they start over when added again.
+TEST(RoutingTable, RemovedClients)
+{
+	Overpass::RoutingTable table(1234);
+	table.insert(overpassAddress(1), externalAddress(1));
+	table.insert(overpassAddress(0), 16, externalAddress(1));
+	table.insert(overpassAddress(2), externalAddress(2));
+
+	boost::asio::ip::udp::endpoint moved(externalAddress(9), 4321);
+	{
+		Overpass::internal::RcuReadGuard guard;
+		boost::asio::ip::udp::endpoint endpoint;
+		Overpass::internal::Counters *traffic = nullptr;
+		ASSERT_TRUE(table.lookup(overpassAddress(1), endpoint, &traffic));
+		traffic->add(Overpass::RoutingTable::PACKETS_SENT);
+		traffic->add(Overpass::RoutingTable::BYTES_SENT, 100);
+		EXPECT_TRUE(table.learnEndpoint(externalAddress(1), moved));
+	}
+
+	// A client with a route left keeps everything.
+	EXPECT_TRUE(table.remove(overpassAddress(1)));
+	EXPECT_EQ(2u, table.traffic().size());
+	EXPECT_EQ(1u, table.traffic()[externalAddress(1)].packetsSent);
+	EXPECT_EQ(0u, table.removedTraffic().packetsSent);
+
+	EXPECT_TRUE(table.remove(overpassAddress(0), 16));
+	auto traffic = table.traffic();
+	ASSERT_EQ(1u, traffic.size());
+	EXPECT_EQ(1u, traffic.count(externalAddress(2)));
+	Overpass::RoutingTable::Traffic removed = table.removedTraffic();
+	EXPECT_EQ(1u, removed.packetsSent);
+	EXPECT_EQ(100u, removed.bytesSent);
+	EXPECT_EQ(0u, removed.packetsReceived);
+	EXPECT_EQ(0u, removed.bytesReceived);
+
+	boost::asio::ip::udp::endpoint endpoint;
+	EXPECT_FALSE(table.clientEndpoint(externalAddress(1), endpoint));
+
+	// The totals stay once the client is freed, and don't follow it back.
+	table.insert(overpassAddress(1), externalAddress(1));
+	table.insert(overpassAddress(3), externalAddress(3));
+	ASSERT_TRUE(table.clientEndpoint(externalAddress(1), endpoint));
+	EXPECT_EQ(boost::asio::ip::udp::endpoint(externalAddress(1), 1234),
+	          endpoint);
+	EXPECT_EQ(0u, table.traffic()[externalAddress(1)].packetsSent);
+	EXPECT_EQ(1u, table.removedTraffic().packetsSent);
+	EXPECT_EQ(100u, table.removedTraffic().bytesSent);
+}
+
+// Test that addresses route to a client only through its own routes, and
+// that the batch check agrees with the single one.
+TEST(RoutingTable, RoutesTo)
+{
+	Overpass::RoutingTable table(1234);
+	table.insert(overpassAddress(1), externalAddress(1));
+	table.insert(overpassAddress(0), 16, externalAddress(2));
+
+	EXPECT_TRUE(table.routesTo(overpassAddress(1), externalAddress(1)));
+	EXPECT_FALSE(table.routesTo(overpassAddress(1), externalAddress(2)));
+	EXPECT_TRUE(table.routesTo(overpassAddress(3), externalAddress(2)));
+	EXPECT_FALSE(table.routesTo(overpassAddress(3), externalAddress(1)));
+	EXPECT_FALSE(table.routesTo(externalAddress(3), externalAddress(2)));
+
+	const boost::asio::ip::address sources[] = {
+	   overpassAddress(1), overpassAddress(1), overpassAddress(3),
+	   externalAddress(3)};
+	const boost::asio::ip::address peers[] = {
+	   externalAddress(1), externalAddress(2), externalAddress(2),
+	   externalAddress(2)};
+	bool results[4];
+	table.routesTo(sources, peers, 4, results);
+	for (size_t i = 0; i < 4; ++i)
+		EXPECT_EQ(table.routesTo(sources[i], peers[i]), results[i]) << i;
+}
+
+// Test that batch lookups and endpoint updates agree with single ones.
+TEST(RoutingTable, Batches)
+{
+	Overpass::RoutingTable table(1234);
+	table.insert(overpassAddress(1), externalAddress(1));
+	table.insert(overpassAddress(2), externalAddress(2));
+	table.insert(boost::asio::ip::address::from_string("fd00::"), 64,
+	             externalAddress(2));
+
+	const boost::asio::ip::address addresses[] = {
+		overpassAddress(2),
+		overpassAddress(3),
+		boost::asio::ip::address::from_string("fd00::5"),
+		overpassAddress(1)};
+
+	boost::asio::ip::udp::endpoint endpoints[4];
+	Overpass::internal::Counters *traffic[4];
+	table.lookup(addresses, 4, endpoints, traffic);
+	EXPECT_EQ(boost::asio::ip::udp::endpoint(externalAddress(2), 1234),
+	          endpoints[0]);
+	EXPECT_EQ(nullptr, traffic[1]);
+	EXPECT_EQ(traffic[0], traffic[2]);
+	EXPECT_EQ(endpoints[0], endpoints[2]);
+	EXPECT_EQ(boost::asio::ip::udp::endpoint(externalAddress(1), 1234),
+	          endpoints[3]);
+	EXPECT_NE(nullptr, traffic[3]);
+	EXPECT_NE(traffic[0], traffic[3]);
+
+	const boost::asio::ip::udp::endpoint sources[] = {
+		boost::asio::ip::udp::endpoint(externalAddress(9), 4321),
+		boost::asio::ip::udp::endpoint(externalAddress(8), 4321),
+		boost::asio::ip::udp::endpoint(externalAddress(7), 4321),
+		boost::asio::ip::udp::endpoint(externalAddress(1), 1234)};
+
+	const boost::asio::ip::address clients[] = {
+		externalAddress(2),
+		externalAddress(3),
+		externalAddress(2),
+		externalAddress(1)};
+
+	Overpass::internal::Counters *learned[4];
+	table.learnEndpoints(clients, sources, 4, learned);
+	for (std::size_t i = 0; i < 4; ++i)
+	{
+		EXPECT_EQ(traffic[i], learned[i]) << i;
+	}
+
+	// The last packet from a client wins.
+	boost::asio::ip::udp::endpoint endpoint;
+	ASSERT_TRUE(table.clientEndpoint(externalAddress(2), endpoint));
+	EXPECT_EQ(sources[2], endpoint);
+	ASSERT_TRUE(table.clientEndpoint(externalAddress(1), endpoint));
+	EXPECT_EQ(sources[3], endpoint);
+}
+
+TEST(RoutingTable, LongestPrefix)
+{
+	Overpass::RoutingTable table;
+	auto address = [](const char *string)
+	{
+		return boost::asio::ip::address::from_string(string);
+	};
+
+	table.insert({
+	                {address("0.0.0.0"), 0, externalAddress(1)},
+	                {address("192.168.0.0"), 16, externalAddress(2)},
+	                {address("192.168.7.0"), 24, externalAddress(3)},
+	                {address("fd00::"), 8, externalAddress(4)},
+	             });
+	table.insert(address("192.168.7.7"), externalAddress(5));
+	EXPECT_EQ(5u, table.size());
+
+	boost::asio::ip::address found;
+	ASSERT_TRUE(table.lookup(address("8.8.8.8"), found));
+	EXPECT_EQ(externalAddress(1), found);
+	ASSERT_TRUE(table.lookup(address("192.168.1.1"), found));
+	EXPECT_EQ(externalAddress(2), found);
+	ASSERT_TRUE(table.lookup(address("192.168.7.1"), found));
+	EXPECT_EQ(externalAddress(3), found);
+	ASSERT_TRUE(table.lookup(address("192.168.7.7"), found));
+	EXPECT_EQ(externalAddress(5), found);
+	ASSERT_TRUE(table.lookup(address("fd12::1"), found));
+	EXPECT_EQ(externalAddress(4), found);
+
+	// There's no IPv6 default route.
+	EXPECT_FALSE(table.lookup(address("2001:db8::1"), found));
+
+	// Host bits of a network are ignored.
+	EXPECT_TRUE(table.remove(address("192.168.7.99"), 24));
+	ASSERT_TRUE(table.lookup(address("192.168.7.1"), found));
+	EXPECT_EQ(externalAddress(2), found);
+}
+
+TEST(RoutingTable, InvalidPrefixLength)
+{
+	Overpass::RoutingTable table;
+	EXPECT_THROW(table.insert(overpassAddress(1), 33, externalAddress(1)),
+	             Overpass::RoutingTableException);
+	EXPECT_FALSE(table.remove(overpassAddress(1), 33));
+	EXPECT_EQ(0u, table.size());
+}
+
+// Hammer the table with lookups from many threads while another thread keeps
+// adding, updating and removing clients. Stable clients must always be found
+// with their one address, and churning clients must never be seen with an
+// address that wasn't theirs. Counts made while reading must never be lost,
+// even for clients removed meanwhile.
+TEST(RoutingTable, ConcurrentLookupsDuringUpdates)
+{
+	const std::uint32_t STABLE_CLIENTS = 16;
+	const std::uint32_t CHURNING_CLIENTS = 16;
+	const std::uint32_t GENERATIONS = 50;
+	const unsigned int READERS = 4;
+
+	Overpass::RoutingTable table;
+	for (std::uint32_t i = 0; i < STABLE_CLIENTS; ++i)
+	{
+		table.insert(overpassAddress(i), externalAddress(i));
+	}
+
+	std::atomic<bool> done(false);
+	std::atomic<std::uint64_t> failures(0);
+	std::atomic<std::uint64_t> lookups(0);
+	std::atomic<std::uint64_t> counted(0);
+
+	std::vector<std::thread> readers;
+	for (unsigned int reader = 0; reader < READERS; ++reader)
+	{
+		readers.push_back(std::thread([&]()
+		{
+			std::uint64_t count = 0;
+			std::uint64_t sent = 0;
+			boost::asio::ip::address found;
+			while (!done.load(std::memory_order_relaxed))
+			{
+				for (std::uint32_t i = 0; i < STABLE_CLIENTS + CHURNING_CLIENTS;
+				     ++i, ++count)
+				{
+					bool present = table.lookup(overpassAddress(i), found);
+					if (i < STABLE_CLIENTS)
+					{
+						if (!present || found != externalAddress(i))
+						{
+							++failures;
+						}
+					}
+					else if (present &&
+					         (found.to_v4().to_ulong() & 0xffff) != i)
+					{
+						++failures;
+					}
+
+					Overpass::internal::RcuReadGuard guard;
+					boost::asio::ip::udp::endpoint endpoint;
+					Overpass::internal::Counters *traffic;
+					if (table.lookup(overpassAddress(i), endpoint, &traffic))
+					{
+						traffic->add(Overpass::RoutingTable::PACKETS_SENT);
+						++sent;
+					}
+				}
+			}
+
+			lookups += count;
+			counted += sent;
+		}));
+	}
+
+	for (std::uint32_t generation = 0; generation < GENERATIONS; ++generation)
+	{
+		for (std::uint32_t i = STABLE_CLIENTS;
+		     i < STABLE_CLIENTS + CHURNING_CLIENTS; ++i)
+		{
+			if ((i + generation) % 3 == 0)
+			{
+				table.remove(overpassAddress(i));
+			}
+			else
+			{
+				table.insert(overpassAddress(i), externalAddress(i, generation));
+			}
+		}
+	}
+
+	done = true;
+	for (auto &reader : readers)
+	{
+		reader.join();
+	}
+
+	EXPECT_EQ(0u, failures.load());
+	EXPECT_GT(lookups.load(), 0u);
+
+	std::uint64_t total = table.removedTraffic().packetsSent;
+	for (const auto &client : table.traffic())
+	{
+		total += client.second.packetsSent;
+	}
+
+	EXPECT_EQ(counted.load(), total);
+}
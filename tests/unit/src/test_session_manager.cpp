@@ -0,0 +1,349 @@
+#include <thread>
+#include <algorithm>
+
+#include <gtest/gtest.h>
+
+#include "internal/session_manager.h"
+
+using namespace Overpass::internal;
+
+namespace
+{
+	typedef boost::asio::ip::udp::endpoint Endpoint;
+	typedef Overpass::DatagramBatch<Endpoint> Batch;
+
+	AeadKey makeKey(std::uint8_t seed)
+	{
+		AeadKey key;
+		for (std::size_t i = 0; i < key.size(); ++i)
+		{
+			key[i] = std::uint8_t(seed + i);
+		}
+
+		return key;
+	}
+
+	Overpass::SharedBuffer makePacket(std::uint8_t value)
+	{
+		Overpass::SharedBuffer packet(100);
+		std::fill(packet.begin(), packet.end(), value);
+		return packet;
+	}
+
+	/*!
+	 * \brief One side of a connection: a session manager, its executor, and
+	 *        the handshake messages it sent.
+	 */
+	struct Side
+	{
+		Side(const std::string &address, const SessionOptions &options,
+		     std::uint8_t keySeed = 1) :
+		   endpoint(boost::asio::ip::address::from_string(address), 4000),
+		   manager(Overpass::Cipher::ChaCha20Poly1305, makeKey(keySeed),
+		           executor, std::bind(&Side::send, this,
+		                               std::placeholders::_1,
+		                               std::placeholders::_2),
+		           options)
+		{
+		}
+
+		void send(const Endpoint &, const Overpass::SharedBuffer &message)
+		{
+			outbox.push_back(message);
+		}
+
+		// Seal a packet for the other side (empty if it can't be yet).
+		Overpass::SharedBuffer seal(const Side &to, std::uint8_t value)
+		{
+			Batch batch{{to.endpoint, makePacket(value)}};
+			manager.seal(batch);
+			return batch.empty() ? Overpass::SharedBuffer() : batch[0].buffer;
+		}
+
+		// Open a message from the other side (empty if it doesn't).
+		Overpass::SharedBuffer open(const Side &from,
+		                            const Overpass::SharedBuffer &message)
+		{
+			Batch batch{{from.endpoint, message}};
+			manager.open(batch);
+			return batch.empty() ? Overpass::SharedBuffer() : batch[0].buffer;
+		}
+
+		Endpoint endpoint;
+		boost::asio::io_service executor;
+		std::vector<Overpass::SharedBuffer> outbox;
+		SessionManager manager;
+	};
+
+	/*!
+	 * \brief Run both executors and deliver handshake messages until a
+	 *        condition holds, or too long passed.
+	 */
+	template <typename Condition>
+	bool pump(Side &first, Side &second, Condition condition)
+	{
+		auto deadline = std::chrono::steady_clock::now() +
+		                std::chrono::seconds(5);
+		while (!condition())
+		{
+			if (std::chrono::steady_clock::now() > deadline)
+			{
+				return false;
+			}
+
+			first.executor.poll();
+			second.executor.poll();
+
+			for (const auto &sides : {std::make_pair(&first, &second),
+			                          std::make_pair(&second, &first)})
+			{
+				std::vector<Overpass::SharedBuffer> outbox;
+				outbox.swap(sides.first->outbox);
+				for (const auto &message : outbox)
+				{
+					EXPECT_FALSE(sides.second->open(*sides.first, message));
+				}
+			}
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		return true;
+	}
+
+	// Messages are opened in place, so replaying one takes a copy.
+	Overpass::SharedBuffer copy(const Overpass::SharedBuffer &buffer)
+	{
+		Overpass::SharedBuffer result(buffer.size());
+		std::copy(buffer.begin(), buffer.end(), result.begin());
+		return result;
+	}
+
+	bool samePacket(const Overpass::SharedBuffer &packet, std::uint8_t value)
+	{
+		return packet && packet.size() == 100 &&
+		       std::all_of(packet.begin(), packet.end(),
+		                   [value](std::uint8_t byte)
+		                   {
+		                      return byte == value;
+		                   });
+	}
+
+	/*!
+	 * \brief Connect two sides, the first initiating, and have the
+	 *        responder confirm the session.
+	 */
+	void connect(Side &initiator, Side &responder)
+	{
+		EXPECT_FALSE(initiator.seal(responder, 0));
+		ASSERT_TRUE(pump(initiator, responder, [&initiator]()
+		{
+			return initiator.manager.handshakesCompleted() > 0;
+		}));
+
+		ASSERT_TRUE(samePacket(responder.open(initiator,
+		                                      initiator.seal(responder, 1)),
+		                       1));
+		responder.executor.poll();
+	}
+}
+
+// Test that the first packet sets off a handshake, after which packets go
+// both ways.
+TEST(SessionManager, HandshakeAndData)
+{
+	Side a("10.0.0.1", SessionOptions());
+	Side b("10.0.0.2", SessionOptions());
+	a.manager.addPeer(b.endpoint.address());
+	b.manager.addPeer(a.endpoint.address());
+
+	connect(a, b);
+	EXPECT_EQ(1u, a.manager.packetsWithoutSession());
+	EXPECT_EQ(1u, b.manager.handshakesCompleted());
+
+	for (std::uint8_t i = 0; i < 10; ++i)
+	{
+		EXPECT_TRUE(samePacket(b.open(a, a.seal(b, i)), i));
+		EXPECT_TRUE(samePacket(a.open(b, b.seal(a, i)), i));
+	}
+
+	// Replays and forgeries are dropped.
+	Overpass::SharedBuffer message = a.seal(b, 42);
+	Overpass::SharedBuffer forged = copy(message);
+	forged[AEAD_HEADER_SIZE] ^= 1;
+	EXPECT_TRUE(b.open(a, copy(message)));
+	EXPECT_FALSE(b.open(a, message));
+	EXPECT_EQ(1u, b.manager.replayedPackets());
+
+	EXPECT_FALSE(b.open(a, forged));
+	EXPECT_EQ(1u, b.manager.authenticationFailures());
+
+	// No other handshake was needed.
+	EXPECT_EQ(1u, a.manager.handshakesCompleted());
+	EXPECT_EQ(1u, b.manager.handshakesCompleted());
+}
+
+// Test that sessions are replaced as they get old, while packets sealed with
+// the old one still open.
+TEST(SessionManager, Rekey)
+{
+	SessionOptions options;
+	options.rekeyAfter = std::chrono::milliseconds(50);
+	Side a("10.0.0.1", options);
+	Side b("10.0.0.2", SessionOptions());
+	a.manager.addPeer(b.endpoint.address());
+	b.manager.addPeer(a.endpoint.address());
+
+	connect(a, b);
+	std::this_thread::sleep_for(std::chrono::milliseconds(60));
+
+	// Still sealed with the old session, which sets off a handshake.
+	Overpass::SharedBuffer old = a.seal(b, 1);
+	ASSERT_TRUE(old);
+	ASSERT_TRUE(pump(a, b, [&a]()
+	{
+		return a.manager.handshakesCompleted() > 1;
+	}));
+
+	Overpass::SharedBuffer renewed = a.seal(b, 2);
+	EXPECT_NE(aeadKeyIndex(old), aeadKeyIndex(renewed));
+	EXPECT_TRUE(samePacket(b.open(a, renewed), 2));
+	b.executor.poll();
+	EXPECT_TRUE(samePacket(b.open(a, old), 1));
+
+	// The responder moved on to the new session too.
+	Overpass::SharedBuffer reply = b.seal(a, 3);
+	EXPECT_EQ(aeadKeyIndex(renewed), aeadKeyIndex(a.seal(b, 4)));
+	EXPECT_TRUE(samePacket(a.open(b, reply), 3));
+	EXPECT_EQ(2u, b.manager.handshakesCompleted());
+}
+
+// Test that a peer moving to another address keeps its session.
+TEST(SessionManager, Roaming)
+{
+	Side a("10.0.0.1", SessionOptions());
+	Side b("10.0.0.2", SessionOptions());
+	a.manager.addPeer(b.endpoint.address());
+	b.manager.addPeer(a.endpoint.address());
+	connect(a, b);
+
+	// Packets are from the peer whose session opened them, wherever they
+	// came from.
+	Endpoint moved(boost::asio::ip::address::from_string("10.0.9.9"), 5000);
+	Batch batch{{moved, a.seal(b, 1)}, {moved, makePacket(0)}};
+	std::vector<boost::asio::ip::address> peers;
+	b.manager.open(batch, &peers);
+	ASSERT_EQ(1u, batch.size());
+	EXPECT_TRUE(samePacket(batch[0].buffer, 1));
+	ASSERT_EQ(1u, peers.size());
+	EXPECT_EQ(a.endpoint.address(), peers[0]);
+
+	b.executor.poll();
+	batch = Batch{{moved, makePacket(2)}};
+	b.manager.seal(batch);
+	ASSERT_EQ(1u, batch.size());
+	EXPECT_TRUE(samePacket(a.open(b, batch[0].buffer), 2));
+	EXPECT_EQ(0u, b.manager.packetsWithoutSession());
+}
+
+// Test that a peer is only known by the last address it moved to, and that
+// a peer added there takes it over.
+TEST(SessionManager, RoamingAgain)
+{
+	Side a("10.0.0.1", SessionOptions());
+	Side b("10.0.0.2", SessionOptions());
+	a.manager.addPeer(b.endpoint.address());
+	b.manager.addPeer(a.endpoint.address());
+	connect(a, b);
+
+	Endpoint first(boost::asio::ip::address::from_string("10.0.9.9"), 5000);
+	Endpoint second(boost::asio::ip::address::from_string("10.0.9.10"),
+	                5000);
+	Batch batch{{first, a.seal(b, 1)}};
+	b.manager.open(batch);
+	b.executor.poll();
+	batch = Batch{{second, a.seal(b, 2)}};
+	b.manager.open(batch);
+	b.executor.poll();
+
+	batch = Batch{{first, makePacket(3)}};
+	b.manager.seal(batch);
+	EXPECT_EQ(0u, batch.size());
+	EXPECT_EQ(1u, b.manager.packetsWithoutSession());
+
+	batch = Batch{{second, makePacket(4)}};
+	b.manager.seal(batch);
+	ASSERT_EQ(1u, batch.size());
+	EXPECT_TRUE(samePacket(a.open(b, batch[0].buffer), 4));
+
+	// A peer at a's new address gets it; a keeps its own.
+	b.manager.addPeer(second.address());
+	batch = Batch{{second, makePacket(5)}};
+	b.manager.seal(batch);
+	EXPECT_EQ(0u, batch.size());
+	EXPECT_TRUE(samePacket(a.open(b, b.seal(a, 6)), 6));
+}
+
+// Test that a responder under load only goes through with handshakes once
+// the initiator echoes a cookie.
+TEST(SessionManager, CookieUnderLoad)
+{
+	SessionOptions initiatorOptions;
+	initiatorOptions.handshakeTimeout = std::chrono::milliseconds(20);
+	SessionOptions responderOptions;
+	responderOptions.loadThreshold = 0;
+	Side a("10.0.0.1", initiatorOptions);
+	Side b("10.0.0.2", responderOptions);
+	a.manager.addPeer(b.endpoint.address());
+	b.manager.addPeer(a.endpoint.address());
+
+	connect(a, b);
+	EXPECT_LE(1u, b.manager.cookieReplies());
+	EXPECT_TRUE(samePacket(a.open(b, b.seal(a, 5)), 5));
+}
+
+// Test that replayed initiations and initiations from unknown peers or
+// with the wrong key are turned away.
+TEST(SessionManager, RejectedInitiations)
+{
+	Side a("10.0.0.1", SessionOptions());
+	Side b("10.0.0.2", SessionOptions());
+	Side c("10.0.0.3", SessionOptions());
+	Side impostor("10.0.0.4", SessionOptions(), 2);
+	a.manager.addPeer(b.endpoint.address());
+	b.manager.addPeer(a.endpoint.address());
+	c.manager.addPeer(b.endpoint.address());
+	impostor.manager.addPeer(b.endpoint.address());
+	b.manager.addPeer(impostor.endpoint.address());
+
+	EXPECT_FALSE(a.seal(b, 0));
+	a.executor.poll();
+	ASSERT_EQ(1u, a.outbox.size());
+	Overpass::SharedBuffer initiation = a.outbox.front();
+
+	EXPECT_FALSE(b.open(a, initiation));
+	EXPECT_FALSE(b.open(a, initiation));
+	b.executor.poll();
+	EXPECT_EQ(1u, b.manager.handshakesCompleted());
+	EXPECT_EQ(1u, b.manager.replayedPackets());
+
+	// Unknown peer.
+	EXPECT_FALSE(c.seal(b, 0));
+	c.executor.poll();
+	ASSERT_EQ(1u, c.outbox.size());
+	EXPECT_FALSE(b.open(c, c.outbox.front()));
+
+	// Wrong key.
+	EXPECT_FALSE(impostor.seal(b, 0));
+	impostor.executor.poll();
+	ASSERT_EQ(1u, impostor.outbox.size());
+	EXPECT_FALSE(b.open(impostor, impostor.outbox.front()));
+
+	// Junk.
+	EXPECT_FALSE(b.open(a, makePacket(AEAD_MESSAGE_TYPE)));
+	EXPECT_FALSE(b.open(a, makePacket(0)));
+
+	b.executor.poll();
+	EXPECT_EQ(1u, b.manager.handshakesCompleted());
+	EXPECT_EQ(4u, b.manager.authenticationFailures());
+}
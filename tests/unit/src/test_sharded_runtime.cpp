@@ -0,0 +1,89 @@
+#include <sched.h>
+
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <boost/asio/io_service.hpp>
+
+#include "sharded_runtime.h"
+
+TEST(ShardedRuntime, ShardCount)
+{
+	Overpass::ShardedRuntime runtime(3, false);
+	EXPECT_EQ(3u, runtime.shardCount());
+	EXPECT_EQ(3u, runtime.ioServices().size());
+	EXPECT_THROW(runtime.ioService(3), std::out_of_range);
+
+	// There's always at least one shard.
+	Overpass::ShardedRuntime empty(0, false);
+	EXPECT_EQ(1u, empty.shardCount());
+}
+
+// Test that the default is a shard per CPU the process may use.
+TEST(ShardedRuntime, AvailableShards)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	ASSERT_EQ(0, sched_getaffinity(0, sizeof(set), &set));
+	EXPECT_EQ(static_cast<std::size_t>(CPU_COUNT(&set)),
+	          Overpass::ShardedRuntime::availableShards());
+}
+
+// Test that each shard's work runs on its own thread, which knows which shard
+// it is.
+TEST(ShardedRuntime, HandlersRunOnTheirShard)
+{
+	const std::size_t SHARDS = 4;
+	Overpass::ShardedRuntime runtime(SHARDS);
+
+	std::mutex mutex;
+	std::set<std::thread::id> threads;
+	std::atomic<std::size_t> remaining(SHARDS);
+	for (std::size_t shard = 0; shard < SHARDS; ++shard)
+	{
+		runtime.ioService(shard)->post([&, shard]()
+		{
+			EXPECT_EQ(shard, Overpass::ShardedRuntime::currentShard());
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				threads.insert(std::this_thread::get_id());
+			}
+
+			// The last one out stops the runtime, from a shard's own thread.
+			if (--remaining == 0)
+			{
+				runtime.stop();
+			}
+		});
+	}
+
+	runtime.run();
+
+	EXPECT_EQ(SHARDS, threads.size());
+	EXPECT_EQ(Overpass::ShardedRuntime::NO_SHARD,
+	          Overpass::ShardedRuntime::currentShard());
+}
+
+// Test that an idle runtime keeps running until stopped.
+TEST(ShardedRuntime, RunsUntilStopped)
+{
+	Overpass::ShardedRuntime runtime(2, false);
+
+	std::atomic<bool> finished(false);
+	std::thread thread([&]()
+	{
+		runtime.run();
+		finished = true;
+	});
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	EXPECT_FALSE(finished);
+
+	runtime.stop();
+	thread.join();
+	EXPECT_TRUE(finished);
+}
@@ -0,0 +1,103 @@
+#include <algorithm>
+
+#include <gtest/gtest.h>
+
+#include <boost/asio/io_service.hpp>
+
+#include "internal/sharded_sockets.h"
+
+using boost::asio::ip::udp;
+
+namespace
+{
+	const udp::endpoint LOOPBACK(boost::asio::ip::address_v4::loopback(), 0);
+
+	// Find out which socket a datagram from the given sender lands on.
+	std::size_t receivingShard(Overpass::internal::ShardedSockets &sockets,
+	                           udp::socket &sender)
+	{
+		char payload = 'x';
+		sender.send_to(boost::asio::buffer(&payload, 1),
+		               sockets.front()->local_endpoint());
+
+		while (true)
+		{
+			for (std::size_t i = 0; i < sockets.size(); ++i)
+			{
+				if (sockets[i]->available() > 0)
+				{
+					udp::endpoint source;
+					sockets[i]->receive_from(boost::asio::buffer(&payload, 1),
+					                         source);
+					return i;
+				}
+			}
+		}
+	}
+}
+
+TEST(ShardedSockets, SingleSocket)
+{
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+	auto sockets = Overpass::internal::openShardedSockets({ioService}, LOOPBACK,
+	                                                       1, false);
+	ASSERT_EQ(1u, sockets.size());
+	EXPECT_NE(0, sockets.front()->local_endpoint().port());
+}
+
+TEST(ShardedSockets, SharePort)
+{
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+	auto sockets = Overpass::internal::openShardedSockets({ioService}, LOOPBACK,
+	                                                       4, false);
+	ASSERT_EQ(4u, sockets.size());
+	for (const auto &socket : sockets)
+	{
+		EXPECT_EQ(sockets.front()->local_endpoint(), socket->local_endpoint());
+	}
+}
+
+// Test that with steering, a peer's datagrams land on the socket predicted by
+// peerShard(), no matter which port they come from.
+TEST(ShardedSockets, SteerByPeer)
+{
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+	auto sockets = Overpass::internal::openShardedSockets({ioService}, LOOPBACK,
+	                                                       4, true);
+	ASSERT_EQ(4u, sockets.size());
+
+	for (const char *address : {"127.0.0.1", "127.0.0.2", "127.0.0.3",
+	                            "127.0.0.4", "127.0.0.5"})
+	{
+		auto peer = boost::asio::ip::address::from_string(address);
+		std::size_t expected = Overpass::internal::peerShard(peer, 4);
+
+		for (int port = 0; port < 4; ++port)
+		{
+			udp::socket sender(*ioService, udp::endpoint(peer, 0));
+			EXPECT_EQ(expected, receivingShard(sockets, sender))
+			      << "Datagram from " << sender.local_endpoint()
+			      << " landed on the wrong socket";
+		}
+	}
+}
+
+TEST(ShardedSockets, PeerShard)
+{
+	auto ipv4 = boost::asio::ip::address::from_string("10.0.0.1");
+	auto ipv6 = boost::asio::ip::address::from_string("fd00::1");
+
+	EXPECT_EQ(0u, Overpass::internal::peerShard(ipv4, 1));
+	EXPECT_LT(Overpass::internal::peerShard(ipv4, 3), 3u);
+	EXPECT_LT(Overpass::internal::peerShard(ipv6, 3), 3u);
+
+	// Neighbouring addresses should spread out.
+	std::vector<bool> used(4, false);
+	for (int i = 0; i < 4; ++i)
+	{
+		auto address = boost::asio::ip::address_v4(0x0a000000 + i);
+		used[Overpass::internal::peerShard(address, 4)] = true;
+	}
+
+	EXPECT_EQ(4, std::count(used.begin(), used.end(), true));
+}
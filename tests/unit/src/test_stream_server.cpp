@@ -2,10 +2,14 @@
 #include <condition_variable>
 #include <chrono>
 
+#include <unistd.h>
+#include <sys/socket.h>
+
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
 #include <boost/asio/buffer.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
 #include <boost/system/error_code.hpp>
 
 #include "stream_server.h"
@@ -100,13 +104,15 @@ TEST(StreamServer, ReadCallback)
 
 	std::mutex mutex;
 	std::condition_variable condition;
+	bool called = false;
 
 	auto callback = [&](const Overpass::SharedBuffer &buffer)
 	{
-		EXPECT_LT(1, buffer->size());
-		EXPECT_EQ(0xff, buffer->at(0));
+		EXPECT_LT(1, buffer.size());
+		EXPECT_EQ(0xff, buffer.at(0));
 		ioService->stop();
 		std::unique_lock<std::mutex> lock(mutex);
+		called = true;
 		condition.notify_one();
 	};
 
@@ -118,12 +124,118 @@ TEST(StreamServer, ReadCallback)
 	std::thread thread([&ioService](){ioService->run();});
 
 	std::unique_lock<std::mutex> lock(mutex);
-	auto status = condition.wait_for(lock, std::chrono::seconds(1));
-	EXPECT_EQ(std::cv_status::no_timeout, status) << "Unexpectedly timed out";
+	EXPECT_TRUE(condition.wait_for(lock, std::chrono::seconds(1),
+	                               [&called](){return called;}))
+	      << "Unexpectedly timed out";
 	ioService->stop();
 	thread.join();
 }
 
+// Test that packets are handed to the callback by the handler completing
+// the read in inline mode, and only by a handler of their own otherwise.
+TEST(StreamServer, DispatchModes)
+{
+	const struct
+	{
+		Overpass::DispatchMode mode;
+		std::size_t expected;
+	} modes[] = {
+		{Overpass::DispatchMode::Post, 0},
+		{Overpass::DispatchMode::Inline, 1}};
+	for (const auto &mode : modes)
+	{
+		Overpass::SharedIoService ioService(new boost::asio::io_service);
+		std::size_t packetsRead = 0;
+
+		Overpass::StreamServerOptions options;
+		options.dispatchMode = mode.mode;
+		std::unique_ptr<FakeStreamDescriptorReadSuccess> socket(
+		         new FakeStreamDescriptorReadSuccess(ioService));
+		auto streamServer = Overpass::makeStreamServer(
+		                       ioService,
+		                       [&packetsRead](const Overpass::SharedBuffer &buffer)
+		                       {
+		                          EXPECT_EQ(0xff, buffer.at(0));
+		                          ++packetsRead;
+		                       },
+		                       std::move(socket), options);
+
+		ASSERT_EQ(1u, ioService->run_one());
+		EXPECT_EQ(mode.expected, packetsRead);
+	}
+}
+
+// A descriptor whose reads only complete when the test says so.
+class FakeStreamDescriptorHeld : public FakeStreamDescriptor
+{
+	public:
+		struct Read
+		{
+			boost::asio::mutable_buffers_1 buffers;
+			std::function<void (boost::system::error_code, std::size_t)> callback;
+		};
+
+		FakeStreamDescriptorHeld(const Overpass::SharedIoService &ioService) :
+		   FakeStreamDescriptor(ioService)
+		{
+		}
+
+		void async_read_some(
+		      boost::asio::mutable_buffers_1 buffers,
+		      std::function<void (
+		         boost::system::error_code, std::size_t)> callback)
+		{
+			reads.push_back(Read{buffers, callback});
+		}
+
+		// Complete a read with a single byte.
+		void complete(std::size_t read, std::uint8_t value)
+		{
+			Read completed = reads[read];
+			boost::asio::buffer_cast<std::uint8_t*>(completed.buffers)[0] = value;
+			completed.callback(boost::system::error_code(), 1);
+		}
+
+		std::vector<Read> reads;
+};
+
+// Test that several reads are kept outstanding, and that packets reach the
+// callback in the order the reads were started if asked to, even when
+// posted.
+TEST(StreamServer, ReadDepth)
+{
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+
+	Overpass::StreamServerOptions options;
+	options.readDepth = 3;
+	options.orderedReads = true;
+
+	std::vector<int> received;
+	std::unique_ptr<FakeStreamDescriptorHeld> ownedSocket(
+	         new FakeStreamDescriptorHeld(ioService));
+	FakeStreamDescriptorHeld *socket = ownedSocket.get();
+	auto server = Overpass::makeStreamServer(
+	                 ioService, [&received](const Overpass::SharedBuffer &buffer)
+	                 {
+	                    received.push_back(buffer.at(0));
+	                 },
+	                 std::move(ownedSocket), options);
+
+	ASSERT_EQ(3u, socket->reads.size());
+	EXPECT_NE(boost::asio::buffer_cast<void*>(socket->reads[0].buffers),
+	          boost::asio::buffer_cast<void*>(socket->reads[1].buffers));
+
+	socket->complete(1, 1);
+	socket->complete(2, 2);
+	EXPECT_EQ(3u, socket->reads.size());
+
+	socket->complete(0, 0);
+	EXPECT_EQ(6u, socket->reads.size());
+
+	ioService->poll();
+	EXPECT_EQ((std::vector<int>{0, 1, 2}), received);
+}
+
 TEST(StreamServer, ReadError)
 {
 	Overpass::SharedIoService ioService(new boost::asio::io_service);
@@ -183,3 +295,315 @@ TEST(StreamServer, ReadNothing)
 	ioService->stop();
 	thread.join();
 }
+
+namespace
+{
+	typedef boost::asio::posix::stream_descriptor Descriptor;
+
+	Overpass::SharedBuffer makePacket(std::uint8_t writer, std::uint32_t index,
+	                                  std::size_t size)
+	{
+		Overpass::SharedBuffer buffer(size);
+		std::fill(buffer.begin(), buffer.end(), 0);
+		buffer[0] = writer;
+		buffer[1] = index >> 16;
+		buffer[2] = index >> 8;
+		buffer[3] = index;
+		return buffer;
+	}
+}
+
+// Test that packets written from several threads at once arrive whole, one per
+// write, and in order for each writer.
+TEST(StreamServer, ConcurrentWrites)
+{
+	const int WRITERS = 4;
+	const std::uint32_t PACKETS = 2000;
+
+	// Sequenced packet sockets keep write boundaries, like a TUN device.
+	int descriptors[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, descriptors));
+
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+	std::unique_ptr<Descriptor> socket(new Descriptor(*ioService, descriptors[0]));
+
+	Overpass::StreamServerOptions options;
+	options.writeQueueDepth = WRITERS * PACKETS;
+	auto server = Overpass::makeStreamServer(
+	                 ioService, [](const Overpass::SharedBuffer&){},
+	                 std::move(socket), options);
+
+	std::unique_ptr<boost::asio::io_service::work> work(
+	         new boost::asio::io_service::work(*ioService));
+	std::thread ioThread([&ioService](){ioService->run();});
+
+	std::vector<std::thread> writers;
+	for (int writer = 0; writer < WRITERS; ++writer)
+	{
+		writers.push_back(std::thread([&server, writer, PACKETS]()
+		{
+			for (std::uint32_t i = 0; i < PACKETS; ++i)
+			{
+				EXPECT_TRUE(server->write(makePacket(writer, i, 64 + writer)));
+			}
+		}));
+	}
+
+	std::vector<std::uint32_t> next(WRITERS, 0);
+	for (std::uint32_t received = 0; received < WRITERS * PACKETS; ++received)
+	{
+		std::uint8_t data[256];
+		ssize_t size = read(descriptors[1], data, sizeof(data));
+		ASSERT_LT(3, size);
+
+		int writer = data[0];
+		ASSERT_LT(writer, WRITERS);
+		EXPECT_EQ(64 + writer, size);
+
+		std::uint32_t index = data[1] << 16 | data[2] << 8 | data[3];
+		EXPECT_EQ(next[writer]++, index);
+	}
+
+	for (auto &writer : writers)
+	{
+		writer.join();
+	}
+
+	work.reset();
+	ioService->stop();
+	ioThread.join();
+	close(descriptors[1]);
+
+	EXPECT_EQ(0u, server->droppedWrites());
+}
+
+// Test that packets are combined into gathering writes on byte streams, and
+// that partial writes pick up where they left off.
+TEST(StreamServer, CoalescedWrites)
+{
+	const std::uint32_t PACKETS = 5000;
+	const std::size_t SIZE = 1000;
+
+	int descriptors[2];
+	ASSERT_EQ(0, pipe(descriptors));
+
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+	std::unique_ptr<Descriptor> socket(new Descriptor(*ioService, descriptors[1]));
+
+	Overpass::StreamServerOptions options;
+	options.writeQueueDepth = PACKETS;
+	options.coalesceWrites = true;
+	auto server = Overpass::makeStreamServer(
+	                 ioService, [](const Overpass::SharedBuffer&){},
+	                 std::move(socket), options);
+
+	// Queue everything before the writer gets a chance to run, so the pipe
+	// fills up (it holds far less than this).
+	for (std::uint32_t i = 0; i < PACKETS; ++i)
+	{
+		ASSERT_TRUE(server->write(makePacket(0, i, SIZE)));
+	}
+
+	std::unique_ptr<boost::asio::io_service::work> work(
+	         new boost::asio::io_service::work(*ioService));
+	std::thread ioThread([&ioService](){ioService->run();});
+
+	std::vector<std::uint8_t> stream;
+	stream.reserve(PACKETS * SIZE);
+	while (stream.size() < PACKETS * SIZE)
+	{
+		std::uint8_t data[65536];
+		ssize_t size = read(descriptors[0], data, sizeof(data));
+		ASSERT_LT(0, size);
+		stream.insert(stream.end(), data, data + size);
+	}
+
+	work.reset();
+	ioService->stop();
+	ioThread.join();
+	close(descriptors[0]);
+
+	for (std::uint32_t i = 0; i < PACKETS; ++i)
+	{
+		const std::uint8_t *packet = stream.data() + i * SIZE;
+		ASSERT_EQ(i, static_cast<std::uint32_t>(
+		             packet[1] << 16 | packet[2] << 8 | packet[3]));
+	}
+}
+
+// Test that packets read and written back are timed through every stage,
+// if asked to.
+TEST(StreamServer, TraceLatency)
+{
+	int descriptors[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, descriptors));
+
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+	std::unique_ptr<Descriptor> socket(new Descriptor(*ioService, descriptors[0]));
+
+	Overpass::StreamServerOptions options;
+	options.traceLatency = true;
+	std::shared_ptr<Overpass::StreamServer<Descriptor>> server;
+	server = Overpass::makeStreamServer(
+	            ioService, [&server](const Overpass::SharedBuffer &buffer)
+	            {
+	               server->write(buffer);
+	            },
+	            std::move(socket), options);
+	ASSERT_NE(nullptr, server->tracer());
+
+	std::thread ioThread([&ioService](){ioService->run();});
+
+	std::uint8_t data[64] = {0x45};
+	ASSERT_EQ(ssize_t(sizeof(data)), write(descriptors[1], data, sizeof(data)));
+	ASSERT_LT(0, read(descriptors[1], data, sizeof(data)));
+
+	ioService->stop();
+	ioThread.join();
+	close(descriptors[1]);
+
+	const Overpass::internal::LatencyStage stages[] = {
+		Overpass::internal::LatencyStage::Dispatch,
+		Overpass::internal::LatencyStage::Route,
+		Overpass::internal::LatencyStage::Send,
+		Overpass::internal::LatencyStage::Total};
+	for (auto stage : stages)
+	{
+		EXPECT_EQ(1u, server->tracer()->snapshot(stage).count)
+		   << toString(stage);
+	}
+
+	server.reset();
+}
+
+namespace
+{
+	/*!
+	 * \brief A descriptor whose first wait for room fails.
+	 */
+	class FailingWaitDescriptor : public Descriptor
+	{
+		public:
+			FailingWaitDescriptor(boost::asio::io_service &ioService,
+			                      int descriptor) :
+			   Descriptor(ioService, descriptor),
+			   m_ioService(ioService),
+			   m_failed(false)
+			{
+			}
+
+			template <typename Handler>
+			void async_write_some(boost::asio::null_buffers, Handler handler)
+			{
+				if (m_failed)
+				{
+					Descriptor::async_write_some(boost::asio::null_buffers(),
+					                             handler);
+					return;
+				}
+
+				m_failed = true;
+				m_ioService.post(std::bind(
+				   handler, boost::asio::error::connection_reset, 0));
+			}
+
+		private:
+			boost::asio::io_service &m_ioService;
+			bool m_failed;
+	};
+}
+
+// Test that a failed wait for room only costs the packet that was waiting,
+// and that writing carries on.
+TEST(StreamServer, WriteAfterFailedWait)
+{
+	const std::uint32_t PACKETS = 200;
+
+	int descriptors[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, descriptors));
+	int sendBuffer = 4096;
+	ASSERT_EQ(0, setsockopt(descriptors[0], SOL_SOCKET, SO_SNDBUF,
+	                        &sendBuffer, sizeof(sendBuffer)));
+	timeval timeout = {5, 0};
+	ASSERT_EQ(0, setsockopt(descriptors[1], SOL_SOCKET, SO_RCVTIMEO,
+	                        &timeout, sizeof(timeout)));
+
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+	std::unique_ptr<FailingWaitDescriptor> socket(
+	         new FailingWaitDescriptor(*ioService, descriptors[0]));
+
+	Overpass::StreamServerOptions options;
+	options.writeQueueDepth = PACKETS;
+	auto server = Overpass::makeStreamServer(
+	                 ioService, [](const Overpass::SharedBuffer&){},
+	                 std::move(socket), options);
+
+	std::unique_ptr<boost::asio::io_service::work> work(
+	         new boost::asio::io_service::work(*ioService));
+	std::thread ioThread([&ioService](){ioService->run();});
+
+	// More than the socket takes, so the writer has to wait.
+	for (std::uint32_t i = 0; i < PACKETS; ++i)
+	{
+		EXPECT_TRUE(server->write(makePacket(0, i, 512)));
+	}
+
+	// Every packet but the one given up arrives, in order.
+	std::uint32_t next = 0;
+	for (std::uint32_t received = 0; received < PACKETS - 1; ++received)
+	{
+		std::uint8_t data[512];
+		ASSERT_EQ(512, read(descriptors[1], data, sizeof(data)));
+		std::uint32_t index = data[1] << 16 | data[2] << 8 | data[3];
+		EXPECT_LE(next, index);
+		next = index + 1;
+	}
+
+	EXPECT_EQ(PACKETS, next);
+	EXPECT_EQ(1u, server->statistics().writeErrors);
+
+	// Later writes go through too.
+	EXPECT_TRUE(server->write(makePacket(0, PACKETS, 512)));
+	std::uint8_t data[512];
+	EXPECT_EQ(512, read(descriptors[1], data, sizeof(data)));
+
+	work.reset();
+	ioService->stop();
+	ioThread.join();
+	close(descriptors[1]);
+}
+
+// Test that writes are refused, and counted, once the queue is full.
+TEST(StreamServer, WriteBackpressure)
+{
+	int descriptors[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, descriptors));
+
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+	std::unique_ptr<Descriptor> socket(new Descriptor(*ioService, descriptors[0]));
+
+	Overpass::StreamServerOptions options;
+	options.writeQueueDepth = 8;
+	auto server = Overpass::makeStreamServer(
+	                 ioService, [](const Overpass::SharedBuffer&){},
+	                 std::move(socket), options);
+
+	// Nothing is running the IO service, so nothing is written yet.
+	for (std::uint32_t i = 0; i < 8; ++i)
+	{
+		EXPECT_TRUE(server->write(makePacket(0, i, 16)));
+	}
+
+	EXPECT_FALSE(server->write(makePacket(0, 8, 16)));
+	EXPECT_FALSE(server->write(makePacket(0, 9, 16)));
+	EXPECT_EQ(2u, server->droppedWrites());
+	EXPECT_EQ(8u, server->pendingWrites());
+
+	// Once the writer catches up there's room again.
+	ioService->poll();
+	EXPECT_EQ(0u, server->pendingWrites());
+	EXPECT_TRUE(server->write(makePacket(0, 10, 16)));
+
+	ioService->stop();
+	close(descriptors[1]);
+}
@@ -0,0 +1,150 @@
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "internal/timer_wheel.h"
+
+using Overpass::internal::TimerWheel;
+
+namespace
+{
+	typedef TimerWheel::Clock Clock;
+
+	/*!
+	 * \brief A timer recording when it fired, and checking it didn't fire
+	 *        early.
+	 */
+	struct RecordingTimer
+	{
+		RecordingTimer(std::vector<int> &fired, int id) :
+		   timer([this, &fired, id]()
+		   {
+		      EXPECT_GE(Clock::now(), due) << id;
+		      fired.push_back(id);
+		   })
+		{
+		}
+
+		void arm(TimerWheel &wheel, Clock::duration delay)
+		{
+			due = Clock::now() + delay;
+			wheel.arm(timer, delay);
+		}
+
+		Clock::time_point due;
+		TimerWheel::Timer timer;
+	};
+}
+
+// Test that timers fire in order, and once.
+TEST(TimerWheel, Order)
+{
+	boost::asio::io_service ioService;
+	TimerWheel wheel(ioService, std::chrono::milliseconds(1));
+	std::vector<int> fired;
+	RecordingTimer first(fired, 1);
+	RecordingTimer second(fired, 2);
+	RecordingTimer third(fired, 3);
+
+	third.arm(wheel, std::chrono::milliseconds(30));
+	first.arm(wheel, std::chrono::milliseconds(10));
+	second.arm(wheel, std::chrono::milliseconds(20));
+	EXPECT_EQ(3u, wheel.armedCount());
+
+	ioService.run();
+	EXPECT_EQ(std::vector<int>({1, 2, 3}), fired);
+	EXPECT_EQ(0u, wheel.armedCount());
+	EXPECT_FALSE(first.timer.armed());
+}
+
+// Test that cancelled timers (or timers armed again) don't fire, and that a
+// wheel with nothing armed doesn't keep its IO service busy.
+TEST(TimerWheel, Cancel)
+{
+	boost::asio::io_service ioService;
+	TimerWheel wheel(ioService, std::chrono::milliseconds(1));
+	std::vector<int> fired;
+	RecordingTimer cancelled(fired, 1);
+	RecordingTimer rearmed(fired, 2);
+
+	cancelled.arm(wheel, std::chrono::milliseconds(5));
+	rearmed.arm(wheel, std::chrono::milliseconds(5));
+	rearmed.arm(wheel, std::chrono::milliseconds(15));
+	wheel.cancel(cancelled.timer);
+	wheel.cancel(cancelled.timer);
+	EXPECT_FALSE(cancelled.timer.armed());
+	EXPECT_EQ(1u, wheel.armedCount());
+
+	ioService.run();
+	EXPECT_EQ(std::vector<int>({2}), fired);
+
+	{
+		RecordingTimer destroyed(fired, 3);
+		destroyed.arm(wheel, std::chrono::seconds(30));
+	}
+
+	EXPECT_EQ(0u, wheel.armedCount());
+	Clock::time_point start = Clock::now();
+	ioService.restart();
+	ioService.run();
+	EXPECT_LT(Clock::now() - start, std::chrono::seconds(1));
+	EXPECT_EQ(std::vector<int>({2}), fired);
+}
+
+// Test that timers can arm themselves (and others) again from their
+// callbacks.
+TEST(TimerWheel, Periodic)
+{
+	boost::asio::io_service ioService;
+	TimerWheel wheel(ioService, std::chrono::milliseconds(1));
+	std::size_t count = 0;
+	std::unique_ptr<TimerWheel::Timer> other;
+	TimerWheel::Timer periodic([&]()
+	{
+		if (++count < 5)
+		{
+			wheel.arm(periodic, std::chrono::milliseconds(2));
+			wheel.arm(*other, std::chrono::milliseconds(10));
+		}
+		else
+		{
+			wheel.cancel(*other);
+		}
+	});
+
+	other.reset(new TimerWheel::Timer([]()
+	{
+		ADD_FAILURE() << "Armed again before it could fire";
+	}));
+
+	wheel.post([&]()
+	{
+		wheel.arm(periodic, std::chrono::milliseconds(0));
+	});
+
+	ioService.run();
+	EXPECT_EQ(5u, count);
+	EXPECT_FALSE(other->armed());
+}
+
+// Test that timers far enough to start on the coarser wheels come down
+// them in time, and in order.
+TEST(TimerWheel, Cascade)
+{
+	boost::asio::io_service ioService;
+	TimerWheel wheel(ioService, std::chrono::microseconds(1));
+	std::vector<int> fired;
+	RecordingTimer near(fired, 1);
+	RecordingTimer second(fired, 2);
+	RecordingTimer third(fired, 3);
+	RecordingTimer far(fired, 4);
+
+	// Up to 64 ticks fit the first wheel, 4096 the second, and so on.
+	far.arm(wheel, std::chrono::milliseconds(300));
+	third.arm(wheel, std::chrono::milliseconds(5));
+	near.arm(wheel, std::chrono::microseconds(30));
+	second.arm(wheel, std::chrono::microseconds(3000));
+
+	ioService.run();
+	EXPECT_EQ(std::vector<int>({1, 2, 3, 4}), fired);
+}
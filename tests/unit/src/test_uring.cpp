@@ -0,0 +1,457 @@
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/asio/io_service.hpp>
+
+#include "datagram_server.h"
+#include "stream_server.h"
+#include "internal/aead.h"
+#include "internal/uring.h"
+#include "internal/uring_sockets.h"
+
+using boost::asio::ip::udp;
+using Overpass::internal::Aead;
+using Overpass::internal::AeadKey;
+using Overpass::internal::Uring;
+using Overpass::internal::UringUdp;
+using Overpass::internal::UringCompletion;
+using Overpass::internal::UringDatagramSocket;
+using Overpass::internal::UringStreamDescriptor;
+
+namespace
+{
+	const std::uint32_t DATAGRAMS = 200;
+
+	std::size_t waitForCompletions(Uring &ring, UringCompletion *completions,
+	                               std::size_t count)
+	{
+		std::size_t completed = 0;
+		for (int attempt = 0; completed < count && attempt < 1000; ++attempt)
+		{
+			completed += ring.complete(completions + completed,
+			                           count - completed);
+			if (completed < count)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+
+		return completed;
+	}
+
+	Overpass::SharedBuffer makePacket(std::uint32_t index, std::size_t size)
+	{
+		Overpass::SharedBuffer buffer(size);
+		std::fill(buffer.begin(), buffer.end(), 0xab);
+		buffer[0] = index >> 24;
+		buffer[1] = index >> 16;
+		buffer[2] = index >> 8;
+		buffer[3] = index;
+		return buffer;
+	}
+
+	std::uint32_t packetIndex(const std::uint8_t *data)
+	{
+		return data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+	}
+
+	/*!
+	 * \brief Send datagrams to a DatagramServer over loopback, and check they
+	 *        all arrive, intact and from the right sender.
+	 */
+	void receiveDatagrams(bool useUring, std::size_t batchSize)
+	{
+		Overpass::SharedIoService ioService(new boost::asio::io_service);
+
+		udp::endpoint loopback(boost::asio::ip::address_v4::loopback(), 0);
+		std::unique_ptr<udp::socket> receiver(
+		         new udp::socket(*ioService, loopback));
+		receiver->set_option(boost::asio::socket_base::receive_buffer_size(
+		                        1024 * 1024));
+		udp::endpoint destination = receiver->local_endpoint();
+
+		std::unique_ptr<UringDatagramSocket> socket(new UringDatagramSocket(
+		         *ioService, std::move(receiver), useUring));
+		EXPECT_EQ(useUring && Uring::isSupported(), socket->usingUring());
+
+		udp::socket sender(*ioService, loopback);
+
+		std::mutex mutex;
+		std::condition_variable condition;
+		std::uint32_t received = 0;
+		std::uint32_t next = 0;
+
+		auto callback = [&](const udp::endpoint &endpoint,
+		                    const Overpass::SharedBuffer &buffer)
+		{
+			// Buffers are trimmed to the size of each datagram.
+			std::size_t size = 100 + next % 100;
+			EXPECT_EQ(sender.local_endpoint(), endpoint);
+			ASSERT_EQ(size, buffer.size());
+			EXPECT_EQ(next++, packetIndex(buffer.data()));
+			EXPECT_EQ(0xab, buffer[size - 1]);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (++received == DATAGRAMS)
+			{
+				condition.notify_one();
+			}
+		};
+
+		Overpass::DatagramServerOptions options;
+		options.batchSize = batchSize;
+		auto server = std::make_shared<Overpass::DatagramServer<UringUdp>>(
+		                 ioService, std::move(socket), callback, options);
+
+		std::unique_ptr<boost::asio::io_service::work> work(
+		         new boost::asio::io_service::work(*ioService));
+		std::thread thread([&ioService](){ioService->run();});
+
+		for (std::uint32_t i = 0; i < DATAGRAMS; ++i)
+		{
+			Overpass::SharedBuffer packet = makePacket(i, 100 + i % 100);
+			sender.send_to(boost::asio::buffer(packet.data(), packet.size()),
+			               destination);
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			EXPECT_TRUE(condition.wait_for(
+			               lock, std::chrono::seconds(5),
+			               [&received](){return received == DATAGRAMS;}))
+			      << "Unexpectedly timed out";
+		}
+
+		work.reset();
+		ioService->stop();
+		thread.join();
+	}
+}
+
+// Test that requests written to the ring reach the kernel and come back.
+TEST(Uring, ReadAndWrite)
+{
+	if (!Uring::isSupported())
+	{
+		return;
+	}
+
+	int pipeDescriptors[2];
+	ASSERT_EQ(0, pipe(pipeDescriptors));
+
+	Uring ring(8);
+	const char message[] = "overpass";
+
+	io_uring_sqe *entry = ring.prepare(1);
+	ASSERT_NE(nullptr, entry);
+	entry->opcode = IORING_OP_WRITE;
+	entry->fd = pipeDescriptors[1];
+	entry->addr = reinterpret_cast<std::uint64_t>(message);
+	entry->len = sizeof(message);
+	entry->off = static_cast<std::uint64_t>(-1);
+	ring.submit();
+
+	UringCompletion completion;
+	ASSERT_EQ(1u, waitForCompletions(ring, &completion, 1));
+	EXPECT_EQ(1u, completion.userData);
+	EXPECT_EQ(static_cast<std::int32_t>(sizeof(message)), completion.result);
+
+	char data[sizeof(message)] = {};
+	entry = ring.prepare(2);
+	ASSERT_NE(nullptr, entry);
+	entry->opcode = IORING_OP_READ;
+	entry->fd = pipeDescriptors[0];
+	entry->addr = reinterpret_cast<std::uint64_t>(data);
+	entry->len = sizeof(data);
+	entry->off = static_cast<std::uint64_t>(-1);
+	ring.submit();
+
+	ASSERT_EQ(1u, waitForCompletions(ring, &completion, 1));
+	EXPECT_EQ(2u, completion.userData);
+	EXPECT_EQ(static_cast<std::int32_t>(sizeof(message)), completion.result);
+	EXPECT_STREQ(message, data);
+	EXPECT_EQ(0u, ring.inFlight());
+
+	close(pipeDescriptors[0]);
+	close(pipeDescriptors[1]);
+}
+
+// Test that the submission queue reports being full rather than overwriting
+// entries, and that requests still in flight are cancelled on destruction.
+TEST(Uring, FullQueueAndCancellation)
+{
+	if (!Uring::isSupported())
+	{
+		return;
+	}
+
+	int pipeDescriptors[2];
+	ASSERT_EQ(0, pipe(pipeDescriptors));
+
+	char data[16];
+	{
+		Uring ring(4);
+		for (std::uint64_t i = 0; i < 4; ++i)
+		{
+			io_uring_sqe *entry = ring.prepare(i);
+			ASSERT_NE(nullptr, entry);
+
+			// Nothing is ever written, so these never complete.
+			entry->opcode = IORING_OP_READ;
+			entry->fd = pipeDescriptors[0];
+			entry->addr = reinterpret_cast<std::uint64_t>(data);
+			entry->len = sizeof(data);
+			entry->off = static_cast<std::uint64_t>(-1);
+		}
+
+		EXPECT_EQ(nullptr, ring.prepare(4));
+
+		ring.submit();
+		EXPECT_EQ(4u, ring.inFlight());
+	}
+
+	close(pipeDescriptors[0]);
+	close(pipeDescriptors[1]);
+}
+
+// Test that datagrams are received in batches through the multishot receive,
+// without being copied.
+TEST(Uring, DatagramBatchReceive)
+{
+	receiveDatagrams(true, 16);
+}
+
+// Test that datagrams are received one at a time as well.
+TEST(Uring, DatagramReceive)
+{
+	receiveDatagrams(true, 1);
+}
+
+// Test that without io_uring the socket behaves like a plain Asio socket.
+TEST(Uring, DatagramFallback)
+{
+	receiveDatagrams(false, 16);
+	receiveDatagrams(false, 1);
+}
+
+// Test that sealed datagrams read one at a time (the default batch size)
+// open, which takes them at their actual size.
+TEST(Uring, SealedDatagramsOneAtATime)
+{
+	AeadKey key;
+	key.fill(7);
+	for (bool useUring : {true, false})
+	{
+		SCOPED_TRACE(useUring);
+		Overpass::SharedIoService ioService(new boost::asio::io_service);
+
+		udp::endpoint loopback(boost::asio::ip::address_v4::loopback(), 0);
+		std::unique_ptr<udp::socket> receiver(
+		         new udp::socket(*ioService, loopback));
+		udp::endpoint destination = receiver->local_endpoint();
+		std::unique_ptr<UringDatagramSocket> socket(new UringDatagramSocket(
+		         *ioService, std::move(receiver), useUring));
+
+		Aead sealer(Overpass::Cipher::ChaCha20Poly1305, key);
+		Aead opener(Overpass::Cipher::ChaCha20Poly1305, key);
+
+		std::mutex mutex;
+		std::condition_variable condition;
+		std::uint32_t opened = 0;
+
+		auto callback = [&](const Overpass::DatagramBatch<udp::endpoint> &batch)
+		{
+			ASSERT_EQ(1u, batch.size());
+			Overpass::SharedBuffer packet;
+			std::uint64_t counter;
+			ASSERT_EQ(1u, opener.open(&batch[0].buffer, 1, &packet, &counter));
+			EXPECT_EQ(100u, packet.size());
+			EXPECT_EQ(opened, packetIndex(packet.data()));
+
+			std::lock_guard<std::mutex> lock(mutex);
+			++opened;
+			condition.notify_one();
+		};
+
+		Overpass::DatagramServerOptions options;
+		options.batchSize = 1;
+		auto server = std::make_shared<Overpass::DatagramServer<UringUdp>>(
+		                 ioService, std::move(socket), callback, options);
+
+		std::unique_ptr<boost::asio::io_service::work> work(
+		         new boost::asio::io_service::work(*ioService));
+		std::thread thread([&ioService](){ioService->run();});
+
+		udp::socket sender(*ioService, loopback);
+		for (std::uint32_t i = 0; i < 10; ++i)
+		{
+			Overpass::SharedBuffer packet = makePacket(i, 100);
+			Overpass::SharedBuffer message;
+			ASSERT_EQ(1u, sealer.seal(&packet, 1, &message));
+			sender.send_to(boost::asio::buffer(message.data(), message.size()),
+			               destination);
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			EXPECT_TRUE(condition.wait_for(lock, std::chrono::seconds(5),
+			                               [&opened](){return opened == 10;}))
+			      << "Unexpectedly timed out";
+		}
+
+		work.reset();
+		ioService->stop();
+		thread.join();
+	}
+}
+
+// Test that reads and writes through io_uring keep packet boundaries and
+// order, like a TUN device.
+TEST(Uring, StreamReadAndWrite)
+{
+	const std::uint32_t PACKETS = 2000;
+
+	int descriptors[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, descriptors));
+
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+	std::unique_ptr<UringStreamDescriptor> descriptor(
+	         new UringStreamDescriptor(*ioService, descriptors[0], true));
+	EXPECT_EQ(Uring::isSupported(), descriptor->usingUring());
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::uint32_t received = 0;
+
+	Overpass::StreamServerOptions options;
+	options.writeQueueDepth = PACKETS;
+	auto server = Overpass::makeStreamServer(
+	                 ioService, [&](const Overpass::SharedBuffer &buffer)
+	                 {
+	                    ASSERT_LE(64u, buffer.size());
+	                    EXPECT_EQ(received, packetIndex(buffer.data()));
+
+	                    std::lock_guard<std::mutex> lock(mutex);
+	                    ++received;
+	                    condition.notify_one();
+	                 },
+	                 std::move(descriptor), options);
+
+	std::unique_ptr<boost::asio::io_service::work> work(
+	         new boost::asio::io_service::work(*ioService));
+	std::thread ioThread([&ioService](){ioService->run();});
+
+	// Reading.
+	for (std::uint32_t i = 0; i < 100; ++i)
+	{
+		Overpass::SharedBuffer packet = makePacket(i, 64);
+		ASSERT_EQ(64, write(descriptors[1], packet.data(), packet.size()));
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		EXPECT_TRUE(condition.wait_for(lock, std::chrono::seconds(5),
+		                               [&received](){return received == 100;}))
+		      << "Unexpectedly timed out";
+	}
+
+	// Writing, faster than the peer reads (so the socket fills up).
+	std::thread writer([&server, PACKETS]()
+	{
+		for (std::uint32_t i = 0; i < PACKETS; ++i)
+		{
+			EXPECT_TRUE(server->write(makePacket(i, 100 + i % 100)));
+		}
+	});
+
+	for (std::uint32_t i = 0; i < PACKETS; ++i)
+	{
+		std::uint8_t data[256];
+		ssize_t size = read(descriptors[1], data, sizeof(data));
+		ASSERT_EQ(static_cast<ssize_t>(100 + i % 100), size);
+		EXPECT_EQ(i, packetIndex(data));
+	}
+
+	writer.join();
+
+	work.reset();
+	ioService->stop();
+	ioThread.join();
+	close(descriptors[1]);
+
+	EXPECT_EQ(0u, server->droppedWrites());
+}
+
+// Test that a packet that can't be written through io_uring is counted as a
+// write error, without losing the packets queued after it.
+TEST(Uring, StreamWriteError)
+{
+	if (!Uring::isSupported())
+	{
+		return;
+	}
+
+	int descriptors[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, descriptors));
+
+	// Too big for the socket, whatever room there is.
+	int sendBuffer = 4096;
+	ASSERT_EQ(0, setsockopt(descriptors[0], SOL_SOCKET, SO_SNDBUF,
+	                        &sendBuffer, sizeof(sendBuffer)));
+
+	// Lost packets fail the test rather than hang it.
+	timeval timeout = {5, 0};
+	ASSERT_EQ(0, setsockopt(descriptors[1], SOL_SOCKET, SO_RCVTIMEO,
+	                        &timeout, sizeof(timeout)));
+
+	Overpass::SharedIoService ioService(new boost::asio::io_service);
+	std::unique_ptr<UringStreamDescriptor> descriptor(
+	         new UringStreamDescriptor(*ioService, descriptors[0], true));
+	ASSERT_TRUE(descriptor->usingUring());
+
+	auto server = Overpass::makeStreamServer(
+	                 ioService, [](const Overpass::SharedBuffer&) {},
+	                 std::move(descriptor));
+
+	std::unique_ptr<boost::asio::io_service::work> work(
+	         new boost::asio::io_service::work(*ioService));
+	std::thread ioThread([&ioService](){ioService->run();});
+
+	EXPECT_TRUE(server->write(makePacket(0, 64)));
+	EXPECT_TRUE(server->write(makePacket(1, 64 * 1024)));
+	EXPECT_TRUE(server->write(makePacket(2, 64)));
+	EXPECT_TRUE(server->write(makePacket(3, 64)));
+
+	for (std::uint32_t i : {0, 2, 3})
+	{
+		std::uint8_t data[128];
+		ASSERT_EQ(64, read(descriptors[1], data, sizeof(data)));
+		EXPECT_EQ(i, packetIndex(data));
+	}
+
+	// The failure is known by the next write.
+	for (int attempt = 0; attempt < 1000 &&
+	     server->statistics().writeErrors == 0; ++attempt)
+	{
+		EXPECT_TRUE(server->write(makePacket(4, 64)));
+		std::uint8_t data[128];
+		ASSERT_EQ(64, read(descriptors[1], data, sizeof(data)));
+		EXPECT_EQ(4u, packetIndex(data));
+	}
+
+	EXPECT_EQ(1u, server->statistics().writeErrors);
+
+	work.reset();
+	ioService->stop();
+	ioThread.join();
+	close(descriptors[1]);
+}